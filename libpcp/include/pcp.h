@@ -99,6 +99,7 @@ extern pcp_loglvl_e pcp_log_level;
 
 typedef struct pcp_flow_s pcp_flow_t;
 typedef struct pcp_ctx_s pcp_ctx_t;
+typedef struct pcp_transport pcp_transport_t;
 
 typedef struct pcp_socket_vt_s {
     PCP_SOCKET (*sock_create)(int domain, int type, int protocol);
@@ -121,16 +122,117 @@ typedef struct pcp_socket_vt_s {
 #define DISABLE_AUTODISCOVERY 0
 pcp_ctx_t *pcp_init(uint8_t autodiscovery, pcp_socket_vt_t *socket_vt);
 
-//returns internal pcp server ID, -1 => error occurred
+/*
+ * UDP socket shared by several contexts of the process. Datagrams read from it
+ * are handed to the context whose server sent them; responses carrying nonce
+ * go only to the context which sent the request.
+ *  socket_vt      - optional - as of pcp_init, used by all attached contexts
+ *  return value   - transport, NULL on error
+ */
+pcp_transport_t *pcp_transport_create(pcp_socket_vt_t *socket_vt);
+
+/*
+ * Initialize context using socket of transport t instead of its own one.
+ * pcp_get_socket of the context returns the shared socket; when it's readable,
+ * pcp_transport_pulse has to be called (pcp_pulse of one context only queues
+ * datagrams of the others). pcp_terminate detaches the context from t.
+ */
+pcp_ctx_t *pcp_init_shared(pcp_transport_t *t, uint8_t autodiscovery);
+
+PCP_SOCKET pcp_transport_get_socket(pcp_transport_t *t);
+
+/*
+ * Call pcp_pulse of every context attached to t, until all datagrams read
+ * from the shared socket are handled. Timeout is the nearest one of contexts.
+ */
+int pcp_transport_pulse(pcp_transport_t *t, struct timeval *next_timeout);
+
+/*
+ * Close socket of t, after all its contexts were terminated.
+ *  return value - PCP_ERR_SUCCESS or PCP_ERR_BAD_ARGS, if t is still used
+ */
+int pcp_transport_destroy(pcp_transport_t *t);
+
+/*
+ * Add PCP server. Server is identified by its address, port and, for
+ * link-local addresses, scope id. Adding the same address with another port
+ * adds a second server (e.g. next to an auto-discovered gateway on port 5351)
+ * and new flows are then sent to both of them; disable auto-discovery to use
+ * only the given server. Adding an already known server updates its version.
+ *
+ * returns internal pcp server ID, -1 => error occurred
+ */
 int pcp_add_server(pcp_ctx_t *ctx, struct sockaddr *pcp_server,
         uint8_t pcp_version);
 
+/*
+ * Keep negotiated version, epoch and ping round trip of responding PCP servers
+ * in memory mapped file path, which may be shared by several processes.
+ * Servers with a record younger than ttl seconds skip ping and version
+ * negotiation and start sending requests right away. Servers already added
+ * are looked up at once, later ones when added. pcp_init opens the file named
+ * by PCP_SERVER_CACHE environment variable before gateway discovery.
+ *  path         - cache file, NULL stops using the cache
+ *  ttl          - lifetime of records, 0 for PCP_SERVER_CACHE_TTL
+ *  return value - PCP_ERR_SUCCESS or pcp_errno
+ */
+int pcp_set_server_cache(pcp_ctx_t *ctx, const char *path, uint32_t ttl);
+
+/*
+ * Record every datagram the context sends or receives through its socket
+ * functions to pcap file path, with timestamps. Recording may be replayed
+ * by pcp-replay or inspected by tcpdump or Wireshark. pcp_init starts
+ * recording to file named by PCP_CAPTURE environment variable.
+ *  path         - capture file, replaced if it exists; NULL stops recording
+ *  return value - PCP_ERR_SUCCESS or pcp_errno
+ */
+int pcp_set_capture(pcp_ctx_t *ctx, const char *path);
+
+/*
+ * Counters of PCP messages of the context since pcp_init.
+ */
+typedef struct pcp_stats {
+    uint64_t sent;          //requests and pings, including retransmissions
+    uint64_t retransmitted; //sent again after response timeout
+    uint64_t received;      //datagrams received by the context's socket
+} pcp_stats_t;
+
+/*
+ * Fill stats with counters of the context.
+ *  return value - PCP_ERR_SUCCESS or pcp_errno
+ */
+int pcp_get_stats(pcp_ctx_t *ctx, pcp_stats_t *stats);
+
 /*
  * Close socket fds and clean up all settings, frees all library buffers
  *      close_flows - signal end of flows to PCP servers
  */
 void pcp_terminate(pcp_ctx_t *ctx, int close_flows);
 
+/*
+ * Save PCP servers and flows of the context to file path (replaced atomically),
+ * so a restarted application can take its mappings over by pcp_ctx_restore
+ * instead of requesting them anew. Nonces, external assignments, lifetimes,
+ * server epochs and the set of flows managed by pcp_reconcile are kept.
+ * Flows being closed and EXPERIMENTAL options are not saved.
+ *  return value - PCP_ERR_SUCCESS or pcp_errno
+ */
+int pcp_ctx_save(pcp_ctx_t *ctx, const char *path);
+
+/*
+ * Restore servers and flows saved by pcp_ctx_save into a context returned by
+ * pcp_init, before any flows are created. Servers which responded before skip
+ * ping; flows with unexpired mapping wait for its renewal without sending any
+ * request, the others are requested again, suggesting previous external
+ * address. Flows of a server that already has flows or whose source address
+ * changed are not restored. Restored flows have no user data; find them by
+ * pcp_flow_enum.
+ *  return value - count of restored flow handles, one for each flow returned
+ *                 by pcp_new_flow however many servers it was sent to,
+ *                 or pcp_errno
+ */
+int pcp_ctx_restore(pcp_ctx_t *ctx, const char *path);
+
 ////////////////////////////////////////////////////////////////////////////////
 //                          Flow API
 
@@ -150,6 +252,41 @@ pcp_flow_t *pcp_new_flow(pcp_ctx_t *ctx, struct sockaddr *src_addr,
         struct sockaddr *dst_addr, struct sockaddr *ext_addr, uint8_t protocol,
         uint32_t lifetime, void *userdata);
 
+/*
+ * Parameters of one flow created by pcp_new_flows; meaning of the fields is
+ * the same as of pcp_new_flow arguments.
+ */
+typedef struct pcp_flow_req {
+    struct sockaddr *src_addr;
+    struct sockaddr *dst_addr;  // optional
+    struct sockaddr *ext_addr;  // optional
+    uint8_t protocol;
+    uint32_t lifetime;
+    void *userdata;
+} pcp_flow_req_t;
+
+/*
+ * Creates n flows at once. Memory for all flows is allocated in one step,
+ * flows are inserted into the flow DB in bulk and their PCP messages are sent
+ * in one (paced) burst on the next pcp_pulse.
+ *  out         array of n flow handles; out[i] is NULL if reqs[i] is invalid
+ *  return value - count of created flows
+ */
+size_t pcp_new_flows(pcp_ctx_t *ctx, const pcp_flow_req_t *reqs, size_t n,
+        pcp_flow_t **out);
+
+/*
+ * Bring flows managed by this function to the desired state. Flows for desired
+ * requests missing from the previous call are created, flows not present in
+ * desired any more are closed and flows with changed lifetime are updated;
+ * the rest is left untouched. All resulting PCP messages are sent in paced
+ * bursts by pcp_pulse. Flows created by pcp_reconcile are owned by the library
+ * and must not be closed or deleted by the application.
+ *  desired     array of n requested flows (ext_addr is used only on creation)
+ *  return value - count of created, closed and updated flows or pcp_errno
+ */
+int pcp_reconcile(pcp_ctx_t *ctx, const pcp_flow_req_t *desired, size_t n);
+
 void pcp_flow_set_lifetime(pcp_flow_t *f, uint32_t lifetime);
 
 /*
@@ -255,6 +392,71 @@ typedef struct pcp_flow_info {
 // Allocates info_buf by malloc, has to be freed by client when no longer needed.
 pcp_flow_info_t *pcp_flow_get_info(pcp_flow_t *f, size_t *info_count);
 
+/*
+ * Non-allocating variant of pcp_flow_get_info. Fills at most info_count
+ * records (one per PCP server the flow is signaled to) into caller's info_buf.
+ *    return value - count of records of the flow; if it's greater than
+ *                   info_count, only first info_count records were filled.
+ */
+size_t pcp_flow_get_info_buf(pcp_flow_t *f, pcp_flow_info_t *info_buf,
+        size_t info_count);
+
+/*
+ * Cursor for enumeration of all flows in a context by pcp_flow_enum.
+ * Initialize it by PCP_FLOW_CURSOR_INIT before the first call and pass the
+ * same cursor to subsequent calls to continue where the previous one stopped.
+ */
+typedef struct pcp_flow_cursor {
+    uint32_t bucket;
+    uint32_t pos;
+} pcp_flow_cursor_t;
+
+#define PCP_FLOW_CURSOR_INIT {0, 0}
+
+/*
+ * Enumerate next slice of flows (one record per PCP server) of the context.
+ *   cursor (in/out)  - enumeration position
+ *   flows (out)      - optional - array of count flow handles
+ *   info_buf (out)   - optional - array of count flow info records
+ *   return value     - count of filled records, 0 when enumeration finished.
+ * Flows added or removed between two calls may be skipped or reported twice.
+ */
+size_t pcp_flow_enum(pcp_ctx_t *ctx, pcp_flow_cursor_t *cursor,
+        pcp_flow_t **flows, pcp_flow_info_t *info_buf, size_t count);
+
+/*
+ * Enable (nonzero) or disable sharing of identical MAP/PEER flows. When
+ * enabled, new flow with the same key as an existing one (on the same PCP
+ * server) doesn't create another mapping on wire; it shares the existing one.
+ * Each flow keeps its own handle, user data and state change notification.
+ * Options set on any of them apply to the shared mapping. The mapping is
+ * requested with the longest lifetime set on its flows; lifetime 0 (as well as
+ * pcp_close_flow) detaches only that flow and the mapping is removed when the
+ * last of them is closed. Identical requests of one pcp_new_flows batch share
+ * a mapping too.
+ */
+void pcp_set_flow_sharing(pcp_ctx_t *ctx, int enable);
+
+/*
+ * Enable (nonzero) or disable optimistic start of PCP servers added by
+ * pcp_add_server. Requests of all waiting flows are sent right after the
+ * initial ping instead of after its response, saving one round trip. Any
+ * valid response proves the server alive. If the server doesn't support
+ * given version, flows wait for version negotiation as without this option.
+ */
+void pcp_set_optimistic_start(pcp_ctx_t *ctx, int enable);
+
+/*
+ * Enable (nonzero) or disable racing of gateways found by auto-discovery.
+ * Gateways of the same address family are pinged one after another,
+ * PCP_GATEWAY_RACE_DELAY ms apart, and flows are handled by the first one
+ * which responds. The others are kept in reserve - their part of flows is
+ * reported as failed - until the chosen gateway stops working or its route
+ * disappears; then the race is run again among them. Enabling applies to
+ * gateways which haven't been pinged yet.
+ */
+void pcp_set_gateway_racing(pcp_ctx_t *ctx, int enable);
+
 //callback function type - called when flow state has changed
 typedef void (*pcp_flow_change_notify)(pcp_flow_t *f, struct sockaddr *src_addr,
         struct sockaddr *ext_addr, pcp_fstate_e, void *cb_arg);
@@ -291,6 +493,42 @@ int pcp_pulse(pcp_ctx_t *ctx, struct timeval *next_timeout);
  */
 PCP_SOCKET pcp_get_socket(pcp_ctx_t *ctx);
 
+/*
+ * Track changes of routing table (Linux netlink only). Gateways of added routes
+ * become new PCP servers and servers of gateways without route are retired.
+ * Flows of a retired server are moved to another PCP server of the same
+ * address family (source address of flow is changed to the one of new server)
+ * or wait for such server to appear. Changes are processed by pcp_pulse; socket
+ * returned by pcp_get_route_socket has to be in the select set along with
+ * pcp_get_socket. Enabling also adds gateways present at the moment.
+ *  enable       - 1 start tracking, 0 stop tracking
+ *  return value - PCP_ERR_SUCCESS or pcp_errno, if not supported
+ */
+int pcp_track_gateways(pcp_ctx_t *ctx, int enable);
+
+/*
+ * Get socket receiving routing table changes, -1 if gateways are not tracked.
+ */
+int pcp_get_route_socket(pcp_ctx_t *ctx);
+
+/*
+ * Serve flows of local processes on unix socket path (Linux only), so all of
+ * them share server discovery, pacing and renewals of this context. Identical
+ * flows of different processes are mapped once (flow sharing is enabled).
+ * A process whose environment has PCP_DAEMON=path set when calling pcp_init
+ * gets a context which forwards its flows to the daemon through shared memory;
+ * its pcp_add_server calls are ignored. Requests are handled by pcp_pulse;
+ * socket returned by pcp_get_daemon_socket has to be in the select set along
+ * with pcp_get_socket. Context stops serving in pcp_terminate.
+ *  return value - PCP_ERR_SUCCESS or pcp_errno
+ */
+int pcp_daemon_listen(pcp_ctx_t *ctx, const char *path);
+
+/*
+ * Get socket signalling requests of local processes, -1 if not serving them.
+ */
+int pcp_get_daemon_socket(pcp_ctx_t *ctx);
+
 //example of pcp_pulse and pcp_get_socket use in select loop:
 /*
  pcp_ctx_t *ctx=pcp_init(1, NULL);
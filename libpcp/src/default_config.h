@@ -60,6 +60,17 @@
 #define PCP_RETX_MRT 1024000
 #endif
 
+/* Maximum number of PCP messages sent to one server in a pacing interval
+ * (0 indicates no maximum) */
+#ifndef PCP_MAX_SEND_BURST
+#define PCP_MAX_SEND_BURST 256
+#endif
+
+/* Pacing interval in ms */
+#ifndef PCP_SEND_BURST_INTERVAL
+#define PCP_SEND_BURST_INTERVAL 10
+#endif
+
 /* enable SADSCP option support */
 /* #undef PCP_SADSCP */
 
@@ -73,6 +84,46 @@
 #define PCP_SERVER_PORT 5351
 #endif
 
+/* Number of destinations in source address cache */
+#ifndef PCP_SADDR_CACHE_SIZE
+#define PCP_SADDR_CACHE_SIZE 64
+#endif
+
+/* Lifetime of cached source address in seconds */
+#ifndef PCP_SADDR_CACHE_TTL
+#define PCP_SADDR_CACHE_TTL 60
+#endif
+
+/* Number of PCP servers in server cache file */
+#ifndef PCP_SERVER_CACHE_SIZE
+#define PCP_SERVER_CACHE_SIZE 64
+#endif
+
+/* Default lifetime of server cache records in seconds */
+#ifndef PCP_SERVER_CACHE_TTL
+#define PCP_SERVER_CACHE_TTL 600
+#endif
+
+/* Delay in ms between first pings of racing gateways */
+#ifndef PCP_GATEWAY_RACE_DELAY
+#define PCP_GATEWAY_RACE_DELAY 250
+#endif
+
+/* Slots in each ring shared with a local daemon client, power of 2 */
+#ifndef PCP_DAEMON_RING_SIZE
+#define PCP_DAEMON_RING_SIZE 1024
+#endif
+
+/* Datagrams read from shared socket by one call */
+#ifndef PCP_TRANSPORT_BATCH
+#define PCP_TRANSPORT_BATCH 32
+#endif
+
+/* Datagrams of shared socket queued per context */
+#ifndef PCP_TRANSPORT_QUEUE
+#define PCP_TRANSPORT_QUEUE 32
+#endif
+
 #ifndef PCP_MAX_SUPPORTED_VERSION
 #define PCP_MAX_SUPPORTED_VERSION 2
 #endif
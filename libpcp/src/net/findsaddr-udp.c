@@ -32,7 +32,9 @@
 #include "default_config.h"
 #endif
 
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #ifndef WIN32
 # include <sys/types.h>
 # include <sys/socket.h>
@@ -164,4 +166,168 @@ err:
     return (errstr);
 }
 
+/*
+ * Source address cache.
+ *
+ * Each lookup above costs a socket, connect, getsockname and close. The cache
+ * keeps one probe socket per address family and re-connects it, and stores
+ * the result per destination in a direct mapped table. Entries expire after
+ * PCP_SADDR_CACHE_TTL seconds and are flushed by the owner on routing table
+ * changes.
+ */
+
+struct saddr_cache_entry {
+    struct in6_addr dst;
+    uint32_t scope_id;
+    struct in6_addr src;
+    time_t expires; //0 - empty slot
+};
+
+struct saddr_cache {
+    SOCKET probe[2]; //IPv4 and IPv6 probe sockets, opened on first use
+    struct saddr_cache_entry entries[PCP_SADDR_CACHE_SIZE];
+};
+
+struct saddr_cache *saddr_cache_create(void)
+{
+    struct saddr_cache *c=(struct saddr_cache *)calloc(1, sizeof(*c));
+
+    if (c) {
+        c->probe[0]=INVALID_SOCKET;
+        c->probe[1]=INVALID_SOCKET;
+    }
+    return c;
+}
+
+void saddr_cache_destroy(struct saddr_cache *c)
+{
+    int i;
+
+    if (!c) {
+        return;
+    }
+    for (i=0; i < 2; ++i) {
+        if (c->probe[i] != INVALID_SOCKET) {
+            (void)CLOSE(c->probe[i]);
+        }
+    }
+    free(c);
+}
+
+void saddr_cache_flush(struct saddr_cache *c)
+{
+    if (c) {
+        memset(c->entries, 0, sizeof(c->entries));
+    }
+}
+
+static const char *probe_saddr(struct saddr_cache *c,
+        const struct sockaddr *to, struct in6_addr *from)
+{
+    int v6=(to->sa_family == AF_INET6);
+    struct sockaddr_storage cto, cfrom;
+    socklen_t len=v6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+    SOCKET s=c->probe[v6];
+
+    if (s == INVALID_SOCKET) {
+        uint32_t sock_flg=0;
+
+        s=socket(to->sa_family, SOCK_DGRAM, 0);
+        if (s == INVALID_SOCKET)
+            return ("failed to open DGRAM socket for src addr selection.");
+        //Enable Dual-stack socket for Vista and higher
+        if ((v6) && (setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY,
+                (char *)&sock_flg, sizeof(sock_flg)) == -1)) {
+            (void)CLOSE(s);
+            return ("setsockopt failed to set dual stack mode.");
+        }
+        c->probe[v6]=s;
+    } else {
+        struct sockaddr unspec;
+
+        // dissolve previous association, so the kernel selects source
+        // address again; where connect replaces it by itself this fails
+        // harmlessly
+        memset(&unspec, 0, sizeof(unspec));
+        unspec.sa_family=AF_UNSPEC;
+        (void)connect(s, &unspec, sizeof(unspec));
+    }
+
+    memcpy(&cto, to, len);
+    /* Dummy port for connect(2). */
+    if (v6) {
+        ((struct sockaddr_in6 *)&cto)->sin6_port=htons(65535);
+    } else {
+        ((struct sockaddr_in *)&cto)->sin_port=htons(65535);
+    }
+    if (connect(s, (struct sockaddr *)&cto, len) == -1)
+        return ("failed to connect to peer for src addr selection.");
+
+    if (getsockname(s, (struct sockaddr *)&cfrom, &len) == -1)
+        return ("failed to get socket name for src addr selection.");
+
+    if (cfrom.ss_family != to->sa_family)
+        return ("unexpected address family in src addr selection.");
+
+    if (v6) {
+        memcpy(from, &((struct sockaddr_in6 *)&cfrom)->sin6_addr,
+                sizeof(struct in6_addr));
+    } else {
+        ((uint32_t *)from)[0]=0;
+        ((uint32_t *)from)[1]=0;
+        ((uint32_t *)from)[2]=htonl(0xffff);
+        ((uint32_t *)from)[3]=((struct sockaddr_in *)&cfrom)->sin_addr.s_addr;
+    }
+
+    return (NULL);
+}
+
+const char *saddr_cache_find(struct saddr_cache *c, const struct sockaddr *to,
+        struct in6_addr *from)
+{
+    struct saddr_cache_entry *e;
+    struct in6_addr dst;
+    uint32_t scope_id=0, h;
+    const char *errstr;
+    time_t now;
+
+    if (to->sa_family == AF_INET6) {
+        const struct sockaddr_in6 *to6=(const struct sockaddr_in6 *)to;
+
+        if ((!c) || (IN6_IS_ADDR_LOOPBACK(&to6->sin6_addr)))
+            return (findsaddr6(to6, from));
+        memcpy(&dst, &to6->sin6_addr, sizeof(dst));
+        scope_id=to6->sin6_scope_id;
+    } else if (to->sa_family == AF_INET) {
+        if (!c)
+            return (findsaddr((const struct sockaddr_in *)to, from));
+        ((uint32_t *)&dst)[0]=0;
+        ((uint32_t *)&dst)[1]=0;
+        ((uint32_t *)&dst)[2]=htonl(0xffff);
+        ((uint32_t *)&dst)[3]=((const struct sockaddr_in *)to)->sin_addr.s_addr;
+    } else {
+        return ("unexpected address family in src addr selection.");
+    }
+
+    h=((uint32_t *)&dst)[0] ^ ((uint32_t *)&dst)[1] ^ ((uint32_t *)&dst)[2]
+            ^ ((uint32_t *)&dst)[3] ^ scope_id;
+    e=c->entries + (h * 0x9E3779B9) % PCP_SADDR_CACHE_SIZE;
+    now=time(NULL);
+    if ((e->expires > now) && (e->scope_id == scope_id)
+            && (memcmp(&e->dst, &dst, sizeof(dst)) == 0)) {
+        memcpy(from, &e->src, sizeof(*from));
+        return (NULL);
+    }
+
+    errstr=probe_saddr(c, to, from);
+    if (errstr)
+        return (errstr);
+
+    memcpy(&e->dst, &dst, sizeof(dst));
+    e->scope_id=scope_id;
+    memcpy(&e->src, from, sizeof(e->src));
+    e->expires=now + PCP_SADDR_CACHE_TTL;
+    return (NULL);
+}
+
 /* end */
@@ -32,4 +32,21 @@ const char *findsaddr(register const struct sockaddr_in *to,
 const char *findsaddr6(register const struct sockaddr_in6 *to,
         register struct in6_addr *from);
 
+struct saddr_cache;
+
+// Source address cache with probe sockets kept open between lookups.
+// Returns NULL when there is not enough memory.
+struct saddr_cache *saddr_cache_create(void);
+
+void saddr_cache_destroy(struct saddr_cache *c);
+
+// Drop all cached addresses, e.g. after routing table change.
+void saddr_cache_flush(struct saddr_cache *c);
+
+// Same as findsaddr/findsaddr6 for to of either family, answered from cache
+// when the destination was resolved less than PCP_SADDR_CACHE_TTL s ago.
+// IPv4 source is returned as IPv4-mapped address. c may be NULL.
+const char *saddr_cache_find(struct saddr_cache *c, const struct sockaddr *to,
+        struct in6_addr *from);
+
 #endif //FINDSADDR_UDP_H_
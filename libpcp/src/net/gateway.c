@@ -40,6 +40,7 @@
 #include <linux/types.h>
 #include <linux/netlink.h>
 #include <linux/rtnetlink.h>
+#include <fcntl.h>
 #endif
 
 #include <stdio.h>
@@ -109,55 +110,237 @@
 
 #define BUFSIZE 8192
 
-static ssize_t readNlSock(int sockFd, char *bufPtr, unsigned seqNum,
-        unsigned pId)
+// Result array of getgateways grown by doubling. Routes of full BGP table go
+// through a few gateways, so duplicates are dropped using open addressing
+// index of the array.
+struct gw_slot {
+    uint32_t hash;
+    int indx; //-1 empty
+};
+
+struct gw_array {
+    struct sockaddr_in6 *gws;
+    int count;
+    int size;
+    struct gw_slot *index; //2*size slots
+};
+
+static uint32_t gw_hash(const struct sockaddr_in6 *gw)
 {
-    struct nlmsghdr *nlHdr;
-    ssize_t readLen=0, msgLen=0;
+    uint32_t h=gw->sin6_scope_id;
+    int i;
 
-    do {
-        /* Receive response from the kernel */
-        readLen=recv(sockFd, bufPtr, BUFSIZE - msgLen, 0);
-        if (readLen == -1) {
-            char errmsg[128];
-            pcp_strerror(errno, errmsg, sizeof(errmsg));
-            PCP_LOG(PCP_LOGLVL_DEBUG, "SOCK READ: %s", errmsg);
-            return -1;
+    for (i=0; i < 4; ++i) {
+        h=(h ^ S6_ADDR32(&gw->sin6_addr)[i]) * 0x9E3779B9;
+        h^=h >> 16;
+    }
+    return h;
+}
+
+static struct gw_slot *gw_array_slot(struct gw_array *a,
+        const struct sockaddr_in6 *gw, uint32_t hash)
+{
+    uint32_t mask=(a->size << 1) - 1;
+    uint32_t i=hash & mask;
+
+    for (;; i=(i + 1) & mask) {
+        struct gw_slot *slot=a->index + i;
+        if ((slot->indx < 0) || ((slot->hash == hash)
+                && (IN6_ARE_ADDR_EQUAL(&a->gws[slot->indx].sin6_addr,
+                        &gw->sin6_addr))
+                && (a->gws[slot->indx].sin6_scope_id == gw->sin6_scope_id))) {
+            return slot;
         }
+    }
+}
 
-        nlHdr=(struct nlmsghdr *)bufPtr;
+static int gw_array_grow(struct gw_array *a)
+{
+    int size=a->size ? a->size << 1 : 8;
+    int old_slots=a->size << 1;
+    struct sockaddr_in6 *gws;
+    struct gw_slot *index, *old_index=a->index;
+    int i;
 
-        /* Check if the header is valid */
-        if ((NLMSG_OK(nlHdr, (unsigned)readLen) == 0)
-                || (nlHdr->nlmsg_type == NLMSG_ERROR)) {
-            PCP_LOG(PCP_LOGLVL_DEBUG, "%s", "Error in received packet");
-            return -1;
+    gws=(struct sockaddr_in6 *)realloc(a->gws, sizeof(*gws) * size);
+    if (!gws) {
+        return PCP_ERR_NO_MEM;
+    }
+    a->gws=gws;
+    index=(struct gw_slot *)malloc(sizeof(*index) * (size << 1));
+    if (!index) {
+        return PCP_ERR_NO_MEM;
+    }
+    for (i=0; i < (size << 1); ++i) {
+        index[i].indx=-1;
+    }
+    a->index=index;
+    a->size=size;
+    // reinsert with hashes kept in old index
+    for (i=0; i < old_slots; ++i) {
+        if (old_index[i].indx >= 0) {
+            *gw_array_slot(a, a->gws + old_index[i].indx, old_index[i].hash)=
+                    old_index[i];
         }
+    }
+    free(old_index);
+    return PCP_ERR_SUCCESS;
+}
 
-        /* Check if the its the last message */
-        if (nlHdr->nlmsg_type == NLMSG_DONE) {
-            break;
-        } else {
-            /* Else move the pointer to buffer appropriately */
-            bufPtr+=readLen;
-            msgLen+=readLen;
+static int gw_array_add(struct gw_array *a, const struct sockaddr_in6 *gw)
+{
+    uint32_t hash=gw_hash(gw);
+    struct gw_slot *slot;
+
+    if ((a->count == a->size) && (gw_array_grow(a) != PCP_ERR_SUCCESS)) {
+        return PCP_ERR_NO_MEM;
+    }
+    slot=gw_array_slot(a, gw, hash);
+    if (slot->indx < 0) {
+        slot->hash=hash;
+        slot->indx=a->count;
+        memcpy(a->gws + a->count++, gw, sizeof(*gw));
+    }
+    return PCP_ERR_SUCCESS;
+}
+
+// Fill gw from route of main routing table, which goes through a gateway.
+// Returns 1 if nlMsg is such a route.
+static int parse_gateway(struct nlmsghdr *nlMsg, struct sockaddr_in6 *gw)
+{
+    struct rtmsg *rtMsg;
+    struct rtattr *rtAttr;
+    int rtLen;
+    unsigned int scope_id = 0;
+    struct in6_addr addr;
+    int found = 0;
+    rtMsg=(struct rtmsg *)NLMSG_DATA(nlMsg);
+
+    /* If the route is not for AF_INET(6) or does not belong to main
+       routing table then return. */
+    if (((rtMsg->rtm_family != AF_INET) && (rtMsg->rtm_family != AF_INET6))
+            || (rtMsg->rtm_table != RT_TABLE_MAIN)) {
+        return 0;
+    }
+
+    /* get the rtattr field */
+    rtAttr=(struct rtattr *)RTM_RTA(rtMsg);
+    rtLen=RTM_PAYLOAD(nlMsg);
+    for (; RTA_OK(rtAttr,rtLen); rtAttr=RTA_NEXT(rtAttr,rtLen)) {
+        size_t rtaLen=RTA_PAYLOAD(rtAttr);
+        if (rtaLen > sizeof(struct in6_addr)) {
+            continue;
+        }
+        if (rtAttr->rta_type == RTA_OIF) {
+            memcpy(&scope_id, RTA_DATA(rtAttr), sizeof(unsigned int));
+        } else if (rtAttr->rta_type == RTA_GATEWAY) {
+            memset(&addr, 0, sizeof(struct in6_addr));
+            memcpy(&addr, RTA_DATA(rtAttr), rtaLen);
+            if (rtMsg->rtm_family == AF_INET) {
+                TO_IPV6MAPPED(&addr);
+            }
+            found=1;
         }
+    }
+    if (!found) {
+        return 0;
+    }
 
-        /* Check if its a multi part message */
-        if ((nlHdr->nlmsg_flags & NLM_F_MULTI) == 0) {
-            /* return if its not */
-            break;
+    memset(gw, 0, sizeof(*gw));
+    gw->sin6_family=AF_INET6;
+    memcpy(&gw->sin6_addr, &addr, sizeof(addr));
+    gw->sin6_scope_id=scope_id;
+    SET_SA_LEN(gw, sizeof(struct sockaddr_in6))
+    return 1;
+}
+
+int nl_read_gateways(nl_recv_fn rcv, void *arg, unsigned seq,
+        struct sockaddr_in6 **gws)
+{
+    struct gw_array a;
+    char *msgBuf;
+    int ret=PCP_ERR_SUCCESS;
+
+    memset(&a, 0, sizeof(a));
+    msgBuf=(char *)malloc(NL_DUMP_BUFSIZE);
+    if (!msgBuf) {
+        PCP_LOG(PCP_LOGLVL_ERR, "%s", "Error allocating memory");
+        return PCP_ERR_NO_MEM;
+    }
+
+    // each datagram is parsed as it comes, so dump of any size fits
+    for (;;) {
+        struct nlmsghdr *nlMsg=(struct nlmsghdr *)msgBuf;
+        ssize_t len=rcv(arg, msgBuf, NL_DUMP_BUFSIZE);
+
+        if ((len < 0) || (len > NL_DUMP_BUFSIZE)) {
+            PCP_LOG(PCP_LOGLVL_DEBUG, "%s", "Read From Netlink Socket Failed...");
+            ret=PCP_ERR_RECV_FAILED;
+            goto end;
+        }
+
+        for (; NLMSG_OK(nlMsg,(unsigned)len); nlMsg=NLMSG_NEXT(nlMsg,len)) {
+            struct sockaddr_in6 gw;
+
+            if (nlMsg->nlmsg_seq != seq) {
+                continue;
+            }
+            if (nlMsg->nlmsg_type == NLMSG_DONE) {
+                goto end;
+            }
+            if (nlMsg->nlmsg_type == NLMSG_ERROR) {
+                PCP_LOG(PCP_LOGLVL_DEBUG, "%s", "Error in received packet");
+                ret=PCP_ERR_RECV_FAILED;
+                goto end;
+            }
+            if ((nlMsg->nlmsg_type == RTM_NEWROUTE)
+                    && (parse_gateway(nlMsg, &gw))
+                    && (gw_array_add(&a, &gw) != PCP_ERR_SUCCESS)) {
+                PCP_LOG(PCP_LOGLVL_ERR, "%s", "Error allocating memory");
+                ret=PCP_ERR_NO_MEM;
+                goto end;
+            }
         }
-    } while ((nlHdr->nlmsg_seq != seqNum) || (nlHdr->nlmsg_pid != pId));
-    return msgLen;
+    }
+
+end:
+    free(msgBuf);
+    free(a.index);
+    if (ret != PCP_ERR_SUCCESS) {
+        free(a.gws);
+        return ret;
+    }
+    *gws=a.gws;
+    return a.count;
 }
 
-int getgateways(struct sockaddr_in6 **gws)
+static ssize_t nl_sock_recv(void *arg, void *buf, size_t len)
 {
-    struct nlmsghdr *nlMsg;
-    char msgBuf[BUFSIZE];
+    ssize_t ret;
 
-    int sock, msgSeq=0;
+    do {
+        // MSG_TRUNC - real length of datagram is returned
+        ret=recv(*(int *)arg, buf, len, MSG_TRUNC);
+    } while ((ret == -1) && (errno == EINTR));
+
+    if (ret == -1) {
+        char errmsg[128];
+        pcp_strerror(errno, errmsg, sizeof(errmsg));
+        PCP_LOG(PCP_LOGLVL_DEBUG, "SOCK READ: %s", errmsg);
+    }
+    return ret;
+}
+
+int getgateways(struct sockaddr_in6 **gws)
+{
+    struct {
+        struct nlmsghdr nh;
+        struct rtmsg rt;
+        char table[RTA_SPACE(sizeof(uint32_t))];
+    } req;
+    struct rtattr *rta;
+    unsigned seq=1;
+    int sock;
     ssize_t len;
     int ret;
 
@@ -172,100 +355,128 @@ int getgateways(struct sockaddr_in6 **gws)
         return PCP_ERR_UNKNOWN;
     }
 
-    /* Initialize the buffer */
-    memset(msgBuf, 0, BUFSIZE);
-
-    /* point the header and the msg structure pointers into the buffer */
-    nlMsg=(struct nlmsghdr *)msgBuf;
-
-    /* Fill in the nlmsg header*/
-    nlMsg->nlmsg_len=NLMSG_LENGTH(sizeof(struct rtmsg)); // Length of message.
-    nlMsg->nlmsg_type=RTM_GETROUTE; // Get the routes from kernel routing table.
+#ifdef NETLINK_GET_STRICT_CHK
+    {
+        // with strict checking kernel dumps only routes of requested table;
+        // older kernels ignore the filter and routes are filtered here
+        int one=1;
+        if (setsockopt(sock, SOL_NETLINK, NETLINK_GET_STRICT_CHK, &one,
+                sizeof(one))) {
+            PCP_LOG(PCP_LOGLVL_DEBUG, "%s",
+                    "Netlink strict checking not supported");
+        }
+    }
+#endif
 
-    nlMsg->nlmsg_flags=NLM_F_DUMP | NLM_F_REQUEST; // The message is a request for dump.
-    nlMsg->nlmsg_seq=msgSeq++; // Sequence of the message packet.
-    nlMsg->nlmsg_pid=getpid(); // PID of process sending the request.
+    /* Dump main routing table of all address families */
+    memset(&req, 0, sizeof(req));
+    req.nh.nlmsg_len=NLMSG_LENGTH(sizeof(struct rtmsg) + RTA_LENGTH(sizeof(uint32_t)));
+    req.nh.nlmsg_type=RTM_GETROUTE;
+    req.nh.nlmsg_flags=NLM_F_DUMP | NLM_F_REQUEST;
+    req.nh.nlmsg_seq=seq;
+    req.rt.rtm_family=AF_UNSPEC;
+    req.rt.rtm_table=RT_TABLE_MAIN;
+    rta=(struct rtattr *)req.table;
+    rta->rta_type=RTA_TABLE;
+    rta->rta_len=RTA_LENGTH(sizeof(uint32_t));
+    *(uint32_t *)RTA_DATA(rta)=RT_TABLE_MAIN;
 
     /* Send the request */
-    len=send(sock, nlMsg, nlMsg->nlmsg_len, 0);
+    len=send(sock, &req, req.nh.nlmsg_len, 0);
     if (len == -1) {
         PCP_LOG(PCP_LOGLVL_DEBUG, "%s", "Write To Netlink Socket Failed...");
         ret=PCP_ERR_SEND_FAILED;
         goto end;
     }
 
-    /* Read the response */
-    len=readNlSock(sock, msgBuf, msgSeq, getpid());
-    if (len < 0) {
-        PCP_LOG(PCP_LOGLVL_DEBUG, "%s", "Read From Netlink Socket Failed...");
-        ret=PCP_ERR_RECV_FAILED;
-        goto end;
+    /* Read and parse the response */
+    ret=nl_read_gateways(nl_sock_recv, &sock, seq, gws);
+
+end:
+    if (close(sock)) {
+        PCP_LOG(PCP_LOGLVL_DEBUG, "%s", "Close socket error");
     }
-    /* Parse and print the response */
-    ret=0;
-
-    for (; NLMSG_OK(nlMsg,(unsigned)len); nlMsg=NLMSG_NEXT(nlMsg,len)) {
-        struct rtmsg *rtMsg;
-        struct rtattr *rtAttr;
-        int rtLen;
-        unsigned int scope_id = 0;
-        struct in6_addr addr;
-        int found = 0;
-        rtMsg=(struct rtmsg *)NLMSG_DATA(nlMsg);
-
-        /* If the route is not for AF_INET(6) or does not belong to main
-           routing table then return. */
-        if (((rtMsg->rtm_family != AF_INET) && (rtMsg->rtm_family != AF_INET6))
-                || (rtMsg->rtm_table != RT_TABLE_MAIN)) {
-            continue;
-        }
+    return ret;
+}
 
-        /* get the rtattr field */
-        rtAttr=(struct rtattr *)RTM_RTA(rtMsg);
-        rtLen=RTM_PAYLOAD(nlMsg);
-        for (; RTA_OK(rtAttr,rtLen); rtAttr=RTA_NEXT(rtAttr,rtLen)) {
-            size_t rtaLen=RTA_PAYLOAD(rtAttr);
-            if (rtaLen > sizeof(struct in6_addr)) {
-                continue;
-            }
-            if (rtAttr->rta_type == RTA_OIF) {
-                memcpy(&scope_id, RTA_DATA(rtAttr), sizeof(unsigned int));
-            } else if (rtAttr->rta_type == RTA_GATEWAY) {
-                memset(&addr, 0, sizeof(struct in6_addr));
-                memcpy(&addr, RTA_DATA(rtAttr), rtaLen);
-                if (rtMsg->rtm_family == AF_INET) {
-                    TO_IPV6MAPPED(&addr);
-                }
-                found=1;
+int route_monitor_open(void)
+{
+    struct sockaddr_nl sa;
+    int sock;
+
+    sock=socket(PF_NETLINK, SOCK_DGRAM, NETLINK_ROUTE);
+    if (sock < 0) {
+        PCP_LOG(PCP_LOGLVL_DEBUG, "%s", "Netlink Socket Creation Failed...");
+        return PCP_ERR_UNKNOWN;
+    }
+
+    // subscribe to route and local address groups
+    memset(&sa, 0, sizeof(sa));
+    sa.nl_family=AF_NETLINK;
+    sa.nl_groups=RTMGRP_IPV4_ROUTE | RTMGRP_IPV6_ROUTE | RTMGRP_IPV4_IFADDR
+            | RTMGRP_IPV6_IFADDR;
+    if ((bind(sock, (struct sockaddr *)&sa, sizeof(sa)) == -1)
+            || (fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK))) {
+        char errmsg[128];
+        pcp_strerror(errno, errmsg, sizeof(errmsg));
+        PCP_LOG(PCP_LOGLVL_DEBUG, "Netlink Socket Setup Failed (%s)", errmsg);
+        close(sock);
+        return PCP_ERR_UNKNOWN;
+    }
+
+    return sock;
+}
+
+int route_monitor_read(int sock, route_change_cb cb, void *arg)
+{
+    char msgBuf[BUFSIZE];
+    int ret=0;
+
+    for (;;) {
+        struct nlmsghdr *nlMsg=(struct nlmsghdr *)msgBuf;
+        ssize_t len=recv(sock, msgBuf, sizeof(msgBuf), 0);
+
+        if (len == -1) {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+                break;
             }
+            // ENOBUFS - kernel dropped notifications, caller has to resync
+            PCP_LOG(PCP_LOGLVL_DEBUG, "%s", "Read From Netlink Socket Failed...");
+            return PCP_ERR_RECV_FAILED;
         }
-        if (found) {
-            struct sockaddr_in6 *tmp_gws;
-            tmp_gws=(struct sockaddr_in6 *)realloc(*gws,
-                    sizeof(struct sockaddr_in6) * (ret + 1));
-            if (!tmp_gws) {
-                PCP_LOG(PCP_LOGLVL_ERR, "%s",
-                        "Error allocating memory");
-                if (*gws) {
-                    free(*gws);
-                    *gws=NULL;
-                }
-                ret=PCP_ERR_NO_MEM;
-                goto end;
+
+        for (; NLMSG_OK(nlMsg,(unsigned)len); nlMsg=NLMSG_NEXT(nlMsg,len)) {
+            struct sockaddr_in6 gw;
+            int added=((nlMsg->nlmsg_type == RTM_NEWROUTE)
+                    || (nlMsg->nlmsg_type == RTM_NEWADDR));
+
+            switch (nlMsg->nlmsg_type) {
+                case RTM_NEWROUTE:
+                case RTM_DELROUTE:
+                    if (parse_gateway(nlMsg, &gw)) {
+                        cb(arg, &gw, added);
+                        break;
+                    }
+                    // fall through
+                case RTM_NEWADDR:
+                case RTM_DELADDR:
+                    cb(arg, NULL, added);
+                    break;
+                default:
+                    continue;
             }
-            *gws=tmp_gws;
-            (*gws + ret)->sin6_family=AF_INET6;
-            memcpy(&((*gws + ret)->sin6_addr), &addr, sizeof(addr));
-            (*gws + ret)->sin6_scope_id=scope_id;
-            SET_SA_LEN(*gws + ret, sizeof(struct sockaddr_in6))
             ret++;
         }
     }
-end:
+
+    return ret;
+}
+
+void route_monitor_close(int sock)
+{
     if (close(sock)) {
         PCP_LOG(PCP_LOGLVL_DEBUG, "%s", "Close socket error");
     }
-    return ret;
 }
 
 #endif /* #ifdef USE_NETLINK */
@@ -956,3 +1167,21 @@ static int get_if_addr_from_name(char *ifname, struct sockaddr *ifsock,
 #endif //0
 
 #endif
+
+#ifndef USE_NETLINK
+// route change notifications are implemented for netlink only
+int route_monitor_open(void)
+{
+    return PCP_ERR_UNKNOWN;
+}
+
+int route_monitor_read(UNUSED int sock, UNUSED route_change_cb cb,
+        UNUSED void *arg)
+{
+    return 0;
+}
+
+void route_monitor_close(UNUSED int sock)
+{
+}
+#endif
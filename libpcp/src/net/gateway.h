@@ -28,6 +28,37 @@
 
 struct sockaddr_in6;
 
+// Get distinct gateways of main routing table. Returns count of gateways or
+// pcp_errno; *gws has to be freed by caller.
 int getgateways(struct sockaddr_in6 **gws);
 
+#ifdef __linux__
+#include <sys/types.h>
+
+// route dump datagrams are never bigger (see netlink_recvmsg)
+#define NL_DUMP_BUFSIZE 32768
+
+// Source of netlink datagrams. Returns length of datagram, which is bigger
+// than len if it was truncated, or -1 on error.
+typedef ssize_t (*nl_recv_fn)(void *arg, void *buf, size_t len);
+
+// Parse RTM_GETROUTE dump with sequence number seq datagram by datagram.
+int nl_read_gateways(nl_recv_fn rcv, void *arg, unsigned seq,
+        struct sockaddr_in6 **gws);
+#endif
+
+// called for each added (added=1) or removed route through gateway gw;
+// gw is NULL for other routes and for local addresses
+typedef void (*route_change_cb)(void *arg, struct sockaddr_in6 *gw, int added);
+
+// Open non-blocking socket receiving routing table changes.
+// Returns socket or pcp_errno when not supported on this platform.
+int route_monitor_open(void);
+
+// Read all pending route changes. Returns count of reported changes or
+// pcp_errno when some changes were lost and routes have to be read again.
+int route_monitor_read(int sock, route_change_cb cb, void *arg);
+
+void route_monitor_close(int sock);
+
 #endif
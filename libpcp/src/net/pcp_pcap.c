@@ -0,0 +1,509 @@
+/*
+ Copyright (c) 2014 by Cisco Systems, Inc.
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice, this
+ list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#else
+#include "default_config.h"
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#ifdef WIN32
+#include "pcp_win_defines.h"
+#include "pcp_gettimeofday.h"
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <sys/time.h>
+#endif
+#include "pcp.h"
+#include "pcp_socket.h"
+#include "pcp_pcap.h"
+
+#define PCAP_MAGIC_US 0xa1b2c3d4
+#define PCAP_MAGIC_NS 0xa1b23c4d
+#define PCAP_HDR_LEN 24
+#define PCAP_REC_HDR_LEN 16
+#define PCAP_MAX_REC 262144
+
+#define LINKTYPE_NULL 0
+#define LINKTYPE_ETHERNET 1
+#define LINKTYPE_RAW 101
+#define LINKTYPE_LOOP 108
+#define LINKTYPE_LINUX_SLL 113
+#define LINKTYPE_IPV4 228
+#define LINKTYPE_IPV6 229
+#define LINKTYPE_LINUX_SLL2 276
+// raw IP has these numbers too on some OpenBSD and BSD/OS captures
+#define DLT_RAW_12 12
+#define DLT_RAW_14 14
+
+#define IP4_HDR_LEN 20
+#define IP6_HDR_LEN 40
+#define UDP_HDR_LEN 8
+// written datagrams are cut to this length, PCP messages are much shorter
+#define PCAP_WRITE_SNAP 2048
+
+struct pcp_pcap {
+    FILE *f;
+    uint8_t big_endian; //byte order of the file
+    uint8_t nsec; //timestamps in nanoseconds
+    uint32_t linktype;
+    uint16_t ip_id;
+    uint8_t *pkt; //read buffer
+};
+
+static void put16(uint8_t *b, uint16_t v)
+{
+    b[0]=(uint8_t)(v >> 8);
+    b[1]=(uint8_t)v;
+}
+
+static uint16_t get16(const uint8_t *b)
+{
+    return (uint16_t)((b[0] << 8) | b[1]);
+}
+
+// field of file header or record header in byte order of the file
+static uint32_t get32(pcp_pcap_t *p, const uint8_t *b)
+{
+    if (p->big_endian) {
+        return ((uint32_t)b[0] << 24) | ((uint32_t)b[1] << 16)
+                | ((uint32_t)b[2] << 8) | b[3];
+    }
+    return ((uint32_t)b[3] << 24) | ((uint32_t)b[2] << 16)
+            | ((uint32_t)b[1] << 8) | b[0];
+}
+
+static uint32_t csum_add(uint32_t sum, const uint8_t *b, size_t len)
+{
+    for (; len > 1; b+=2, len-=2) {
+        sum+=get16(b);
+    }
+    if (len) {
+        sum+=(uint32_t)b[0] << 8;
+    }
+    return sum;
+}
+
+static uint16_t csum_fold(uint32_t sum)
+{
+    while (sum >> 16) {
+        sum=(sum & 0xffff) + (sum >> 16);
+    }
+    return (uint16_t)~sum;
+}
+
+// address of sa as IPv6 (IPv4 mapped), NULL is unspecified address
+static void get_addr(const struct sockaddr *sa, uint8_t ip[16],
+        uint16_t *port)
+{
+    memset(ip, 0, 16);
+    *port=0;
+    if (!sa) {
+        return;
+    }
+    if (sa->sa_family == AF_INET) {
+        const struct sockaddr_in *sin=(const struct sockaddr_in *)sa;
+
+        ip[10]=0xff;
+        ip[11]=0xff;
+        memcpy(ip + 12, &sin->sin_addr, 4);
+        *port=ntohs(sin->sin_port);
+    } else if (sa->sa_family == AF_INET6) {
+        const struct sockaddr_in6 *sin6=(const struct sockaddr_in6 *)sa;
+
+        memcpy(ip, &sin6->sin6_addr, 16);
+        *port=ntohs(sin6->sin6_port);
+    }
+}
+
+// IPv4 mapped or unspecified address, which fits both versions
+static int is_ip4(const uint8_t ip[16])
+{
+    static const uint8_t mapped[12]={0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+    static const uint8_t unspec[16]={0};
+
+    return (memcmp(ip, mapped, sizeof(mapped)) == 0)
+            || (memcmp(ip, unspec, sizeof(unspec)) == 0);
+}
+
+pcp_pcap_t *pcp_pcap_create(const char *path)
+{
+    uint8_t hdr[PCAP_HDR_LEN];
+    uint32_t magic=PCAP_MAGIC_US;
+    uint16_t major=2, minor=4;
+    uint32_t zero=0, snaplen=PCP_PCAP_MAX_DATA, linktype=LINKTYPE_RAW;
+    pcp_pcap_t *p;
+
+    p=(pcp_pcap_t *)calloc(1, sizeof(*p));
+    if (!p) {
+        return NULL;
+    }
+    p->f=fopen(path, "wb");
+    if (!p->f) {
+        free(p);
+        return NULL;
+    }
+    p->linktype=LINKTYPE_RAW;
+
+    // header in host byte order, readers detect it by the magic
+    memcpy(hdr, &magic, 4);
+    memcpy(hdr + 4, &major, 2);
+    memcpy(hdr + 6, &minor, 2);
+    memcpy(hdr + 8, &zero, 4);
+    memcpy(hdr + 12, &zero, 4);
+    memcpy(hdr + 16, &snaplen, 4);
+    memcpy(hdr + 20, &linktype, 4);
+    if ((fwrite(hdr, sizeof(hdr), 1, p->f) != 1) || (fflush(p->f))) {
+        pcp_pcap_close(p);
+        return NULL;
+    }
+    return p;
+}
+
+int pcp_pcap_write(pcp_pcap_t *p, const struct timeval *ts,
+        const struct sockaddr *src, const struct sockaddr *dst,
+        const void *data, size_t len)
+{
+    uint8_t rec[PCAP_REC_HDR_LEN + IP6_HDR_LEN + UDP_HDR_LEN + PCAP_WRITE_SNAP];
+    uint8_t *ip=rec + PCAP_REC_HDR_LEN;
+    uint8_t *udp;
+    uint8_t sip[16], dip[16], pseudo[4];
+    uint16_t sport, dport;
+    uint32_t sum, ts_sec, ts_usec, incl_len, orig_len;
+    size_t ip_hdr, snap;
+    struct timeval now;
+
+    if ((!p) || (!p->f) || (len > 0xffff - IP6_HDR_LEN - UDP_HDR_LEN)) {
+        return -1;
+    }
+    if (!ts) {
+        gettimeofday(&now, NULL);
+        ts=&now;
+    }
+
+    get_addr(src, sip, &sport);
+    get_addr(dst, dip, &dport);
+    // pseudo header: zero, protocol and UDP length, same for both versions
+    pseudo[0]=0;
+    pseudo[1]=IPPROTO_UDP;
+    put16(pseudo + 2, (uint16_t)(UDP_HDR_LEN + len));
+
+    if ((is_ip4(sip)) && (is_ip4(dip))) {
+        ip_hdr=IP4_HDR_LEN;
+        memset(ip, 0, IP4_HDR_LEN);
+        ip[0]=0x45;
+        put16(ip + 2, (uint16_t)(IP4_HDR_LEN + UDP_HDR_LEN + len));
+        put16(ip + 4, p->ip_id++);
+        ip[8]=64;
+        ip[9]=IPPROTO_UDP;
+        memcpy(ip + 12, sip + 12, 4);
+        memcpy(ip + 16, dip + 12, 4);
+        put16(ip + 10, csum_fold(csum_add(0, ip, IP4_HDR_LEN)));
+        sum=csum_add(csum_add(0, ip + 12, 8), pseudo, sizeof(pseudo));
+    } else {
+        ip_hdr=IP6_HDR_LEN;
+        memset(ip, 0, IP6_HDR_LEN);
+        ip[0]=0x60;
+        put16(ip + 4, (uint16_t)(UDP_HDR_LEN + len));
+        ip[6]=IPPROTO_UDP;
+        ip[7]=64;
+        memcpy(ip + 8, sip, 16);
+        memcpy(ip + 24, dip, 16);
+        sum=csum_add(csum_add(0, ip + 8, 32), pseudo, sizeof(pseudo));
+    }
+
+    udp=ip + ip_hdr;
+    put16(udp, sport);
+    put16(udp + 2, dport);
+    put16(udp + 4, (uint16_t)(UDP_HDR_LEN + len));
+    put16(udp + 6, 0);
+    sum=csum_add(sum, udp, UDP_HDR_LEN);
+    sum=csum_fold(csum_add(sum, (const uint8_t *)data, len));
+    put16(udp + 6, sum ? (uint16_t)sum : 0xffff);
+
+    snap=len < PCAP_WRITE_SNAP ? len : PCAP_WRITE_SNAP;
+    memcpy(udp + UDP_HDR_LEN, data, snap);
+
+    ts_sec=(uint32_t)ts->tv_sec;
+    ts_usec=(uint32_t)ts->tv_usec;
+    incl_len=(uint32_t)(ip_hdr + UDP_HDR_LEN + snap);
+    orig_len=(uint32_t)(ip_hdr + UDP_HDR_LEN + len);
+    memcpy(rec, &ts_sec, 4);
+    memcpy(rec + 4, &ts_usec, 4);
+    memcpy(rec + 8, &incl_len, 4);
+    memcpy(rec + 12, &orig_len, 4);
+
+    // flushed, so capture survives killed process
+    if ((fwrite(rec, PCAP_REC_HDR_LEN + incl_len, 1, p->f) != 1)
+            || (fflush(p->f))) {
+        return -1;
+    }
+    return 0;
+}
+
+pcp_pcap_t *pcp_pcap_open(const char *path)
+{
+    static const uint8_t m_us[4]={0xa1, 0xb2, 0xc3, 0xd4};
+    static const uint8_t m_ns[4]={0xa1, 0xb2, 0x3c, 0x4d};
+    uint8_t hdr[PCAP_HDR_LEN], rev[4];
+    pcp_pcap_t *p;
+    int i;
+
+    p=(pcp_pcap_t *)calloc(1, sizeof(*p));
+    if (!p) {
+        return NULL;
+    }
+    p->f=fopen(path, "rb");
+    if ((!p->f) || (fread(hdr, sizeof(hdr), 1, p->f) != 1)) {
+        pcp_pcap_close(p);
+        return NULL;
+    }
+
+    for (i=0; i < 4; ++i) {
+        rev[i]=hdr[3 - i];
+    }
+    if ((!memcmp(hdr, m_us, 4)) || (!memcmp(hdr, m_ns, 4))) {
+        p->big_endian=1;
+    } else if ((memcmp(rev, m_us, 4)) && (memcmp(rev, m_ns, 4))) {
+        // pcapng and other formats
+        pcp_pcap_close(p);
+        return NULL;
+    }
+    p->nsec=(get32(p, hdr) == PCAP_MAGIC_NS);
+    // upper bits may carry FCS length
+    p->linktype=get32(p, hdr + 20) & 0xffff;
+
+    switch (p->linktype) {
+        case LINKTYPE_NULL:
+        case LINKTYPE_ETHERNET:
+        case LINKTYPE_RAW:
+        case DLT_RAW_12:
+        case DLT_RAW_14:
+        case LINKTYPE_LOOP:
+        case LINKTYPE_LINUX_SLL:
+        case LINKTYPE_LINUX_SLL2:
+        case LINKTYPE_IPV4:
+        case LINKTYPE_IPV6:
+            break;
+        default:
+            pcp_pcap_close(p);
+            return NULL;
+    }
+
+    p->pkt=(uint8_t *)malloc(PCAP_MAX_REC);
+    if (!p->pkt) {
+        pcp_pcap_close(p);
+        return NULL;
+    }
+    return p;
+}
+
+// offset of IP header in link layer frame, -1 if it doesn't carry IP
+static int ip_offset(uint32_t linktype, const uint8_t *pkt, size_t len)
+{
+    size_t off;
+    uint32_t af;
+    uint16_t type;
+
+    switch (linktype) {
+        case LINKTYPE_NULL:
+        case LINKTYPE_LOOP:
+            // address family of capturing host, in unknown byte order
+            if (len < 4) {
+                return -1;
+            }
+            af=(uint32_t)(pkt[0] | pkt[1] | pkt[2] | pkt[3]);
+            return ((af == 2) || (af == 24) || (af == 28) || (af == 30)) ?
+                    4 : -1;
+        case LINKTYPE_ETHERNET:
+            off=14;
+            if (len < off) {
+                return -1;
+            }
+            type=get16(pkt + 12);
+            // VLAN tags
+            while (((type == 0x8100) || (type == 0x88a8)) && (len >= off + 4)) {
+                type=get16(pkt + off + 2);
+                off+=4;
+            }
+            break;
+        case LINKTYPE_LINUX_SLL:
+            off=16;
+            if (len < off) {
+                return -1;
+            }
+            type=get16(pkt + 14);
+            break;
+        case LINKTYPE_LINUX_SLL2:
+            off=20;
+            if (len < off) {
+                return -1;
+            }
+            type=get16(pkt);
+            break;
+        default:
+            return 0;
+    }
+    return ((type == 0x0800) || (type == 0x86dd)) ? (int)off : -1;
+}
+
+static void set_addr(struct sockaddr_storage *ss, int ip6, const uint8_t *ip,
+        const uint8_t *port)
+{
+    memset(ss, 0, sizeof(*ss));
+    if (ip6) {
+        struct sockaddr_in6 *sin6=(struct sockaddr_in6 *)ss;
+
+        sin6->sin6_family=AF_INET6;
+        memcpy(&sin6->sin6_addr, ip, 16);
+        memcpy(&sin6->sin6_port, port, 2);
+        SET_SA_LEN(sin6, sizeof(*sin6));
+    } else {
+        struct sockaddr_in *sin=(struct sockaddr_in *)ss;
+
+        sin->sin_family=AF_INET;
+        memcpy(&sin->sin_addr, ip, 4);
+        memcpy(&sin->sin_port, port, 2);
+        SET_SA_LEN(sin, sizeof(*sin));
+    }
+}
+
+// parse UDP datagram out of the frame, 0 if frame is something else
+static int parse_frame(pcp_pcap_t *p, size_t len, pcp_pcap_rec_t *rec)
+{
+    const uint8_t *pkt=p->pkt, *src, *dst, *udp;
+    int off=ip_offset(p->linktype, pkt, len);
+    size_t end, hlen, ulen;
+    int ip6;
+
+    if ((off < 0) || ((size_t)off >= len)) {
+        return 0;
+    }
+    pkt+=off;
+    len-=off;
+
+    if ((pkt[0] >> 4) == 4) {
+        hlen=(size_t)(pkt[0] & 0x0f) * 4;
+        if ((len < IP4_HDR_LEN) || (hlen < IP4_HDR_LEN) || (hlen > len)
+                || (pkt[9] != IPPROTO_UDP) || (get16(pkt + 6) & 0x3fff)) {
+            return 0;
+        }
+        end=get16(pkt + 2) < len ? get16(pkt + 2) : len;
+        ip6=0;
+        src=pkt + 12;
+        dst=pkt + 16;
+    } else if ((pkt[0] >> 4) == 6) {
+        size_t plen;
+        uint8_t nh;
+
+        if (len < IP6_HDR_LEN) {
+            return 0;
+        }
+        plen=(size_t)IP6_HDR_LEN + get16(pkt + 4);
+        end=plen < len ? plen : len;
+        nh=pkt[6];
+        hlen=IP6_HDR_LEN;
+        // hop-by-hop, routing and destination options extension headers
+        while (((nh == 0) || (nh == 43) || (nh == 60)) && (hlen + 8 <= end)) {
+            nh=pkt[hlen];
+            hlen+=((size_t)pkt[hlen + 1] + 1) * 8;
+        }
+        if (nh != IPPROTO_UDP) {
+            return 0;
+        }
+        ip6=1;
+        src=pkt + 8;
+        dst=pkt + 24;
+    } else {
+        return 0;
+    }
+
+    if (hlen + UDP_HDR_LEN > end) {
+        return 0;
+    }
+    udp=pkt + hlen;
+    ulen=get16(udp + 4);
+    if (ulen < UDP_HDR_LEN) {
+        return 0;
+    }
+    ulen-=UDP_HDR_LEN;
+    if (ulen > end - hlen - UDP_HDR_LEN) {
+        ulen=end - hlen - UDP_HDR_LEN;
+    }
+
+    set_addr(&rec->src, ip6, src, udp);
+    set_addr(&rec->dst, ip6, dst, udp + 2);
+    memcpy(rec->data, udp + UDP_HDR_LEN, ulen);
+    rec->len=ulen;
+    return 1;
+}
+
+int pcp_pcap_read(pcp_pcap_t *p, pcp_pcap_rec_t *rec)
+{
+    uint8_t hdr[PCAP_REC_HDR_LEN];
+
+    if ((!p) || (!p->pkt)) {
+        return -1;
+    }
+    for (;;) {
+        uint32_t incl_len, frac;
+
+        if (fread(hdr, sizeof(hdr), 1, p->f) != 1) {
+            return 0;
+        }
+        incl_len=get32(p, hdr + 8);
+        if (incl_len > PCAP_MAX_REC) {
+            return -1;
+        }
+        // record cut by end of file is end of capture
+        if ((incl_len) && (fread(p->pkt, incl_len, 1, p->f) != 1)) {
+            return 0;
+        }
+        frac=get32(p, hdr + 4);
+        rec->ts.tv_sec=get32(p, hdr);
+        rec->ts.tv_usec=p->nsec ? frac / 1000 : frac;
+        if (parse_frame(p, incl_len, rec)) {
+            return 1;
+        }
+    }
+}
+
+void pcp_pcap_close(pcp_pcap_t *p)
+{
+    if (!p) {
+        return;
+    }
+    if (p->f) {
+        fclose(p->f);
+    }
+    free(p->pkt);
+    free(p);
+}
@@ -0,0 +1,70 @@
+/*
+ Copyright (c) 2014 by Cisco Systems, Inc.
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice, this
+ list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PCP_PCAP_H_
+#define PCP_PCAP_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "pcp.h"
+
+// Capture files in classic pcap format. Datagrams are written as raw IPv4 or
+// IPv6 packets with UDP header, so tcpdump and Wireshark dissect them as PCP.
+// Reader accepts also captures of Ethernet, Linux cooked and BSD loopback
+// links (e.g. taken by tcpdump or written by Scapy) and skips everything but
+// unfragmented UDP datagrams. Every record is written by one fwrite, so
+// threads may share a writer.
+
+#define PCP_PCAP_MAX_DATA 65535
+
+typedef struct pcp_pcap pcp_pcap_t;
+
+typedef struct pcp_pcap_rec {
+    struct timeval ts;
+    struct sockaddr_storage src;
+    struct sockaddr_storage dst;
+    size_t len;
+    uint8_t data[PCP_PCAP_MAX_DATA];
+} pcp_pcap_rec_t;
+
+// create (replace) capture file for writing, NULL on error
+pcp_pcap_t *pcp_pcap_create(const char *path);
+
+// open capture file for reading, NULL if it can't be read or isn't pcap
+pcp_pcap_t *pcp_pcap_open(const char *path);
+
+// Append datagram sent from src to dst, ts NULL for current time. NULL
+// address is written as unspecified one. Packet is IPv4 if both addresses
+// are IPv4 (or IPv4 mapped), IPv6 otherwise. Returns 0 or -1.
+int pcp_pcap_write(pcp_pcap_t *p, const struct timeval *ts,
+        const struct sockaddr *src, const struct sockaddr *dst,
+        const void *data, size_t len);
+
+// next UDP datagram: 1 - rec filled in, 0 - end of file, -1 - corrupted file
+int pcp_pcap_read(pcp_pcap_t *p, pcp_pcap_rec_t *rec);
+
+void pcp_pcap_close(pcp_pcap_t *p);
+
+#endif /* PCP_PCAP_H_ */
@@ -47,6 +47,8 @@
 #include "unp.h"
 #include "pcp_utils.h"
 #include "pcp_socket.h"
+#include "pcp_pcap.h"
+#include "pcp_transport.h"
 
 static PCP_SOCKET pcp_socket_create_impl(int domain, int type, int protocol);
 static ssize_t pcp_socket_recvfrom_impl(PCP_SOCKET sock, void *buf, size_t len,
@@ -195,28 +197,59 @@ PCP_SOCKET pcp_socket_create(struct pcp_ctx_s *ctx, int domain, int type,
     return ctx->virt_socket_tb->sock_create(domain, type, protocol);
 }
 
+// datagrams of the context are recorded as they pass the socket table
 ssize_t pcp_socket_recvfrom(struct pcp_ctx_s *ctx, void *buf, size_t len,
         int flags, struct sockaddr *src_addr, socklen_t *addrlen)
 {
+    ssize_t ret;
+
     assert(ctx && ctx->virt_socket_tb && ctx->virt_socket_tb->sock_recvfrom);
 
-    return ctx->virt_socket_tb->sock_recvfrom(ctx->socket, buf, len, flags,
-            src_addr, addrlen);
+    if (ctx->transport) {
+        ret=pcp_transport_recv(ctx, buf, len, src_addr, addrlen);
+    } else {
+        ret=ctx->virt_socket_tb->sock_recvfrom(ctx->socket, buf, len, flags,
+                src_addr, addrlen);
+    }
+    if (ret > 0) {
+        ctx->stats.received++;
+    }
+    if ((ctx->capture) && (ret > 0)) {
+        pcp_pcap_write(ctx->capture, NULL, src_addr,
+                (struct sockaddr *)&ctx->capture_local, buf, (size_t)ret);
+    }
+    return ret;
 }
 
 ssize_t pcp_socket_sendto(struct pcp_ctx_s *ctx, const void *buf, size_t len,
         int flags, struct sockaddr *dest_addr, socklen_t addrlen)
 {
+    ssize_t ret;
+
     assert(ctx && ctx->virt_socket_tb && ctx->virt_socket_tb->sock_sendto);
 
-    return ctx->virt_socket_tb->sock_sendto(ctx->socket, buf, len, flags,
+    ret=ctx->virt_socket_tb->sock_sendto(ctx->socket, buf, len, flags,
             dest_addr, addrlen);
+    if (ret > 0) {
+        ctx->stats.sent++;
+    }
+    if ((ctx->capture) && (ret > 0)) {
+        pcp_pcap_write(ctx->capture, NULL,
+                (struct sockaddr *)&ctx->capture_local, dest_addr, buf,
+                (size_t)ret);
+    }
+    return ret;
 }
 
 int pcp_socket_close(struct pcp_ctx_s *ctx)
 {
     assert(ctx && ctx->virt_socket_tb && ctx->virt_socket_tb->sock_close);
 
+    // shared socket is closed by pcp_transport_destroy
+    if (ctx->transport) {
+        pcp_transport_detach(ctx);
+        return 0;
+    }
     return ctx->virt_socket_tb->sock_close(ctx->socket);
 }
 
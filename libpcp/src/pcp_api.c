@@ -61,7 +61,12 @@
 #include "pcp_event_handler.h"
 #include "pcp_utils.h"
 #include "pcp_server_discovery.h"
+#include "pcp_server_cache.h"
+#include "pcp_daemon.h"
+#include "pcp_transport.h"
+#include "pcp_pcap.h"
 #include "net/findsaddr.h"
+#include "net/gateway.h"
 
 PCP_SOCKET pcp_get_socket(pcp_ctx_t *ctx)
 {
@@ -69,6 +74,139 @@ PCP_SOCKET pcp_get_socket(pcp_ctx_t *ctx)
     return ctx ? ctx->socket : PCP_INVALID_SOCKET;
 }
 
+int pcp_get_route_socket(pcp_ctx_t *ctx)
+{
+    return ctx ? ctx->route_sock : -1;
+}
+
+int pcp_track_gateways(pcp_ctx_t *ctx, int enable)
+{
+    int sock;
+
+    PCP_LOG_BEGIN(PCP_LOGLVL_DEBUG);
+
+    if (!ctx) {
+        PCP_LOG_END(PCP_LOGLVL_DEBUG);
+        return PCP_ERR_BAD_ARGS;
+    }
+
+    // gateways are tracked by local daemon
+    if (ctx->daemon_link) {
+        PCP_LOG_END(PCP_LOGLVL_DEBUG);
+        return PCP_ERR_SUCCESS;
+    }
+
+    if (!enable) {
+        if (ctx->route_sock >= 0) {
+            route_monitor_close(ctx->route_sock);
+            ctx->route_sock=-1;
+        }
+        PCP_LOG_END(PCP_LOGLVL_DEBUG);
+        return PCP_ERR_SUCCESS;
+    }
+
+    if (ctx->route_sock < 0) {
+        sock=route_monitor_open();
+        if (sock < 0) {
+            PCP_LOG(PCP_LOGLVL_WARN, "%s",
+                    "Routing table changes can't be tracked.");
+            PCP_LOG_END(PCP_LOGLVL_DEBUG);
+            return sock;
+        }
+        ctx->route_sock=sock;
+        // subscribed now, so no change is missed between the dump and
+        // first notification
+        psd_sync_gws(ctx);
+    }
+
+    PCP_LOG_END(PCP_LOGLVL_DEBUG);
+    return PCP_ERR_SUCCESS;
+}
+
+static int warm_start_iter(pcp_server_t *s, UNUSED void *data)
+{
+    if ((s->server_state == pss_ping) && (psc_warm_start(s))) {
+        s->server_state=pss_send_all_msgs;
+    }
+    return 0;
+}
+
+int pcp_set_server_cache(pcp_ctx_t *ctx, const char *path, uint32_t ttl)
+{
+    int ret;
+
+    PCP_LOG_BEGIN(PCP_LOGLVL_DEBUG);
+
+    if (!ctx) {
+        PCP_LOG_END(PCP_LOGLVL_DEBUG);
+        return PCP_ERR_BAD_ARGS;
+    }
+
+    if (!path) {
+        psc_close(ctx);
+        PCP_LOG_END(PCP_LOGLVL_DEBUG);
+        return PCP_ERR_SUCCESS;
+    }
+
+    ret=psc_open(ctx, path, ttl ? ttl : PCP_SERVER_CACHE_TTL);
+    if (ret == PCP_ERR_SUCCESS) {
+        pcp_db_foreach_server(ctx, warm_start_iter, NULL);
+    }
+
+    PCP_LOG_END(PCP_LOGLVL_DEBUG);
+    return ret;
+}
+
+int pcp_set_capture(pcp_ctx_t *ctx, const char *path)
+{
+    socklen_t len=sizeof(ctx->capture_local);
+
+    PCP_LOG_BEGIN(PCP_LOGLVL_DEBUG);
+
+    if (!ctx) {
+        PCP_LOG_END(PCP_LOGLVL_DEBUG);
+        return PCP_ERR_BAD_ARGS;
+    }
+
+    pcp_pcap_close(ctx->capture);
+    ctx->capture=NULL;
+    if (!path) {
+        PCP_LOG_END(PCP_LOGLVL_DEBUG);
+        return PCP_ERR_SUCCESS;
+    }
+
+    ctx->capture=pcp_pcap_create(path);
+    if (!ctx->capture) {
+        PCP_LOG(PCP_LOGLVL_WARN, "Can't create capture file %s", path);
+        PCP_LOG_END(PCP_LOGLVL_DEBUG);
+        return PCP_ERR_UNKNOWN;
+    }
+
+    // unknown for sockets of custom socket table, written as unspecified
+    memset(&ctx->capture_local, 0, sizeof(ctx->capture_local));
+#ifndef PCP_SOCKET_IS_VOIDPTR
+    if (getsockname(ctx->socket, (struct sockaddr *)&ctx->capture_local,
+            &len)) {
+        memset(&ctx->capture_local, 0, sizeof(ctx->capture_local));
+    }
+#else
+    (void)len;
+#endif
+
+    PCP_LOG_END(PCP_LOGLVL_DEBUG);
+    return PCP_ERR_SUCCESS;
+}
+
+int pcp_get_stats(pcp_ctx_t *ctx, pcp_stats_t *stats)
+{
+    if ((!ctx) || (!stats)) {
+        return PCP_ERR_BAD_ARGS;
+    }
+
+    *stats=ctx->stats;
+    return PCP_ERR_SUCCESS;
+}
+
 int pcp_add_server(pcp_ctx_t *ctx, struct sockaddr *pcp_server,
         uint8_t pcp_version)
 {
@@ -83,6 +221,12 @@ int pcp_add_server(pcp_ctx_t *ctx, struct sockaddr *pcp_server,
         PCP_LOG_END(PCP_LOGLVL_INFO);
         return PCP_ERR_UNSUP_VERSION;
     }
+    if (ctx->daemon_link) {
+        PCP_LOG(PCP_LOGLVL_INFO, "%s",
+                "PCP server not added, flows are mapped by local daemon.");
+        PCP_LOG_END(PCP_LOGLVL_DEBUG);
+        return PCP_ERR_SUCCESS;
+    }
 
     res=psd_add_pcp_server(ctx, pcp_server, pcp_version);
 
@@ -90,9 +234,11 @@ int pcp_add_server(pcp_ctx_t *ctx, struct sockaddr *pcp_server,
     return res;
 }
 
-pcp_ctx_t *pcp_init(uint8_t autodiscovery, pcp_socket_vt_t *socket_vt)
+static pcp_ctx_t *init_ctx(uint8_t autodiscovery, pcp_socket_vt_t *socket_vt,
+        pcp_transport_t *transport)
 {
     pcp_ctx_t *ctx=(pcp_ctx_t *)calloc(1, sizeof(pcp_ctx_t));
+    char *env;
 
     pcp_logger_init();
 
@@ -103,19 +249,37 @@ pcp_ctx_t *pcp_init(uint8_t autodiscovery, pcp_socket_vt_t *socket_vt)
         return NULL;
     }
 
+    ctx->route_sock=-1;
+
     if (socket_vt) {
         ctx->virt_socket_tb=socket_vt;
     } else {
         ctx->virt_socket_tb=&default_socket_vt;
     }
 
-    ctx->socket=pcp_socket_create(ctx,
+    // flows are forwarded to local daemon, nothing is sent by this context
+    if ((!socket_vt) && (!transport) && (env=getenv("PCP_DAEMON"))) {
+        if (pcp_daemon_connect(ctx, env) == PCP_ERR_SUCCESS) {
+            PCP_LOG_END(PCP_LOGLVL_DEBUG);
+            return ctx;
+        }
+        PCP_LOG(PCP_LOGLVL_WARN, "Can't connect to local PCP daemon %s, "
+                "mapping flows by this process.", env);
+    }
+
+    if (transport) {
+        if (pcp_transport_attach(transport, ctx) != PCP_ERR_SUCCESS) {
+            ctx->socket=PCP_INVALID_SOCKET;
+        }
+    } else {
+        ctx->socket=pcp_socket_create(ctx,
 #ifdef PCP_USE_IPV6_SOCKET
-            AF_INET6,
+                AF_INET6,
 #else
-            AF_INET,
+                AF_INET,
 #endif
-            SOCK_DGRAM, 0);
+                SOCK_DGRAM, 0);
+    }
 
     if (ctx->socket == PCP_INVALID_SOCKET) {
         PCP_LOG(PCP_LOGLVL_WARN, "%s",
@@ -126,6 +290,17 @@ pcp_ctx_t *pcp_init(uint8_t autodiscovery, pcp_socket_vt_t *socket_vt)
     }
     PCP_LOG(PCP_LOGLVL_DEBUG, "%s", "Created a new PCP socket.");
 
+    // without cache every lookup opens its own probe socket
+    ctx->saddr_cache=saddr_cache_create();
+
+    if ((env=getenv("PCP_SERVER_CACHE"))) {
+        pcp_set_server_cache(ctx, env, PCP_SERVER_CACHE_TTL);
+    }
+
+    if ((env=getenv("PCP_CAPTURE"))) {
+        pcp_set_capture(ctx, env);
+    }
+
     if (autodiscovery)
         psd_add_gws(ctx);
 
@@ -133,46 +308,51 @@ pcp_ctx_t *pcp_init(uint8_t autodiscovery, pcp_socket_vt_t *socket_vt)
     return ctx;
 }
 
+pcp_ctx_t *pcp_init(uint8_t autodiscovery, pcp_socket_vt_t *socket_vt)
+{
+    return init_ctx(autodiscovery, socket_vt, NULL);
+}
+
+pcp_ctx_t *pcp_init_shared(pcp_transport_t *t, uint8_t autodiscovery)
+{
+    if (!t) {
+        return NULL;
+    }
+    return init_ctx(autodiscovery, NULL, t);
+}
+
 int pcp_eval_flow_state(pcp_flow_t *flow, pcp_fstate_e *fstate)
 {
-    pcp_flow_t *fiter;
-    int nexit_states=0;
-    int fpresent_no_exit_state=0;
-    int fsuccess=0;
-    int ffailed=0;
+    uint32_t *cnt;
+    int nexit_states;
 
     PCP_LOG_BEGIN(PCP_LOGLVL_DEBUG);
 
-    for (fiter=flow; fiter != NULL; fiter=fiter->next_child) {
-        switch (fiter->state) {
-            case pfs_wait_for_lifetime_renew:
-                fsuccess=1;
-                ++nexit_states;
-                break;
-            case pfs_failed:
-                ffailed=1;
-                ++nexit_states;
-                break;
-            case pfs_wait_after_short_life_error:
-                ++nexit_states;
-                break;
-            default:
-                fpresent_no_exit_state=1;
-                break;
+    if (!flow) {
+        if (fstate) {
+            *fstate=pcp_state_short_lifetime_error;
         }
+        PCP_LOG_END(PCP_LOGLVL_DEBUG);
+        return 0;
     }
 
+    // group keeps counts of its flows' states
+    pcp_flow_account_state(flow);
+    cnt=flow->group->group_cnt;
+    nexit_states=cnt[pfc_succeeded] + cnt[pfc_failed]
+            + cnt[pfc_short_lifetime_error];
+
     if (fstate) {
-        if (fpresent_no_exit_state) {
-            if (fsuccess) {
+        if (cnt[pfc_processing]) {
+            if (cnt[pfc_succeeded]) {
                 *fstate=pcp_state_partial_result;
             } else {
                 *fstate=pcp_state_processing;
             }
         } else {
-            if (fsuccess) {
+            if (cnt[pfc_succeeded]) {
                 *fstate=pcp_state_succeeded;
-            } else if (ffailed) {
+            } else if (cnt[pfc_failed]) {
                 *fstate=pcp_state_failed;
             } else {
                 *fstate=pcp_state_short_lifetime_error;
@@ -228,6 +408,9 @@ pcp_fstate_e pcp_wait(pcp_flow_t *flow, int timeout, int exit_on_partial_res)
 
     fd=pcp_get_socket(flow->ctx);
     fdmax=fd + 1;
+    if (flow->ctx->route_sock >= fdmax) {
+        fdmax=flow->ctx->route_sock + 1;
+    }
 
     // main loop
     for (;;) {
@@ -259,6 +442,9 @@ pcp_fstate_e pcp_wait(pcp_flow_t *flow, int timeout, int exit_on_partial_res)
 
         FD_ZERO(&read_fds);
         FD_SET(fd, &read_fds);
+        if (flow->ctx->route_sock >= 0) {
+            FD_SET(flow->ctx->route_sock, &read_fds);
+        }
 
         PCP_LOG(PCP_LOGLVL_DEBUG,
                 "Executing select with fdmax=%d, timeout = %ld s; %ld us",
@@ -309,17 +495,17 @@ static inline void init_flow(pcp_flow_t *f, pcp_server_t *s, int lifetime,
         f->lifetime=lifetime;
         f->timeout=curtime;
 
-        if (s->server_state == pss_wait_io) {
+        if ((s->server_state == pss_wait_io)
+                || (s->server_state == pss_daemon)) {
             f->state=pfs_send;
+        } else if (s->server_state == pss_race_lost) {
+            f->state=pfs_failed; //handled by gateway which won the race
         } else {
             f->state=pfs_wait_for_server_init;
         }
+        pcp_flow_account_state(f);
 
-        s->next_timeout=curtime;
         f->user_data=NULL;
-
-        pcp_db_add_flow(f);
-        PCP_LOG_FLOW(f, "Added new flow");
     }
     PCP_LOG_END(PCP_LOGLVL_DEBUG);
 }
@@ -334,6 +520,7 @@ struct caasi_data {
     uint8_t toler_fields;
     char *app_name;
     void *userdata;
+    int batch; //flows are added to DB by caller
 };
 
 static int chain_and_assign_src_ip(pcp_server_t *s, void *data)
@@ -347,13 +534,33 @@ static int chain_and_assign_src_ip(pcp_server_t *s, void *data)
         return 0;
     }
 
-    if ((IN6_IS_ADDR_UNSPECIFIED(d->src_ip))
+    if ((s->server_state == pss_daemon)
+            || (IN6_IS_ADDR_UNSPECIFIED(d->src_ip))
             || (IN6_ARE_ADDR_EQUAL(d->src_ip, (struct in6_addr *) s->src_ip))) {
         pcp_flow_t *f=NULL;
+        pcp_flow_t *wire=NULL;
+        int sharing;
+
+        if (s->server_state == pss_daemon) {
+            // source address is chosen by daemon's servers
+            memcpy(&d->kd->src_ip, d->src_ip, sizeof(d->kd->src_ip));
+            pcp_daemon_link_key(s, d->kd);
+        } else {
+            memcpy(&d->kd->src_ip, s->src_ip, sizeof(d->kd->src_ip));
+            memcpy(&d->kd->pcp_server_ip, s->pcp_ip,
+                    sizeof(d->kd->pcp_server_ip));
+            memcpy(&d->kd->nonce, &s->nonce, sizeof(d->kd->nonce));
+        }
 
-        memcpy(&d->kd->src_ip, s->src_ip, sizeof(d->kd->src_ip));
-        memcpy(&d->kd->pcp_server_ip, s->pcp_ip, sizeof(d->kd->pcp_server_ip));
-        memcpy(&d->kd->nonce, &s->nonce, sizeof(d->kd->nonce));
+        sharing=(s->ctx->flow_sharing) && ((d->kd->operation == PCP_OPCODE_MAP)
+                || (d->kd->operation == PCP_OPCODE_PEER));
+        if (sharing) {
+            wire=pcp_get_flow(d->kd, s);
+            // don't join flow being closed or already failed
+            if ((wire) && ((wire->lifetime == 0) || (wire->state == pfs_failed))) {
+                wire=NULL;
+            }
+        }
 
         f=pcp_create_flow(s, d->kd);
         if (!f) {
@@ -374,8 +581,23 @@ static int chain_and_assign_src_ip(pcp_server_t *s, void *data)
 #endif
         init_flow(f, s, d->lifetime, d->ext_addr);
         f->user_data=d->userdata;
+        if (wire) {
+            pcp_db_flow_share(wire, f);
+            if (d->lifetime > wire->lifetime) {
+                wire->lifetime=d->lifetime;
+                pcp_flow_updated(wire);
+            }
+            PCP_LOG_FLOW(f, "Added new flow sharing existing one");
+        } else if ((!d->batch) || (sharing)) {
+            // in batch only shareable flows, so that the same request later
+            // in the batch finds them
+            gettimeofday(&s->next_timeout, NULL);
+            pcp_db_add_flow(f);
+            PCP_LOG_FLOW(f, "Added new flow");
+        }
         if (d->fprev) {
             d->fprev->next_child=f;
+            pcp_flow_join_group(d->ffirst, f);
         } else {
             d->ffirst=f;
         }
@@ -386,25 +608,22 @@ static int chain_and_assign_src_ip(pcp_server_t *s, void *data)
     return 0;
 }
 
-pcp_flow_t *pcp_new_flow(pcp_ctx_t *ctx, struct sockaddr *src_addr,
-        struct sockaddr *dst_addr, struct sockaddr *ext_addr, uint8_t protocol,
-        uint32_t lifetime, void *userdata)
+// Fill flow key data and source IP of a new MAP/PEER flow. Unspecified
+// dst_addr is dropped and missing ext_addr is replaced by unspecified address
+// stored in tmp_ext_addr.
+static pcp_errno fill_new_flow_key(pcp_ctx_t *ctx, struct flow_key_data *kd,
+        struct in6_addr *src_ip, struct sockaddr *src_addr,
+        struct sockaddr *dst_addr, struct sockaddr **ext_addr, uint8_t protocol,
+        struct sockaddr_storage *tmp_ext_addr)
 {
-    struct flow_key_data kd;
-    struct caasi_data data;
-    struct in6_addr src_ip;
-    struct sockaddr_storage tmp_ext_addr;
-
-    PCP_LOG_BEGIN(PCP_LOGLVL_DEBUG);
+    memset(kd, 0, sizeof(*kd));
 
-    memset(&kd, 0, sizeof(kd));
-
-    if ((!src_addr) || (!ctx)) {
-        return NULL;
+    if (!src_addr) {
+        return PCP_ERR_BAD_ARGS;
     }
-    pcp_fill_in6_addr(&src_ip, &kd.map_peer.src_port, src_addr);
+    pcp_fill_in6_addr(src_ip, &kd->map_peer.src_port, src_addr);
 
-    kd.map_peer.protocol=protocol;
+    kd->map_peer.protocol=protocol;
 
     if (dst_addr) {
         switch (dst_addr->sa_family) {
@@ -427,30 +646,29 @@ pcp_flow_t *pcp_new_flow(pcp_ctx_t *ctx, struct sockaddr *src_addr,
     }
 
     if (dst_addr) {
-        pcp_fill_in6_addr(&kd.map_peer.dst_ip, &kd.map_peer.dst_port, dst_addr);
-        kd.operation=PCP_OPCODE_PEER;
+        pcp_fill_in6_addr(&kd->map_peer.dst_ip, &kd->map_peer.dst_port,
+                dst_addr);
+        kd->operation=PCP_OPCODE_PEER;
         if (src_addr->sa_family == AF_INET) {
-            if (S6_ADDR32(&src_ip)[3] == INADDR_ANY) {
-                findsaddr((struct sockaddr_in*)dst_addr, &src_ip);
+            if (S6_ADDR32(src_ip)[3] == INADDR_ANY) {
+                saddr_cache_find(ctx->saddr_cache, dst_addr, src_ip);
             }
-        } else if (IN6_IS_ADDR_UNSPECIFIED(&src_ip)) {
-            findsaddr6((struct sockaddr_in6*)dst_addr, &src_ip);
+        } else if (IN6_IS_ADDR_UNSPECIFIED(src_ip)) {
+            saddr_cache_find(ctx->saddr_cache, dst_addr, src_ip);
         } else if (dst_addr->sa_family != src_addr->sa_family) {
             PCP_LOG(PCP_LOGLVL_PERR, "%s",
                     "Socket family mismatch.");
-
-            PCP_LOG_END(PCP_LOGLVL_DEBUG);
-            return NULL;
+            return PCP_ERR_BAD_AFINET;
         }
     } else {
-        kd.operation=PCP_OPCODE_MAP;
+        kd->operation=PCP_OPCODE_MAP;
     }
 
-    if (!ext_addr) {
-      struct sockaddr_in *te4=(struct sockaddr_in *)&tmp_ext_addr;
-      struct sockaddr_in6 *te6=(struct sockaddr_in6 *)&tmp_ext_addr;
-      tmp_ext_addr.ss_family=src_addr->sa_family;
-      switch (tmp_ext_addr.ss_family) {
+    if (!*ext_addr) {
+      struct sockaddr_in *te4=(struct sockaddr_in *)tmp_ext_addr;
+      struct sockaddr_in6 *te6=(struct sockaddr_in6 *)tmp_ext_addr;
+      tmp_ext_addr->ss_family=src_addr->sa_family;
+      switch (tmp_ext_addr->ss_family) {
         case AF_INET:
           memset(&te4->sin_addr, 0, sizeof(te4->sin_addr));
           te4->sin_port=0;
@@ -462,11 +680,36 @@ pcp_flow_t *pcp_new_flow(pcp_ctx_t *ctx, struct sockaddr *src_addr,
         default:
           PCP_LOG(PCP_LOGLVL_PERR, "%s",
                   "Unsupported address family.");
-          return NULL;
+          return PCP_ERR_BAD_AFINET;
       }
-      ext_addr=(struct sockaddr *)&tmp_ext_addr;
+      *ext_addr=(struct sockaddr *)tmp_ext_addr;
     }
 
+    return PCP_ERR_SUCCESS;
+}
+
+pcp_flow_t *pcp_new_flow(pcp_ctx_t *ctx, struct sockaddr *src_addr,
+        struct sockaddr *dst_addr, struct sockaddr *ext_addr, uint8_t protocol,
+        uint32_t lifetime, void *userdata)
+{
+    struct flow_key_data kd;
+    struct caasi_data data;
+    struct in6_addr src_ip;
+    struct sockaddr_storage tmp_ext_addr;
+
+    PCP_LOG_BEGIN(PCP_LOGLVL_DEBUG);
+
+    if ((!src_addr) || (!ctx)) {
+        return NULL;
+    }
+
+    if (fill_new_flow_key(ctx, &kd, &src_ip, src_addr, dst_addr, &ext_addr,
+            protocol, &tmp_ext_addr) != PCP_ERR_SUCCESS) {
+        PCP_LOG_END(PCP_LOGLVL_DEBUG);
+        return NULL;
+    }
+
+    memset(&data, 0, sizeof(data));
     data.fprev=NULL;
     data.lifetime=lifetime;
     data.ext_addr=ext_addr;
@@ -486,14 +729,111 @@ pcp_flow_t *pcp_new_flow(pcp_ctx_t *ctx, struct sockaddr *src_addr,
     return data.ffirst;
 }
 
+static int count_active_servers(pcp_server_t *s, void *data)
+{
+    if (s->server_state != pss_not_working) {
+        ++*(size_t *)data;
+    }
+    return 0;
+}
+
+size_t pcp_new_flows(pcp_ctx_t *ctx, const pcp_flow_req_t *reqs, size_t n,
+        pcp_flow_t **out)
+{
+    struct flow_key_data kd;
+    struct caasi_data data;
+    struct in6_addr src_ip;
+    struct sockaddr_storage tmp_ext_addr;
+    size_t servers_cnt=0;
+    size_t created=0;
+    size_t i;
+    struct timeval curtime;
+
+    PCP_LOG_BEGIN(PCP_LOGLVL_DEBUG);
+
+    if ((!ctx) || (!reqs) || (!out)) {
+        PCP_LOG_END(PCP_LOGLVL_DEBUG);
+        return 0;
+    }
+
+    // preallocate flows for all requests at once
+    pcp_db_foreach_server(ctx, count_active_servers, &servers_cnt);
+    pcp_db_reserve_flows(ctx, n * servers_cnt);
+
+    for (i=0; i < n; ++i) {
+        const pcp_flow_req_t *r=reqs + i;
+        struct sockaddr *ext_addr=r->ext_addr;
+
+        out[i]=NULL;
+
+        if (fill_new_flow_key(ctx, &kd, &src_ip, r->src_addr, r->dst_addr,
+                &ext_addr, r->protocol, &tmp_ext_addr) != PCP_ERR_SUCCESS) {
+            continue;
+        }
+
+        memset(&data, 0, sizeof(data));
+        data.lifetime=r->lifetime;
+        data.ext_addr=ext_addr;
+        data.src_ip=&src_ip;
+        data.kd=&kd;
+        data.userdata=r->userdata;
+        data.batch=1;
+
+        if (pcp_db_foreach_server(ctx, chain_and_assign_src_ip, &data)
+                != PCP_ERR_MAX_SIZE) {
+            pcp_delete_flow(data.ffirst);
+            continue;
+        }
+
+        out[i]=data.ffirst;
+        if (data.ffirst) {
+            ++created;
+        }
+    }
+
+    pcp_db_add_flows(ctx, out, n);
+
+    // send all new flows in one burst on next pcp_pulse
+    gettimeofday(&curtime, NULL);
+    for (i=0; i < n; ++i) {
+        pcp_flow_t *fiter;
+
+        for (fiter=out[i]; fiter; fiter=fiter->next_child) {
+            pcp_server_t *s=get_pcp_server(ctx, fiter->pcp_server_indx);
+            if (s) {
+                s->next_timeout=curtime;
+            }
+            PCP_LOG_FLOW(fiter, "Added new flow");
+        }
+    }
+
+    PCP_LOG_END(PCP_LOGLVL_DEBUG);
+    return created;
+}
+
 void pcp_flow_set_lifetime(pcp_flow_t *f, uint32_t lifetime)
 {
-    pcp_flow_t *fiter;
+    pcp_flow_t *fiter, *fnext;
 
-    for (fiter=f; fiter != NULL; fiter=fiter->next_child) {
-        fiter->lifetime=lifetime;
+    for (fiter=f; fiter != NULL; fiter=fnext) {
+        pcp_flow_t *w=PCP_WIRE_FLOW(fiter);
 
-        pcp_flow_updated(fiter);
+        fnext=fiter->next_child;
+        if (!w->share_cnt) {
+            w->lifetime=lifetime;
+        } else if (lifetime == 0) {
+            // other flows keep the shared mapping
+            pcp_close_flow_intern(fiter);
+            continue;
+        } else {
+            fiter->req_lifetime=lifetime;
+            if (fiter != w) {
+                fiter->lifetime=lifetime;
+            }
+            pcp_db_flow_share_lifetime(w);
+        }
+
+        pcp_flow_updated(w);
     }
 }
 
@@ -502,9 +842,15 @@ void pcp_flow_set_3rd_party_opt(pcp_flow_t *f, struct sockaddr *thirdp_addr)
     pcp_flow_t *fiter;
 
     for (fiter=f; fiter != NULL; fiter=fiter->next_child) {
-        fiter->third_party_option_present=1;
-        pcp_fill_in6_addr(&fiter->third_party_ip, NULL, thirdp_addr);
-        pcp_flow_updated(fiter);
+        pcp_flow_t *w=PCP_WIRE_FLOW(fiter);
+        struct pcp_flow_ext *ext=pcp_db_flow_ext(w);
+
+        if (!ext) {
+            continue;
+        }
+        ext->third_party_option_present=1;
+        pcp_fill_in6_addr(&ext->third_party_ip, NULL, thirdp_addr);
+        pcp_flow_updated(w);
     }
 }
 
@@ -514,12 +860,18 @@ void pcp_flow_set_filter_opt(pcp_flow_t *f, struct sockaddr *filter_ip,
     pcp_flow_t *fiter;
 
     for (fiter=f; fiter != NULL; fiter=fiter->next_child) {
-        if (!fiter->filter_option_present) {
-            fiter->filter_option_present=1;
+        pcp_flow_t *w=PCP_WIRE_FLOW(fiter);
+        struct pcp_flow_ext *ext=pcp_db_flow_ext(w);
+
+        if (!ext) {
+            continue;
         }
-        pcp_fill_in6_addr(&fiter->filter_ip, &fiter->filter_port, filter_ip);
-        fiter->filter_prefix=filter_prefix;
-        pcp_flow_updated(fiter);
+        if (!ext->filter_option_present) {
+            ext->filter_option_present=1;
+        }
+        pcp_fill_in6_addr(&ext->filter_ip, &ext->filter_port, filter_ip);
+        ext->filter_prefix=filter_prefix;
+        pcp_flow_updated(w);
     }
 }
 
@@ -528,9 +880,11 @@ void pcp_flow_set_prefer_failure_opt(pcp_flow_t *f)
     pcp_flow_t *fiter;
 
     for (fiter=f; fiter != NULL; fiter=fiter->next_child) {
-        if (!fiter->pfailure_option_present) {
-            fiter->pfailure_option_present=1;
-            pcp_flow_updated(fiter);
+        pcp_flow_t *w=PCP_WIRE_FLOW(fiter);
+
+        if (!w->pfailure_option_present) {
+            w->pfailure_option_present=1;
+            pcp_flow_updated(w);
         }
     }
 }
@@ -540,8 +894,14 @@ int pcp_flow_set_userid(pcp_flow_t *f, pcp_userid_option_p user)
     pcp_flow_t *fiter;
 
     for (fiter=f; fiter; fiter=fiter->next_child) {
-        memcpy(&(fiter->f_userid.userid[0]), &(user->userid[0]), MAX_USER_ID);
-        pcp_flow_updated(fiter);
+        pcp_flow_t *w=PCP_WIRE_FLOW(fiter);
+        struct pcp_flow_ext *ext=pcp_db_flow_ext(w);
+
+        if (!ext) {
+            return PCP_ERR_NO_MEM;
+        }
+        memcpy(&(ext->f_userid.userid[0]), &(user->userid[0]), MAX_USER_ID);
+        pcp_flow_updated(w);
     }
     return 0;
 }
@@ -551,8 +911,14 @@ int pcp_flow_set_location(pcp_flow_t *f, pcp_location_option_p loc)
     pcp_flow_t *fiter;
 
     for (fiter=f; fiter; fiter=fiter->next_child) {
-        memcpy(&(fiter->f_location.location[0]), &(loc->location[0]), MAX_GEO_STR);
-        pcp_flow_updated(fiter);
+        pcp_flow_t *w=PCP_WIRE_FLOW(fiter);
+        struct pcp_flow_ext *ext=pcp_db_flow_ext(w);
+
+        if (!ext) {
+            return PCP_ERR_NO_MEM;
+        }
+        memcpy(&(ext->f_location.location[0]), &(loc->location[0]), MAX_GEO_STR);
+        pcp_flow_updated(w);
     }
 
     return 0;
@@ -563,8 +929,14 @@ int pcp_flow_set_deviceid(pcp_flow_t *f, pcp_deviceid_option_p dev)
     pcp_flow_t *fiter;
 
     for (fiter=f; fiter; fiter=fiter->next_child) {
-        memcpy(&(fiter->f_deviceid.deviceid[0]), &(dev->deviceid[0]), MAX_DEVICE_ID);
-        pcp_flow_updated(fiter);
+        pcp_flow_t *w=PCP_WIRE_FLOW(fiter);
+        struct pcp_flow_ext *ext=pcp_db_flow_ext(w);
+
+        if (!ext) {
+            return PCP_ERR_NO_MEM;
+        }
+        memcpy(&(ext->f_deviceid.deviceid[0]), &(dev->deviceid[0]), MAX_DEVICE_ID);
+        pcp_flow_updated(w);
     }
     return 0;
 }
@@ -575,8 +947,10 @@ pcp_flow_add_md (pcp_flow_t *f, uint32_t md_id, void *value, size_t val_len)
     pcp_flow_t *fiter;
 
     for (fiter=f; fiter!=NULL; fiter=fiter->next_child) {
-        pcp_db_add_md(fiter, md_id, value, val_len);
-        pcp_flow_updated(fiter);
+        pcp_flow_t *w=PCP_WIRE_FLOW(fiter);
+
+        pcp_db_add_md(w, md_id, value, val_len);
+        pcp_flow_updated(w);
     }
 }
 #endif
@@ -587,21 +961,39 @@ void pcp_flow_set_flowp(pcp_flow_t *f, uint8_t dscp_up, uint8_t dscp_down)
     pcp_flow_t *fiter;
 
     for (fiter=f; fiter; fiter=fiter->next_child) {
+        pcp_flow_t *w=PCP_WIRE_FLOW(fiter);
         uint8_t fpresent = (dscp_up!=0)||(dscp_down!=0);
-        if (fiter->flowp_option_present != fpresent) {
-            fiter->flowp_option_present=fpresent;
-        }
-        if (fpresent) {
-            fiter->flowp_dscp_up=dscp_up;
-            fiter->flowp_dscp_down=dscp_down;
+        struct pcp_flow_ext *ext=fpresent ? pcp_db_flow_ext(w) : w->ext;
+
+        if (ext) {
+            ext->flowp_option_present=fpresent;
+            if (fpresent) {
+                ext->flowp_dscp_up=dscp_up;
+                ext->flowp_dscp_down=dscp_down;
+            }
         }
-        pcp_flow_updated(fiter);
+        pcp_flow_updated(w);
     }
 }
 #endif
 
-static inline void pcp_close_flow_intern(pcp_flow_t *f)
+void pcp_close_flow_intern(pcp_flow_t *f)
 {
+    // shared mapping stays on wire for the remaining flows
+    if (f->shared || f->next_follower) {
+        pcp_flow_t *w=f->shared ? f->shared : f->next_follower;
+        uint32_t lifetime=PCP_WIRE_FLOW(f)->lifetime;
+
+        pcp_db_flow_unshare(f);
+        PCP_LOG_FLOW(f, "Flow detached from shared one");
+        f->lifetime=0;
+        // renew with the longest lifetime still requested
+        if (w->lifetime != lifetime) {
+            pcp_flow_updated(w);
+        }
+        return;
+    }
+
     switch (f->state) {
         case pfs_wait_for_server_init:
         case pfs_idle:
@@ -620,7 +1012,9 @@ static inline void pcp_close_flow_intern(pcp_flow_t *f)
         pcp_flow_updated(f);
     } else {
         f->state=pfs_failed;
+        f->lifetime=0; //not to be sent again by another server
     }
+    pcp_flow_account_state(f);
 }
 
 void pcp_close_flow(pcp_flow_t *f)
@@ -643,13 +1037,241 @@ void pcp_delete_flow(pcp_flow_t *f)
 
     while (fiter) {
         fnext=fiter->next_child;
+        if (fiter->ctx->daemon_link) {
+            pcp_daemon_link_forget(fiter);
+        }
         pcp_delete_flow_intern(fiter);
         fiter=fnext;
     }
 }
 
+void pcp_set_optimistic_start(pcp_ctx_t *ctx, int enable)
+{
+    if (ctx) {
+        ctx->optimistic_start=(enable != 0);
+    }
+}
+
+static int gateway_race_iter(pcp_server_t *s, void *data)
+{
+    if (data) {
+        pcp_server_join_race(s);
+    } else {
+        pcp_server_leave_race(s);
+    }
+    return 0;
+}
+
+void pcp_set_gateway_racing(pcp_ctx_t *ctx, int enable)
+{
+    if (ctx) {
+        ctx->gateway_racing=enable ? 1 : 0;
+        pcp_db_foreach_server(ctx, gateway_race_iter,
+                enable ? (void *)ctx : NULL);
+    }
+}
+
+void pcp_set_flow_sharing(pcp_ctx_t *ctx, int enable)
+{
+    if (ctx) {
+        ctx->flow_sharing=(enable != 0);
+    }
+}
+
+struct reconcile_desired {
+    struct reconcile_key key;
+    size_t req_indx;
+};
+
+static int reconcile_key_cmp(const void *a, const void *b)
+{
+    return memcmp(a, b, sizeof(struct reconcile_key));
+}
+
+static int reconcile_fill_key(pcp_ctx_t *ctx, struct reconcile_key *key,
+        const pcp_flow_req_t *r)
+{
+    struct flow_key_data kd;
+    struct in6_addr src_ip;
+    struct sockaddr_storage tmp_ext_addr;
+    struct sockaddr *ext_addr=r->ext_addr;
+
+    if (fill_new_flow_key(ctx, &kd, &src_ip, r->src_addr, r->dst_addr,
+            &ext_addr, r->protocol, &tmp_ext_addr) != PCP_ERR_SUCCESS) {
+        return 0;
+    }
+
+    memset(key, 0, sizeof(*key));
+    key->operation=kd.operation;
+    key->protocol=kd.map_peer.protocol;
+    key->src_port=kd.map_peer.src_port;
+    key->dst_port=kd.map_peer.dst_port;
+    key->src_ip=src_ip;
+    key->dst_ip=kd.map_peer.dst_ip;
+
+    return 1;
+}
+
+// closed flow can be deleted once its closing message was processed
+static int reconcile_flow_finished(pcp_flow_t *f)
+{
+    for (; f; f=f->next_child) {
+        switch (f->state) {
+            case pfs_send:
+            case pfs_wait_resp:
+            case pfs_send_renew:
+                return 0;
+            default:
+                break;
+        }
+    }
+    return 1;
+}
+
+int pcp_reconcile(pcp_ctx_t *ctx, const pcp_flow_req_t *desired, size_t n)
+{
+    struct reconcile_desired *d=NULL;
+    struct pcp_reconcile_entry *old_idx, *new_idx=NULL;
+    pcp_flow_req_t *create_reqs=NULL;
+    pcp_flow_t **created=NULL;
+    size_t *create_pos=NULL;
+    size_t d_cnt=0, old_cnt, new_cnt=0, create_cnt=0;
+    size_t i, j;
+    int changes=0;
+
+    PCP_LOG_BEGIN(PCP_LOGLVL_DEBUG);
+
+    if ((!ctx) || ((!desired) && (n > 0))) {
+        PCP_LOG_END(PCP_LOGLVL_DEBUG);
+        return PCP_ERR_BAD_ARGS;
+    }
+
+    old_idx=ctx->reconciled;
+    old_cnt=ctx->reconciled_cnt;
+
+    if (n > 0) {
+        d=(struct reconcile_desired *)malloc(n * sizeof(*d));
+        create_reqs=(pcp_flow_req_t *)malloc(n * sizeof(*create_reqs));
+        created=(pcp_flow_t **)malloc(n * sizeof(*created));
+        create_pos=(size_t *)malloc(n * sizeof(*create_pos));
+    }
+    new_idx=(struct pcp_reconcile_entry *)malloc(
+            (old_cnt + n + 1) * sizeof(*new_idx));
+    if ((n > 0 && ((!d) || (!create_reqs) || (!created) || (!create_pos)))
+            || (!new_idx)) {
+        free(d);
+        free(create_reqs);
+        free(created);
+        free(create_pos);
+        free(new_idx);
+        PCP_LOG_END(PCP_LOGLVL_DEBUG);
+        return PCP_ERR_NO_MEM;
+    }
+
+    for (i=0; i < n; ++i) {
+        if (reconcile_fill_key(ctx, &d[d_cnt].key, desired + i)) {
+            d[d_cnt++].req_indx=i;
+        } else {
+            PCP_LOG(PCP_LOGLVL_WARN, "Ignoring invalid desired flow %zu", i);
+        }
+    }
+    qsort(d, d_cnt, sizeof(*d), reconcile_key_cmp);
+
+    // merge sorted desired keys with sorted index of managed flows
+    for (i=0, j=0; (i < old_cnt) || (j < d_cnt);) {
+        int cmp;
+
+        if (i == old_cnt) {
+            cmp=1;
+        } else if (j == d_cnt) {
+            cmp=-1;
+        } else {
+            cmp=reconcile_key_cmp(&old_idx[i].key, &d[j].key);
+        }
+
+        // closed flow requested again - create it anew if closing finished
+        if ((cmp == 0) && (old_idx[i].lifetime == 0)
+                && (reconcile_flow_finished(old_idx[i].flow))) {
+            pcp_delete_flow(old_idx[i++].flow);
+            cmp=1;
+        }
+
+        if (cmp < 0) {
+            struct pcp_reconcile_entry *e=old_idx + i++;
+
+            if (e->lifetime == 0) {
+                if (reconcile_flow_finished(e->flow)) {
+                    pcp_delete_flow(e->flow);
+                    continue;
+                }
+            } else {
+                pcp_flow_t *fiter;
+
+                for (fiter=e->flow; fiter; fiter=fiter->next_child) {
+                    pcp_close_flow_intern(fiter);
+                }
+                e->lifetime=0;
+                ++changes;
+            }
+            new_idx[new_cnt++]=*e;
+        } else if (cmp > 0) {
+            const pcp_flow_req_t *r=desired + d[j].req_indx;
+
+            new_idx[new_cnt].key=d[j].key;
+            new_idx[new_cnt].lifetime=r->lifetime;
+            new_idx[new_cnt].flow=NULL; // assigned after batch creation
+            create_pos[create_cnt]=new_cnt++;
+            create_reqs[create_cnt++]=*r;
+            // skip duplicate desired entries
+            for (++j; (j < d_cnt)
+                    && (!reconcile_key_cmp(&d[j].key, &d[j - 1].key)); ++j);
+        } else {
+            struct pcp_reconcile_entry *e=old_idx + i++;
+            const pcp_flow_req_t *r=desired + d[j].req_indx;
+
+            if (e->lifetime != r->lifetime) {
+                pcp_flow_set_lifetime(e->flow, r->lifetime);
+                e->lifetime=r->lifetime;
+                ++changes;
+            }
+            new_idx[new_cnt++]=*e;
+            for (++j; (j < d_cnt)
+                    && (!reconcile_key_cmp(&d[j].key, &d[j - 1].key)); ++j);
+        }
+    }
+
+    if (create_cnt > 0) {
+        changes+=pcp_new_flows(ctx, create_reqs, create_cnt, created);
+        for (i=0; i < create_cnt; ++i) {
+            new_idx[create_pos[i]].flow=created[i];
+        }
+        // drop entries of flows which couldn't be created
+        for (i=0, j=0; i < new_cnt; ++i) {
+            if (new_idx[i].flow) {
+                new_idx[j++]=new_idx[i];
+            }
+        }
+        new_cnt=j;
+    }
+
+    free(d);
+    free(create_reqs);
+    free(created);
+    free(create_pos);
+    free(old_idx);
+    ctx->reconciled=new_idx;
+    ctx->reconciled_cnt=new_cnt;
+
+    PCP_LOG_END(PCP_LOGLVL_DEBUG);
+    return changes;
+}
+
 static int delete_flow_iter(pcp_flow_t *f, void *data)
 {
+    // flows sharing f are not in DB
+    while (f->next_follower) {
+        pcp_delete_flow_intern(f->next_follower);
+    }
     if (data) {
         pcp_close_flow_intern(f);
         pcp_pulse(f->ctx, NULL);
@@ -661,25 +1283,93 @@ static int delete_flow_iter(pcp_flow_t *f, void *data)
 
 void pcp_terminate(pcp_ctx_t *ctx, int close_flows)
 {
+    // closing messages are not subject to send pacing
+    ctx->terminating=1;
+    pcp_track_gateways(ctx, 0);
+    // flows of local clients are closed along with own ones
+    pcp_daemon_close(ctx);
     pcp_db_foreach_flow(ctx, delete_flow_iter, close_flows ? (void *)1 : NULL);
+    free(ctx->reconciled);
+    ctx->reconciled=NULL;
+    ctx->reconciled_cnt=0;
+    pcp_db_free_flow_pool(ctx);
     pcp_db_free_pcp_servers(ctx);
-    pcp_socket_close(ctx);
+    if (ctx->daemon_link) {
+        pcp_daemon_link_close(ctx);
+    } else {
+        pcp_socket_close(ctx);
+    }
+    saddr_cache_destroy(ctx->saddr_cache);
+    ctx->saddr_cache=NULL;
+    psc_close(ctx);
+    pcp_set_capture(ctx, NULL);
 }
 
-pcp_flow_info_t *pcp_flow_get_info(pcp_flow_t *f, size_t *info_count)
+static void fill_flow_info(pcp_flow_info_t *info, pcp_flow_t *f)
+{
+    memset(info, 0, sizeof(*info));
+
+    switch (f->state) {
+        case pfs_wait_after_short_life_error:
+            info->result=pcp_state_short_lifetime_error;
+            break;
+        case pfs_wait_for_lifetime_renew:
+            info->result=pcp_state_succeeded;
+            break;
+        case pfs_failed:
+            info->result=pcp_state_failed;
+            break;
+        default:
+            info->result=pcp_state_processing;
+            break;
+    }
+
+    info->recv_lifetime_end=f->recv_lifetime;
+    info->lifetime_renew_s=f->lifetime;
+    info->pcp_result_code=f->recv_result;
+    memcpy(&info->int_ip, &f->kd.src_ip, sizeof(struct in6_addr));
+    memcpy(&info->pcp_server_ip, &f->kd.pcp_server_ip,
+            sizeof(info->pcp_server_ip));
+    if ((f->kd.operation == PCP_OPCODE_MAP)
+            || (f->kd.operation == PCP_OPCODE_PEER)) {
+        memcpy(&info->dst_ip, &f->kd.map_peer.dst_ip, sizeof(info->dst_ip));
+        memcpy(&info->ext_ip, &f->map_peer.ext_ip, sizeof(info->ext_ip));
+        info->int_port=f->kd.map_peer.src_port;
+        info->dst_port=f->kd.map_peer.dst_port;
+        info->ext_port=f->map_peer.ext_port;
+        info->protocol=f->kd.map_peer.protocol;
+#ifdef PCP_SADSCP
+    } else if (f->kd.operation == PCP_OPCODE_SADSCP) {
+        info->learned_dscp=f->sadscp.learned_dscp;
+#endif
+    }
+}
+
+size_t pcp_flow_get_info_buf(pcp_flow_t *f, pcp_flow_info_t *info_buf,
+        size_t info_count)
 {
     pcp_flow_t *fiter;
+    size_t cnt=0;
+
+    for (fiter=f; fiter; fiter=fiter->next_child, ++cnt) {
+        if ((info_buf) && (cnt < info_count)) {
+            fill_flow_info(info_buf + cnt, fiter);
+        }
+    }
+
+    return cnt;
+}
+
+pcp_flow_info_t *pcp_flow_get_info(pcp_flow_t *f, size_t *info_count)
+{
     pcp_flow_info_t *info_buf;
-    pcp_flow_info_t *info_iter;
-    uint32_t cnt=0;
+    size_t cnt;
 
     if (!info_count) {
         return NULL;
     }
 
-    for (fiter=f; fiter; fiter=fiter->next_child) {
-      ++cnt;
-    }
+    cnt=pcp_flow_get_info_buf(f, NULL, 0);
 
     info_buf=(pcp_flow_info_t *)calloc(cnt, sizeof(pcp_flow_info_t));
     if (!info_buf) {
@@ -687,49 +1377,51 @@ pcp_flow_info_t *pcp_flow_get_info(pcp_flow_t *f, size_t *info_count)
         return NULL;
     }
 
-    for (fiter=f, info_iter=info_buf; fiter != NULL;
-            fiter=fiter->next_child, ++info_iter) {
+    *info_count=pcp_flow_get_info_buf(f, info_buf, cnt);
 
-        switch (fiter->state) {
-            case pfs_wait_after_short_life_error:
-                info_iter->result=pcp_state_short_lifetime_error;
-                break;
-            case pfs_wait_for_lifetime_renew:
-                info_iter->result=pcp_state_succeeded;
-                break;
-            case pfs_failed:
-                info_iter->result=pcp_state_failed;
-                break;
-            default:
-                info_iter->result=pcp_state_processing;
-                break;
+    return info_buf;
+}
+
+size_t pcp_flow_enum(pcp_ctx_t *ctx, pcp_flow_cursor_t *cursor,
+        pcp_flow_t **flows, pcp_flow_info_t *info_buf, size_t count)
+{
+    size_t filled=0;
+
+    if ((!ctx) || (!cursor)) {
+        return 0;
+    }
+
+    while ((filled < count) && (cursor->bucket < FLOW_HASH_SIZE)) {
+        pcp_flow_t *fiter=ctx->pcp_db.flows[cursor->bucket];
+        uint32_t pos;
+
+        // resume at the position where the previous call stopped
+        for (pos=0; (fiter) && (pos < cursor->pos); ++pos) {
+            fiter=fiter->next;
         }
 
-        info_iter->recv_lifetime_end=fiter->recv_lifetime;
-        info_iter->lifetime_renew_s=fiter->lifetime;
-        info_iter->pcp_result_code=fiter->recv_result;
-        memcpy(&info_iter->int_ip, &fiter->kd.src_ip, sizeof(struct in6_addr));
-        memcpy(&info_iter->pcp_server_ip, &fiter->kd.pcp_server_ip,
-                sizeof(info_iter->pcp_server_ip));
-        if ((fiter->kd.operation == PCP_OPCODE_MAP)
-                || (fiter->kd.operation == PCP_OPCODE_PEER)) {
-            memcpy(&info_iter->dst_ip, &fiter->kd.map_peer.dst_ip,
-                    sizeof(info_iter->dst_ip));
-            memcpy(&info_iter->ext_ip, &fiter->map_peer.ext_ip,
-                    sizeof(info_iter->ext_ip));
-            info_iter->int_port=fiter->kd.map_peer.src_port;
-            info_iter->dst_port=fiter->kd.map_peer.dst_port;
-            info_iter->ext_port=fiter->map_peer.ext_port;
-            info_iter->protocol=fiter->kd.map_peer.protocol;
-#ifdef PCP_SADSCP
-        } else if (fiter->kd.operation == PCP_OPCODE_SADSCP) {
-            info_iter->learned_dscp=fiter->sadscp.learned_dscp;
-#endif
+        for (; (fiter) && (filled < count); fiter=fiter->next) {
+            ++cursor->pos;
+            // skip internal NAT-PMP announce messages
+            if (fiter->kd.operation == PCP_OPCODE_ANNOUNCE) {
+                continue;
+            }
+            if (flows) {
+                flows[filled]=fiter;
+            }
+            if (info_buf) {
+                fill_flow_info(info_buf + filled, fiter);
+            }
+            ++filled;
+        }
+
+        if (!fiter) {
+            ++cursor->bucket;
+            cursor->pos=0;
         }
     }
-    *info_count=cnt;
 
-    return info_buf;
+    return filled;
 }
 
 void pcp_flow_set_user_data(pcp_flow_t *f, void *userdata)
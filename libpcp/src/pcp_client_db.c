@@ -44,23 +44,60 @@
 #define EMPTY 0xFFFFFFFF
 #define PCP_INIT_SERVER_COUNT 5
 
-static uint32_t compute_flow_key(struct flow_key_data *kd)
+struct pcp_flow_chunk {
+    struct pcp_flow_chunk *next;
+    struct pcp_flow_s flows[1];
+};
+
+#define FLOW_HASH_SEED   0x27D4EB2F165667C5ULL
+#define FLOW_HASH_PRIME1 0x9E3779B185EBCA87ULL
+#define FLOW_HASH_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define FLOW_HASH_PRIME3 0x165667B19E3779F9ULL
+
+static inline uint64_t flow_hash_round(uint64_t h, uint64_t v)
 {
-    uint32_t h=0;
-    uint8_t *k=(uint8_t*)(kd + 1);
+    h^=v * FLOW_HASH_PRIME2;
+    h=(h << 31) | (h >> 33);
+    return h * FLOW_HASH_PRIME1;
+}
 
-    while ((void*)(k--) != (void*)kd) {
-        uint32_t ho=h & 0xff000000;
-        h=h << 8;
-        h=h ^ (ho >> 24);
-        h=h ^ *k;
-    }
+static inline uint64_t flow_hash_addr(uint64_t h, const struct in6_addr *a)
+{
+    uint64_t w[2];
 
-    h=(h * 0x9E3779B9) >> (32 - FLOW_HASH_BITS);
+    memcpy(w, a, sizeof(w));
+    h=flow_hash_round(h, w[0]);
+    return flow_hash_round(h, w[1]);
+}
+
+// Hash key fields word by word. Padding and nonce are left out - nonce is
+// the same for all flows of a PCP server.
+uint64_t pcp_db_flow_hash(const struct flow_key_data *kd)
+{
+    uint64_t h=FLOW_HASH_SEED;
+
+    h=flow_hash_round(h, (uint64_t)kd->operation
+            | ((uint64_t)kd->map_peer.protocol << 8)
+            | ((uint64_t)kd->map_peer.src_port << 16)
+            | ((uint64_t)kd->map_peer.dst_port << 32));
+    h=flow_hash_addr(h, &kd->src_ip);
+    h=flow_hash_addr(h, &kd->pcp_server_ip);
+    h=flow_hash_addr(h, &kd->map_peer.dst_ip);
+
+    h^=h >> 33;
+    h*=FLOW_HASH_PRIME2;
+    h^=h >> 29;
+    h*=FLOW_HASH_PRIME3;
+    h^=h >> 32;
 
     return h;
 }
 
+static inline uint32_t flow_hash_bucket(uint64_t h)
+{
+    return (uint32_t)(h >> (64 - FLOW_HASH_BITS));
+}
+
 pcp_flow_t *pcp_create_flow(pcp_server_t *s, struct flow_key_data *fkd)
 {
     pcp_flow_t *flow;
@@ -69,8 +106,9 @@ pcp_flow_t *pcp_create_flow(pcp_server_t *s, struct flow_key_data *fkd)
 
     assert(fkd && s);
 
-    flow=(pcp_flow_t*)calloc(1, sizeof(struct pcp_flow_s));
-    if (flow == NULL) {
+    if ((!s->ctx->pcp_db.free_flows)
+            && (pcp_db_reserve_flows(s->ctx, PCP_FLOW_POOL_CHUNK)
+                    != PCP_ERR_SUCCESS)) {
         PCP_LOG(PCP_LOGLVL_ERR, "%s",
                 "Malloc can't allocate enough memory for the pcp_flow.");
         PCP_LOG(PCP_LOGLVL_ERR, "%s", "Returning NULL.");
@@ -78,11 +116,19 @@ pcp_flow_t *pcp_create_flow(pcp_server_t *s, struct flow_key_data *fkd)
         return NULL;
     }
 
+    flow=s->ctx->pcp_db.free_flows;
+    s->ctx->pcp_db.free_flows=flow->next;
+    s->ctx->pcp_db.free_flow_cnt--;
+    memset(flow, 0, sizeof(*flow));
+
     flow->pcp_msg_len=0;
     flow->pcp_server_indx=(s ? s->index : PCP_INV_SERVER);
     flow->kd=*fkd;
     flow->key_bucket=EMPTY;
     flow->ctx=s->ctx;
+    flow->group=flow;
+    flow->state_class=pfc_processing;
+    flow->group_cnt[pfc_processing]=1;
 
     PCP_LOG_END(PCP_LOGLVL_DEBUG);
     return flow;
@@ -105,12 +151,17 @@ pcp_errno pcp_delete_flow_intern(pcp_flow_t *f)
 
     assert(f);
 
+    pcp_db_flow_unshare(f);
     pcp_db_rem_flow(f);
 
     if (f->pcp_msg_buffer) {
         free(f->pcp_msg_buffer);
     }
 
+    if (f->ext) {
+        free(f->ext);
+    }
+
 #ifdef PCP_EXPERIMENTAL
     if (f->md_vals) {
         free(f->md_vals);
@@ -129,10 +180,59 @@ pcp_errno pcp_delete_flow_intern(pcp_flow_t *f)
         s->ping_flow_msg=NULL;
     }
 
-    free(f);
+    //return flow to the pool
+    f->next=f->ctx->pcp_db.free_flows;
+    f->ctx->pcp_db.free_flows=f;
+    f->ctx->pcp_db.free_flow_cnt++;
     return PCP_ERR_SUCCESS;
 }
 
+pcp_errno pcp_db_reserve_flows(pcp_ctx_t *ctx, size_t count)
+{
+    struct pcp_flow_chunk *chunk;
+    size_t i;
+
+    assert(ctx);
+
+    if (ctx->pcp_db.free_flow_cnt >= count) {
+        return PCP_ERR_SUCCESS;
+    }
+    count-=ctx->pcp_db.free_flow_cnt;
+
+    chunk=(struct pcp_flow_chunk *)malloc(sizeof(*chunk)
+            + sizeof(chunk->flows[0]) * (count - 1));
+    if (!chunk) {
+        char buff[ERR_BUF_LEN];
+        pcp_strerror(errno, buff, sizeof(buff));
+        PCP_LOG(PCP_LOGLVL_ERR, "Error (%s) occurred during malloc ", buff);
+        return PCP_ERR_NO_MEM;
+    }
+    chunk->next=ctx->pcp_db.flow_chunks;
+    ctx->pcp_db.flow_chunks=chunk;
+
+    for (i=count; i > 0; --i) {
+        chunk->flows[i - 1].next=ctx->pcp_db.free_flows;
+        ctx->pcp_db.free_flows=chunk->flows + i - 1;
+    }
+    ctx->pcp_db.free_flow_cnt+=count;
+
+    return PCP_ERR_SUCCESS;
+}
+
+void pcp_db_free_flow_pool(pcp_ctx_t *ctx)
+{
+    struct pcp_flow_chunk *chunk;
+
+    assert(ctx);
+
+    while ((chunk=ctx->pcp_db.flow_chunks) != NULL) {
+        ctx->pcp_db.flow_chunks=chunk->next;
+        free(chunk);
+    }
+    ctx->pcp_db.free_flows=NULL;
+    ctx->pcp_db.free_flow_cnt=0;
+}
+
 pcp_errno pcp_db_add_flow(pcp_flow_t *f)
 {
     uint32_t indx;
@@ -145,7 +245,8 @@ pcp_errno pcp_db_add_flow(pcp_flow_t *f)
 
     ctx=f->ctx;
 
-    f->key_bucket=indx=compute_flow_key(&f->kd);
+    f->key_hash=pcp_db_flow_hash(&f->kd);
+    f->key_bucket=indx=flow_hash_bucket(f->key_hash);
     PCP_LOG(PCP_LOGLVL_DEBUG, "Adding flow %p, key_bucket %d",
             f, f->key_bucket);
 
@@ -161,9 +262,52 @@ pcp_errno pcp_db_add_flow(pcp_flow_t *f)
     return PCP_ERR_SUCCESS;
 }
 
+pcp_errno pcp_db_add_flows(pcp_ctx_t *ctx, pcp_flow_t **flows, size_t count)
+{
+    pcp_flow_t **tails[FLOW_HASH_SIZE];
+    size_t i;
+
+    if ((!ctx) || ((!flows) && (count > 0))) {
+        return PCP_ERR_BAD_ARGS;
+    }
+
+    memset(tails, 0, sizeof(tails));
+
+    for (i=0; i < count; ++i) {
+        pcp_flow_t *f;
+
+        // append flow and its children; each bucket's tail is looked up once
+        for (f=flows[i]; f != NULL; f=f->next_child) {
+            uint32_t indx;
+
+            // sharing flows and flows added while creating batch
+            if ((f->shared) || (f->key_bucket != EMPTY)) {
+                continue;
+            }
+
+            f->key_hash=pcp_db_flow_hash(&f->kd);
+            f->key_bucket=indx=flow_hash_bucket(f->key_hash);
+            if (!tails[indx]) {
+                for (tails[indx]=ctx->pcp_db.flows + indx; *tails[indx] != NULL;
+                        tails[indx]=&(*tails[indx])->next);
+            }
+            *tails[indx]=f;
+            f->next=NULL;
+            tails[indx]=&f->next;
+            ctx->pcp_db.flow_cnt++;
+        }
+    }
+
+    PCP_LOG(PCP_LOGLVL_DEBUG, "total Number of flows added %zu",
+            ctx->pcp_db.flow_cnt);
+
+    return PCP_ERR_SUCCESS;
+}
+
 pcp_flow_t *pcp_get_flow(struct flow_key_data *fkd, pcp_server_t *s)
 {
     pcp_flow_t **fdb;
+    uint64_t hash;
     uint32_t bucket;
     uint32_t pcp_server_index;
 
@@ -172,10 +316,12 @@ pcp_flow_t *pcp_get_flow(struct flow_key_data *fkd, pcp_server_t *s)
     }
     pcp_server_index=s->index;
 
-    bucket=compute_flow_key(fkd);
+    hash=pcp_db_flow_hash(fkd);
+    bucket=flow_hash_bucket(hash);
     PCP_LOG(PCP_LOGLVL_DEBUG, "Computed key_bucket %d", bucket);
     for (fdb=&s->ctx->pcp_db.flows[bucket]; (*fdb) != NULL; fdb=&(*fdb)->next) {
-        if (((*fdb)->pcp_server_indx == pcp_server_index)
+        if (((*fdb)->key_hash == hash)
+                && ((*fdb)->pcp_server_indx == pcp_server_index)
                 && (0 == memcmp(fkd, &(*fdb)->kd, sizeof(*fkd)))) {
             return *fdb;
         }
@@ -212,6 +358,173 @@ pcp_errno pcp_db_rem_flow(pcp_flow_t *f)
     return PCP_ERR_NOT_FOUND;
 }
 
+static inline pcp_flow_class_e flow_state_class(pcp_flow_state_e state)
+{
+    switch (state) {
+        case pfs_wait_for_lifetime_renew:
+            return pfc_succeeded;
+        case pfs_failed:
+            return pfc_failed;
+        case pfs_wait_after_short_life_error:
+            return pfc_short_lifetime_error;
+        default:
+            return pfc_processing;
+    }
+}
+
+// Update group counters after change of flow's state.
+void pcp_flow_account_state(pcp_flow_t *f)
+{
+    pcp_flow_class_e c=flow_state_class(f->state);
+
+    if (c != f->state_class) {
+        f->group->group_cnt[f->state_class]--;
+        f->group->group_cnt[c]++;
+        f->state_class=c;
+    }
+}
+
+void pcp_flow_join_group(pcp_flow_t *group, pcp_flow_t *f)
+{
+    assert(group && f && (f->group == f));
+
+    pcp_flow_account_state(f);
+    f->group=group;
+    group->group_cnt[f->state_class]++;
+}
+
+struct pcp_flow_ext *pcp_db_flow_ext(pcp_flow_t *f)
+{
+    assert(f);
+
+    if (!f->ext) {
+        f->ext=(struct pcp_flow_ext *)calloc(1, sizeof(*f->ext));
+        if (!f->ext) { //LCOV_EXCL_START
+            PCP_LOG(PCP_LOGLVL_ERR, "%s",
+                    "Malloc can't allocate enough memory for the flow options.");
+        } //LCOV_EXCL_STOP
+    }
+
+    return f->ext;
+}
+
+void pcp_db_flow_share(pcp_flow_t *wire, pcp_flow_t *f)
+{
+    assert(wire && f && (!wire->shared) && (f->key_bucket == EMPTY));
+
+    if (!wire->share_cnt) {
+        wire->req_lifetime=wire->lifetime;
+    }
+    f->req_lifetime=f->lifetime;
+    f->shared=wire;
+    f->next_follower=wire->next_follower;
+    wire->next_follower=f;
+    wire->share_cnt++;
+
+    f->state=wire->state;
+    f->recv_lifetime=wire->recv_lifetime;
+    f->recv_result=wire->recv_result;
+    f->map_peer=wire->map_peer;
+    pcp_flow_account_state(f);
+}
+
+// Shared mapping is requested with the longest lifetime of its flows.
+void pcp_db_flow_share_lifetime(pcp_flow_t *wire)
+{
+    pcp_flow_t *fo;
+
+    wire->lifetime=wire->req_lifetime;
+    for (fo=wire->next_follower; fo; fo=fo->next_follower) {
+        if (fo->req_lifetime > wire->lifetime) {
+            wire->lifetime=fo->req_lifetime;
+        }
+    }
+}
+
+// Detach flow from the on-wire flow it shares. If f is the on-wire flow itself,
+// its first follower takes over its place in DB together with all the wire
+// state. Returns nonzero if f was shared.
+int pcp_db_flow_unshare(pcp_flow_t *f)
+{
+    pcp_flow_t *wire, **fiter;
+
+    assert(f);
+
+    if (f->shared) {
+        wire=f->shared;
+        for (fiter=&wire->next_follower; *fiter; fiter=&(*fiter)->next_follower) {
+            if (*fiter == f) {
+                *fiter=f->next_follower;
+                break;
+            }
+        }
+        wire->share_cnt--;
+        pcp_db_flow_share_lifetime(wire);
+    } else if (f->next_follower) {
+        pcp_flow_t *nl=f->next_follower;
+        pcp_flow_t tmp=*f;
+        pcp_server_t *s;
+
+        // new on-wire flow keeps its own handle data
+        tmp.next_child=nl->next_child;
+        tmp.group=nl->group;
+        memcpy(tmp.group_cnt, nl->group_cnt, sizeof(tmp.group_cnt));
+        tmp.state_class=nl->state_class;
+        tmp.user_data=nl->user_data;
+        tmp.shared=NULL;
+        tmp.next_follower=nl->next_follower;
+        tmp.share_cnt=f->share_cnt - 1;
+        tmp.req_lifetime=nl->req_lifetime;
+        *nl=tmp;
+        for (fiter=&nl->next_follower; *fiter; fiter=&(*fiter)->next_follower) {
+            (*fiter)->shared=nl;
+        }
+        pcp_db_flow_share_lifetime(nl);
+        pcp_flow_account_state(nl);
+
+        // take over f's place in DB
+        if (f->key_bucket != EMPTY) {
+            for (fiter=&f->ctx->pcp_db.flows[f->key_bucket]; *fiter;
+                    fiter=&(*fiter)->next) {
+                if (*fiter == f) {
+                    *fiter=nl;
+                    break;
+                }
+            }
+            f->key_bucket=EMPTY;
+        }
+
+        if ((f->pcp_server_indx != PCP_INV_SERVER)
+                && ((s=get_pcp_server(f->ctx, f->pcp_server_indx)) != NULL)) {
+            if (s->ping_flow_msg == f) {
+                s->ping_flow_msg=nl;
+            }
+            if (s->restart_flow_msg == f) {
+                s->restart_flow_msg=nl;
+            }
+        }
+
+        // buffers were moved to the new on-wire flow
+        f->pcp_msg_buffer=NULL;
+        f->pcp_msg_len=0;
+        f->ext=NULL;
+#ifdef PCP_EXPERIMENTAL
+        f->md_vals=NULL;
+        f->md_val_count=0;
+#endif
+#ifdef PCP_SADSCP
+        f->sadscp_app_name=NULL;
+#endif
+    } else {
+        return 0;
+    }
+
+    f->shared=NULL;
+    f->next_follower=NULL;
+    f->share_cnt=0;
+    return 1;
+}
+
 pcp_errno pcp_db_foreach_flow(pcp_ctx_t *ctx, pcp_db_flow_iterate f, void *data)
 {
     pcp_flow_t *fdb, *fdb_next=NULL;
@@ -272,6 +585,81 @@ void pcp_db_add_md(pcp_flow_t *f, uint16_t md_id, void *val, size_t val_len)
 }
 #endif
 
+// scope_id distinguishes only link-local addresses; routes to other gateways
+// report outgoing interface, which isn't present in received datagrams
+static inline uint32_t server_scope(const struct in6_addr *ip,
+        uint32_t scope_id)
+{
+    return IN6_IS_ADDR_LINKLOCAL(ip) ? scope_id : 0;
+}
+
+static uint32_t compute_server_key(const struct in6_addr *ip, uint16_t port,
+        uint32_t scope_id)
+{
+    uint32_t h=server_scope(ip, scope_id) ^ port;
+    int i;
+
+    for (i=0; i < 4; ++i) {
+        h=(h ^ S6_ADDR32(ip)[i]) * 0x9E3779B9;
+        h^=h >> 16;
+    }
+
+    return h;
+}
+
+// appended to the bucket, so the first added of duplicate servers is found
+static void server_index_add(pcp_ctx_t *ctx, pcp_server_t *s)
+{
+    uint32_t *indx=ctx->pcp_db.server_hash + (compute_server_key(
+            (struct in6_addr *)s->pcp_ip, s->pcp_port, s->pcp_scope_id)
+            & (ctx->pcp_db.server_hash_size - 1));
+
+    while (*indx != PCP_INV_SERVER) {
+        indx=&ctx->pcp_db.pcp_servers[*indx].next_hash;
+    }
+    *indx=s->index;
+    s->next_hash=PCP_INV_SERVER;
+}
+
+// keep at least two buckets per server slot
+static pcp_errno server_index_resize(pcp_ctx_t *ctx)
+{
+    size_t size=1, i;
+    uint32_t *hash;
+
+    while (size < (ctx->pcp_db.pcp_servers_length << 1)) {
+        size<<=1;
+    }
+    if (size <= ctx->pcp_db.server_hash_size) {
+        return PCP_ERR_SUCCESS;
+    }
+
+    hash=(uint32_t *)malloc(size * sizeof(*hash));
+    if (!hash) {
+        char buff[ERR_BUF_LEN];
+        pcp_strerror(errno, buff, sizeof(buff));
+        PCP_LOG(PCP_LOGLVL_ERR, "Error (%s) occurred during malloc ", buff);
+        return PCP_ERR_NO_MEM;
+    }
+    for (i=0; i < size; ++i) {
+        hash[i]=PCP_INV_SERVER;
+    }
+
+    free(ctx->pcp_db.server_hash);
+    ctx->pcp_db.server_hash=hash;
+    ctx->pcp_db.server_hash_size=size;
+
+    for (i=0; i < ctx->pcp_db.pcp_servers_length; ++i) {
+        pcp_server_t *s=ctx->pcp_db.pcp_servers + i;
+        if ((s->server_state != pss_unitialized)
+                && (s->server_state != pss_retired)) {
+            server_index_add(ctx, s);
+        }
+    }
+
+    return PCP_ERR_SUCCESS;
+}
+
 int pcp_new_server(pcp_ctx_t *ctx, struct in6_addr *ip, uint16_t port, uint32_t scope_id)
 {
     uint32_t i;
@@ -325,6 +713,11 @@ int pcp_new_server(pcp_ctx_t *ctx, struct in6_addr *ip, uint16_t port, uint32_t
         ctx->pcp_db.pcp_servers_length<<=1;
     }
 
+    if (server_index_resize(ctx) != PCP_ERR_SUCCESS) {
+        PCP_LOG_END(PCP_LOGLVL_DEBUG);
+        return PCP_ERR_NO_MEM;
+    }
+
     ret->epoch=~0;
 #ifdef PCP_USE_IPV6_SOCKET
     ret->af = AF_INET6;
@@ -337,8 +730,15 @@ int pcp_new_server(pcp_ctx_t *ctx, struct in6_addr *ip, uint16_t port, uint32_t
     ret->ctx=ctx;
     ret->server_state=pss_allocated;
     ret->pcp_version=PCP_MAX_SUPPORTED_VERSION;
+    ret->version_known=0;
+    ret->optimistic=0;
+    ret->stale_requests=0;
+    ret->warm=0;
+    ret->rtt_us=0;
+    ret->racing=0;
     createNonce(&ret->nonce);
     ret->index=ret - ctx->pcp_db.pcp_servers;
+    server_index_add(ctx, ret);
 
     PCP_LOG_END(PCP_LOGLVL_DEBUG);
     return ret->index;
@@ -392,37 +792,76 @@ pcp_errno pcp_db_foreach_server(pcp_ctx_t *ctx, pcp_db_server_iterate f,
     return ret;
 }
 
-typedef struct find_data {
-    struct in6_addr *ip;
-    pcp_server_t *found_server;
-} find_data_t;
-
-static int find_ip(pcp_server_t *s, void *data)
+pcp_server_t *get_pcp_server_by_addr(pcp_ctx_t *ctx, struct in6_addr *ip,
+        uint16_t port, uint32_t scope_id)
 {
-    find_data_t *fd=(find_data_t *)data;
+    uint32_t indx;
+
+    PCP_LOG_BEGIN(PCP_LOGLVL_DEBUG);
+
+    assert(ctx && ip);
+
+    if (!ctx->pcp_db.server_hash) {
+        PCP_LOG_END(PCP_LOGLVL_DEBUG);
+        return NULL;
+    }
 
-    if (IN6_ARE_ADDR_EQUAL(fd->ip, (struct in6_addr *) s->pcp_ip)) {
+    scope_id=server_scope(ip, scope_id);
+    indx=ctx->pcp_db.server_hash[compute_server_key(ip, port, scope_id)
+            & (ctx->pcp_db.server_hash_size - 1)];
+    while (indx != PCP_INV_SERVER) {
+        pcp_server_t *s=ctx->pcp_db.pcp_servers + indx;
 
-        fd->found_server=s;
-        return 1;
+        if ((IN6_ARE_ADDR_EQUAL(ip, (struct in6_addr *) s->pcp_ip))
+                && (s->pcp_port == port)
+                && (server_scope(ip, s->pcp_scope_id) == scope_id)) {
+            PCP_LOG_END(PCP_LOGLVL_DEBUG);
+            return s;
+        }
+        indx=s->next_hash;
     }
-    return 0;
+
+    PCP_LOG_END(PCP_LOGLVL_DEBUG);
+    return NULL;
 }
 
-pcp_server_t *get_pcp_server_by_ip(pcp_ctx_t *ctx, struct in6_addr *ip)
+static void server_index_rem(pcp_server_t *s)
 {
-    find_data_t fdata;
-
-    PCP_LOG_BEGIN(PCP_LOGLVL_DEBUG);
+    pcp_ctx_t *ctx=s->ctx;
+    uint32_t *indx;
+
+    indx=ctx->pcp_db.server_hash + (compute_server_key(
+            (struct in6_addr *)s->pcp_ip, s->pcp_port, s->pcp_scope_id)
+            & (ctx->pcp_db.server_hash_size - 1));
+    for (; *indx != PCP_INV_SERVER;
+            indx=&ctx->pcp_db.pcp_servers[*indx].next_hash) {
+        if (*indx == s->index) {
+            *indx=s->next_hash;
+            break;
+        }
+    }
+    s->next_hash=PCP_INV_SERVER;
+}
 
-    assert(ctx && ip);
+void pcp_db_rem_server(pcp_server_t *s)
+{
+    assert(s && s->ctx);
 
-    fdata.found_server=NULL;
-    fdata.ip=ip;
-    pcp_db_foreach_server(ctx, find_ip, &fdata);
+    server_index_rem(s);
+    s->server_state=pss_unitialized;
+    s->gateway=0;
+}
 
-    PCP_LOG_END(PCP_LOGLVL_DEBUG);
-    return fdata.found_server;
+void pcp_db_retire_server(pcp_server_t *s)
+{
+    assert(s && s->ctx);
+
+    server_index_rem(s);
+    s->server_state=pss_retired;
+    s->next_timeout.tv_sec=0;
+    s->next_timeout.tv_usec=0;
+    s->ping_flow_msg=NULL;
+    s->restart_flow_msg=NULL;
 }
 
 void pcp_db_free_pcp_servers(pcp_ctx_t *ctx)
@@ -441,4 +880,7 @@ void pcp_db_free_pcp_servers(pcp_ctx_t *ctx)
     free(ctx->pcp_db.pcp_servers);
     ctx->pcp_db.pcp_servers=NULL;
     ctx->pcp_db.pcp_servers_length=0;
+    free(ctx->pcp_db.server_hash);
+    ctx->pcp_db.server_hash=NULL;
+    ctx->pcp_db.server_hash_size=0;
 }
@@ -58,8 +58,24 @@ typedef struct {
 }md_val_t;
 #endif
 
-#define FLOW_HASH_BITS 5
-#define FLOW_HASH_SIZE (2<<FLOW_HASH_BITS)
+#define FLOW_HASH_BITS 6
+#define FLOW_HASH_SIZE (1<<FLOW_HASH_BITS)
+
+#ifndef PCP_FLOW_POOL_CHUNK
+#define PCP_FLOW_POOL_CHUNK 32
+#endif
+
+// classes of flow states counted per next_child group
+typedef enum {
+    pfc_processing,
+    pfc_succeeded,
+    pfc_failed,
+    pfc_short_lifetime_error,
+    PFC_COUNT
+} pcp_flow_class_e;
+
+// flow which is sent on wire on behalf of f
+#define PCP_WIRE_FLOW(f) ((f)->shared ? (f)->shared : (f))
 
 struct flow_key_data {
     uint8_t operation;
@@ -99,27 +115,119 @@ typedef struct pcp_recv_msg {
     char pcp_msg_buffer[PCP_MAX_LEN];
 } pcp_recv_msg_t;
 
+// requested key of flow managed by pcp_reconcile
+struct reconcile_key {
+    uint8_t operation;
+    uint8_t protocol;
+    uint16_t src_port;
+    uint16_t dst_port;
+    struct in6_addr src_ip;
+    struct in6_addr dst_ip;
+};
+
+struct pcp_reconcile_entry {
+    struct reconcile_key key;
+    uint32_t lifetime; //0 - flow is being closed
+    pcp_flow_t *flow;
+};
+
 struct pcp_ctx_s {
     PCP_SOCKET socket;
     struct pcp_client_db {
         size_t pcp_servers_length;
         pcp_server_t *pcp_servers;
+        size_t server_hash_size;
+        uint32_t *server_hash; //(address, port, scope_id) => server index
         size_t flow_cnt;
         pcp_flow_t *flows[FLOW_HASH_SIZE];
+        //pool of preallocated flows, linked by next
+        size_t free_flow_cnt;
+        pcp_flow_t *free_flows;
+        struct pcp_flow_chunk *flow_chunks;
     } pcp_db;
     pcp_flow_change_notify flow_change_cb_fun;
     void *flow_change_cb_arg;
     pcp_recv_msg_t msg;
     pcp_socket_vt_t *virt_socket_tb;
+    uint8_t terminating;
+    uint8_t flow_sharing;
+    uint8_t optimistic_start;
+    uint8_t gateway_racing;
+    int route_sock; //routing table changes, -1 if gateways aren't tracked
+    struct saddr_cache *saddr_cache; //source address per destination
+    struct pcp_server_cache *server_cache; //NULL - not used
+    struct pcp_pcap *capture; //NULL - datagrams aren't recorded
+    struct sockaddr_storage capture_local; //local address of recorded socket
+    pcp_stats_t stats;
+    //flows managed by pcp_reconcile, sorted by requested key
+    struct pcp_reconcile_entry *reconciled;
+    size_t reconciled_cnt;
+    struct pcp_daemon *daemon; //NULL - flows of local processes aren't served
+    struct pcp_daemon_link *daemon_link; //NULL - flows are mapped by context
+    pcp_transport_t *transport; //NULL - socket is owned by context
+    struct pcp_transport_queue *transport_queue; //datagrams read for context
+};
+
+// Rarely used flow options. Allocated on first use, so flows without them
+// don't pay for the option buffers.
+struct pcp_flow_ext {
+#ifdef PCP_FLOW_PRIORITY
+    //FLOW Priority Option
+    uint8_t flowp_option_present;
+    uint8_t flowp_dscp_up;
+    uint8_t flowp_dscp_down;
+#endif
+
+    //FILTER Option
+    uint8_t filter_option_present;
+    uint8_t filter_prefix;
+    uint16_t filter_port;
+    struct in6_addr filter_ip;
+
+    // THIRD_PARTY Option
+    uint8_t third_party_option_present;
+    struct in6_addr third_party_ip;
+
+#ifdef PCP_EXPERIMENTAL
+    //Userid
+    pcp_userid_option_t f_userid;
+
+    //Location
+    pcp_location_option_t f_location;
+
+    //DeviceID
+    pcp_deviceid_option_t f_deviceid;
+#endif
 };
 
 struct pcp_flow_s {
-    // flow's data
-    struct pcp_ctx_s *ctx;
-    opt_flags_e opt_flags;
-    struct flow_key_data kd;
+    // hot data - touched by scheduling loop, fits one cache line
+    pcp_flow_state_e state;
+    uint32_t pcp_server_indx;
+    struct timeval timeout;
     uint32_t key_bucket;
+    uint64_t key_hash; //compared before kd in chain walks
+    struct pcp_flow_s *next; //next flow with same key bucket
+    struct pcp_flow_s *next_child; //next flow for MAP with 0.0.0.0 src ip
+
+    //flow key - compared only by lookup
+    struct flow_key_data kd;
+
+    //control data
+    struct pcp_ctx_s *ctx;
+    struct pcp_flow_s *group; //first flow of next_child chain
+    uint32_t group_cnt[PFC_COUNT]; //flows of group per state class (in group)
+    uint8_t state_class; //class of state counted in group_cnt
+    struct pcp_flow_s *shared; //on-wire flow this flow shares (not in DB)
+    struct pcp_flow_s *next_follower; //next flow sharing the same on-wire flow
+    uint32_t share_cnt; //count of flows sharing this on-wire flow
+    uint32_t req_lifetime; //lifetime requested by this flow, while shared
+    uint32_t resend_timeout;
+    uint32_t retry_count;
+    uint32_t to_send_count;
 
+    // flow's data
+    opt_flags_e opt_flags;
     uint32_t lifetime;
     union {
         struct {
@@ -141,46 +249,14 @@ struct pcp_flow_s {
     time_t recv_lifetime;
     uint32_t recv_result;
 
-    //control data
-    struct pcp_flow_s *next; //next flow with same key bucket
-    struct pcp_flow_s *next_child; //next flow for MAP with 0.0.0.0 src ip
-    uint32_t pcp_server_indx;
-    pcp_flow_state_e state;
-    uint32_t resend_timeout;
-    uint32_t retry_count;
-    uint32_t to_send_count;
-    struct timeval timeout;
-
-#ifdef PCP_EXPERIMENTAL
-    //Userid
-    pcp_userid_option_t f_userid;
-
-    //Location
-    pcp_location_option_t f_location;
-
-    //DeviceID
-    pcp_deviceid_option_t f_deviceid;
-#endif
-
-#ifdef PCP_FLOW_PRIORITY
-    //FLOW Priority Option
-    uint8_t flowp_option_present;
-    uint8_t flowp_dscp_up;
-    uint8_t flowp_dscp_down;
-#endif
-
     //PREFER FAILURE Option
     uint8_t pfailure_option_present;
 
-    //FILTER Option
-    uint8_t filter_option_present;
-    uint8_t filter_prefix;
-    uint16_t filter_port;
-    struct in6_addr filter_ip;
+    //created by local daemon for its client, user_data is client's flow
+    uint8_t remote;
 
-    // THIRD_PARTY Option
-    uint8_t third_party_option_present;
-    struct in6_addr third_party_ip;
+    //FILTER, THIRD_PARTY, FLOW PRIORITY and EXPERIMENTAL options
+    struct pcp_flow_ext *ext;
 
 #ifdef PCP_EXPERIMENTAL
     //MD Option
@@ -211,11 +287,24 @@ struct pcp_server {
     time_t cepoch;
     struct pcp_nonce nonce;
     uint32_t index;
+    uint32_t next_hash; //next server in the same server_hash bucket
     pcp_flow_t *ping_flow_msg;
     pcp_flow_t *restart_flow_msg;
     uint32_t ping_count;
     struct timeval next_timeout;
+    //send pacing
+    uint32_t burst_sent;
+    struct timeval burst_end;
     uint32_t natpmp_ext_addr;
+    uint8_t gateway; //discovered from routing table
+    uint8_t version_known; //version given by application
+    uint8_t optimistic; //flows were sent along with the ping
+    uint32_t stale_requests; //optimistic requests of unsupported version
+    uint8_t warm; //started from server cache, no response yet
+    uint32_t rtt_us; //round trip of ping in us, 0 - not measured
+    struct timeval ping_sent;
+    uint8_t racing; //gateway racing for its address family, not pinged yet
+    struct timeval race_start; //first ping of racing gateway not before
     void *app_data;
 };
 
@@ -227,12 +316,32 @@ pcp_flow_t *pcp_create_flow(pcp_server_t *s, struct flow_key_data *fkd);
 
 pcp_errno pcp_free_flow(pcp_flow_t *f);
 
+uint64_t pcp_db_flow_hash(const struct flow_key_data *kd);
+
 pcp_flow_t *pcp_get_flow(struct flow_key_data *fkd, pcp_server_t *s);
 
 pcp_errno pcp_db_add_flow(pcp_flow_t *f);
 
+pcp_errno pcp_db_add_flows(pcp_ctx_t *ctx, pcp_flow_t **flows, size_t count);
+
+pcp_errno pcp_db_reserve_flows(pcp_ctx_t *ctx, size_t count);
+
+void pcp_db_free_flow_pool(pcp_ctx_t *ctx);
+
 pcp_errno pcp_db_rem_flow(pcp_flow_t *f);
 
+void pcp_flow_account_state(pcp_flow_t *f);
+
+void pcp_flow_join_group(pcp_flow_t *group, pcp_flow_t *f);
+
+struct pcp_flow_ext *pcp_db_flow_ext(pcp_flow_t *f);
+
+void pcp_db_flow_share(pcp_flow_t *wire, pcp_flow_t *f);
+
+int pcp_db_flow_unshare(pcp_flow_t *f);
+
+void pcp_db_flow_share_lifetime(pcp_flow_t *wire);
+
 pcp_errno pcp_db_foreach_flow(pcp_ctx_t *ctx, pcp_db_flow_iterate f,
         void *data);
 
@@ -249,12 +358,21 @@ pcp_errno pcp_db_foreach_server(pcp_ctx_t *ctx, pcp_db_server_iterate f,
 
 pcp_server_t *get_pcp_server(pcp_ctx_t *ctx, int pcp_server_index);
 
-pcp_server_t *get_pcp_server_by_ip(pcp_ctx_t *ctx, struct in6_addr *ip);
+pcp_server_t *get_pcp_server_by_addr(pcp_ctx_t *ctx, struct in6_addr *ip,
+        uint16_t port, uint32_t scope_id);
+
+void pcp_db_rem_server(pcp_server_t *s);
+
+// server isn't found by address any more and keeps its flows for migration
+void pcp_db_retire_server(pcp_server_t *s);
 
 void pcp_db_free_pcp_servers(pcp_ctx_t *ctx);
 
 pcp_errno pcp_delete_flow_intern(pcp_flow_t *f);
 
+// set lifetime of flow to 0, sent on next pcp_pulse
+void pcp_close_flow_intern(pcp_flow_t *f);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,1220 @@
+/*
+ Copyright (c) 2014 by Cisco Systems, Inc.
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice, this
+ list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1 //memfd_create, accept4
+#endif
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#else
+#include "default_config.h"
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+#include "pcp.h"
+#include "pcp_utils.h"
+#include "pcp_logger.h"
+#include "pcp_socket.h"
+#include "pcp_client_db.h"
+#include "pcp_event_handler.h"
+#include "pcp_daemon.h"
+
+#ifdef __linux__
+
+#define RING_SLOT(i) ((i) & (PCP_DAEMON_RING_SIZE - 1))
+#define FLOW_ID(kd) ((kd)->nonce.n[0])
+#define DAEMON_FDS 3 //memfd, request and event eventfd
+#define DAEMON_CONNECT_TIMEOUT 2 //s
+#define DAEMON_EPOLL_EVENTS 16
+
+// head is moved by producer, tail by consumer; each on its own cache line
+struct pcp_daemon_ring {
+    uint32_t head;
+    uint8_t pad1[60];
+    uint32_t tail;
+    uint8_t pad2[60];
+};
+
+// shared by daemon and one client, indices are masked before use, so broken
+// peer can only garble its own flows
+struct pcp_daemon_area {
+    uint32_t format; //PCP_DAEMON_FORMAT, 0 - daemon stopped
+    uint32_t ring_size;
+    uint8_t pad[56];
+    struct pcp_daemon_ring req_ring;
+    struct pcp_daemon_ring ev_ring;
+    struct pcp_daemon_req reqs[PCP_DAEMON_RING_SIZE];
+    struct pcp_daemon_event evs[PCP_DAEMON_RING_SIZE];
+};
+
+// flow of a client
+struct pcp_daemon_flow {
+    struct pcp_daemon_req req; //last request, its key identifies the flow
+    struct pcp_daemon_client *client; //NULL - flow is being closed
+    pcp_flow_t *flow; //NULL - flow couldn't be created
+};
+
+struct pcp_daemon_client {
+    int conn;
+    int req_fd; //woken up by client
+    int ev_fd; //woken up by daemon
+    struct pcp_daemon_area *area;
+    struct pcp_daemon_flow **flows; //sorted by id
+    size_t flow_cnt;
+    size_t flow_alloc;
+    size_t resync; //flows from this index have to send their state again
+    uint8_t resyncing;
+    uint8_t backlog; //requests left in ring
+    uint8_t wake; //events were queued since last wakeup
+    uint8_t hangup;
+    struct pcp_daemon_client *next;
+};
+
+struct pcp_daemon {
+    int listen_fd;
+    int epoll_fd;
+    char *path;
+    struct pcp_daemon_client *clients;
+    //closed flows waiting for their request to be sent
+    struct pcp_daemon_flow **closing;
+    size_t closing_cnt;
+    size_t closing_alloc;
+};
+
+struct pcp_daemon_link {
+    int conn; //closed by daemon when client exits
+    int req_fd;
+    int ev_fd; //socket of the context
+    struct pcp_daemon_area *area;
+    uint32_t server_indx; //pseudo server of all flows
+    uint32_t next_id;
+    uint8_t gone; //daemon stopped, flows were failed
+};
+
+static inline uint32_t ring_space(struct pcp_daemon_ring *r)
+{
+    return PCP_DAEMON_RING_SIZE
+            - (r->head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE));
+}
+
+static inline void ring_push(struct pcp_daemon_ring *r)
+{
+    __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+static inline int ring_empty(struct pcp_daemon_ring *r)
+{
+    return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == r->tail;
+}
+
+static inline void ring_pop(struct pcp_daemon_ring *r)
+{
+    __atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+}
+
+static void wake(int fd)
+{
+    uint64_t one=1;
+    // counter can't overflow in practice, reader is woken up anyway
+    ssize_t ret=write(fd, &one, sizeof(one));
+
+    (void)ret;
+}
+
+static void clear_wakeups(int fd)
+{
+    uint64_t cnt;
+    ssize_t ret=read(fd, &cnt, sizeof(cnt));
+
+    (void)ret;
+}
+
+// shorten timeout of pcp_pulse to ms, unless it's shorter already
+static void cap_timeout(struct timeval *next_timeout, long ms)
+{
+    if (((next_timeout->tv_sec == 0) && (next_timeout->tv_usec == 0))
+            || (next_timeout->tv_sec * 1000 + next_timeout->tv_usec / 1000
+                    > ms)) {
+        next_timeout->tv_sec=ms / 1000;
+        next_timeout->tv_usec=(ms % 1000) * 1000;
+    }
+}
+
+static void close_area(struct pcp_daemon_area *a)
+{
+    if (a) {
+        munmap(a, sizeof(*a));
+    }
+}
+
+static void close_fd(int fd)
+{
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//                           Daemon side
+
+static void daemon_fill_sockaddr(struct sockaddr_storage *sa,
+        struct in6_addr *ip, uint16_t port)
+{
+    memset(sa, 0, sizeof(*sa));
+    pcp_fill_sockaddr((struct sockaddr *)sa, ip, port, 0, 0);
+}
+
+static pcp_fstate_e daemon_flow_state(struct pcp_daemon_flow *df)
+{
+    pcp_fstate_e state=pcp_state_failed;
+
+    if (df->flow) {
+        pcp_eval_flow_state(df->flow, &state);
+    }
+    return state;
+}
+
+// Queue state of client's flow group. Mapping of the first server which
+// succeeded is reported.
+static void daemon_flow_event(struct pcp_daemon_flow *df, pcp_fstate_e state)
+{
+    struct pcp_daemon_client *c=df->client;
+    struct pcp_daemon_area *a=c->area;
+    struct pcp_daemon_event ev;
+    pcp_flow_t *fiter, *f=df->flow;
+
+    if (ring_space(&a->ev_ring) == 0) {
+        // event is lost, state of all flows will be sent again
+        c->resyncing=1;
+        c->resync=0;
+        return;
+    }
+
+    for (fiter=df->flow; fiter; fiter=fiter->next_child) {
+        if (fiter->state == pfs_wait_for_lifetime_renew) {
+            f=fiter;
+            break;
+        }
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    memcpy(&ev.kd, &df->req.kd, sizeof(ev.kd));
+    ev.state=(uint8_t)state;
+    if (f) {
+        ev.ext_ip=f->map_peer.ext_ip;
+        ev.ext_port=f->map_peer.ext_port;
+        ev.result=f->recv_result;
+        ev.recv_lifetime=(int64_t)f->recv_lifetime;
+    }
+    memcpy(&a->evs[RING_SLOT(a->ev_ring.head)], &ev, sizeof(ev));
+    ring_push(&a->ev_ring);
+    c->wake=1;
+}
+
+void pcp_daemon_flow_changed(pcp_flow_t *f, pcp_fstate_e state)
+{
+    struct pcp_daemon_flow *df=(struct pcp_daemon_flow *)f->user_data;
+
+    if ((df) && (df->client)) {
+        daemon_flow_event(df, state);
+    }
+}
+
+static void daemon_set_options(pcp_flow_t *f, struct pcp_daemon_req *r)
+{
+    struct sockaddr_storage sa;
+
+    if (r->pfailure) {
+        pcp_flow_set_prefer_failure_opt(f);
+    }
+    if (r->filter) {
+        daemon_fill_sockaddr(&sa, &r->filter_ip, r->filter_port);
+        pcp_flow_set_filter_opt(f, (struct sockaddr *)&sa, r->filter_prefix);
+    }
+    if (r->third_party) {
+        daemon_fill_sockaddr(&sa, &r->third_party_ip, 0);
+        pcp_flow_set_3rd_party_opt(f, (struct sockaddr *)&sa);
+    }
+#ifdef PCP_FLOW_PRIORITY
+    if (r->flowp) {
+        pcp_flow_set_flowp(f, r->dscp_up, r->dscp_down);
+    }
+#endif
+}
+
+static int same_options(struct pcp_daemon_req *a, struct pcp_daemon_req *b)
+{
+    return (a->pfailure == b->pfailure) && (a->filter == b->filter)
+            && (a->filter_prefix == b->filter_prefix)
+            && (a->filter_port == b->filter_port)
+            && (IN6_ARE_ADDR_EQUAL(&a->filter_ip, &b->filter_ip))
+            && (a->third_party == b->third_party)
+            && (IN6_ARE_ADDR_EQUAL(&a->third_party_ip, &b->third_party_ip))
+            && (a->flowp == b->flowp) && (a->dscp_up == b->dscp_up)
+            && (a->dscp_down == b->dscp_down);
+}
+
+static void daemon_create_flow(pcp_ctx_t *ctx, struct pcp_daemon_flow *df)
+{
+    struct pcp_daemon_req *r=&df->req;
+    struct sockaddr_storage src, dst, ext;
+    int peer=r->kd.operation == PCP_OPCODE_PEER;
+    pcp_flow_t *fiter;
+
+    if ((!peer) && (r->kd.operation != PCP_OPCODE_MAP)) {
+        return;
+    }
+
+    daemon_fill_sockaddr(&src, &r->kd.src_ip, r->kd.map_peer.src_port);
+    daemon_fill_sockaddr(&ext, &r->ext_ip, r->ext_port);
+    if (peer) {
+        daemon_fill_sockaddr(&dst, &r->kd.map_peer.dst_ip,
+                r->kd.map_peer.dst_port);
+    }
+
+    df->flow=pcp_new_flow(ctx, (struct sockaddr *)&src,
+            peer ? (struct sockaddr *)&dst : NULL, (struct sockaddr *)&ext,
+            r->kd.map_peer.protocol, r->lifetime, df);
+    if (!df->flow) {
+        return;
+    }
+    for (fiter=df->flow; fiter; fiter=fiter->next_child) {
+        fiter->remote=1;
+    }
+    daemon_set_options(df->flow, r);
+}
+
+// Flow is closed on wire by the daemon's next send of its servers and deleted
+// after that by pcp_daemon_send.
+static void daemon_close_flow(struct pcp_daemon *d, struct pcp_daemon_flow *df)
+{
+    pcp_flow_t *fiter;
+
+    df->client=NULL;
+    if (!df->flow) {
+        free(df);
+        return;
+    }
+
+    for (fiter=df->flow; fiter; fiter=fiter->next_child) {
+        pcp_close_flow_intern(fiter);
+    }
+
+    if (d->closing_cnt == d->closing_alloc) {
+        size_t n=d->closing_alloc ? d->closing_alloc * 2 : 64;
+        struct pcp_daemon_flow **tmp=(struct pcp_daemon_flow **)realloc(
+                d->closing, n * sizeof(*tmp));
+
+        if (!tmp) {
+            pcp_delete_flow(df->flow);
+            free(df);
+            return;
+        }
+        d->closing=tmp;
+        d->closing_alloc=n;
+    }
+    d->closing[d->closing_cnt++]=df;
+}
+
+static void daemon_delete_flow(struct pcp_daemon_flow *df)
+{
+    if (df->flow) {
+        pcp_delete_flow(df->flow);
+    }
+    free(df);
+}
+
+// index of the first flow of client with id not less than id
+static size_t client_flow_pos(struct pcp_daemon_client *c, uint32_t id)
+{
+    size_t lo=0, hi=c->flow_cnt;
+
+    while (lo < hi) {
+        size_t mid=lo + (hi - lo) / 2;
+
+        if (FLOW_ID(&c->flows[mid]->req.kd) < id) {
+            lo=mid + 1;
+        } else {
+            hi=mid;
+        }
+    }
+    return lo;
+}
+
+static void client_remove_flow(struct pcp_daemon_client *c, size_t i)
+{
+    memmove(c->flows + i, c->flows + i + 1,
+            (c->flow_cnt - i - 1) * sizeof(*c->flows));
+    c->flow_cnt--;
+    if (c->resync > i) {
+        c->resync--;
+    }
+}
+
+static struct pcp_daemon_flow *client_insert_flow(struct pcp_daemon_client *c,
+        size_t i, struct pcp_daemon_req *r)
+{
+    struct pcp_daemon_flow *df;
+
+    if (c->flow_cnt == c->flow_alloc) {
+        size_t n=c->flow_alloc ? c->flow_alloc * 2 : 64;
+        struct pcp_daemon_flow **tmp=(struct pcp_daemon_flow **)realloc(
+                c->flows, n * sizeof(*tmp));
+
+        if (!tmp) {
+            return NULL;
+        }
+        c->flows=tmp;
+        c->flow_alloc=n;
+    }
+
+    df=(struct pcp_daemon_flow *)calloc(1, sizeof(*df));
+    if (!df) {
+        return NULL;
+    }
+    memcpy(&df->req, r, sizeof(df->req));
+    df->client=c;
+
+    memmove(c->flows + i + 1, c->flows + i,
+            (c->flow_cnt - i) * sizeof(*c->flows));
+    c->flows[i]=df;
+    c->flow_cnt++;
+    if (c->resync > i) {
+        c->resync++;
+    }
+    return df;
+}
+
+static void daemon_handle_req(pcp_ctx_t *ctx, struct pcp_daemon_client *c,
+        struct pcp_daemon_req *r)
+{
+    size_t i=client_flow_pos(c, FLOW_ID(&r->kd));
+    struct pcp_daemon_flow *df=NULL;
+
+    if ((i < c->flow_cnt)
+            && (memcmp(&c->flows[i]->req.kd, &r->kd, sizeof(r->kd)) == 0)) {
+        df=c->flows[i];
+    }
+
+    if ((r->op == pdo_delete) || (r->lifetime == 0)) {
+        if (df) {
+            client_remove_flow(c, i);
+            if (r->op == pdo_delete) {
+                daemon_delete_flow(df);
+            } else {
+                daemon_close_flow(ctx->daemon, df);
+            }
+        }
+        return;
+    }
+
+    if (!df) {
+        df=client_insert_flow(c, i, r);
+        if (!df) {
+            PCP_LOG(PCP_LOGLVL_ERR, "%s",
+                    "Not enough memory for flow of local client.");
+            return;
+        }
+        daemon_create_flow(ctx, df);
+    } else if (!df->flow) {
+        // retry of flow which couldn't be created
+        memcpy(&df->req, r, sizeof(df->req));
+        daemon_create_flow(ctx, df);
+    } else {
+        if (r->lifetime != df->req.lifetime) {
+            pcp_flow_set_lifetime(df->flow, r->lifetime);
+        }
+        if (!same_options(r, &df->req)) {
+            daemon_set_options(df->flow, r);
+        }
+        memcpy(&df->req, r, sizeof(df->req));
+    }
+
+    // flow may have joined mapping shared with another client
+    daemon_flow_event(df, daemon_flow_state(df));
+}
+
+static void daemon_read_requests(pcp_ctx_t *ctx, struct pcp_daemon_client *c)
+{
+    struct pcp_daemon_area *a=c->area;
+    struct pcp_daemon_req r;
+    uint32_t n;
+
+    // requests are copied out first, client may still write the slot
+    for (n=0; (n < PCP_DAEMON_RING_SIZE) && (!ring_empty(&a->req_ring)); ++n) {
+        memcpy(&r, &a->reqs[RING_SLOT(a->req_ring.tail)], sizeof(r));
+        ring_pop(&a->req_ring);
+        daemon_handle_req(ctx, c, &r);
+    }
+    c->backlog=!ring_empty(&a->req_ring);
+}
+
+static int send_fds(int conn, int *fds)
+{
+    uint32_t format=PCP_DAEMON_FORMAT;
+    struct iovec iov={&format, sizeof(format)};
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(DAEMON_FDS * sizeof(int))];
+    } ctrl;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(&ctrl, 0, sizeof(ctrl));
+    msg.msg_iov=&iov;
+    msg.msg_iovlen=1;
+    msg.msg_control=ctrl.buf;
+    msg.msg_controllen=sizeof(ctrl.buf);
+    cmsg=CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level=SOL_SOCKET;
+    cmsg->cmsg_type=SCM_RIGHTS;
+    cmsg->cmsg_len=CMSG_LEN(DAEMON_FDS * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, DAEMON_FDS * sizeof(int));
+
+    return sendmsg(conn, &msg, MSG_NOSIGNAL) == (ssize_t)sizeof(format) ? 0 : -1;
+}
+
+static void client_free(struct pcp_daemon_client *c)
+{
+    close_fd(c->conn);
+    close_fd(c->req_fd);
+    close_fd(c->ev_fd);
+    close_area(c->area);
+    free(c->flows);
+    free(c);
+}
+
+static struct pcp_daemon_client *daemon_new_client(struct pcp_daemon *d,
+        int conn)
+{
+    struct pcp_daemon_client *c;
+    struct epoll_event ev;
+    void *area;
+    int fds[DAEMON_FDS];
+
+    c=(struct pcp_daemon_client *)calloc(1, sizeof(*c));
+    if (!c) {
+        return NULL;
+    }
+    c->conn=conn;
+    c->req_fd=eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    c->ev_fd=eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    fds[0]=memfd_create("pcp-daemon", MFD_CLOEXEC);
+    fds[1]=c->req_fd;
+    fds[2]=c->ev_fd;
+
+    if ((c->req_fd < 0) || (c->ev_fd < 0) || (fds[0] < 0)
+            || (ftruncate(fds[0], sizeof(*c->area)))) {
+        goto fail;
+    }
+    area=mmap(NULL, sizeof(*c->area), PROT_READ | PROT_WRITE, MAP_SHARED,
+            fds[0], 0);
+    if (area == MAP_FAILED) {
+        goto fail;
+    }
+    c->area=(struct pcp_daemon_area *)area;
+    c->area->format=PCP_DAEMON_FORMAT;
+    c->area->ring_size=PCP_DAEMON_RING_SIZE;
+
+    if (send_fds(conn, fds)) {
+        goto fail;
+    }
+    close(fds[0]);
+    fds[0]=-1;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events=EPOLLIN;
+    ev.data.ptr=c;
+    if ((epoll_ctl(d->epoll_fd, EPOLL_CTL_ADD, c->conn, &ev))
+            || (epoll_ctl(d->epoll_fd, EPOLL_CTL_ADD, c->req_fd, &ev))) {
+        goto fail;
+    }
+
+    c->next=d->clients;
+    d->clients=c;
+    PCP_LOG(PCP_LOGLVL_INFO, "Local client connected to daemon %s", d->path);
+    return c;
+
+fail:
+    PCP_LOG(PCP_LOGLVL_WARN, "Can't set up local client of daemon %s (%s)",
+            d->path, strerror(errno));
+    close_fd(fds[0]);
+    c->conn=-1; //closed by caller
+    client_free(c);
+    return NULL;
+}
+
+static void daemon_accept(struct pcp_daemon *d)
+{
+    for (;;) {
+        int conn=accept4(d->listen_fd, NULL, NULL,
+                SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (conn < 0) {
+            break;
+        }
+        if (!daemon_new_client(d, conn)) {
+            close(conn);
+        }
+    }
+}
+
+// Client exited or closed its context. Its mappings are no longer renewed and
+// expire on server, as they would after exit of a standalone process.
+static void daemon_drop_client(struct pcp_daemon *d,
+        struct pcp_daemon_client *c)
+{
+    struct pcp_daemon_client **citer;
+    size_t i;
+
+    for (citer=&d->clients; *citer; citer=&(*citer)->next) {
+        if (*citer == c) {
+            *citer=c->next;
+            break;
+        }
+    }
+    for (i=0; i < c->flow_cnt; ++i) {
+        daemon_delete_flow(c->flows[i]);
+    }
+    PCP_LOG(PCP_LOGLVL_INFO, "Local client of daemon %s left, %zu flows "
+            "deleted", d->path, c->flow_cnt);
+    // closing fd removes it from epoll set
+    client_free(c);
+}
+
+void pcp_daemon_recv(pcp_ctx_t *ctx)
+{
+    struct pcp_daemon *d=ctx->daemon;
+    struct pcp_daemon_client *c, *cnext;
+    struct epoll_event evs[DAEMON_EPOLL_EVENTS];
+    int i, n;
+
+    n=epoll_wait(d->epoll_fd, evs, DAEMON_EPOLL_EVENTS, 0);
+    for (i=0; i < n; ++i) {
+        char b;
+
+        c=(struct pcp_daemon_client *)evs[i].data.ptr;
+        if (!c) {
+            daemon_accept(d);
+            continue;
+        }
+        clear_wakeups(c->req_fd);
+        // client never writes to connection, readable means closed
+        if ((evs[i].events & (EPOLLHUP | EPOLLERR))
+                || (recv(c->conn, &b, 1, MSG_PEEK | MSG_DONTWAIT) == 0)) {
+            c->hangup=1;
+        }
+    }
+
+    // every ring is checked, wakeups are only a hint
+    for (c=d->clients; c; c=cnext) {
+        cnext=c->next;
+        daemon_read_requests(ctx, c);
+        if (c->hangup) {
+            daemon_drop_client(d, c);
+        }
+    }
+}
+
+static int flow_sending(pcp_flow_t *f)
+{
+    for (; f; f=f->next_child) {
+        if (f->state == pfs_send) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void pcp_daemon_send(pcp_ctx_t *ctx, struct timeval *next_timeout)
+{
+    struct pcp_daemon *d=ctx->daemon;
+    struct pcp_daemon_client *c;
+    size_t i;
+    int more=0;
+
+    for (i=0; i < d->closing_cnt;) {
+        struct pcp_daemon_flow *df=d->closing[i];
+
+        if (flow_sending(df->flow)) {
+            ++i;
+            continue;
+        }
+        daemon_delete_flow(df);
+        d->closing[i]=d->closing[--d->closing_cnt];
+    }
+
+    for (c=d->clients; c; c=c->next) {
+        while ((c->resyncing) && (c->resync < c->flow_cnt)
+                && (ring_space(&c->area->ev_ring) > 0)) {
+            struct pcp_daemon_flow *df=c->flows[c->resync++];
+
+            daemon_flow_event(df, daemon_flow_state(df));
+        }
+        if (c->resync >= c->flow_cnt) {
+            c->resyncing=0;
+        }
+        if (c->wake) {
+            wake(c->ev_fd);
+            c->wake=0;
+        }
+        more|=c->resyncing | c->backlog;
+    }
+
+    // ring of some client was full, come back when it made room
+    if (more) {
+        cap_timeout(next_timeout, PCP_SEND_BURST_INTERVAL);
+    }
+}
+
+void pcp_daemon_close(pcp_ctx_t *ctx)
+{
+    struct pcp_daemon *d=ctx->daemon;
+    struct pcp_daemon_client *c;
+    size_t i;
+
+    if (!d) {
+        return;
+    }
+
+    // flows stay in context, so pcp_terminate closes them if asked to
+    while ((c=d->clients)) {
+        d->clients=c->next;
+        for (i=0; i < c->flow_cnt; ++i) {
+            pcp_flow_t *fiter;
+
+            for (fiter=c->flows[i]->flow; fiter; fiter=fiter->next_child) {
+                fiter->remote=0;
+                fiter->user_data=NULL;
+            }
+            free(c->flows[i]);
+        }
+        __atomic_store_n(&c->area->format, 0, __ATOMIC_RELEASE);
+        wake(c->ev_fd);
+        client_free(c);
+    }
+    for (i=0; i < d->closing_cnt; ++i) {
+        pcp_flow_t *fiter;
+
+        for (fiter=d->closing[i]->flow; fiter; fiter=fiter->next_child) {
+            fiter->remote=0;
+            fiter->user_data=NULL;
+        }
+        free(d->closing[i]);
+    }
+    free(d->closing);
+
+    close_fd(d->epoll_fd);
+    close_fd(d->listen_fd);
+    unlink(d->path);
+    free(d->path);
+    free(d);
+    ctx->daemon=NULL;
+}
+
+int pcp_daemon_listen(pcp_ctx_t *ctx, const char *path)
+{
+    struct pcp_daemon *d;
+    struct sockaddr_un sun;
+    struct epoll_event ev;
+
+    PCP_LOG_BEGIN(PCP_LOGLVL_DEBUG);
+
+    if ((!ctx) || (!path) || (ctx->daemon) || (ctx->daemon_link)
+            || (strlen(path) >= sizeof(sun.sun_path))) {
+        PCP_LOG_END(PCP_LOGLVL_DEBUG);
+        return PCP_ERR_BAD_ARGS;
+    }
+
+    d=(struct pcp_daemon *)calloc(1, sizeof(*d));
+    if (!d) {
+        PCP_LOG_END(PCP_LOGLVL_DEBUG);
+        return PCP_ERR_NO_MEM;
+    }
+    d->epoll_fd=-1;
+    d->path=strdup(path);
+    d->listen_fd=socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family=AF_UNIX;
+    memcpy(sun.sun_path, path, strlen(path));
+    // socket left by daemon which didn't exit cleanly
+    unlink(path);
+
+    if ((!d->path) || (d->listen_fd < 0)
+            || (bind(d->listen_fd, (struct sockaddr *)&sun, sizeof(sun)))
+            || (listen(d->listen_fd, SOMAXCONN))
+            || ((d->epoll_fd=epoll_create1(EPOLL_CLOEXEC)) < 0)) {
+        goto fail;
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.events=EPOLLIN;
+    ev.data.ptr=NULL;
+    if (epoll_ctl(d->epoll_fd, EPOLL_CTL_ADD, d->listen_fd, &ev)) {
+        goto fail;
+    }
+
+    ctx->daemon=d;
+    // identical flows of clients share one mapping
+    pcp_set_flow_sharing(ctx, 1);
+    PCP_LOG(PCP_LOGLVL_INFO, "Serving local clients on %s", path);
+
+    PCP_LOG_END(PCP_LOGLVL_DEBUG);
+    return PCP_ERR_SUCCESS;
+
+fail:
+    PCP_LOG(PCP_LOGLVL_WARN, "Can't listen for local clients on %s (%s)",
+            path, strerror(errno));
+    close_fd(d->epoll_fd);
+    if (d->listen_fd >= 0) {
+        close(d->listen_fd);
+        unlink(path);
+    }
+    free(d->path);
+    free(d);
+    PCP_LOG_END(PCP_LOGLVL_DEBUG);
+    return PCP_ERR_UNKNOWN;
+}
+
+int pcp_get_daemon_socket(pcp_ctx_t *ctx)
+{
+    return ((ctx) && (ctx->daemon)) ? ctx->daemon->epoll_fd : -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//                           Client side
+
+static int recv_fds(int conn, int *fds)
+{
+    uint32_t format=0;
+    struct iovec iov={&format, sizeof(format)};
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(DAEMON_FDS * sizeof(int))];
+    } ctrl;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    ssize_t ret;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov=&iov;
+    msg.msg_iovlen=1;
+    msg.msg_control=ctrl.buf;
+    msg.msg_controllen=sizeof(ctrl.buf);
+
+    ret=recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+    cmsg=CMSG_FIRSTHDR(&msg);
+    if ((!cmsg) || (cmsg->cmsg_level != SOL_SOCKET)
+            || (cmsg->cmsg_type != SCM_RIGHTS)
+            || (cmsg->cmsg_len != CMSG_LEN(DAEMON_FDS * sizeof(int)))) {
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), DAEMON_FDS * sizeof(int));
+    if ((ret != (ssize_t)sizeof(format)) || (format != PCP_DAEMON_FORMAT)) {
+        int i;
+
+        for (i=0; i < DAEMON_FDS; ++i) {
+            close(fds[i]);
+        }
+        return -1;
+    }
+    return 0;
+}
+
+static void link_free(struct pcp_daemon_link *l)
+{
+    close_fd(l->conn);
+    close_fd(l->req_fd);
+    close_fd(l->ev_fd);
+    close_area(l->area);
+    free(l);
+}
+
+pcp_errno pcp_daemon_connect(pcp_ctx_t *ctx, const char *path)
+{
+    struct pcp_daemon_link *l;
+    struct sockaddr_un sun;
+    struct timeval tv={DAEMON_CONNECT_TIMEOUT, 0};
+    struct in6_addr any=IN6ADDR_ANY_INIT;
+    struct stat st;
+    pcp_server_t *s;
+    void *area;
+    int fds[DAEMON_FDS];
+    int indx;
+
+    if (strlen(path) >= sizeof(sun.sun_path)) {
+        return PCP_ERR_BAD_ARGS;
+    }
+    l=(struct pcp_daemon_link *)calloc(1, sizeof(*l));
+    if (!l) {
+        return PCP_ERR_NO_MEM;
+    }
+    l->req_fd=-1;
+    l->ev_fd=-1;
+
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family=AF_UNIX;
+    memcpy(sun.sun_path, path, strlen(path));
+
+    // daemon answers on its next pcp_pulse
+    l->conn=socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if ((l->conn < 0)
+            || (connect(l->conn, (struct sockaddr *)&sun, sizeof(sun)))
+            || (setsockopt(l->conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)))
+            || (recv_fds(l->conn, fds))) {
+        link_free(l);
+        return PCP_ERR_UNKNOWN;
+    }
+    l->req_fd=fds[1];
+    l->ev_fd=fds[2];
+
+    area=MAP_FAILED;
+    if ((fstat(fds[0], &st) == 0) && ((size_t)st.st_size >= sizeof(*l->area))) {
+        area=mmap(NULL, sizeof(*l->area), PROT_READ | PROT_WRITE, MAP_SHARED,
+                fds[0], 0);
+    }
+    close(fds[0]);
+    if (area == MAP_FAILED) {
+        link_free(l);
+        return PCP_ERR_UNKNOWN;
+    }
+    l->area=(struct pcp_daemon_area *)area;
+    if ((l->area->format != PCP_DAEMON_FORMAT)
+            || (l->area->ring_size != PCP_DAEMON_RING_SIZE)) {
+        PCP_LOG(PCP_LOGLVL_WARN, "Local PCP daemon %s uses different format",
+                path);
+        link_free(l);
+        return PCP_ERR_UNKNOWN;
+    }
+
+    indx=pcp_new_server(ctx, &any, 0, 0);
+    s=indx >= 0 ? get_pcp_server(ctx, indx) : NULL;
+    if (!s) {
+        link_free(l);
+        return PCP_ERR_NO_MEM;
+    }
+    s->server_state=pss_daemon;
+    snprintf(s->pcp_server_paddr, sizeof(s->pcp_server_paddr), "%s",
+            "local daemon");
+    l->server_indx=s->index;
+
+    ctx->socket=l->ev_fd;
+    ctx->daemon_link=l;
+    PCP_LOG(PCP_LOGLVL_INFO, "Flows are mapped by local PCP daemon %s", path);
+    return PCP_ERR_SUCCESS;
+}
+
+void pcp_daemon_link_key(pcp_server_t *s, struct flow_key_data *kd)
+{
+    struct pcp_daemon_link *l=s->ctx->daemon_link;
+
+    memcpy(&kd->pcp_server_ip, s->pcp_ip, sizeof(kd->pcp_server_ip));
+    memcpy(&kd->nonce, &s->nonce, sizeof(kd->nonce));
+    FLOW_ID(kd)=++l->next_id;
+}
+
+static void link_fill_req(struct pcp_daemon_req *r, pcp_flow_t *f)
+{
+    memset(r, 0, sizeof(*r));
+    memcpy(&r->kd, &f->kd, sizeof(r->kd));
+    r->op=pdo_set;
+    r->lifetime=f->lifetime;
+    r->ext_ip=f->map_peer.ext_ip;
+    r->ext_port=f->map_peer.ext_port;
+    r->pfailure=f->pfailure_option_present;
+    if (f->ext) {
+        r->filter=f->ext->filter_option_present;
+        r->filter_prefix=f->ext->filter_prefix;
+        r->filter_ip=f->ext->filter_ip;
+        r->filter_port=f->ext->filter_port;
+        r->third_party=f->ext->third_party_option_present;
+        r->third_party_ip=f->ext->third_party_ip;
+#ifdef PCP_FLOW_PRIORITY
+        r->flowp=f->ext->flowp_option_present;
+        r->dscp_up=f->ext->flowp_dscp_up;
+        r->dscp_down=f->ext->flowp_dscp_down;
+#endif
+    }
+}
+
+struct link_send_data {
+    pcp_server_t *s;
+    struct pcp_daemon_link *l;
+    size_t sent;
+    int full;
+};
+
+static int link_send_iter(pcp_flow_t *f, void *data)
+{
+    struct link_send_data *d=(struct link_send_data *)data;
+    struct pcp_daemon_area *a=d->l->area;
+    struct pcp_daemon_req r;
+
+    if ((f->pcp_server_indx != d->s->index) || (f->state != pfs_send)) {
+        return 0;
+    }
+
+    if ((d->l->gone) || ((f->kd.operation != PCP_OPCODE_MAP)
+            && (f->kd.operation != PCP_OPCODE_PEER))) {
+        // only MAP and PEER flows are mapped by daemon
+        f->state=pfs_failed;
+        pcp_flow_account_state(f);
+        return 0;
+    }
+
+    if (ring_space(&a->req_ring) == 0) {
+        d->full=1;
+        return 1;
+    }
+    link_fill_req(&r, f);
+    memcpy(&a->reqs[RING_SLOT(a->req_ring.head)], &r, sizeof(r));
+    ring_push(&a->req_ring);
+    f->ctx->stats.sent++;
+    d->sent++;
+
+    // closed flow isn't reported by daemon any more
+    f->state=f->lifetime ? pfs_wait_resp : pfs_failed;
+    f->timeout.tv_sec=0;
+    f->timeout.tv_usec=0;
+    pcp_flow_account_state(f);
+    return 0;
+}
+
+pcp_server_state_e pcp_daemon_link_send(pcp_server_t *s)
+{
+    struct link_send_data d;
+
+    memset(&d, 0, sizeof(d));
+    d.s=s;
+    d.l=s->ctx->daemon_link;
+    s->next_timeout.tv_sec=0;
+    s->next_timeout.tv_usec=0;
+
+    pcp_db_foreach_flow(s->ctx, link_send_iter, &d);
+    if (d.sent) {
+        wake(d.l->req_fd);
+    }
+    if (d.full) {
+        // daemon hasn't caught up, retry after pacing interval
+        gettimeofday(&s->next_timeout, NULL);
+        s->next_timeout.tv_usec+=PCP_SEND_BURST_INTERVAL * 1000;
+        timeval_align(&s->next_timeout);
+    }
+
+    return pss_daemon;
+}
+
+static pcp_flow_state_e link_flow_state(uint8_t state)
+{
+    switch (state) {
+        case pcp_state_succeeded:
+        case pcp_state_partial_result:
+            return pfs_wait_for_lifetime_renew;
+        case pcp_state_short_lifetime_error:
+            return pfs_wait_after_short_life_error;
+        case pcp_state_failed:
+            return pfs_failed;
+        default:
+            return pfs_wait_resp;
+    }
+}
+
+// update of flow not yet forwarded again keeps it waiting for send
+static void link_apply_event(pcp_flow_t *f, struct pcp_daemon_event *ev)
+{
+    pcp_fstate_e before, after;
+    struct in6_addr prev_ext_addr=f->map_peer.ext_ip;
+    uint16_t prev_ext_port=f->map_peer.ext_port;
+
+    pcp_eval_flow_state(f, &before);
+    if (f->state != pfs_send) {
+        f->state=link_flow_state(ev->state);
+    }
+    f->recv_result=ev->result;
+    f->recv_lifetime=(time_t)ev->recv_lifetime;
+    if (ev->state == pcp_state_succeeded
+            || ev->state == pcp_state_partial_result) {
+        f->map_peer.ext_ip=ev->ext_ip;
+        f->map_peer.ext_port=ev->ext_port;
+    }
+    pcp_flow_account_state(f);
+    pcp_eval_flow_state(f, &after);
+    if ((before != after)
+            || (!IN6_ARE_ADDR_EQUAL(&prev_ext_addr, &f->map_peer.ext_ip))
+            || (prev_ext_port != f->map_peer.ext_port)) {
+        pcp_flow_notify(f, after);
+    }
+}
+
+static int link_fail_iter(pcp_flow_t *f, void *data)
+{
+    struct pcp_daemon_event *ev=(struct pcp_daemon_event *)data;
+
+    if ((f->lifetime) && (f->state != pfs_failed)) {
+        f->state=pfs_wait_resp;
+        link_apply_event(f, ev);
+    }
+    return 0;
+}
+
+void pcp_daemon_link_recv(pcp_ctx_t *ctx)
+{
+    struct pcp_daemon_link *l=ctx->daemon_link;
+    struct pcp_daemon_area *a=l->area;
+    pcp_server_t *s=get_pcp_server(ctx, l->server_indx);
+    struct pcp_daemon_event ev;
+    uint32_t n;
+
+    clear_wakeups(l->ev_fd);
+    for (n=0; (n < PCP_DAEMON_RING_SIZE) && (!ring_empty(&a->ev_ring)); ++n) {
+        pcp_flow_t *f;
+
+        memcpy(&ev, &a->evs[RING_SLOT(a->ev_ring.tail)], sizeof(ev));
+        ring_pop(&a->ev_ring);
+        ctx->stats.received++;
+
+        f=s ? pcp_get_flow(&ev.kd, s) : NULL;
+        // closed flow keeps failed state
+        if ((f) && (f->lifetime)) {
+            link_apply_event(f, &ev);
+        }
+    }
+    if (!ring_empty(&a->ev_ring)) {
+        // more events than ring holds at once, continue on next pcp_pulse
+        wake(l->ev_fd);
+    }
+
+    if ((!l->gone)
+            && (__atomic_load_n(&a->format, __ATOMIC_ACQUIRE) == 0)) {
+        PCP_LOG(PCP_LOGLVL_WARN, "%s", "Local PCP daemon stopped.");
+        l->gone=1;
+        memset(&ev, 0, sizeof(ev));
+        ev.state=pcp_state_failed;
+        pcp_db_foreach_flow(ctx, link_fail_iter, &ev);
+    }
+}
+
+void pcp_daemon_link_forget(pcp_flow_t *f)
+{
+    struct pcp_daemon_link *l=f->ctx->daemon_link;
+    struct pcp_daemon_area *a=l->area;
+    struct pcp_daemon_req r;
+
+    if ((l->gone) || (ring_space(&a->req_ring) == 0)) {
+        // daemon renews the flow until this process exits
+        return;
+    }
+    memset(&r, 0, sizeof(r));
+    memcpy(&r.kd, &f->kd, sizeof(r.kd));
+    r.op=pdo_delete;
+    memcpy(&a->reqs[RING_SLOT(a->req_ring.head)], &r, sizeof(r));
+    ring_push(&a->req_ring);
+    wake(l->req_fd);
+}
+
+void pcp_daemon_link_close(pcp_ctx_t *ctx)
+{
+    if (ctx->daemon_link) {
+        link_free(ctx->daemon_link);
+        ctx->daemon_link=NULL;
+        ctx->socket=PCP_INVALID_SOCKET;
+    }
+}
+
+#else //__linux__
+
+void pcp_daemon_recv(UNUSED pcp_ctx_t *ctx)
+{
+}
+
+void pcp_daemon_send(UNUSED pcp_ctx_t *ctx,
+        UNUSED struct timeval *next_timeout)
+{
+}
+
+void pcp_daemon_flow_changed(UNUSED pcp_flow_t *f, UNUSED pcp_fstate_e state)
+{
+}
+
+void pcp_daemon_close(UNUSED pcp_ctx_t *ctx)
+{
+}
+
+int pcp_daemon_listen(UNUSED pcp_ctx_t *ctx, UNUSED const char *path)
+{
+    return PCP_ERR_UNKNOWN;
+}
+
+int pcp_get_daemon_socket(UNUSED pcp_ctx_t *ctx)
+{
+    return -1;
+}
+
+pcp_errno pcp_daemon_connect(UNUSED pcp_ctx_t *ctx, UNUSED const char *path)
+{
+    return PCP_ERR_UNKNOWN;
+}
+
+void pcp_daemon_link_key(UNUSED pcp_server_t *s,
+        UNUSED struct flow_key_data *kd)
+{
+}
+
+pcp_server_state_e pcp_daemon_link_send(pcp_server_t *s)
+{
+    return s->server_state;
+}
+
+void pcp_daemon_link_recv(UNUSED pcp_ctx_t *ctx)
+{
+}
+
+void pcp_daemon_link_forget(UNUSED pcp_flow_t *f)
+{
+}
+
+void pcp_daemon_link_close(UNUSED pcp_ctx_t *ctx)
+{
+}
+
+#endif //__linux__
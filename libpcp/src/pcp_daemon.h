@@ -0,0 +1,104 @@
+/*
+ Copyright (c) 2014 by Cisco Systems, Inc.
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice, this
+ list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PCP_DAEMON_H_
+#define PCP_DAEMON_H_
+
+#include "pcp_client_db.h"
+#include "pcp_event_handler.h"
+
+// Local daemon maps flows of all processes of the host in its own context.
+// Client connects to daemon's unix socket and receives a shared memory area
+// with two single producer, single consumer rings (requests and events) and
+// an eventfd for wakeups in each direction. The connection is then used only
+// to notice exit of the client.
+//
+// Client's context has no PCP socket and no servers of its own. Its flows
+// belong to pseudo server in state pss_daemon, which forwards them instead of
+// sending them on wire. Nonce of flow key is unique per flow, so daemon echoes
+// the key in events and client finds the flow by its usual hash lookup.
+
+#define PCP_DAEMON_FORMAT 1
+
+typedef enum {
+    pdo_set,    //create flow or change its lifetime and options, 0 closes it
+    pdo_delete  //forget flow without closing, as if its process exited
+} pcp_daemon_op_e;
+
+struct pcp_daemon_req {
+    struct flow_key_data kd; //client's flow key
+    uint8_t op;
+    uint8_t pfailure;
+    uint8_t filter;
+    uint8_t filter_prefix;
+    uint8_t third_party;
+    uint8_t flowp;
+    uint8_t dscp_up;
+    uint8_t dscp_down;
+    uint32_t lifetime;
+    uint16_t ext_port;
+    uint16_t filter_port;
+    struct in6_addr ext_ip; //suggested or assigned external address
+    struct in6_addr filter_ip;
+    struct in6_addr third_party_ip;
+};
+
+struct pcp_daemon_event {
+    struct flow_key_data kd; //client's flow key
+    uint8_t state; //pcp_fstate_e of daemon's flow group
+    uint16_t ext_port;
+    uint32_t result;
+    int64_t recv_lifetime;
+    struct in6_addr ext_ip;
+};
+
+// Serving side, called by pcp_pulse. Requests are read before timeouts of
+// servers are processed, clients are woken up after that.
+void pcp_daemon_recv(pcp_ctx_t *ctx);
+void pcp_daemon_send(pcp_ctx_t *ctx, struct timeval *next_timeout);
+
+// state of flow created for a client has changed
+void pcp_daemon_flow_changed(pcp_flow_t *f, pcp_fstate_e state);
+
+void pcp_daemon_close(pcp_ctx_t *ctx);
+
+// Client side. Connect context to daemon listening on path.
+pcp_errno pcp_daemon_connect(pcp_ctx_t *ctx, const char *path);
+
+// make key of new flow unique, so flow is identified by it in events
+void pcp_daemon_link_key(pcp_server_t *s, struct flow_key_data *kd);
+
+// pss_daemon handler, forwards flows waiting to be sent
+pcp_server_state_e pcp_daemon_link_send(pcp_server_t *s);
+
+// apply events received from daemon
+void pcp_daemon_link_recv(pcp_ctx_t *ctx);
+
+// daemon forgets deleted flow
+void pcp_daemon_link_forget(pcp_flow_t *f);
+
+void pcp_daemon_link_close(pcp_ctx_t *ctx);
+
+#endif /* PCP_DAEMON_H_ */
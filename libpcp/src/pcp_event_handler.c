@@ -57,7 +57,9 @@
 #include "pcp_logger.h"
 #include "pcp_event_handler.h"
 #include "pcp_server_discovery.h"
+#include "pcp_server_cache.h"
 #include "pcp_socket.h"
+#include "pcp_daemon.h"
 
 #define MIN(a, b) (a<b?a:b)
 #define MAX(a, b) (a>b?a:b)
@@ -86,6 +88,8 @@ static pcp_server_state_e handle_server_reping(pcp_server_t *s);
 static pcp_server_state_e pcp_terminate_server(pcp_server_t *s);
 static pcp_server_state_e log_unexepected_state_event(pcp_server_t *s);
 static pcp_server_state_e ignore_events(pcp_server_t *s);
+static int race_settle(pcp_server_t *s);
+static void race_revive(pcp_server_t *s);
 
 #if PCP_MAX_LOG_LEVEL>=PCP_LOGLVL_DEBUG
 
@@ -130,6 +134,8 @@ static const char *dbg_get_func_name(void *f)
         return "handle_server_reping";
     } else if (f == pcp_terminate_server) {
         return "pcp_terminate_server";
+    } else if (f == pcp_daemon_link_send) {
+        return "pcp_daemon_link_send";
     } else if (f == log_unexepected_state_event) {
         return "log_unexepected_state_event";
     } else if (f == ignore_events) {
@@ -217,7 +223,10 @@ static const char *dbg_get_sstate_name(pcp_server_state_e s)
             "pss_server_restart",
             "pss_server_reping",
             "pss_set_not_working",
-            "pss_not_working"
+            "pss_not_working",
+            "pss_retired",
+            "pss_race_lost",
+            "pss_daemon"
     };
 
     assert((int)s < (int)(sizeof(server_state_names) /
@@ -384,6 +393,36 @@ static pcp_errno read_msg(pcp_ctx_t *ctx, pcp_recv_msg_t *msg)
     return PCP_ERR_SUCCESS;
 }
 
+// Check send budget of the server. If it's exhausted, postpone sending of
+// the flow's message to the next pacing interval and return nonzero.
+static int pcp_flow_send_deferred(pcp_flow_t *f, pcp_server_t *s)
+{
+#if PCP_MAX_SEND_BURST>0
+    struct timeval ctv;
+
+    if (s->ctx->terminating) {
+        return 0;
+    }
+
+    gettimeofday(&ctv, NULL);
+    if (timeval_comp(&ctv, &s->burst_end) >= 0) {
+        s->burst_end=ctv;
+        s->burst_end.tv_usec+=PCP_SEND_BURST_INTERVAL * 1000;
+        timeval_align(&s->burst_end);
+        s->burst_sent=0;
+    }
+
+    if (s->burst_sent >= PCP_MAX_SEND_BURST) {
+        PCP_LOG(PCP_LOGLVL_DEBUG, "Send burst limit reached for server %s, "
+                "deferring flow %d", s->pcp_server_paddr, f->key_bucket);
+        f->timeout=s->burst_end;
+        return 1;
+    }
+    s->burst_sent++;
+#endif
+    return 0;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 //              Flow State Transitions Handlers
 
@@ -401,6 +440,11 @@ static pcp_flow_event_e fhndl_send(pcp_flow_t *f, UNUSED pcp_recv_msg_t *msg)
         return fev_ignored;
     }
 
+    if (pcp_flow_send_deferred(f, s)) {
+        PCP_LOG_END(PCP_LOGLVL_DEBUG);
+        return fev_none;
+    }
+
     if (pcp_flow_send_msg(f, s) != PCP_ERR_SUCCESS) {
         PCP_LOG_END(PCP_LOGLVL_DEBUG);
         return fev_failed;
@@ -426,8 +470,17 @@ static pcp_flow_event_e fhndl_resend(pcp_flow_t *f, UNUSED pcp_recv_msg_t *msg)
         return fev_failed;
     }
 
+    if (pcp_flow_send_deferred(f, s)) {
+        PCP_LOG_END(PCP_LOGLVL_DEBUG);
+        return fev_none;
+    }
+
 #if PCP_RETX_MRC>0
     if (++f->retry_count >= PCP_RETX_MRC) {
+        if (s->warm) {
+            // cached server didn't answer, next run will ping it
+            psc_forget(s);
+        }
         return fev_failed;
     }
 #endif
@@ -436,6 +489,7 @@ static pcp_flow_event_e fhndl_resend(pcp_flow_t *f, UNUSED pcp_recv_msg_t *msg)
         PCP_LOG_END(PCP_LOGLVL_DEBUG);
         return fev_failed;
     }
+    f->ctx->stats.retransmitted++;
 
     f->resend_timeout=PCP_RT(f->resend_timeout);
 
@@ -516,6 +570,10 @@ static pcp_flow_event_e fhndl_send_renew(pcp_flow_t *f,
         return fev_failed;
     }
 
+    if (pcp_flow_send_deferred(f, s)) {
+        return fev_none;
+    }
+
     if (pcp_flow_send_msg(f, s) != PCP_ERR_SUCCESS) {
         return fev_failed;
     }
@@ -557,7 +615,33 @@ static pcp_flow_event_e fhndl_waitresp(pcp_flow_t *f,
     return fev_none;
 }
 
-static void flow_change_notify(pcp_flow_t *flow, pcp_fstate_e state);
+
+// Mirror state of on-wire flow to flows sharing it. Every sharing flow is
+// notified on its own, so each caller gets its own callback.
+static void sync_shared_flows(pcp_flow_t *f)
+{
+    pcp_flow_t *fo, *fnext;
+
+    for (fo=f->next_follower; fo; fo=fnext) {
+        pcp_fstate_e before, after;
+        struct in6_addr prev_ext_addr=fo->map_peer.ext_ip;
+        uint16_t prev_ext_port=fo->map_peer.ext_port;
+
+        fnext=fo->next_follower;
+        pcp_eval_flow_state(fo, &before);
+        fo->state=f->state;
+        fo->recv_lifetime=f->recv_lifetime;
+        fo->recv_result=f->recv_result;
+        fo->map_peer=f->map_peer;
+        pcp_flow_account_state(fo);
+        pcp_eval_flow_state(fo, &after);
+        if ((before != after)
+                || (!IN6_ARE_ADDR_EQUAL(&prev_ext_addr, &fo->map_peer.ext_ip))
+                || (prev_ext_port != fo->map_peer.ext_port)) {
+            pcp_flow_notify(fo, after);
+        }
+    }
+}
 
 static pcp_flow_state_e handle_flow_event(pcp_flow_t *f, pcp_flow_event_e ev,
         pcp_recv_msg_t *r)
@@ -625,12 +709,14 @@ static pcp_flow_state_e handle_flow_event(pcp_flow_t *f, pcp_flow_event_e ev,
         }
     }
 end:
+    pcp_flow_account_state(f);
     pcp_eval_flow_state(f, &after);
     if ((before != after)
             || (!IN6_ARE_ADDR_EQUAL(&prev_ext_addr, &f->map_peer.ext_ip))
             || (prev_ext_port != f->map_peer.ext_port)) {
-        flow_change_notify(f, after);
+        pcp_flow_notify(f, after);
     }
+    sync_shared_flows(f);
 
     PCP_LOG_END(PCP_LOGLVL_DEBUG);
     return f->state;
@@ -805,6 +891,46 @@ static int flow_send_event_iter(pcp_flow_t *f, void *data)
     return 0;
 }
 
+// Send requests waiting for server initialization before the ping response
+// arrives.
+static int flow_send_optimistic_iter(pcp_flow_t *f, void *data)
+{
+    pcp_server_t *s=(pcp_server_t *)data;
+
+    if ((f->pcp_server_indx == s->index)
+            && (f->state == pfs_wait_for_server_init)) {
+        handle_flow_event(f, fev_server_initialized, NULL);
+    }
+
+    return 0;
+}
+
+// Requests sent along with the ping keep their retransmission schedule.
+static int flow_send_queued_iter(pcp_flow_t *f, void *data)
+{
+    struct flow_iterator_data *d=(struct flow_iterator_data *)data;
+
+    if ((d->s->optimistic) && (f->state == pfs_wait_resp)) {
+        return 0;
+    }
+
+    return flow_send_event_iter(f, data);
+}
+
+// Return optimistically sent requests to wait for version negotiation.
+static int flow_requeue_iter(pcp_flow_t *f, void *data)
+{
+    pcp_server_t *s=(pcp_server_t *)data;
+
+    if ((f->pcp_server_indx == s->index) && (f != s->ping_flow_msg)
+            && (f->state == pfs_wait_resp)) {
+        handle_flow_event(f, fev_res_unsupp_version, NULL);
+        s->stale_requests++;
+    }
+
+    return 0;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 //                 Server state machine event handlers
 
@@ -814,6 +940,18 @@ static pcp_server_state_e handle_server_ping(pcp_server_t *s)
     PCP_LOG_BEGIN(PCP_LOGLVL_DEBUG);
     s->ping_count=0;
 
+    // racing gateways start one after another
+    if (s->racing) {
+        struct timeval ctv;
+
+        gettimeofday(&ctv, NULL);
+        if (timeval_comp(&ctv, &s->race_start) < 0) {
+            s->next_timeout=s->race_start;
+            PCP_LOG_END(PCP_LOGLVL_DEBUG);
+            return pss_ping;
+        }
+    }
+
     msg=get_ping_msg(s);
 
     if (!msg) {
@@ -826,10 +964,18 @@ static pcp_server_state_e handle_server_ping(pcp_server_t *s)
 
     PCP_LOG(PCP_LOGLVL_INFO, "Pinging PCP server at address %s",
             s->pcp_server_paddr);
+    gettimeofday(&s->ping_sent, NULL);
 
     if (handle_flow_event(msg, fev_send, NULL) != pfs_failed) {
         s->next_timeout=msg->timeout;
 
+        if ((s->ctx->optimistic_start) && (s->version_known)) {
+            PCP_LOG(PCP_LOGLVL_INFO, "Sending requests to PCP server %s "
+                    "without waiting for ping response", s->pcp_server_paddr);
+            s->optimistic=1;
+            pcp_db_foreach_flow(s->ctx, flow_send_optimistic_iter, s);
+        }
+
         PCP_LOG_END(PCP_LOGLVL_DEBUG);
         return pss_wait_ping_resp;
     }
@@ -869,11 +1015,30 @@ static pcp_server_state_e handle_wait_ping_resp_timeout(pcp_server_t *s)
 
 static pcp_server_state_e handle_wait_ping_resp_recv(pcp_server_t *s)
 {
-    pcp_server_state_e res=handle_wait_io_receive_msg(s);
+    pcp_recv_msg_t *msg=&s->ctx->msg;
+    pcp_server_state_e res;
+
+    // answer to optimistic request, the version was lowered already
+    if ((s->stale_requests) && (msg->recv_result == PCP_RES_UNSUPP_VERSION)
+            && (msg->recv_version == s->pcp_version)) {
+        s->stale_requests--;
+        return pss_wait_ping_resp;
+    }
+
+    res=handle_wait_io_receive_msg(s);
 
     switch (res) {
         case pss_wait_io_calc_nearest_timeout:
-            res=pss_send_all_msgs;
+            // round trip of ping which wasn't retransmitted
+            if (s->ping_count == 0) {
+                struct timeval ctv;
+
+                gettimeofday(&ctv, NULL);
+                timeval_subtract(&ctv, &ctv, &s->ping_sent);
+                s->rtt_us=ctv.tv_sec * 1000000 + ctv.tv_usec;
+            }
+            psc_store(s);
+            res=race_settle(s) ? pss_race_lost : pss_send_all_msgs;
             break;
         case pss_wait_io:
             res=pss_wait_ping_resp;
@@ -888,6 +1053,11 @@ static pcp_server_state_e handle_version_negotiation(pcp_server_t *s)
 {
     pcp_flow_t *ping_msg;
 
+    if (s->optimistic) {
+        s->optimistic=0;
+        pcp_db_foreach_flow(s->ctx, flow_requeue_iter, s);
+    }
+
     if (s->next_version == s->pcp_version) {
         s->next_version--;
     }
@@ -916,6 +1086,7 @@ static pcp_server_state_e handle_version_negotiation(pcp_server_t *s)
     if (s->pcp_version == 0) {
         if (ping_msg) {
             ping_msg->state=pfs_wait_for_server_init;
+            pcp_flow_account_state(ping_msg);
             ping_msg->timeout.tv_sec=0;
             ping_msg->timeout.tv_usec=0;
         }
@@ -935,6 +1106,7 @@ static pcp_server_state_e handle_version_negotiation(pcp_server_t *s)
     ping_msg->retry_count=0;
     ping_msg->resend_timeout=0;
 
+    gettimeofday(&s->ping_sent, NULL);
     handle_flow_event(ping_msg, fev_send, NULL);
     if (ping_msg->state == pfs_failed) {
         return pss_set_not_working;
@@ -949,7 +1121,9 @@ static pcp_server_state_e handle_send_all_msgs(pcp_server_t *s)
 {
     struct flow_iterator_data d={s, fev_server_initialized};
 
-    pcp_db_foreach_flow(s->ctx, flow_send_event_iter, &d);
+    pcp_db_foreach_flow(s->ctx, flow_send_queued_iter, &d);
+    s->optimistic=0;
+    s->stale_requests=0;
     gettimeofday(&s->next_timeout, NULL);
 
     return pss_wait_io_calc_nearest_timeout;
@@ -997,10 +1171,14 @@ static pcp_server_state_e handle_wait_io_receive_msg(pcp_server_t *s)
         s->cepoch=msg->received_time;
         gettimeofday(&s->next_timeout, NULL);
         s->restart_flow_msg=f;
+        psc_store(s);
 
         return pss_server_restart;
     }
 
+    if (s->warm) {
+        psc_store(s);
+    }
     gettimeofday(&s->next_timeout, NULL);
 
     return pss_wait_io_calc_nearest_timeout;
@@ -1034,7 +1212,12 @@ static pcp_server_state_e handle_server_set_not_working(pcp_server_t *s)
     "Disabling sending of PCP messages to this server for %d minutes.",
             s->pcp_server_paddr, PCP_SERVER_DISCOVERY_RETRY_DELAY / 60);
 
+    s->optimistic=0;
+    s->stale_requests=0;
+    psc_forget(s);
     pcp_db_foreach_flow(s->ctx, flow_send_event_iter, &d);
+    race_revive(s);
+    s->racing=0;
 
     gettimeofday(&s->next_timeout, NULL);
     s->next_timeout.tv_sec+=PCP_SERVER_DISCOVERY_RETRY_DELAY;
@@ -1069,6 +1252,9 @@ static pcp_server_state_e handle_server_not_working(pcp_server_t *s)
         gettimeofday(&s->next_timeout, NULL);
         s->restart_flow_msg=f;
 
+        if (race_settle(s)) {
+            return pss_race_lost;
+        }
         return pss_server_restart;
     }
 
@@ -1158,6 +1344,9 @@ pcp_server_state_machine_t server_sm[]={{pss_any, pcpe_terminate,
         {pss_not_working, pcpe_any, handle_server_not_working},
         // -> reping
         {pss_allocated, pcpe_any, ignore_events},
+        {pss_retired, pcpe_any, ignore_events},
+        {pss_race_lost, pcpe_any, ignore_events},
+        {pss_daemon, pcpe_any, pcp_daemon_link_send},
         {pss_any, pcpe_any, log_unexepected_state_event}
 // -> last_state
         };
@@ -1263,10 +1452,22 @@ int pcp_pulse(pcp_ctx_t *ctx, struct timeval *next_timeout)
         next_timeout=&tmp_timeout;
     }
 
+    if (ctx->route_sock >= 0) {
+        psd_process_route_changes(ctx);
+    }
+
+    if (ctx->daemon) {
+        pcp_daemon_recv(ctx);
+    }
+
     memset(msg, 1, sizeof(*msg));
 
-    if (read_msg(ctx, msg) == PCP_ERR_SUCCESS) {
+    if (ctx->daemon_link) {
+        pcp_daemon_link_recv(ctx);
+    } else if (read_msg(ctx, msg) == PCP_ERR_SUCCESS) {
         struct in6_addr ip6;
+        uint16_t port;
+        uint32_t scope_id=0;
         pcp_server_t *s;
         struct hserver_iter_data param={NULL, pcpe_io_event};
 
@@ -1282,8 +1483,11 @@ int pcp_pulse(pcp_ctx_t *ctx, struct timeval *next_timeout)
             goto process_timeouts;
         }
 
-        pcp_fill_in6_addr(&ip6, NULL, (struct sockaddr*)&msg->rcvd_from_addr);
-        s=get_pcp_server_by_ip(ctx, &ip6);
+        pcp_fill_in6_addr(&ip6, &port, (struct sockaddr*)&msg->rcvd_from_addr);
+        if (msg->rcvd_from_addr.ss_family == AF_INET6) {
+            scope_id=((struct sockaddr_in6 *)&msg->rcvd_from_addr)->sin6_scope_id;
+        }
+        s=get_pcp_server_by_addr(ctx, &ip6, port, scope_id);
 
         if (s) {
           msg->pcp_server_indx=s->index;
@@ -1304,6 +1508,10 @@ process_timeouts:
         pcp_db_foreach_server(ctx, hserver_iter, &param);
     }
 
+    if (ctx->daemon) {
+        pcp_daemon_send(ctx, next_timeout);
+    }
+
     PCP_LOG_END(PCP_LOGLVL_DEBUG);
     return (next_timeout->tv_sec * 1000) + (next_timeout->tv_usec / 1000);
 }
@@ -1326,7 +1534,377 @@ void pcp_flow_updated(pcp_flow_t *f)
     if ((f->state != pfs_wait_for_server_init) && (f->state != pfs_idle)
             && (f->state != pfs_failed)) {
         f->state=pfs_send;
+        pcp_flow_account_state(f);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//                  Migration of flows from retired servers
+
+// retired server's flow waits here until another server takes it over
+static int flow_park_iter(pcp_flow_t *f, void *data)
+{
+    pcp_server_t *s=(pcp_server_t *)data;
+    pcp_fstate_e before, after;
+
+    if ((f->pcp_server_indx != s->index) || (f->state == pfs_failed)) {
+        return 0;
+    }
+
+    pcp_eval_flow_state(f, &before);
+    f->state=pfs_wait_for_server_init;
+    fhndl_clear_timeouts(f, NULL);
+    f->retry_count=0;
+    pcp_eval_flow_state(f, &after);
+    if (before != after) {
+        pcp_flow_notify(f, after);
+    }
+    sync_shared_flows(f);
+
+    return 0;
+}
+
+struct migrate_iter_data {
+    pcp_server_t *from;
+    pcp_server_t *to;
+    size_t left; //flows remaining on the retired server
+};
+
+static int flow_migrate_iter(pcp_flow_t *f, void *data)
+{
+    struct migrate_iter_data *d=(struct migrate_iter_data *)data;
+    pcp_server_t *to=d->to;
+    struct flow_key_data kd;
+    pcp_flow_t *fo;
+
+    if (f->pcp_server_indx != d->from->index) {
+        return 0;
     }
+
+    if ((!to) || (f->state == pfs_failed)
+            || (IN6_IS_ADDR_V4MAPPED(&f->kd.src_ip)
+                    != IN6_IS_ADDR_V4MAPPED((struct in6_addr *)to->pcp_ip))) {
+        d->left++;
+        return 0;
+    }
+
+    memcpy(&kd, &f->kd, sizeof(kd));
+    memcpy(&kd.src_ip, to->src_ip, sizeof(kd.src_ip));
+    memcpy(&kd.pcp_server_ip, to->pcp_ip, sizeof(kd.pcp_server_ip));
+    memcpy(&kd.nonce, &to->nonce, sizeof(kd.nonce));
+
+    if (pcp_get_flow(&kd, to)) {
+        // the same request already goes through this server (e.g. other flow
+        // of the group)
+        d->left++;
+        return 0;
+    }
+
+    pcp_db_rem_flow(f);
+    memcpy(&f->kd, &kd, sizeof(kd));
+    f->pcp_server_indx=to->index;
+    for (fo=f->next_follower; fo; fo=fo->next_follower) {
+        memcpy(&fo->kd, &kd, sizeof(kd));
+        fo->pcp_server_indx=to->index;
+    }
+    pcp_db_add_flow(f);
+    PCP_LOG_FLOW(f, "Flow migrated to another PCP server");
+
+    gettimeofday(&to->next_timeout, NULL);
+    if ((to->server_state == pss_wait_io)
+            || (to->server_state == pss_wait_io_calc_nearest_timeout)) {
+        handle_flow_event(f, fev_server_initialized, NULL);
+    }
+
+    return 0;
+}
+
+static int server_accepts_flows(pcp_server_t *s)
+{
+    switch (s->server_state) {
+        case pss_unitialized:
+        case pss_allocated:
+        case pss_set_not_working:
+        case pss_not_working:
+        case pss_retired:
+        case pss_race_lost:
+            return 0;
+        default:
+            return 1;
+    }
+}
+
+static int same_af_server_iter(pcp_server_t *s, void *data)
+{
+    pcp_flow_t *f=(pcp_flow_t *)data;
+
+    return (server_accepts_flows(s)) && (IN6_IS_ADDR_V4MAPPED(&f->kd.src_ip)
+            == IN6_IS_ADDR_V4MAPPED((struct in6_addr *)s->pcp_ip));
+}
+
+// flow left on retired server although there is a server to move it to is
+// already sent through each such server
+static int flow_fail_unmoved_iter(pcp_flow_t *f, void *data)
+{
+    pcp_server_t *s=(pcp_server_t *)data;
+
+    if ((f->pcp_server_indx == s->index) && (f->state != pfs_failed)
+            && (pcp_db_foreach_server(s->ctx, same_af_server_iter, f)
+                    == PCP_ERR_SUCCESS)) {
+        handle_flow_event(f, fev_failed, NULL);
+    }
+
+    return 0;
+}
+
+// move flows of retired servers to server to; retired servers without flows
+// are released
+static int migrate_retired_iter(pcp_server_t *s, void *data)
+{
+    struct migrate_iter_data d={s, (pcp_server_t *)data, 0};
+
+    if (s->server_state != pss_retired) {
+        return 0;
+    }
+
+    pcp_db_foreach_flow(s->ctx, flow_migrate_iter, &d);
+    if (d.left == 0) {
+        PCP_LOG(PCP_LOGLVL_DEBUG, "Released retired PCP server %s",
+                s->pcp_server_paddr);
+        pcp_db_rem_server(s);
+    }
+
+    return 0;
+}
+
+void pcp_server_adopt_flows(pcp_server_t *s)
+{
+    if ((!s) || (!server_accepts_flows(s))) {
+        return;
+    }
+
+    pcp_db_foreach_server(s->ctx, migrate_retired_iter, s);
+}
+
+static int adopt_flows_iter(pcp_server_t *s, UNUSED void *data)
+{
+    pcp_server_adopt_flows(s);
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//                  Racing of discovered gateways
+
+static int race_same_af(pcp_server_t *a, pcp_server_t *b)
+{
+    return IN6_IS_ADDR_V4MAPPED((struct in6_addr *)a->pcp_ip)
+            == IN6_IS_ADDR_V4MAPPED((struct in6_addr *)b->pcp_ip);
+}
+
+struct race_iter_data {
+    pcp_server_t *s;
+    uint32_t cnt;
+};
+
+// gateways of the same address family which already carry flows; those not
+// pinged yet only join the race
+static int race_active_iter(pcp_server_t *o, void *data)
+{
+    struct race_iter_data *d=(struct race_iter_data *)data;
+
+    if ((o != d->s) && (o->gateway) && (!o->racing)
+            && (o->server_state != pss_ping)
+            && (o->server_state != pss_wait_ping_resp)
+            && (server_accepts_flows(o)) && (race_same_af(o, d->s))) {
+        d->cnt++;
+    }
+    return 0;
+}
+
+static int race_racing_iter(pcp_server_t *o, void *data)
+{
+    struct race_iter_data *d=(struct race_iter_data *)data;
+
+    if ((o != d->s) && (o->racing) && (race_same_af(o, d->s))) {
+        d->cnt++;
+    }
+    return 0;
+}
+
+static void race_join(pcp_server_t *s, uint32_t order)
+{
+    gettimeofday(&s->race_start, NULL);
+    s->race_start.tv_usec+=(long)order * PCP_GATEWAY_RACE_DELAY * 1000;
+    timeval_align(&s->race_start);
+    s->racing=1;
+}
+
+// flows of server kept in reserve are failed, so they don't hold up results
+// of their groups
+static void race_cancel(pcp_server_t *s)
+{
+    struct flow_iterator_data d={s, fev_failed};
+
+    PCP_LOG(PCP_LOGLVL_INFO, "Gateway %s is kept in reserve. "
+            "Its flows are handled by another gateway.", s->pcp_server_paddr);
+
+    s->racing=0;
+    s->optimistic=0;
+    s->stale_requests=0;
+    pcp_db_foreach_flow(s->ctx, flow_send_event_iter, &d);
+    s->ping_flow_msg=NULL;
+    s->next_timeout.tv_sec=0;
+    s->next_timeout.tv_usec=0;
+    s->server_state=pss_race_lost;
+}
+
+static int race_cancel_iter(pcp_server_t *o, void *data)
+{
+    pcp_server_t *s=(pcp_server_t *)data;
+
+    if ((o != s) && (o->racing) && (race_same_af(o, s))) {
+        race_cancel(o);
+    }
+    return 0;
+}
+
+// First responding gateway wins the race and the others are cancelled.
+// Returns nonzero if gateway s responded too late and is kept in reserve.
+static int race_settle(pcp_server_t *s)
+{
+    struct race_iter_data d={s, 0};
+
+    if ((!s->ctx->gateway_racing) || (!s->gateway)) {
+        return 0;
+    }
+
+    pcp_db_foreach_server(s->ctx, race_active_iter, &d);
+    if (d.cnt) {
+        race_cancel(s);
+        return 1;
+    }
+
+    if (s->racing) {
+        PCP_LOG(PCP_LOGLVL_INFO, "Gateway %s responded first",
+                s->pcp_server_paddr);
+        s->racing=0;
+    }
+    pcp_db_foreach_server(s->ctx, race_cancel_iter, s);
+
+    return 0;
+}
+
+// cancelled flow of reserve gateway waits for its server again
+static int race_park_iter(pcp_flow_t *f, void *data)
+{
+    pcp_server_t *s=(pcp_server_t *)data;
+    pcp_fstate_e before, after;
+
+    if ((f->pcp_server_indx != s->index) || (f->state != pfs_failed)
+            || (f->lifetime == 0)) {
+        return 0;
+    }
+
+    pcp_eval_flow_state(f, &before);
+    f->state=pfs_wait_for_server_init;
+    fhndl_clear_timeouts(f, NULL);
+    f->retry_count=0;
+    pcp_eval_flow_state(f, &after);
+    if (before != after) {
+        pcp_flow_notify(f, after);
+    }
+    sync_shared_flows(f);
+
+    return 0;
+}
+
+static int race_revive_iter(pcp_server_t *o, void *data)
+{
+    struct race_iter_data *d=(struct race_iter_data *)data;
+
+    if ((o->server_state != pss_race_lost) || (!race_same_af(o, d->s))) {
+        return 0;
+    }
+
+    PCP_LOG(PCP_LOGLVL_INFO, "Gateway %s rejoins the race",
+            o->pcp_server_paddr);
+    pcp_db_foreach_flow(o->ctx, race_park_iter, o);
+    race_join(o, d->cnt++);
+    o->server_state=pss_ping;
+    gettimeofday(&o->next_timeout, NULL);
+
+    return 0;
+}
+
+// Gateway s doesn't carry flows any more. Start a new race of gateways kept
+// in reserve, unless there is another working one.
+static void race_revive(pcp_server_t *s)
+{
+    struct race_iter_data d={s, 0};
+
+    if ((!s->ctx->gateway_racing) || (!s->gateway) || (s->racing)) {
+        return;
+    }
+
+    pcp_db_foreach_server(s->ctx, race_active_iter, &d);
+    if (d.cnt) {
+        return;
+    }
+    pcp_db_foreach_server(s->ctx, race_racing_iter, &d);
+    pcp_db_foreach_server(s->ctx, race_revive_iter, &d);
+}
+
+void pcp_server_join_race(pcp_server_t *s)
+{
+    struct race_iter_data d={s, 0};
+
+    if ((!s) || (!s->gateway) || (s->racing)
+            || (s->server_state != pss_ping)) {
+        return;
+    }
+
+    pcp_db_foreach_server(s->ctx, race_active_iter, &d);
+    if (d.cnt) {
+        race_cancel(s);
+        return;
+    }
+    pcp_db_foreach_server(s->ctx, race_racing_iter, &d);
+    race_join(s, d.cnt);
+}
+
+void pcp_server_leave_race(pcp_server_t *s)
+{
+    if (!s) {
+        return;
+    }
+
+    s->racing=0;
+    if (s->server_state == pss_race_lost) {
+        pcp_db_foreach_flow(s->ctx, race_park_iter, s);
+        s->server_state=pss_ping;
+        gettimeofday(&s->next_timeout, NULL);
+    }
+}
+
+void pcp_server_retire(pcp_server_t *s)
+{
+    if ((!s) || (s->server_state == pss_unitialized)
+            || (s->server_state == pss_retired)) {
+        return;
+    }
+
+    PCP_LOG(PCP_LOGLVL_INFO, "PCP server %s retired. "
+            "Its flows will be moved to another PCP server.",
+            s->pcp_server_paddr);
+
+    pcp_db_retire_server(s);
+    race_revive(s);
+    s->racing=0;
+    pcp_db_foreach_flow(s->ctx, flow_park_iter, s);
+    pcp_db_foreach_server(s->ctx, adopt_flows_iter, NULL);
+    pcp_db_foreach_flow(s->ctx, flow_fail_unmoved_iter, s);
+    // release retired server, if it has no flows left
+    migrate_retired_iter(s, NULL);
 }
 
 void pcp_set_flow_change_cb(pcp_ctx_t *ctx, pcp_flow_change_notify cb_fun,
@@ -1338,11 +1916,17 @@ void pcp_set_flow_change_cb(pcp_ctx_t *ctx, pcp_flow_change_notify cb_fun,
     }
 }
 
-static void flow_change_notify(pcp_flow_t *flow, pcp_fstate_e state)
+void pcp_flow_notify(pcp_flow_t *flow, pcp_fstate_e state)
 {
     struct sockaddr_storage src_addr, ext_addr;
     pcp_ctx_t *ctx=flow->ctx;
 
+    // flows of local daemon's clients are reported only to their owners
+    if (flow->remote) {
+        pcp_daemon_flow_changed(flow, state);
+        return;
+    }
+
     PCP_LOG_DEBUG( "Flow's %d state changed to: %s",
             flow->key_bucket, dbg_get_fstate_name(state));
 
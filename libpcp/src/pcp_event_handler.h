@@ -84,15 +84,35 @@ typedef enum {
     pss_server_reping,
     pss_set_not_working,
     pss_not_working,
+    pss_retired,
+    pss_race_lost,
+    pss_daemon, //pseudo server of client of local daemon
     PSS_COUNT
 } pcp_server_state_e;
 
 void pcp_flow_updated(pcp_flow_t *f);
 
+// report state of flow to its owner
+void pcp_flow_notify(pcp_flow_t *flow, pcp_fstate_e state);
+
 typedef struct pcp_server pcp_server_t;
 
 pcp_errno run_server_state_machine(pcp_server_t *s, pcp_event_e event);
 
 void pcp_fd_change_notify(pcp_server_t *s, int added);
 
+// Stop using server s and move its flows to another server of the same
+// address family. Without such server flows wait until one is adopting them.
+void pcp_server_retire(pcp_server_t *s);
+
+// Take over flows waiting on retired servers.
+void pcp_server_adopt_flows(pcp_server_t *s);
+
+// Enter gateway s into the race of gateways of its address family, or keep it
+// in reserve if another gateway of the family already carries flows.
+void pcp_server_join_race(pcp_server_t *s);
+
+// Use gateway s regardless of the race.
+void pcp_server_leave_race(pcp_server_t *s);
+
 #endif /* PCP_EVENT_HANDLER_H_ */
@@ -49,7 +49,7 @@
 #include "pcp_msg_structs.h"
 #include "pcp_logger.h"
 
-static void *add_filter_option(pcp_flow_t *f, void *cur)
+static void *add_filter_option(struct pcp_flow_ext *f, void *cur)
 {
     pcp_filter_option_t *filter_op=(pcp_filter_option_t *)cur;
 
@@ -78,7 +78,7 @@ static void *add_prefer_failure_option(void *cur)
     return cur;
 }
 
-static void *add_third_party_option(pcp_flow_t *f, void *cur)
+static void *add_third_party_option(struct pcp_flow_ext *f, void *cur)
 {
     pcp_3rd_party_option_t *tp_op=(pcp_3rd_party_option_t *)cur;
 
@@ -92,7 +92,7 @@ static void *add_third_party_option(pcp_flow_t *f, void *cur)
 }
 
 #ifdef PCP_EXPERIMENTAL
-static void *add_userid_option(pcp_flow_t *f, void *cur)
+static void *add_userid_option(struct pcp_flow_ext *f, void *cur)
 {
     pcp_userid_option_t *userid_op = (pcp_userid_option_t *) cur;
 
@@ -104,7 +104,7 @@ static void *add_userid_option(pcp_flow_t *f, void *cur)
     return cur;
 }
 
-static void *add_location_option(pcp_flow_t *f, void *cur)
+static void *add_location_option(struct pcp_flow_ext *f, void *cur)
 {
     pcp_location_option_t *location_op = (pcp_location_option_t *) cur;
 
@@ -116,7 +116,7 @@ static void *add_location_option(pcp_flow_t *f, void *cur)
     return cur;
 }
 
-static void *add_deviceid_option(pcp_flow_t *f, void *cur)
+static void *add_deviceid_option(struct pcp_flow_ext *f, void *cur)
 {
     pcp_deviceid_option_t *deviceid_op = (pcp_deviceid_option_t *) cur;
 
@@ -132,7 +132,7 @@ static void *add_deviceid_option(pcp_flow_t *f, void *cur)
 #endif
 
 #ifdef PCP_FLOW_PRIORITY
-static void *add_flowp_option(pcp_flow_t *f, void *cur)
+static void *add_flowp_option(struct pcp_flow_ext *f, void *cur)
 {
     pcp_flow_priority_option_t *flowp_op = (pcp_flow_priority_option_t *)cur;
 
@@ -185,32 +185,34 @@ static void *add_md_options(pcp_flow_t *f, void *cur)
 
 static pcp_errno build_pcp_options(pcp_flow_t *flow, void *cur)
 {
+    struct pcp_flow_ext *ext=flow->ext;
+
 #ifdef PCP_FLOW_PRIORITY
-    if (flow->flowp_option_present) {
-        cur=add_flowp_option(flow, cur);
+    if ((ext) && (ext->flowp_option_present)) {
+        cur=add_flowp_option(ext, cur);
     }
 #endif
-    if (flow->filter_option_present) {
-        cur=add_filter_option(flow, cur);
+    if ((ext) && (ext->filter_option_present)) {
+        cur=add_filter_option(ext, cur);
     }
 
     if (flow->pfailure_option_present) {
         cur=add_prefer_failure_option(cur);
     }
-    if (flow->third_party_option_present) {
-        cur=add_third_party_option(flow, cur);
+    if ((ext) && (ext->third_party_option_present)) {
+        cur=add_third_party_option(ext, cur);
     }
 #ifdef PCP_EXPERIMENTAL
-    if (flow->f_deviceid.deviceid[0] != '\0') {
-        cur=add_deviceid_option(flow, cur);
+    if ((ext) && (ext->f_deviceid.deviceid[0] != '\0')) {
+        cur=add_deviceid_option(ext, cur);
     }
 
-    if (flow->f_userid.userid[0] != '\0') {
-        cur=add_userid_option(flow, cur);
+    if ((ext) && (ext->f_userid.userid[0] != '\0')) {
+        cur=add_userid_option(ext, cur);
     }
 
-    if (flow->f_location.location[0] != '\0') {
-        cur=add_location_option(flow, cur);
+    if ((ext) && (ext->f_location.location[0] != '\0')) {
+        cur=add_location_option(ext, cur);
     }
 
     if (flow->md_val_count>0) {
@@ -0,0 +1,242 @@
+/*
+ Copyright (c) 2014 by Cisco Systems, Inc.
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice, this
+ list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#else
+#include "default_config.h"
+#endif
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#ifndef WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#include "pcp.h"
+#include "pcp_utils.h"
+#include "pcp_logger.h"
+#include "pcp_server_cache.h"
+
+#ifndef WIN32
+
+struct pcp_server_cache {
+    struct psc_header *hdr; //mapped file
+    struct psc_record *recs;
+    size_t map_len;
+    uint32_t ttl;
+};
+
+#define PSC_FILE_SIZE (sizeof(struct psc_header) \
+        + PCP_SERVER_CACHE_SIZE * sizeof(struct psc_record))
+
+pcp_errno psc_open(pcp_ctx_t *ctx, const char *path, uint32_t ttl)
+{
+    struct pcp_server_cache *c;
+    struct stat st;
+    void *map;
+    int fd;
+
+    psc_close(ctx);
+
+    fd=open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        char errmsg[128];
+        pcp_strerror(errno, errmsg, sizeof(errmsg));
+        PCP_LOG(PCP_LOGLVL_WARN, "Can't open server cache %s (%s)", path,
+                errmsg);
+        return PCP_ERR_UNKNOWN;
+    }
+
+    if ((fstat(fd, &st)) || ((st.st_size != (off_t)PSC_FILE_SIZE)
+            && (ftruncate(fd, PSC_FILE_SIZE)))) {
+        close(fd);
+        return PCP_ERR_UNKNOWN;
+    }
+
+    map=mmap(NULL, PSC_FILE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return PCP_ERR_UNKNOWN;
+    }
+
+    c=(struct pcp_server_cache *)calloc(1, sizeof(*c));
+    if (!c) {
+        munmap(map, PSC_FILE_SIZE);
+        return PCP_ERR_NO_MEM;
+    }
+    c->hdr=(struct psc_header *)map;
+    c->recs=(struct psc_record *)(c->hdr + 1);
+    c->map_len=PSC_FILE_SIZE;
+    c->ttl=ttl;
+
+    // new file or written by other format
+    if ((c->hdr->magic != PSC_MAGIC) || (c->hdr->format != PSC_FORMAT)
+            || (c->hdr->rec_size != sizeof(struct psc_record))
+            || (c->hdr->count != PCP_SERVER_CACHE_SIZE)) {
+        memset(map, 0, PSC_FILE_SIZE);
+        c->hdr->format=PSC_FORMAT;
+        c->hdr->rec_size=sizeof(struct psc_record);
+        c->hdr->count=PCP_SERVER_CACHE_SIZE;
+        c->hdr->magic=PSC_MAGIC;
+    }
+
+    ctx->server_cache=c;
+    return PCP_ERR_SUCCESS;
+}
+
+void psc_close(pcp_ctx_t *ctx)
+{
+    struct pcp_server_cache *c=ctx->server_cache;
+
+    if (c) {
+        munmap(c->hdr, c->map_len);
+        free(c);
+        ctx->server_cache=NULL;
+    }
+}
+
+static int psc_match(struct psc_record *r, pcp_server_t *s)
+{
+    return (r->port == s->pcp_port) && (r->scope_id == s->pcp_scope_id)
+            && (memcmp(r->ip, s->pcp_ip, sizeof(r->ip)) == 0);
+}
+
+static struct psc_record *psc_find(struct pcp_server_cache *c,
+        pcp_server_t *s)
+{
+    uint32_t i;
+
+    for (i=0; i < PCP_SERVER_CACHE_SIZE; ++i) {
+        if ((c->recs[i].valid) && (psc_match(c->recs + i, s))) {
+            return c->recs + i;
+        }
+    }
+    return NULL;
+}
+
+int psc_warm_start(pcp_server_t *s)
+{
+    struct pcp_server_cache *c=s->ctx->server_cache;
+    struct psc_record *r;
+
+    if ((!c) || (!(r=psc_find(c, s))) || (r->expires <= (int64_t)time(NULL))) {
+        return 0;
+    }
+
+    // negotiated version may be lower than the one application asked for
+    if (r->version < s->pcp_version) {
+        s->pcp_version=r->version;
+    }
+    s->version_known=1;
+    s->epoch=r->epoch;
+    s->cepoch=(time_t)r->cepoch;
+    s->rtt_us=r->rtt_us;
+    s->warm=1;
+
+    PCP_LOG(PCP_LOGLVL_INFO, "PCP server %s (version %d) taken from cache",
+            s->pcp_server_paddr, s->pcp_version);
+    return 1;
+}
+
+void psc_store(pcp_server_t *s)
+{
+    struct pcp_server_cache *c=s->ctx->server_cache;
+    struct psc_record *r, *oldest;
+    uint32_t i;
+
+    s->warm=0;
+    if (!c) {
+        return;
+    }
+
+    r=psc_find(c, s);
+    for (i=0, oldest=c->recs; (!r) && (i < PCP_SERVER_CACHE_SIZE); ++i) {
+        if (!c->recs[i].valid) {
+            r=c->recs + i;
+        } else if (c->recs[i].expires < oldest->expires) {
+            oldest=c->recs + i;
+        }
+    }
+    if (!r) {
+        r=oldest;
+    }
+
+    r->valid=0;
+    memcpy(r->ip, s->pcp_ip, sizeof(r->ip));
+    r->scope_id=s->pcp_scope_id;
+    r->port=s->pcp_port;
+    r->version=s->pcp_version;
+    r->epoch=s->epoch;
+    r->cepoch=s->cepoch;
+    r->rtt_us=s->rtt_us;
+    r->expires=(int64_t)time(NULL) + c->ttl;
+    r->valid=1;
+}
+
+void psc_forget(pcp_server_t *s)
+{
+    struct pcp_server_cache *c=s->ctx->server_cache;
+    struct psc_record *r;
+
+    s->warm=0;
+    if ((c) && ((r=psc_find(c, s)))) {
+        r->valid=0;
+    }
+}
+
+#else //WIN32
+
+pcp_errno psc_open(UNUSED pcp_ctx_t *ctx, UNUSED const char *path,
+        UNUSED uint32_t ttl)
+{
+    return PCP_ERR_UNKNOWN;
+}
+
+void psc_close(UNUSED pcp_ctx_t *ctx)
+{
+}
+
+int psc_warm_start(UNUSED pcp_server_t *s)
+{
+    return 0;
+}
+
+void psc_store(pcp_server_t *s)
+{
+    s->warm=0;
+}
+
+void psc_forget(pcp_server_t *s)
+{
+    s->warm=0;
+}
+
+#endif //WIN32
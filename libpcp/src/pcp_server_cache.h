@@ -0,0 +1,73 @@
+/*
+ Copyright (c) 2014 by Cisco Systems, Inc.
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice, this
+ list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PCP_SERVER_CACHE_H_
+#define PCP_SERVER_CACHE_H_
+
+#include "pcp_client_db.h"
+
+// Capabilities of PCP servers kept in a memory mapped file, so a restarted
+// process can skip ping and version negotiation. The file may be shared by
+// several processes; a record torn by concurrent update only costs a cold
+// start of that server.
+
+#define PSC_MAGIC 0x43504350 // "PCPC"
+#define PSC_FORMAT 1
+
+struct psc_header {
+    uint32_t magic;
+    uint32_t format;
+    uint32_t rec_size;
+    uint32_t count;
+};
+
+struct psc_record {
+    uint32_t ip[4];
+    uint32_t scope_id;
+    uint16_t port;
+    uint8_t version;
+    uint8_t valid;
+    uint32_t epoch;
+    uint32_t rtt_us; //ping round trip in us, 0 - not measured
+    int64_t cepoch; //client time of epoch
+    int64_t expires;
+};
+
+// map cache file (created if missing) to the context, replacing previous one
+pcp_errno psc_open(pcp_ctx_t *ctx, const char *path, uint32_t ttl);
+
+void psc_close(pcp_ctx_t *ctx);
+
+// Apply cached capabilities to server s. Returns nonzero if the record is
+// valid and server can skip ping.
+int psc_warm_start(pcp_server_t *s);
+
+// server confirmed by response, (re)write its record
+void psc_store(pcp_server_t *s);
+
+// server stopped responding
+void psc_forget(pcp_server_t *s);
+
+#endif /* PCP_SERVER_CACHE_H_ */
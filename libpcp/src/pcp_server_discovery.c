@@ -52,6 +52,7 @@
 #include "pcp_logger.h"
 #include "findsaddr.h"
 #include "pcp_socket.h"
+#include "pcp_server_cache.h"
 
 static pcp_errno psd_fill_pcp_server_src(pcp_server_t *s)
 {
@@ -79,7 +80,8 @@ static pcp_errno psd_fill_pcp_server_src(pcp_server_t *s)
                 (void *)&((struct sockaddr_in *)&s->pcp_server_saddr)->sin_addr,
                 s->pcp_server_paddr, sizeof(s->pcp_server_paddr));
 
-        err=findsaddr((struct sockaddr_in *)&s->pcp_server_saddr, &src_ip);
+        err=saddr_cache_find(s->ctx->saddr_cache,
+                (struct sockaddr *)&s->pcp_server_saddr, &src_ip);
         if (err) {
             PCP_LOG(PCP_LOGLVL_WARN,
                     "Error (%s) occurred while registering a new "
@@ -112,7 +114,8 @@ static pcp_errno psd_fill_pcp_server_src(pcp_server_t *s)
             (void *)&((struct sockaddr_in6*) &s->pcp_server_saddr)->sin6_addr,
             s->pcp_server_paddr, sizeof(s->pcp_server_paddr));
 
-    err=findsaddr6((struct sockaddr_in6*)&s->pcp_server_saddr, &src_ip);
+    err=saddr_cache_find(s->ctx->saddr_cache,
+            (struct sockaddr *)&s->pcp_server_saddr, &src_ip);
     if (err) {
         PCP_LOG(PCP_LOGLVL_WARN,
                 "Error (%s) occurred while registering a new "
@@ -126,7 +129,8 @@ static pcp_errno psd_fill_pcp_server_src(pcp_server_t *s)
     s->src_ip[2]=S6_ADDR32(&src_ip)[2];
     s->src_ip[3]=S6_ADDR32(&src_ip)[3];
 #endif //PCP_USE_IPV6_SOCKET
-    s->server_state=pss_ping;
+    // server known from previous run goes straight to sending requests
+    s->server_state=psc_warm_start(s) ? pss_send_all_msgs : pss_ping;
     s->next_timeout.tv_sec=0;
     s->next_timeout.tv_usec=0;
 
@@ -134,6 +138,45 @@ static pcp_errno psd_fill_pcp_server_src(pcp_server_t *s)
     return PCP_ERR_SUCCESS;
 }
 
+static void psd_add_gw(pcp_ctx_t *ctx, struct sockaddr_in6 *gw)
+{
+    int pcps_indx;
+    pcp_server_t *s;
+
+    if ((IN6_IS_ADDR_V4MAPPED(&gw->sin6_addr)) && (S6_ADDR32(&gw->sin6_addr)[3] == INADDR_ANY))
+        return;
+
+    if (IN6_IS_ADDR_UNSPECIFIED(&gw->sin6_addr))
+        return;
+
+    if (get_pcp_server_by_addr(ctx, &gw->sin6_addr,
+            ntohs(PCP_SERVER_PORT), gw->sin6_scope_id))
+        return;
+
+    pcps_indx=pcp_new_server(ctx, &gw->sin6_addr, ntohs(PCP_SERVER_PORT), gw->sin6_scope_id);
+    if (pcps_indx < 0)
+        return;
+
+    s=get_pcp_server(ctx, pcps_indx);
+    if (!s)
+        return;
+
+    s->gateway=1;
+    if (psd_fill_pcp_server_src(s)) {
+        PCP_LOG(PCP_LOGLVL_ERR,
+                "Failed to initialize gateway %s as a PCP server.",
+                s->pcp_server_paddr);
+    } else {
+        PCP_LOG(PCP_LOGLVL_INFO, "Found gateway %s. "
+        "Added as possible PCP server.",
+                s->pcp_server_paddr);
+        if (ctx->gateway_racing) {
+            pcp_server_join_race(s);
+        }
+        pcp_server_adopt_flows(s);
+    }
+}
+
 void psd_add_gws(pcp_ctx_t *ctx)
 {
     struct sockaddr_in6 *gws=NULL, *gw;
@@ -142,35 +185,94 @@ void psd_add_gws(pcp_ctx_t *ctx)
     gw=gws;
 
     for (; rcount > 0; rcount--, gw++) {
-        int pcps_indx;
+        psd_add_gw(ctx, gw);
+    }
+    free(gws);
+}
 
-        if ((IN6_IS_ADDR_V4MAPPED(&gw->sin6_addr)) && (S6_ADDR32(&gw->sin6_addr)[3] == INADDR_ANY))
-            continue;
+struct sync_gws_data {
+    struct sockaddr_in6 *gws;
+    int count;
+};
 
-        if (IN6_IS_ADDR_UNSPECIFIED(&gw->sin6_addr))
-            continue;
+static int retire_removed_gw_iter(pcp_server_t *s, void *data)
+{
+    struct sync_gws_data *d=(struct sync_gws_data *)data;
+    int i;
 
-        if (get_pcp_server_by_ip(ctx, &gw->sin6_addr))
-            continue;
+    if ((!s->gateway) || (s->server_state == pss_retired)) {
+        return 0;
+    }
 
-        pcps_indx=pcp_new_server(ctx, &gw->sin6_addr, ntohs(PCP_SERVER_PORT), gw->sin6_scope_id);
-        if (pcps_indx >= 0) {
-            pcp_server_t *s=get_pcp_server(ctx, pcps_indx);
-            if (!s)
-                continue;
-
-            if (psd_fill_pcp_server_src(s)) {
-                PCP_LOG(PCP_LOGLVL_ERR,
-                        "Failed to initialize gateway %s as a PCP server.",
-                        s?s->pcp_server_paddr:"NULL pointer!!!");
-            } else {
-                PCP_LOG(PCP_LOGLVL_INFO, "Found gateway %s. "
-                "Added as possible PCP server.",
-                        s?s->pcp_server_paddr:"NULL pointer!!!");
-            }
+    for (i=0; i < d->count; ++i) {
+        if ((IN6_ARE_ADDR_EQUAL(&d->gws[i].sin6_addr,
+                (struct in6_addr *)s->pcp_ip))
+                && ((!IN6_IS_ADDR_LINKLOCAL(&d->gws[i].sin6_addr))
+                        || (d->gws[i].sin6_scope_id == s->pcp_scope_id))) {
+            return 0;
+        }
+    }
+
+    pcp_server_retire(s);
+    return 0;
+}
+
+void psd_sync_gws(pcp_ctx_t *ctx)
+{
+    struct sync_gws_data d={NULL, 0};
+    int i;
+
+    d.count=getgateways(&d.gws);
+    if (d.count < 0) {
+        return;
+    }
+
+    // add new gateways first, so flows of removed ones have where to move
+    for (i=0; i < d.count; ++i) {
+        psd_add_gw(ctx, d.gws + i);
+    }
+    pcp_db_foreach_server(ctx, retire_removed_gw_iter, &d);
+    free(d.gws);
+}
+
+struct route_changes {
+    pcp_ctx_t *ctx;
+    int removed;
+};
+
+static void psd_route_changed(void *arg, struct sockaddr_in6 *gw, int added)
+{
+    struct route_changes *rc=(struct route_changes *)arg;
+
+    // any change may move a destination to other interface or source
+    saddr_cache_flush(rc->ctx->saddr_cache);
+    if (!gw) {
+        return;
+    }
+    if (added) {
+        psd_add_gw(rc->ctx, gw);
+    } else {
+        pcp_server_t *s=get_pcp_server_by_addr(rc->ctx, &gw->sin6_addr,
+                ntohs(PCP_SERVER_PORT), gw->sin6_scope_id);
+
+        // other route through the same gateway may remain
+        if ((s) && (s->gateway) && (s->server_state != pss_retired)) {
+            rc->removed=1;
         }
     }
-    free(gws);
+}
+
+void psd_process_route_changes(pcp_ctx_t *ctx)
+{
+    struct route_changes rc={ctx, 0};
+
+    if (route_monitor_read(ctx->route_sock, psd_route_changed, &rc) < 0) {
+        saddr_cache_flush(ctx->saddr_cache);
+        rc.removed=1;
+    }
+    if (rc.removed) {
+        psd_sync_gws(ctx);
+    }
 }
 
 pcp_errno psd_add_pcp_server(pcp_ctx_t *ctx, struct sockaddr *sa,
@@ -199,7 +301,7 @@ pcp_errno psd_add_pcp_server(pcp_ctx_t *ctx, struct sockaddr *sa,
         pcp_port=ntohs(PCP_SERVER_PORT);
     }
 
-    pcps=get_pcp_server_by_ip(ctx, (struct in6_addr *)&pcp_ip);
+    pcps=get_pcp_server_by_addr(ctx, &pcp_ip, pcp_port, scope_id);
     if (!pcps) {
         int pcps_indx=pcp_new_server(ctx, &pcp_ip, pcp_port, scope_id);
 
@@ -212,15 +314,14 @@ pcp_errno psd_add_pcp_server(pcp_ctx_t *ctx, struct sockaddr *sa,
             PCP_LOG_END(PCP_LOGLVL_DEBUG);
             return PCP_ERR_UNKNOWN;
         }
-    } else {
-        pcps->pcp_port=pcp_port;
     }
 
     pcps->pcp_version=version;
+    pcps->version_known=1;
     pcps->server_state=pss_allocated;
 
     if (psd_fill_pcp_server_src(pcps)) {
-        pcps->server_state=pss_unitialized;
+        pcp_db_rem_server(pcps);
         PCP_LOG(PCP_LOGLVL_INFO, "Failed to add PCP server %s",
                 pcps->pcp_server_paddr);
 
@@ -229,6 +330,7 @@ pcp_errno psd_add_pcp_server(pcp_ctx_t *ctx, struct sockaddr *sa,
     }
 
     PCP_LOG(PCP_LOGLVL_INFO, "Added PCP server %s", pcps->pcp_server_paddr);
+    pcp_server_adopt_flows(pcps);
 
     PCP_LOG_END(PCP_LOGLVL_DEBUG);
     return (pcp_errno)pcps->index;
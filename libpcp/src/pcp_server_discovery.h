@@ -29,6 +29,12 @@
 #include "pcp_client_db.h"
 
 void psd_add_gws(pcp_ctx_t *ctx);
+
+// add gateways from routing table and retire servers of removed ones
+void psd_sync_gws(pcp_ctx_t *ctx);
+
+// apply pending notifications of routing table changes
+void psd_process_route_changes(pcp_ctx_t *ctx);
 pcp_errno psd_add_pcp_server(pcp_ctx_t *ctx, struct sockaddr *sa,
         uint8_t version);
 
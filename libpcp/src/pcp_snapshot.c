@@ -0,0 +1,754 @@
+/*
+ Copyright (c) 2014 by Cisco Systems, Inc.
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice, this
+ list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#else
+#include "default_config.h"
+#endif
+
+#ifdef _MSC_VER
+#define _CRT_SECURE_NO_WARNINGS 1
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+#ifdef WIN32
+#include <winsock2.h>
+#include "pcp_win_defines.h"
+#include "pcp_gettimeofday.h"
+#else
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#endif
+#include "pcp.h"
+#include "pcp_client_db.h"
+#include "pcp_logger.h"
+#include "pcp_event_handler.h"
+#include "pcp_utils.h"
+#include "pcp_socket.h"
+#include "pcp_server_discovery.h"
+
+// Snapshot file: header, server records, flow records and index of flows
+// managed by pcp_reconcile. Records are in host byte order, the file is meant
+// to be read back on the same host.
+
+#define PCS_MAGIC 0x53504350 // "PCPS"
+#define PCS_FORMAT 1
+#define PCS_NONE (~0u)
+
+struct pcs_header {
+    uint32_t magic;
+    uint32_t format;
+    uint32_t server_rec_size;
+    uint32_t flow_rec_size;
+    uint32_t reconcile_rec_size;
+    uint32_t server_cnt;
+    uint32_t flow_cnt;
+    uint32_t reconcile_cnt;
+};
+
+struct pcs_server {
+    uint32_t ip[4];
+    uint32_t src_ip[4];
+    uint32_t scope_id;
+    uint32_t epoch;
+    struct pcp_nonce nonce;
+    int64_t cepoch;
+    uint16_t port;
+    uint8_t version;
+    uint8_t gateway;
+    uint8_t confirmed; //server responded, ping can be skipped
+    uint8_t reserved[3];
+};
+
+typedef enum {
+    pcsf_first=1 << 0, //first flow of handle, following ones are its children
+    pcsf_shared=1 << 1, //on-wire mapping is shared with other flows
+    pcsf_pfailure=1 << 2,
+    pcsf_third_party=1 << 3,
+    pcsf_filter=1 << 4,
+    pcsf_flowp=1 << 5,
+} pcs_flow_flags_e;
+
+struct pcs_flow {
+    uint32_t server; //index of server record
+    uint32_t src_ip[4];
+    uint32_t dst_ip[4];
+    uint32_t ext_ip[4];
+    uint32_t third_party_ip[4];
+    uint32_t filter_ip[4];
+    struct pcp_nonce nonce;
+    uint32_t lifetime;
+    uint32_t recv_result;
+    int64_t recv_lifetime;
+    int64_t timeout_sec;
+    int32_t timeout_usec;
+    uint16_t src_port;
+    uint16_t dst_port;
+    uint16_t ext_port;
+    uint16_t filter_port;
+    uint8_t operation;
+    uint8_t protocol;
+    uint8_t state;
+    uint8_t flags;
+    uint8_t opt_flags;
+    uint8_t filter_prefix;
+    uint8_t flowp_dscp_up;
+    uint8_t flowp_dscp_down;
+};
+
+struct pcs_reconcile {
+    struct reconcile_key key;
+    uint32_t lifetime;
+    uint32_t flow; //index of first flow record of the handle
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//                              Save
+
+struct pcs_handle {
+    pcp_flow_t *head;
+    uint32_t rec;
+};
+
+struct pcs_save_data {
+    FILE *fp;
+    uint32_t *server_rec; //server index => record index
+    size_t server_len;
+    struct pcs_handle *handles;
+    size_t handles_len;
+    struct pcs_header hdr;
+    pcp_errno err;
+};
+
+static int server_confirmed(pcp_server_t *s)
+{
+    switch (s->server_state) {
+        case pss_send_all_msgs:
+            return !s->warm;
+        case pss_wait_io:
+        case pss_wait_io_calc_nearest_timeout:
+        case pss_server_restart:
+        case pss_server_reping:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static int save_server_iter(pcp_server_t *s, void *data)
+{
+    struct pcs_save_data *d=(struct pcs_save_data *)data;
+    struct pcs_server r;
+
+    switch (s->server_state) {
+        case pss_unitialized:
+        case pss_set_not_working:
+        case pss_not_working:
+        case pss_retired:
+        case pss_race_lost:
+            return 0;
+        default:
+            break;
+    }
+
+    memset(&r, 0, sizeof(r));
+    memcpy(r.ip, s->pcp_ip, sizeof(r.ip));
+    memcpy(r.src_ip, s->src_ip, sizeof(r.src_ip));
+    r.scope_id=s->pcp_scope_id;
+    r.epoch=s->epoch;
+    r.nonce=s->nonce;
+    r.cepoch=(int64_t)s->cepoch;
+    r.port=s->pcp_port;
+    r.version=s->pcp_version;
+    r.gateway=s->gateway;
+    r.confirmed=(uint8_t)server_confirmed(s);
+
+    if (fwrite(&r, sizeof(r), 1, d->fp) != 1) {
+        d->err=PCP_ERR_UNKNOWN;
+        return 1;
+    }
+    d->server_rec[s->index]=d->hdr.server_cnt++;
+
+    return 0;
+}
+
+static void save_flow_record(struct pcs_save_data *d, pcp_flow_t *f,
+        uint32_t server, uint8_t flags)
+{
+    pcp_flow_t *w=PCP_WIRE_FLOW(f);
+    struct pcs_flow r;
+
+    memset(&r, 0, sizeof(r));
+    r.server=server;
+    memcpy(r.src_ip, &f->kd.src_ip, sizeof(r.src_ip));
+    memcpy(r.dst_ip, &f->kd.map_peer.dst_ip, sizeof(r.dst_ip));
+    r.nonce=f->kd.nonce;
+    r.src_port=f->kd.map_peer.src_port;
+    r.dst_port=f->kd.map_peer.dst_port;
+    r.operation=f->kd.operation;
+    r.protocol=f->kd.map_peer.protocol;
+    // on-wire flow of shared mapping keeps its own request aside
+    r.lifetime=f->share_cnt ? f->req_lifetime : f->lifetime;
+
+    // mapping state and options are kept by on-wire flow
+    memcpy(r.ext_ip, &w->map_peer.ext_ip, sizeof(r.ext_ip));
+    r.ext_port=w->map_peer.ext_port;
+    r.state=(uint8_t)w->state;
+    r.recv_result=w->recv_result;
+    r.recv_lifetime=(int64_t)w->recv_lifetime;
+    r.timeout_sec=(int64_t)w->timeout.tv_sec;
+    r.timeout_usec=(int32_t)w->timeout.tv_usec;
+    r.opt_flags=(uint8_t)w->opt_flags;
+    r.flags=flags;
+    if ((f->shared) || (f->next_follower)) {
+        r.flags|=pcsf_shared;
+    }
+    if (w->pfailure_option_present) {
+        r.flags|=pcsf_pfailure;
+    }
+    if (w->ext) {
+        if (w->ext->third_party_option_present) {
+            r.flags|=pcsf_third_party;
+            memcpy(r.third_party_ip, &w->ext->third_party_ip,
+                    sizeof(r.third_party_ip));
+        }
+        if (w->ext->filter_option_present) {
+            r.flags|=pcsf_filter;
+            memcpy(r.filter_ip, &w->ext->filter_ip, sizeof(r.filter_ip));
+            r.filter_port=w->ext->filter_port;
+            r.filter_prefix=w->ext->filter_prefix;
+        }
+#ifdef PCP_FLOW_PRIORITY
+        if (w->ext->flowp_option_present) {
+            r.flags|=pcsf_flowp;
+            r.flowp_dscp_up=w->ext->flowp_dscp_up;
+            r.flowp_dscp_down=w->ext->flowp_dscp_down;
+        }
+#endif
+    }
+
+    if (fwrite(&r, sizeof(r), 1, d->fp) != 1) {
+        d->err=PCP_ERR_UNKNOWN;
+        return;
+    }
+    d->hdr.flow_cnt++;
+}
+
+// write flows of one handle (next_child chain starting at head)
+static void save_handle(struct pcs_save_data *d, pcp_flow_t *head)
+{
+    pcp_flow_t *f;
+    uint8_t flags=pcsf_first;
+
+    if (head->lifetime == 0) {
+        return; //being closed
+    }
+
+    for (f=head; (f) && (d->err == PCP_ERR_SUCCESS); f=f->next_child) {
+        if (((f->kd.operation != PCP_OPCODE_MAP)
+                && (f->kd.operation != PCP_OPCODE_PEER))
+                || (f->pcp_server_indx >= d->server_len)
+                || (d->server_rec[f->pcp_server_indx] == PCS_NONE)) {
+            continue;
+        }
+
+        if (flags & pcsf_first) {
+            struct pcs_handle *h=(struct pcs_handle *)realloc(d->handles,
+                    (d->hdr.reconcile_cnt + 1) * sizeof(*h));
+            if (!h) {
+                d->err=PCP_ERR_NO_MEM;
+                return;
+            }
+            d->handles=h;
+            h[d->hdr.reconcile_cnt].head=head;
+            h[d->hdr.reconcile_cnt].rec=d->hdr.flow_cnt;
+            d->handles_len=++d->hdr.reconcile_cnt;
+        }
+        save_flow_record(d, f, d->server_rec[f->pcp_server_indx], flags);
+        flags=0;
+    }
+}
+
+static int save_flow_iter(pcp_flow_t *f, void *data)
+{
+    struct pcs_save_data *d=(struct pcs_save_data *)data;
+    pcp_flow_t *fl;
+
+    // handles are walked from their first flow; followers are not in DB
+    if (f->group == f) {
+        save_handle(d, f);
+    }
+    for (fl=f->next_follower; fl; fl=fl->next_follower) {
+        if (fl->group == fl) {
+            save_handle(d, fl);
+        }
+    }
+
+    return d->err != PCP_ERR_SUCCESS;
+}
+
+static int handle_cmp(const void *a, const void *b)
+{
+    const pcp_flow_t *x=((const struct pcs_handle *)a)->head;
+    const pcp_flow_t *y=((const struct pcs_handle *)b)->head;
+
+    return (x > y) - (x < y);
+}
+
+static void save_reconciled(struct pcs_save_data *d, pcp_ctx_t *ctx)
+{
+    size_t i;
+
+    d->hdr.reconcile_cnt=0;
+    qsort(d->handles, d->handles_len, sizeof(*d->handles), handle_cmp);
+
+    for (i=0; (i < ctx->reconciled_cnt) && (d->err == PCP_ERR_SUCCESS); ++i) {
+        struct pcp_reconcile_entry *e=ctx->reconciled + i;
+        struct pcs_handle key, *h;
+        struct pcs_reconcile r;
+
+        if (e->lifetime == 0) {
+            continue;
+        }
+        key.head=e->flow;
+        h=(struct pcs_handle *)bsearch(&key, d->handles, d->handles_len,
+                sizeof(*d->handles), handle_cmp);
+        if (!h) {
+            continue;
+        }
+
+        memset(&r, 0, sizeof(r));
+        r.key=e->key;
+        r.lifetime=e->lifetime;
+        r.flow=h->rec;
+        if (fwrite(&r, sizeof(r), 1, d->fp) != 1) {
+            d->err=PCP_ERR_UNKNOWN;
+        }
+        d->hdr.reconcile_cnt++;
+    }
+}
+
+int pcp_ctx_save(pcp_ctx_t *ctx, const char *path)
+{
+    struct pcs_save_data d;
+    char *tmp_path;
+    size_t i;
+
+    PCP_LOG_BEGIN(PCP_LOGLVL_DEBUG);
+
+    if ((!ctx) || (!path)) {
+        PCP_LOG_END(PCP_LOGLVL_DEBUG);
+        return PCP_ERR_BAD_ARGS;
+    }
+
+    memset(&d, 0, sizeof(d));
+    d.err=PCP_ERR_SUCCESS;
+    d.hdr.magic=PCS_MAGIC;
+    d.hdr.format=PCS_FORMAT;
+    d.hdr.server_rec_size=sizeof(struct pcs_server);
+    d.hdr.flow_rec_size=sizeof(struct pcs_flow);
+    d.hdr.reconcile_rec_size=sizeof(struct pcs_reconcile);
+
+    d.server_len=ctx->pcp_db.pcp_servers_length;
+    d.server_rec=(uint32_t *)malloc((d.server_len + 1) * sizeof(uint32_t));
+    // written next to the target and renamed, so the snapshot is never torn
+    tmp_path=(char *)malloc(strlen(path) + 5);
+    if ((!d.server_rec) || (!tmp_path)) {
+        free(d.server_rec);
+        free(tmp_path);
+        PCP_LOG_END(PCP_LOGLVL_DEBUG);
+        return PCP_ERR_NO_MEM;
+    }
+    for (i=0; i < d.server_len; ++i) {
+        d.server_rec[i]=PCS_NONE;
+    }
+    sprintf(tmp_path, "%s.tmp", path);
+
+    d.fp=fopen(tmp_path, "wb");
+    if (!d.fp) {
+        PCP_LOG(PCP_LOGLVL_WARN, "Can't create snapshot file %s", tmp_path);
+        free(d.server_rec);
+        free(tmp_path);
+        PCP_LOG_END(PCP_LOGLVL_DEBUG);
+        return PCP_ERR_UNKNOWN;
+    }
+
+    if (fwrite(&d.hdr, sizeof(d.hdr), 1, d.fp) != 1) {
+        d.err=PCP_ERR_UNKNOWN;
+    }
+    if (d.err == PCP_ERR_SUCCESS) {
+        pcp_db_foreach_server(ctx, save_server_iter, &d);
+    }
+    if (d.err == PCP_ERR_SUCCESS) {
+        pcp_db_foreach_flow(ctx, save_flow_iter, &d);
+    }
+    if (d.err == PCP_ERR_SUCCESS) {
+        save_reconciled(&d, ctx);
+    }
+    if ((d.err == PCP_ERR_SUCCESS) && ((fseek(d.fp, 0, SEEK_SET))
+            || (fwrite(&d.hdr, sizeof(d.hdr), 1, d.fp) != 1))) {
+        d.err=PCP_ERR_UNKNOWN;
+    }
+    if ((fclose(d.fp)) && (d.err == PCP_ERR_SUCCESS)) {
+        d.err=PCP_ERR_UNKNOWN;
+    }
+
+    if (d.err == PCP_ERR_SUCCESS) {
+#ifdef WIN32
+        remove(path);
+#endif
+        if (rename(tmp_path, path)) {
+            d.err=PCP_ERR_UNKNOWN;
+        }
+    }
+    if (d.err != PCP_ERR_SUCCESS) {
+        PCP_LOG(PCP_LOGLVL_WARN, "Failed to write snapshot file %s", path);
+        remove(tmp_path);
+    } else {
+        PCP_LOG(PCP_LOGLVL_INFO, "Saved %u PCP servers and %u flows to %s",
+                d.hdr.server_cnt, d.hdr.flow_cnt, path);
+    }
+
+    free(d.server_rec);
+    free(d.handles);
+    free(tmp_path);
+    PCP_LOG_END(PCP_LOGLVL_DEBUG);
+    return d.err;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//                              Restore
+
+static int server_flow_iter(pcp_flow_t *f, void *data)
+{
+    pcp_server_t *s=(pcp_server_t *)data;
+
+    return f->pcp_server_indx == s->index;
+}
+
+// Bring server of record r into ctx. NULL if flows of the record can't be
+// restored - their nonce would differ from the one of already used server.
+static pcp_server_t *restore_server(pcp_ctx_t *ctx, struct pcs_server *r)
+{
+    pcp_server_t *s;
+
+    s=get_pcp_server_by_addr(ctx, (struct in6_addr *)r->ip, r->port,
+            r->scope_id);
+    if (!s) {
+        struct sockaddr_in6 sa;
+        int indx;
+
+        memset(&sa, 0, sizeof(sa));
+        sa.sin6_family=AF_INET6;
+        memcpy(&sa.sin6_addr, r->ip, sizeof(sa.sin6_addr));
+        sa.sin6_port=r->port;
+        sa.sin6_scope_id=r->scope_id;
+        SET_SA_LEN(&sa, sizeof(sa));
+
+        indx=psd_add_pcp_server(ctx, (struct sockaddr *)&sa, r->version);
+        if (indx < 0) {
+            return NULL;
+        }
+        s=get_pcp_server(ctx, indx);
+        if (!s) {
+            return NULL;
+        }
+        s->gateway=r->gateway;
+    }
+
+    switch (s->server_state) {
+        case pss_allocated:
+        case pss_ping:
+        case pss_send_all_msgs:
+            break;
+        default:
+            PCP_LOG(PCP_LOGLVL_WARN, "PCP server %s is already in use. "
+                    "Its flows are not restored.", s->pcp_server_paddr);
+            return NULL;
+    }
+    if ((s->ping_flow_msg)
+            || (pcp_db_foreach_flow(ctx, server_flow_iter, s)
+                    == PCP_ERR_SUCCESS)) {
+        PCP_LOG(PCP_LOGLVL_WARN, "PCP server %s already has flows. "
+                "Its flows are not restored.", s->pcp_server_paddr);
+        return NULL;
+    }
+    if (memcmp(s->src_ip, r->src_ip, sizeof(s->src_ip))) {
+        PCP_LOG(PCP_LOGLVL_WARN, "Source address for PCP server %s changed. "
+                "Its flows are not restored.", s->pcp_server_paddr);
+        return NULL;
+    }
+
+    s->nonce=r->nonce;
+    if (r->confirmed) {
+        s->pcp_version=r->version;
+        s->version_known=1;
+        s->epoch=r->epoch;
+        s->cepoch=(time_t)r->cepoch;
+        s->warm=0;
+        s->server_state=pss_send_all_msgs;
+    }
+    gettimeofday(&s->next_timeout, NULL);
+
+    return s;
+}
+
+static pcp_flow_t *restore_flow(pcp_server_t *s, struct pcs_flow *r,
+        time_t now)
+{
+    struct flow_key_data kd;
+    pcp_flow_t *f;
+
+    memset(&kd, 0, sizeof(kd));
+    kd.operation=r->operation;
+    memcpy(&kd.src_ip, r->src_ip, sizeof(kd.src_ip));
+    memcpy(&kd.pcp_server_ip, s->pcp_ip, sizeof(kd.pcp_server_ip));
+    kd.nonce=r->nonce;
+    kd.map_peer.protocol=r->protocol;
+    kd.map_peer.src_port=r->src_port;
+    memcpy(&kd.map_peer.dst_ip, r->dst_ip, sizeof(kd.map_peer.dst_ip));
+    kd.map_peer.dst_port=r->dst_port;
+
+    f=pcp_create_flow(s, &kd);
+    if (!f) {
+        return NULL;
+    }
+
+    f->lifetime=r->lifetime;
+    f->opt_flags=(opt_flags_e)r->opt_flags;
+    // previous assignment is suggested again if the mapping has to be redone
+    memcpy(&f->map_peer.ext_ip, r->ext_ip, sizeof(f->map_peer.ext_ip));
+    f->map_peer.ext_port=r->ext_port;
+    f->pfailure_option_present=(r->flags & pcsf_pfailure) ? 1 : 0;
+    if ((r->flags & (pcsf_third_party | pcsf_filter | pcsf_flowp))
+            && (pcp_db_flow_ext(f))) {
+        if (r->flags & pcsf_third_party) {
+            f->ext->third_party_option_present=1;
+            memcpy(&f->ext->third_party_ip, r->third_party_ip,
+                    sizeof(f->ext->third_party_ip));
+        }
+        if (r->flags & pcsf_filter) {
+            f->ext->filter_option_present=1;
+            memcpy(&f->ext->filter_ip, r->filter_ip,
+                    sizeof(f->ext->filter_ip));
+            f->ext->filter_port=r->filter_port;
+            f->ext->filter_prefix=r->filter_prefix;
+        }
+#ifdef PCP_FLOW_PRIORITY
+        if (r->flags & pcsf_flowp) {
+            f->ext->flowp_option_present=1;
+            f->ext->flowp_dscp_up=r->flowp_dscp_up;
+            f->ext->flowp_dscp_down=r->flowp_dscp_down;
+        }
+#endif
+    }
+
+    if ((r->state == pfs_wait_for_lifetime_renew)
+            && (s->server_state == pss_send_all_msgs)
+            && ((time_t)r->recv_lifetime > now)) {
+        // mapping still lives on server - only renew it when due
+        f->state=pfs_wait_for_lifetime_renew;
+        f->recv_lifetime=(time_t)r->recv_lifetime;
+        f->recv_result=r->recv_result;
+        f->timeout.tv_sec=(long)r->timeout_sec;
+        f->timeout.tv_usec=r->timeout_usec;
+    } else if (r->state == pfs_failed) {
+        f->state=pfs_failed;
+        f->recv_result=r->recv_result;
+    } else {
+        f->state=pfs_wait_for_server_init;
+    }
+    pcp_flow_account_state(f);
+
+    return f;
+}
+
+int pcp_ctx_restore(pcp_ctx_t *ctx, const char *path)
+{
+    struct pcs_header hdr;
+    pcp_server_t **servers=NULL;
+    pcp_flow_t **handles=NULL; //flow record index => restored handle
+    pcp_flow_t *head=NULL, *prev=NULL;
+    uint32_t head_rec=0;
+    int handle_cnt=0;
+    pcp_errno err=PCP_ERR_SUCCESS;
+    time_t now=time(NULL);
+    long expected;
+    uint32_t i;
+    FILE *fp;
+
+    PCP_LOG_BEGIN(PCP_LOGLVL_DEBUG);
+
+    if ((!ctx) || (!path)) {
+        PCP_LOG_END(PCP_LOGLVL_DEBUG);
+        return PCP_ERR_BAD_ARGS;
+    }
+
+    fp=fopen(path, "rb");
+    if (!fp) {
+        PCP_LOG_END(PCP_LOGLVL_DEBUG);
+        return PCP_ERR_NOT_FOUND;
+    }
+
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1) {
+        err=PCP_ERR_BAD_ARGS;
+    } else if ((hdr.magic != PCS_MAGIC) || (hdr.format != PCS_FORMAT)
+            || (hdr.server_rec_size != sizeof(struct pcs_server))
+            || (hdr.flow_rec_size != sizeof(struct pcs_flow))
+            || (hdr.reconcile_rec_size != sizeof(struct pcs_reconcile))) {
+        PCP_LOG(PCP_LOGLVL_WARN, "Snapshot file %s has unsupported format",
+                path);
+        err=PCP_ERR_UNSUP_VERSION;
+    } else {
+        expected=(long)(sizeof(hdr)
+                + (size_t)hdr.server_cnt * sizeof(struct pcs_server)
+                + (size_t)hdr.flow_cnt * sizeof(struct pcs_flow)
+                + (size_t)hdr.reconcile_cnt * sizeof(struct pcs_reconcile));
+        if ((fseek(fp, 0, SEEK_END)) || (ftell(fp) != expected)
+                || (fseek(fp, sizeof(hdr), SEEK_SET))) {
+            PCP_LOG(PCP_LOGLVL_WARN, "Snapshot file %s is truncated", path);
+            err=PCP_ERR_BAD_ARGS;
+        }
+    }
+    if (err != PCP_ERR_SUCCESS) {
+        fclose(fp);
+        PCP_LOG_END(PCP_LOGLVL_DEBUG);
+        return err;
+    }
+
+    servers=(pcp_server_t **)calloc(hdr.server_cnt + 1, sizeof(*servers));
+    handles=(pcp_flow_t **)calloc(hdr.flow_cnt + 1, sizeof(*handles));
+    if ((!servers) || (!handles)) {
+        err=PCP_ERR_NO_MEM;
+        goto end;
+    }
+
+    for (i=0; i < hdr.server_cnt; ++i) {
+        struct pcs_server r;
+
+        if (fread(&r, sizeof(r), 1, fp) != 1) {
+            err=PCP_ERR_UNKNOWN;
+            goto end;
+        }
+        servers[i]=restore_server(ctx, &r);
+    }
+
+    pcp_db_reserve_flows(ctx, hdr.flow_cnt);
+    for (i=0; i < hdr.flow_cnt; ++i) {
+        struct pcs_flow r;
+        pcp_server_t *s;
+        pcp_flow_t *f, *wire=NULL;
+
+        if (fread(&r, sizeof(r), 1, fp) != 1) {
+            err=PCP_ERR_UNKNOWN;
+            goto end;
+        }
+        if (r.flags & pcsf_first) {
+            head=prev=NULL;
+            head_rec=i;
+        }
+        s=(r.server < hdr.server_cnt) ? servers[r.server] : NULL;
+        if ((!s) || ((r.operation != PCP_OPCODE_MAP)
+                && (r.operation != PCP_OPCODE_PEER))) {
+            continue;
+        }
+
+        f=restore_flow(s, &r, now);
+        if (!f) {
+            err=PCP_ERR_NO_MEM;
+            goto end;
+        }
+
+        if (r.flags & pcsf_shared) {
+            wire=pcp_get_flow(&f->kd, s);
+        }
+        if (wire) {
+            pcp_db_flow_share(wire, f);
+            if (f->lifetime > wire->lifetime) {
+                wire->lifetime=f->lifetime;
+            }
+        } else {
+            pcp_db_add_flow(f);
+        }
+
+        if (prev) {
+            prev->next_child=f;
+            pcp_flow_join_group(head, f);
+        } else {
+            head=f;
+            handles[head_rec]=f;
+            ++handle_cnt;
+        }
+        prev=f;
+        PCP_LOG_FLOW(f, "Restored flow");
+    }
+
+    // flows managed by pcp_reconcile stay managed by it
+    if ((hdr.reconcile_cnt > 0) && (ctx->reconciled_cnt == 0)) {
+        struct pcp_reconcile_entry *idx;
+        size_t cnt=0;
+
+        idx=(struct pcp_reconcile_entry *)malloc(
+                hdr.reconcile_cnt * sizeof(*idx));
+        if (!idx) {
+            err=PCP_ERR_NO_MEM;
+            goto end;
+        }
+        for (i=0; i < hdr.reconcile_cnt; ++i) {
+            struct pcs_reconcile r;
+
+            if (fread(&r, sizeof(r), 1, fp) != 1) {
+                err=PCP_ERR_UNKNOWN;
+                break;
+            }
+            if ((r.flow < hdr.flow_cnt) && (handles[r.flow])) {
+                idx[cnt].key=r.key;
+                idx[cnt].lifetime=r.lifetime;
+                idx[cnt++].flow=handles[r.flow];
+            }
+        }
+        free(ctx->reconciled);
+        ctx->reconciled=idx;
+        ctx->reconciled_cnt=cnt;
+    }
+
+end:
+    fclose(fp);
+    free(servers);
+    free(handles);
+
+    PCP_LOG(PCP_LOGLVL_INFO, "Restored %d flow handles from %s", handle_cnt,
+            path);
+    PCP_LOG_END(PCP_LOGLVL_DEBUG);
+    return err != PCP_ERR_SUCCESS ? err : handle_cnt;
+}
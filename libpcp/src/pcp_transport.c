@@ -0,0 +1,365 @@
+/*
+ Copyright (c) 2014 by Cisco Systems, Inc.
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice, this
+ list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1 //recvmmsg
+#endif
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#else
+#include "default_config.h"
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef WIN32
+#include "pcp_win_defines.h"
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#endif
+#include "pcp.h"
+#include "pcp_utils.h"
+#include "pcp_logger.h"
+#include "pcp_socket.h"
+#include "pcp_msg_structs.h"
+#include "pcp_client_db.h"
+#include "pcp_transport.h"
+
+#if defined(__linux__) && !defined(PCP_SOCKET_IS_VOIDPTR)
+#define PCP_TRANSPORT_MMSG //whole batch is read by one recvmmsg
+#endif
+
+struct pcp_transport_dgram {
+    struct sockaddr_storage from;
+    socklen_t from_len;
+    size_t len;
+    char buf[PCP_MAX_LEN];
+};
+
+// datagrams read from shared socket for one context
+struct pcp_transport_queue {
+    size_t head;
+    size_t cnt;
+    struct pcp_transport_dgram d[PCP_TRANSPORT_QUEUE];
+};
+
+struct pcp_transport {
+    PCP_SOCKET socket;
+    pcp_socket_vt_t *vt;
+    pcp_ctx_t **ctxs;
+    size_t ctx_cnt;
+    size_t ctx_alloc;
+    struct pcp_transport_dgram batch[PCP_TRANSPORT_BATCH];
+};
+
+// Read up to PCP_TRANSPORT_BATCH datagrams waiting on socket.
+static size_t transport_read(pcp_transport_t *t)
+{
+    size_t n;
+
+#ifdef PCP_TRANSPORT_MMSG
+    if (t->vt == &default_socket_vt) {
+        struct mmsghdr msgs[PCP_TRANSPORT_BATCH];
+        struct iovec iov[PCP_TRANSPORT_BATCH];
+        int ret;
+
+        memset(msgs, 0, sizeof(msgs));
+        for (n=0; n < PCP_TRANSPORT_BATCH; ++n) {
+            iov[n].iov_base=t->batch[n].buf;
+            iov[n].iov_len=sizeof(t->batch[n].buf);
+            msgs[n].msg_hdr.msg_iov=iov + n;
+            msgs[n].msg_hdr.msg_iovlen=1;
+            msgs[n].msg_hdr.msg_name=&t->batch[n].from;
+            msgs[n].msg_hdr.msg_namelen=sizeof(t->batch[n].from);
+        }
+        ret=recvmmsg(t->socket, msgs, PCP_TRANSPORT_BATCH, MSG_DONTWAIT,
+                NULL);
+        if (ret <= 0) {
+            return 0;
+        }
+        for (n=0; n < (size_t)ret; ++n) {
+            t->batch[n].len=msgs[n].msg_len;
+            t->batch[n].from_len=msgs[n].msg_hdr.msg_namelen;
+        }
+        return n;
+    }
+#endif
+
+    // socket table of application reads one datagram per call
+    for (n=0; n < PCP_TRANSPORT_BATCH; ++n) {
+        struct pcp_transport_dgram *d=t->batch + n;
+        ssize_t ret;
+
+        d->from_len=sizeof(d->from);
+        ret=t->vt->sock_recvfrom(t->socket, d->buf, sizeof(d->buf),
+                MSG_DONTWAIT, (struct sockaddr *)&d->from, &d->from_len);
+        if (ret < 0) {
+            break;
+        }
+        d->len=(size_t)ret;
+    }
+    return n;
+}
+
+static void queue_push(pcp_ctx_t *ctx, struct pcp_transport_dgram *d)
+{
+    struct pcp_transport_queue *q=ctx->transport_queue;
+    struct pcp_transport_dgram *qd;
+
+    if (q->cnt == PCP_TRANSPORT_QUEUE) {
+        // lost as if socket buffer was full, request is resent
+        PCP_LOG(PCP_LOGLVL_DEBUG, "%s", "Queue of context is full, datagram "
+                "dropped.");
+        return;
+    }
+    qd=q->d + (q->head + q->cnt) % PCP_TRANSPORT_QUEUE;
+    memcpy(&qd->from, &d->from, sizeof(qd->from));
+    qd->from_len=d->from_len;
+    qd->len=d->len;
+    memcpy(qd->buf, d->buf, d->len);
+    q->cnt++;
+}
+
+// Responses to MAP, PEER and SADSCP of PCP v2 carry nonce of the server
+// record, which is random per context. Other datagrams go to every context
+// with the server, as do responses whose nonce no context knows.
+static void transport_dispatch(pcp_transport_t *t,
+        struct pcp_transport_dgram *d)
+{
+    struct in6_addr ip;
+    uint16_t port;
+    uint32_t scope_id=0;
+    struct pcp_nonce nonce;
+    int has_nonce=0;
+    int pass;
+    size_t i;
+
+    pcp_fill_in6_addr(&ip, &port, (struct sockaddr *)&d->from);
+    if (d->from.ss_family == AF_INET6) {
+        scope_id=((struct sockaddr_in6 *)&d->from)->sin6_scope_id;
+    }
+
+    if (d->len >= sizeof(pcp_response_t) + sizeof(nonce)) {
+        pcp_response_t *resp=(pcp_response_t *)d->buf;
+        uint8_t opcode=resp->r_opcode & 0x7F;
+
+        if ((resp->ver >= 2) && ((opcode == PCP_OPCODE_MAP)
+                || (opcode == PCP_OPCODE_PEER)
+                || (opcode == PCP_OPCODE_SADSCP))) {
+            memcpy(&nonce, resp->next_data, sizeof(nonce));
+            has_nonce=1;
+        }
+    }
+
+    for (pass=has_nonce ? 0 : 1; pass < 2; ++pass) {
+        int found=0;
+
+        for (i=0; i < t->ctx_cnt; ++i) {
+            pcp_server_t *s=get_pcp_server_by_addr(t->ctxs[i], &ip, port,
+                    scope_id);
+
+            if ((!s) || ((pass == 0)
+                    && (memcmp(&s->nonce, &nonce, sizeof(nonce))))) {
+                continue;
+            }
+            queue_push(t->ctxs[i], d);
+            found=1;
+        }
+        if (found) {
+            return;
+        }
+    }
+    PCP_LOG(PCP_LOGLVL_DEBUG, "%s", "Datagram from unknown server dropped.");
+}
+
+ssize_t pcp_transport_recv(pcp_ctx_t *ctx, void *buf, size_t len,
+        struct sockaddr *src_addr, socklen_t *addrlen)
+{
+    struct pcp_transport_queue *q=ctx->transport_queue;
+    struct pcp_transport_dgram *d;
+
+    if (q->cnt == 0) {
+        pcp_transport_t *t=ctx->transport;
+        size_t i, n=transport_read(t);
+
+        for (i=0; i < n; ++i) {
+            transport_dispatch(t, t->batch + i);
+        }
+        if (q->cnt == 0) {
+            return PCP_ERR_WOULDBLOCK;
+        }
+    }
+
+    d=q->d + q->head;
+    q->head=(q->head + 1) % PCP_TRANSPORT_QUEUE;
+    q->cnt--;
+
+    if (len > d->len) {
+        len=d->len;
+    }
+    memcpy(buf, d->buf, len);
+    if ((src_addr) && (addrlen)) {
+        memcpy(src_addr, &d->from,
+                *addrlen < d->from_len ? *addrlen : d->from_len);
+        *addrlen=d->from_len;
+    }
+    return (ssize_t)len;
+}
+
+pcp_errno pcp_transport_attach(pcp_transport_t *t, pcp_ctx_t *ctx)
+{
+    if (t->ctx_cnt == t->ctx_alloc) {
+        size_t n=t->ctx_alloc ? t->ctx_alloc * 2 : 4;
+        pcp_ctx_t **tmp=(pcp_ctx_t **)realloc(t->ctxs, n * sizeof(*tmp));
+
+        if (!tmp) {
+            return PCP_ERR_NO_MEM;
+        }
+        t->ctxs=tmp;
+        t->ctx_alloc=n;
+    }
+    ctx->transport_queue=(struct pcp_transport_queue *)calloc(1,
+            sizeof(*ctx->transport_queue));
+    if (!ctx->transport_queue) {
+        return PCP_ERR_NO_MEM;
+    }
+
+    t->ctxs[t->ctx_cnt++]=ctx;
+    ctx->transport=t;
+    ctx->virt_socket_tb=t->vt;
+    ctx->socket=t->socket;
+    return PCP_ERR_SUCCESS;
+}
+
+void pcp_transport_detach(pcp_ctx_t *ctx)
+{
+    pcp_transport_t *t=ctx->transport;
+    size_t i;
+
+    for (i=0; i < t->ctx_cnt; ++i) {
+        if (t->ctxs[i] == ctx) {
+            t->ctxs[i]=t->ctxs[--t->ctx_cnt];
+            break;
+        }
+    }
+    free(ctx->transport_queue);
+    ctx->transport_queue=NULL;
+    ctx->transport=NULL;
+    ctx->socket=PCP_INVALID_SOCKET;
+}
+
+pcp_transport_t *pcp_transport_create(pcp_socket_vt_t *socket_vt)
+{
+    pcp_transport_t *t;
+
+    pcp_logger_init();
+
+    PCP_LOG_BEGIN(PCP_LOGLVL_DEBUG);
+
+    t=(pcp_transport_t *)calloc(1, sizeof(*t));
+    if (!t) {
+        PCP_LOG_END(PCP_LOGLVL_DEBUG);
+        return NULL;
+    }
+    t->vt=socket_vt ? socket_vt : &default_socket_vt;
+    t->socket=t->vt->sock_create(
+#ifdef PCP_USE_IPV6_SOCKET
+            AF_INET6,
+#else
+            AF_INET,
+#endif
+            SOCK_DGRAM, 0);
+
+    if (t->socket == PCP_INVALID_SOCKET) {
+        PCP_LOG(PCP_LOGLVL_WARN, "%s",
+                "Error occurred while creating a shared PCP socket.");
+        free(t);
+        PCP_LOG_END(PCP_LOGLVL_DEBUG);
+        return NULL;
+    }
+
+    PCP_LOG_END(PCP_LOGLVL_DEBUG);
+    return t;
+}
+
+PCP_SOCKET pcp_transport_get_socket(pcp_transport_t *t)
+{
+    return t ? t->socket : PCP_INVALID_SOCKET;
+}
+
+int pcp_transport_pulse(pcp_transport_t *t, struct timeval *next_timeout)
+{
+    struct timeval tmp_timeout={0, 0};
+    size_t i, rounds=0;
+    int pending;
+
+    if (!t) {
+        return PCP_ERR_BAD_ARGS;
+    }
+    if (!next_timeout) {
+        next_timeout=&tmp_timeout;
+    }
+
+    // datagram read by one context may be queued to any other, so contexts
+    // are pulsed until all queues are empty
+    do {
+        pending=0;
+        for (i=0; i < t->ctx_cnt; ++i) {
+            pcp_pulse(t->ctxs[i], next_timeout);
+        }
+        for (i=0; i < t->ctx_cnt; ++i) {
+            pending|=t->ctxs[i]->transport_queue->cnt > 0;
+        }
+    } while ((pending) && (++rounds < PCP_TRANSPORT_QUEUE));
+
+    // socket won't wake caller up for datagrams already read
+    if (pending) {
+        next_timeout->tv_sec=0;
+        next_timeout->tv_usec=1000;
+    }
+
+    return (next_timeout->tv_sec * 1000) + (next_timeout->tv_usec / 1000);
+}
+
+int pcp_transport_destroy(pcp_transport_t *t)
+{
+    if (!t) {
+        return PCP_ERR_BAD_ARGS;
+    }
+    if (t->ctx_cnt) {
+        PCP_LOG(PCP_LOGLVL_WARN, "Shared PCP socket still used by %zu "
+                "contexts.", t->ctx_cnt);
+        return PCP_ERR_BAD_ARGS;
+    }
+    t->vt->sock_close(t->socket);
+    free(t->ctxs);
+    free(t);
+    return PCP_ERR_SUCCESS;
+}
@@ -0,0 +1,45 @@
+/*
+ Copyright (c) 2014 by Cisco Systems, Inc.
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice, this
+ list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PCP_TRANSPORT_H_
+#define PCP_TRANSPORT_H_
+
+#include "pcp_client_db.h"
+
+// Contexts attached to a transport send from its socket directly. Datagrams
+// read from the socket are queued to the context owning the server they came
+// from, found by nonce of the response if it has one; pcp_pulse of a context
+// reads its queue and refills the queues from the socket when it is empty.
+
+// attach ctx to t, its socket becomes the socket of t
+pcp_errno pcp_transport_attach(pcp_transport_t *t, pcp_ctx_t *ctx);
+
+void pcp_transport_detach(pcp_ctx_t *ctx);
+
+// next datagram of ctx, PCP_ERR_WOULDBLOCK if there is none
+ssize_t pcp_transport_recv(pcp_ctx_t *ctx, void *buf, size_t len,
+        struct sockaddr *src_addr, socklen_t *addrlen);
+
+#endif /* PCP_TRANSPORT_H_ */
@@ -36,6 +36,7 @@
 #include <string.h>
 #include <time.h>
 #include <ctype.h>
+#include <signal.h>
 #include "getopt.h"
 
 #ifdef WIN32
@@ -110,6 +111,7 @@ char *ctime_r(const time_t *timep, char *buf)
 #include <ctype.h>
 #include <getopt.h>
 #include <sys/utsname.h>
+#include <sys/resource.h>
 #include "unp.h"
 #include "pcp_utils.h"
 
@@ -167,6 +169,16 @@ typedef pcp_deviceid_option_t pcp_app_deviceid_t;
  OPTION(SHORT(d), disdisc,    "disable-autodiscovery",NOARG,  TABS0 "Disable auto-discovery of PCP servers.") \
  OPTION(SHORT(T), timeout,    "timeout",              REQARG, TABS2 "Receive response timeout in seconds.(DEFAULT 1)") \
  OPTION(SHORT(f), fast_ret,   "fast-return",          NOARG,  TABS1 "Exit immediately after first PCP response.") \
+ OPTION(SHORT(c), capture,    "capture",              REQARG, TABS2 "Record sent and received datagrams to pcap file.") \
+ OPTION(SHORT(b), batch,      "batch",                REQARG, TABS2 "Read MAP/PEER options of flows from file (- for\n" \
+                                                              TABS4 "stdin), one flow per line, as options or JSON\n" \
+                                                              TABS4 "object. Options given on command line are defaults.") \
+ OPTION(SHORT(k), keep,       "keep",                 NOARG,  TABS2 "Keep batch flows renewed until interrupted.") \
+ OPTION(SHORT(B), bench,      "bench",                REQARG, TABS2 "Map N flows of various ports, protocols and\n" \
+                                                              TABS4 "opcodes and print time to mapping statistics.") \
+ OPTION(SHORT(R), serve,      "serve",                REQARG, TABS2 "Map flows of local processes started with\n" \
+                                                              TABS4 "PCP_DAEMON=PATH, listening on unix socket PATH\n" \
+                                                              TABS4 "until interrupted.") \
  HELP_MSG(                                                          "") \
  HELP_MSG(                                                          "MAP/PEER operation related options:") \
  OPTION(SHORT(i), int,        "internal",             REQARG, TABS1 "Internal address[:port] of the flow. Adding this\n" \
@@ -307,6 +319,34 @@ static int check_flow_info(pcp_flow_t* f)
     return ret_val;
 }
 
+#define EXT_ADDR_HEADER_FMT \
+        "%-20s %-4s %-20s %5s   %-20s %5s   %-20s %5s %3s %5s %s\n"
+
+static void print_flow_info(const pcp_flow_info_t *info)
+{
+    char ntop_buffs[4][INET6_ADDRSTRLEN];
+    char timebuf[32];
+
+    printf("%-20s %-4s %-20s %5hu   %-20s %5hu   %-20s %5hu %3d %5s %s",
+            inet_ntop(AF_INET6, &info->pcp_server_ip, ntop_buffs[0],
+                sizeof(ntop_buffs[0])),
+            info->protocol == IPPROTO_TCP ? "TCP" : (
+               info->protocol == IPPROTO_UDP ? "UDP" : "UNK"),
+            inet_ntop(AF_INET6, &info->int_ip, ntop_buffs[1],
+                sizeof(ntop_buffs[1])),
+            ntohs(info->int_port),
+            inet_ntop(AF_INET6, &info->dst_ip, ntop_buffs[2],
+                sizeof(ntop_buffs[2])),
+            ntohs(info->dst_port),
+            inet_ntop(AF_INET6, &info->ext_ip, ntop_buffs[3],
+                sizeof(ntop_buffs[3])),
+            ntohs(info->ext_port),
+            info->pcp_result_code,
+            decode_fresult(info->result),
+            info->recv_lifetime_end == 0 ? " -\n" :
+                    ctime_r(&info->recv_lifetime_end, timebuf));
+}
+
 static void print_ext_addr(pcp_flow_t* f)
 {
     size_t cnt=0;
@@ -314,7 +354,7 @@ static void print_ext_addr(pcp_flow_t* f)
     pcp_flow_info_t *ret = pcp_flow_get_info(f,&cnt);
     info_buf=ret;
 
-    printf("%-20s %-4s %-20s %5s   %-20s %5s   %-20s %5s %3s %5s %s\n",
+    printf(EXT_ADDR_HEADER_FMT,
             "PCP Server IP",
             "Prot",
             "Int. IP", "port",
@@ -322,27 +362,7 @@ static void print_ext_addr(pcp_flow_t* f)
             "Ext. IP", "port",
             "Res", "State","Ends");
     for (; cnt>0; cnt--, ret++) {
-        char ntop_buffs[4][INET6_ADDRSTRLEN];
-        char timebuf[32];
-
-        printf("%-20s %-4s %-20s %5hu   %-20s %5hu   %-20s %5hu %3d %5s %s",
-                inet_ntop(AF_INET6, &ret->pcp_server_ip, ntop_buffs[0],
-                    sizeof(ntop_buffs[0])),
-                ret->protocol == IPPROTO_TCP ? "TCP" : (
-                   ret->protocol == IPPROTO_UDP ? "UDP" : "UNK"),
-                inet_ntop(AF_INET6, &ret->int_ip, ntop_buffs[1],
-                    sizeof(ntop_buffs[1])),
-                ntohs(ret->int_port),
-                inet_ntop(AF_INET6, &ret->dst_ip, ntop_buffs[2],
-                    sizeof(ntop_buffs[2])),
-                ntohs(ret->dst_port),
-                inet_ntop(AF_INET6, &ret->ext_ip, ntop_buffs[3],
-                    sizeof(ntop_buffs[3])),
-                ntohs(ret->ext_port),
-                ret->pcp_result_code,
-                decode_fresult(ret->result),
-                ret->recv_lifetime_end == 0 ? " -\n" :
-                        ctime_r(&ret->recv_lifetime_end, timebuf));
+        print_flow_info(ret);
     }
     if (info_buf) {
         free(info_buf);
@@ -401,7 +421,13 @@ struct pcp_params {
     uint32_t opt_lifetime;
     uint8_t pcp_version;
     uint8_t fast_return;
+    char *capture_file;
+    char *batch_file;
+    uint8_t keep;
+    uint32_t bench;
+    char *serve_path;
     uint32_t timeout;
+    uint8_t timeout_set;
     uint32_t opt_mdid;
     char opt_md_val[256];
     size_t opt_md_val_len;
@@ -422,7 +448,120 @@ struct pcp_params {
     struct pcp_server_list *pcp_servers;
 };
 
+// MAP/PEER flow with addresses parsed from CLI options or batch line
+struct flow_spec {
+    struct sockaddr_storage src;
+    struct sockaddr_storage dst;
+    struct sockaddr_storage ext;
+    struct sockaddr_storage filter_ip;
+    struct sockaddr_storage thirdparty_ip;
+    uint8_t has_ext;
+    uint8_t opt_filter;
+    int opt_filter_prefix;
+    uint8_t opt_pfailure;
+    uint8_t has_thirdparty;
+    uint8_t opt_flowp;
+    uint8_t opt_dscp_up;
+    uint8_t opt_dscp_down;
+    uint8_t protocol;
+    uint32_t lifetime;
+};
+
 static void parse_params(struct pcp_params *p, int argc, char *argv[]);
+static int run_batch(struct pcp_params *p);
+static int run_bench(struct pcp_params *p);
+static int run_serve(struct pcp_params *p);
+
+// Fills flow spec from MAP/PEER options. Returns NULL or error message.
+static const char *parse_flow_spec(struct pcp_params *p, struct flow_spec *fs)
+{
+    memset(fs, 0, sizeof(*fs));
+
+    if ((p->int_addr)&&(0!=sock_pton(p->int_addr, (struct sockaddr*)&fs->src))) {
+        return "Entered invalid internal address!";
+    }
+
+    if ((p->peer_addr)&&(0!=sock_pton(p->peer_addr, (struct sockaddr*)&fs->dst))) {
+        return "Entered invalid peer address!";
+    }
+    if ((p->ext_addr)&&(0!=sock_pton(p->ext_addr, (struct sockaddr*)&fs->ext))) {
+        return "Entered invalid external address!";
+    }
+    fs->has_ext = p->ext_addr != NULL;
+
+    if ((p->peer_addr) && (p->opt_pfailure)){
+        return "Prefer failure option can be added only to MAP message!";
+    }
+
+    if ((p->peer_addr) && (p->opt_filter)){
+        return "Filter option can be added only to MAP message!";
+    }
+
+    if ((p->opt_filter)&&(p->filter_addr)&&
+            (0!=sock_pton_with_prefix(p->filter_addr,
+                    (struct sockaddr*)&fs->filter_ip, &fs->opt_filter_prefix))) {
+        return "Invalid address for Filter option!";
+
+    }
+    if ((p->opt_thirdparty_addr)&&(0!=sock_pton(p->opt_thirdparty_addr, (struct sockaddr*)&fs->thirdparty_ip))) {
+        return "Entered invalid third-party address!";
+    }
+    fs->has_thirdparty = p->opt_thirdparty_addr != NULL;
+    fs->opt_filter = p->opt_filter;
+    fs->opt_pfailure = p->opt_pfailure;
+    fs->opt_flowp = p->opt_flowp;
+    fs->opt_dscp_up = p->opt_dscp_up;
+    fs->opt_dscp_down = p->opt_dscp_down;
+    fs->protocol = p->opt_protocol;
+    fs->lifetime = p->opt_lifetime;
+
+    return NULL;
+}
+
+// Adds PCP options of flow spec and of CLI to the flow.
+static void set_flow_options(pcp_flow_t *flow, struct pcp_params *p,
+        struct flow_spec *fs)
+{
+#ifdef PCP_FLOW_PRIORITY
+    if (fs->opt_flowp) {
+        pcp_flow_set_flowp(flow, fs->opt_dscp_up, fs->opt_dscp_down);
+    }
+#endif
+
+#ifdef PCP_EXPERIMENTAL
+    if ( p->is_md ) {
+        pcp_flow_add_md(flow, p->opt_mdid, p->opt_md_val, p->opt_md_val_len);
+    }
+
+
+    if (p->app_deviceid.deviceid[0] != '\0') {
+        pcp_flow_set_deviceid(flow, &p->app_deviceid);
+    }
+
+    if (p->app_location.location[0] != '\0') {
+        pcp_flow_set_location(flow, &p->app_location);
+    }
+
+    if (p->app_userid.userid[0] != '\0') {
+        pcp_flow_set_userid(flow, &p->app_userid);
+    }
+#else
+    (void)p;
+#endif
+
+    if (fs->opt_filter) {
+        pcp_flow_set_filter_opt(flow, (struct sockaddr*)&fs->filter_ip,
+            (uint8_t)fs->opt_filter_prefix);
+    }
+
+    if (fs->opt_pfailure) {
+        pcp_flow_set_prefer_failure_opt(flow);
+    }
+
+    if (fs->has_thirdparty) {
+        pcp_flow_set_3rd_party_opt(flow, (struct sockaddr *)&fs->thirdparty_ip);
+    }
+}
 
 
 static inline unsigned long mix(unsigned long a, unsigned long b, unsigned long c)
@@ -443,11 +582,7 @@ static inline unsigned long mix(unsigned long a, unsigned long b, unsigned long
 int main(int argc, char *argv[])
 {
     struct pcp_params p;
-    struct sockaddr_storage destination_ip;
-    struct sockaddr_storage source_ip;
-    struct sockaddr_storage ext_ip;
-    struct sockaddr_storage filter_ip;
-    struct sockaddr_storage thirdparty_ip;
+    struct flow_spec fs;
     int ret_val = 1;
     pcp_flow_t* flow = NULL;
     struct pcp_server_list *server;
@@ -456,48 +591,15 @@ int main(int argc, char *argv[])
 
     PD_SOCKET_STARTUP();
 
-    memset(&source_ip, 0, sizeof(source_ip));
-    memset(&destination_ip, 0, sizeof(destination_ip));
-
     parse_params(&p, argc, argv);
 
-    if ((p.int_addr)&&(0!=sock_pton(p.int_addr, (struct sockaddr*)&source_ip))) {
-        fprintf(stderr, "Entered invalid internal address!\n");
-        exit(1);
-    }
-
-    if ((p.peer_addr)&&(0!=sock_pton(p.peer_addr, (struct sockaddr*)&destination_ip))) {
-        fprintf(stderr, "Entered invalid peer address!\n");
-        exit(1);
-    }
-    if ((p.ext_addr)&&(0!=sock_pton(p.ext_addr, (struct sockaddr*)&ext_ip))) {
-        fprintf(stderr, "Entered invalid external address!\n");
-        exit(1);
-    }
-
-    if ((p.peer_addr) && (p.opt_pfailure)){
-        fprintf(stderr,
-                "Prefer failure option can be added only to MAP message!\n");
-        exit(1);
-    }
-
-    if ((p.peer_addr) && (p.opt_filter)){
-        fprintf(stderr,
-                "Filter option can be added only to MAP message!\n");
-        exit(1);
-    }
-
-    if ((p.opt_filter)&&(p.filter_addr)&&
-            (0!=sock_pton_with_prefix(p.filter_addr,
-                    (struct sockaddr*)&filter_ip, &p.opt_filter_prefix))) {
-        fprintf(stderr,
-                "Invalid address for Filter option!\n");
-        exit(1);
+    if (p.has_mappeer_data) {
+        const char *err = parse_flow_spec(&p, &fs);
 
-    }
-    if ((p.opt_thirdparty_addr)&&(0!=sock_pton(p.opt_thirdparty_addr, (struct sockaddr*)&thirdparty_ip))) {
-        fprintf(stderr, "Entered invalid third-party address!\n");
-        exit(1);
+        if (err) {
+            fprintf(stderr, "%s\n", err);
+            exit(1);
+        }
     }
 
     if (!p.dis_auto_discovery) {
@@ -506,6 +608,12 @@ int main(int argc, char *argv[])
         p.ctx = pcp_init(DISABLE_AUTODISCOVERY, NULL);
     }
 
+    if ((p.capture_file) &&
+            (pcp_set_capture(p.ctx, p.capture_file) != PCP_ERR_SUCCESS)) {
+        fprintf(stderr, "Can't create capture file %s!\n", p.capture_file);
+        exit(1);
+    }
+
     for (server = p.pcp_servers; server!=NULL; server=server->next) {
         struct sockaddr *sa;
 
@@ -515,54 +623,36 @@ int main(int argc, char *argv[])
         }
     }
 
+    if (p.batch_file) {
+        ret_val = run_batch(&p);
+        PD_SOCKET_CLEANUP();
+        return ret_val;
+    }
+
+    if (p.bench) {
+        ret_val = run_bench(&p);
+        PD_SOCKET_CLEANUP();
+        return ret_val;
+    }
+
+    if (p.serve_path) {
+        ret_val = run_serve(&p);
+        PD_SOCKET_CLEANUP();
+        return ret_val;
+    }
+
     if (p.has_mappeer_data) {
-        flow = pcp_new_flow(p.ctx, (struct sockaddr*)&source_ip,
-                (struct sockaddr*)&destination_ip,
-                p.ext_addr ? (struct sockaddr*)&ext_ip : NULL,
-                p.opt_protocol, p.opt_lifetime, p.ctx);
+        flow = pcp_new_flow(p.ctx, (struct sockaddr*)&fs.src,
+                (struct sockaddr*)&fs.dst,
+                fs.has_ext ? (struct sockaddr*)&fs.ext : NULL,
+                fs.protocol, fs.lifetime, p.ctx);
 
         if (flow == NULL) {
             fprintf(stderr, "%s:%d Could not create flow \n", __FUNCTION__, __LINE__);
             exit(1);
         }
 
-#ifdef PCP_FLOW_PRIORITY
-        if (p.opt_flowp) {
-            pcp_flow_set_flowp(flow, p.opt_dscp_up, p.opt_dscp_down);
-        }
-#endif
-
-#ifdef PCP_EXPERIMENTAL
-        if ( p.is_md ) {
-            pcp_flow_add_md(flow, p.opt_mdid, p.opt_md_val, p.opt_md_val_len);
-        }
-
-
-        if (p.app_deviceid.deviceid[0] != '\0') {
-            pcp_flow_set_deviceid(flow, &p.app_deviceid);
-        }
-
-        if (p.app_location.location[0] != '\0') {
-            pcp_flow_set_location(flow, &p.app_location);
-        }
-
-        if (p.app_userid.userid[0] != '\0') {
-            pcp_flow_set_userid(flow, &p.app_userid);
-        }
-#endif
-
-        if (p.opt_filter) {
-            pcp_flow_set_filter_opt(flow, (struct sockaddr*)&filter_ip,
-                (uint8_t)p.opt_filter_prefix);
-        }
-
-        if (p.opt_pfailure) {
-            pcp_flow_set_prefer_failure_opt(flow);
-        }
-
-        if (p.opt_thirdparty_addr) {
-            pcp_flow_set_3rd_party_opt(flow, (struct sockaddr *)&thirdparty_ip);
-        }
+        set_flow_options(flow, &p, &fs);
 
 #ifdef PCP_SADSCP
     } else if (p.has_sadscp_data) {
@@ -616,6 +706,35 @@ static inline void parse_opt_fast_ret(struct pcp_params *p)
     p->fast_return=1;
 }
 
+static inline void parse_opt_capture(struct pcp_params *p)
+{
+    p->capture_file=optarg;
+}
+
+static inline void parse_opt_batch(struct pcp_params *p)
+{
+    p->batch_file=optarg;
+}
+
+static inline void parse_opt_keep(struct pcp_params *p)
+{
+    p->keep=1;
+}
+
+static inline void parse_opt_bench(struct pcp_params *p)
+{
+    p->bench = (uint32_t)strtoul(optarg, NULL, 10);
+    if (p->bench == 0) {
+        fprintf(stderr, "Invalid count of benchmark flows %s\n", optarg);
+        exit(1);
+    }
+}
+
+static inline void parse_opt_serve(struct pcp_params *p)
+{
+    p->serve_path=optarg;
+}
+
 static inline void parse_opt_server(struct pcp_params *p)
 {
     struct pcp_server_list* l ;
@@ -646,6 +765,7 @@ static inline void parse_opt_disdisc(struct pcp_params *p)
 static inline void parse_opt_timeout(struct pcp_params *p)
 {
     p->timeout = atoi(optarg) * 1000;
+    p->timeout_set = 1;
 }
 
 static inline void parse_opt_int(struct pcp_params *p)
@@ -889,10 +1009,881 @@ static void parse_params(struct pcp_params *p, int argc, char *argv[])
         print_usage();
         exit(1);
     }
-    if ((!p->has_mappeer_data)&&(!p->has_sadscp_data)) {
+    if ((p->batch_file)&&(p->has_sadscp_data)) {
+        fprintf (stderr, "Batch file holds MAP/PEER operations only.\n");
+        print_usage();
+        exit(1);
+    }
+    if ((p->bench)&&((p->batch_file)||(p->has_sadscp_data))) {
+        fprintf (stderr, "Benchmark can't be mixed with batch or SADSCP op.\n");
+        print_usage();
+        exit(1);
+    }
+    if ((p->keep)&&(!p->batch_file)) {
+        fprintf (stderr, "Flows can be kept only in batch mode.\n");
+        print_usage();
+        exit(1);
+    }
+    if ((p->serve_path)&&((p->batch_file)||(p->bench)||(p->has_mappeer_data)
+            ||(p->has_sadscp_data))) {
+        fprintf (stderr, "Daemon serves flows of other processes only.\n");
+        print_usage();
+        exit(1);
+    }
+    if ((!p->has_mappeer_data)&&(!p->has_sadscp_data)&&(!p->batch_file)
+            &&(!p->bench)&&(!p->serve_path)) {
         fprintf (stderr,
             "give at least one parameter for MAP/PEER op. or for SADSCP op\n");
         print_usage();
         exit(1);
     }
  }
+
+////////////////////////////////////////////////////////////////////////////////
+//                      Batch mode
+
+#define BATCH_MAX_LINE 4096
+#define BATCH_DEFAULT_TIMEOUT 10000
+#define BATCH_SEPARATORS " \t\r\n"
+
+#define SHORT_NAME(a, b, c, d, e) a,
+
+// short option letters, same order as long_options
+static const char *short_names[] = {
+    FOREACH_OPTION(SHORT_NAME, ARG_IGNORE, ARG_IGNORE, ARG_IGNORE)
+};
+
+// one flow of batch file
+struct batch_flow {
+    size_t line;
+    uint8_t json;
+    uint8_t done;
+    int ret_val;
+    pcp_flow_t *flow;
+};
+
+struct batch {
+    struct batch_flow *flows;
+    size_t count;
+    size_t pending;
+    uint8_t fast_return;
+};
+
+static volatile sig_atomic_t batch_stop;
+
+static void batch_signal(int sig UNUSED)
+{
+    batch_stop = 1;
+}
+
+// MAP/PEER options which may be given on batch file line
+static int is_flow_option(int option_index)
+{
+    switch (option_index) {
+    case E_int:
+    case E_peer:
+    case E_ext:
+    case E_tcp:
+    case E_udp:
+    case E_prot:
+    case E_lifetime:
+    case E_pfailure:
+    case E_filter:
+    case E_thirdparty:
+#ifdef PCP_FLOW_PRIORITY
+    case E_dscp_up:
+    case E_dscp_down:
+#endif
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+// Returns index of option given as -x, --name or, if is_key is set, name.
+static int find_option(const char *name, int is_key)
+{
+    int i;
+
+    if ((!is_key) && (name[0] != '-')) {
+        return -1;
+    }
+    for (i = 0; long_options[i].name; ++i) {
+        if (is_key) {
+            if (!strcmp(name, long_options[i].name)) {
+                return i;
+            }
+        } else if (name[1] == '-') {
+            if (!strcmp(name + 2, long_options[i].name)) {
+                return i;
+            }
+        } else if ((name[1]) && (!name[2]) && (short_names[i][0] == name[1])) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void apply_flow_option(struct pcp_params *p, int option_index,
+        char *arg)
+{
+    int c = 0;
+
+    optarg = arg;
+    FOREACH_OPTION(PARSE_OPTION, ARG_IGNORE, ARG_IGNORE, ARG_IGNORE)
+    {
+    }
+}
+
+// Parses options of the line (e.g. "-i 10.0.0.2:5000 -u") into p.
+// Returns NULL or error message.
+static const char *parse_text_line(struct pcp_params *p, char *line,
+        char *err, size_t err_len)
+{
+    char *tok;
+
+    for (tok = strtok(line, BATCH_SEPARATORS); tok;
+            tok = strtok(NULL, BATCH_SEPARATORS)) {
+        int option_index = find_option(tok, 0);
+        char *arg = NULL;
+
+        if ((option_index < 0) || (!is_flow_option(option_index))) {
+            snprintf(err, err_len, "Unknown option `%s'.", tok);
+            return err;
+        }
+        if (long_options[option_index].has_arg == required_argument) {
+            arg = strtok(NULL, BATCH_SEPARATORS);
+            if (!arg) {
+                snprintf(err, err_len, "Option `%s' requires an argument.", tok);
+                return err;
+            }
+        }
+        apply_flow_option(p, option_index, arg);
+    }
+    return NULL;
+}
+
+static char *skip_space(char *s)
+{
+    while ((*s) && (isspace((unsigned char)*s))) {
+        s++;
+    }
+    return s;
+}
+
+// Unescapes JSON string starting at *s in place. Returns NULL on error.
+static char *json_string(char **s)
+{
+    char *in = *s + 1;
+    char *out = in;
+    char *start = in;
+
+    for (; *in != '"'; ++in) {
+        if (!*in) {
+            return NULL;
+        }
+        if (*in == '\\') {
+            switch (*++in) {
+            case '"':
+            case '\\':
+            case '/':
+                *out++ = *in;
+                break;
+            case 't':
+                *out++ = '\t';
+                break;
+            default:
+                return NULL;
+            }
+        } else {
+            *out++ = *in;
+        }
+    }
+    *s = in + 1;
+    *out = '\0';
+    return start;
+}
+
+// Parses flat JSON object with long option names as keys into p, e.g.
+// {"internal": "10.0.0.2:5000", "protocol": 17, "prefer-failure": true}
+// Returns NULL or error message.
+static const char *parse_json_line(struct pcp_params *p, char *line,
+        char *err, size_t err_len)
+{
+    char *s = skip_space(line) + 1;
+    char delim;
+
+    s = skip_space(s);
+    if (*s == '}') {
+        s++;
+        delim = '}';
+    } else {
+        delim = ',';
+    }
+    while (delim == ',') {
+        char *key, *val;
+        int option_index;
+
+        s = skip_space(s);
+        if ((*s != '"') || (!(key = json_string(&s)))) {
+            return "Invalid JSON object key.";
+        }
+        s = skip_space(s);
+        if (*s++ != ':') {
+            return "Missing `:' in JSON object.";
+        }
+        s = skip_space(s);
+        delim = '\0';
+        if (*s == '"') {
+            if (!(val = json_string(&s))) {
+                return "Invalid JSON string value.";
+            }
+        } else {
+            size_t len = strcspn(s, "," "}" BATCH_SEPARATORS);
+
+            if (len == 0) {
+                return "Missing JSON value.";
+            }
+            val = s;
+            s += len;
+            delim = *s;
+            if (delim) {
+                *s++ = '\0';
+            }
+        }
+
+        option_index = find_option(key, 1);
+        if ((option_index < 0) || (!is_flow_option(option_index))) {
+            snprintf(err, err_len, "Unknown option `%s'.", key);
+            return err;
+        }
+        if (long_options[option_index].has_arg == no_argument) {
+            if (!strcmp(val, "true")) {
+                apply_flow_option(p, option_index, NULL);
+            } else if ((strcmp(val, "false")) && (strcmp(val, "null"))) {
+                snprintf(err, err_len, "Option `%s' takes true or false.", key);
+                return err;
+            }
+        } else if (strcmp(val, "null")) {
+            apply_flow_option(p, option_index, val);
+        }
+
+        if ((!delim) || (isspace((unsigned char)delim))) {
+            s = skip_space(s);
+            delim = *s;
+            if (delim) {
+                s++;
+            }
+        }
+        if ((delim != ',') && (delim != '}')) {
+            return "Missing `,' or `}' in JSON object.";
+        }
+    }
+    if (*skip_space(s)) {
+        return "Unexpected data after JSON object.";
+    }
+    return NULL;
+}
+
+static int batch_ret_val(pcp_fstate_e state)
+{
+    switch (state) {
+    case pcp_state_succeeded:
+    case pcp_state_partial_result:
+        return 0;
+    case pcp_state_short_lifetime_error:
+        return 3;
+    case pcp_state_failed:
+        return 4;
+    default:
+        return 2;
+    }
+}
+
+static void print_batch_json(struct batch_flow *bf, const pcp_flow_info_t *info)
+{
+    char ntop_buffs[4][INET6_ADDRSTRLEN];
+
+    printf("{\"line\":%zu,\"state\":\"%s\",\"result\":%d,\"server\":\"%s\","
+            "\"protocol\":%d,\"internal\":\"%s\",\"internal_port\":%hu,"
+            "\"peer\":\"%s\",\"peer_port\":%hu,\"external\":\"%s\","
+            "\"external_port\":%hu,\"ends\":%lld}\n",
+            bf->line, decode_fresult(info->result), info->pcp_result_code,
+            inet_ntop(AF_INET6, &info->pcp_server_ip, ntop_buffs[0],
+                sizeof(ntop_buffs[0])),
+            info->protocol,
+            inet_ntop(AF_INET6, &info->int_ip, ntop_buffs[1],
+                sizeof(ntop_buffs[1])),
+            ntohs(info->int_port),
+            inet_ntop(AF_INET6, &info->dst_ip, ntop_buffs[2],
+                sizeof(ntop_buffs[2])),
+            ntohs(info->dst_port),
+            inet_ntop(AF_INET6, &info->ext_ip, ntop_buffs[3],
+                sizeof(ntop_buffs[3])),
+            ntohs(info->ext_port),
+            (long long)info->recv_lifetime_end);
+}
+
+static void print_batch_info(struct batch_flow *bf, const pcp_flow_info_t *info)
+{
+    if (bf->json) {
+        print_batch_json(bf, info);
+    } else {
+        printf("%-6zu ", bf->line);
+        print_flow_info(info);
+    }
+    // results are streamed to pipe as they come
+    fflush(stdout);
+}
+
+// called for each PCP server of flow on change of its state
+static void batch_flow_change(pcp_flow_t *f, struct sockaddr *src_addr UNUSED,
+        struct sockaddr *ext_addr UNUSED, pcp_fstate_e s UNUSED, void *cb_arg)
+{
+    struct batch *b = (struct batch *)cb_arg;
+    struct batch_flow *bf = (struct batch_flow *)pcp_flow_get_user_data(f);
+    pcp_flow_info_t info;
+    pcp_fstate_e state;
+
+    if ((!bf) || (pcp_flow_get_info_buf(f, &info, 1) == 0)) {
+        return;
+    }
+    // renewal of kept flow is reported by its result only
+    if ((bf->done) && (info.result == pcp_state_processing)) {
+        return;
+    }
+    print_batch_info(bf, &info);
+
+    if ((!bf->done) && (pcp_eval_flow_state(bf->flow, &state) > 0)
+            && ((b->fast_return) || (state != pcp_state_partial_result))) {
+        bf->done = 1;
+        bf->ret_val = batch_ret_val(state);
+        b->pending--;
+    }
+}
+
+// Handles events of the context until *pending drops to zero, timeout (ms)
+// expires or SIGINT/SIGTERM is received. With keep set it waits for the
+// signal only.
+static void run_flows(pcp_ctx_t *ctx, uint32_t timeout, int keep,
+        size_t *pending)
+{
+    struct timeval end;
+    int fd = pcp_get_socket(ctx);
+
+    signal(SIGINT, batch_signal);
+    signal(SIGTERM, batch_signal);
+
+    gettimeofday(&end, NULL);
+    end.tv_sec += timeout / 1000;
+    end.tv_usec += (timeout % 1000) * 1000;
+    end.tv_sec += end.tv_usec / 1000000;
+    end.tv_usec %= 1000000;
+
+    while ((!batch_stop) && ((keep) || (*pending > 0))) {
+        struct timeval tv = {1, 0};
+        int route_fd = pcp_get_route_socket(ctx);
+        int daemon_fd = pcp_get_daemon_socket(ctx);
+        int fdmax = fd + 1;
+        fd_set read_fds;
+
+        if (!keep) {
+            struct timeval now;
+
+            gettimeofday(&now, NULL);
+            if ((timeval_subtract(&tv, &end, &now))
+                    || ((tv.tv_sec == 0) && (tv.tv_usec == 0))) {
+                break;
+            }
+        }
+        pcp_pulse(ctx, &tv);
+        if ((!keep) && (*pending == 0)) {
+            break;
+        }
+
+        FD_ZERO(&read_fds);
+        FD_SET(fd, &read_fds);
+        if (route_fd >= 0) {
+            FD_SET(route_fd, &read_fds);
+            if (route_fd >= fdmax) {
+                fdmax = route_fd + 1;
+            }
+        }
+        if (daemon_fd >= 0) {
+            FD_SET(daemon_fd, &read_fds);
+            if (daemon_fd >= fdmax) {
+                fdmax = daemon_fd + 1;
+            }
+        }
+        select(fdmax, &read_fds, NULL, NULL, &tv);
+    }
+}
+
+// Reads batch file into flow requests. Returns count of invalid lines.
+static size_t read_batch(struct pcp_params *p, FILE *in, struct batch *b,
+        struct flow_spec **specs)
+{
+    char line[BATCH_MAX_LINE];
+    char err[BATCH_MAX_LINE + 64];
+    size_t lineno = 0;
+    size_t errors = 0;
+    size_t alloc = 0;
+
+    while (fgets(line, sizeof(line), in)) {
+        struct pcp_params lp;
+        const char *msg;
+        size_t len = strlen(line);
+        char *s;
+
+        lineno++;
+        if ((len == sizeof(line) - 1) && (line[len - 1] != '\n')) {
+            int ch;
+
+            while (((ch = fgetc(in)) != EOF) && (ch != '\n'))
+                ;
+            fprintf(stderr, "%s:%zu: Line too long.\n", p->batch_file, lineno);
+            errors++;
+            continue;
+        }
+        s = skip_space(line);
+        if ((!*s) || (*s == '#')) {
+            continue;
+        }
+
+        if (b->count == alloc) {
+            size_t n = alloc ? alloc * 2 : 64;
+            struct batch_flow *flows;
+            struct flow_spec *fs;
+
+            flows = (struct batch_flow *)realloc(b->flows, n * sizeof(*flows));
+            if (flows) {
+                b->flows = flows;
+            }
+            fs = (struct flow_spec *)realloc(*specs, n * sizeof(*fs));
+            if (fs) {
+                *specs = fs;
+            }
+            if ((!flows) || (!fs)) {
+                fprintf(stderr, "%s:%zu: Not enough memory.\n", p->batch_file,
+                        lineno);
+                errors++;
+                break;
+            }
+            alloc = n;
+        }
+
+        // options from command line are defaults of each line
+        lp = *p;
+        if (*s == '{') {
+            msg = parse_json_line(&lp, s, err, sizeof(err));
+        } else {
+            msg = parse_text_line(&lp, s, err, sizeof(err));
+        }
+        if ((!msg) && (!lp.int_addr)) {
+            msg = "Missing internal address.";
+        }
+        if (!msg) {
+            msg = parse_flow_spec(&lp, &(*specs)[b->count]);
+        }
+        if (msg) {
+            fprintf(stderr, "%s:%zu: %s\n", p->batch_file, lineno, msg);
+            errors++;
+            continue;
+        }
+        memset(&b->flows[b->count], 0, sizeof(b->flows[0]));
+        b->flows[b->count].line = lineno;
+        b->flows[b->count].json = *s == '{';
+        b->count++;
+    }
+
+    return errors;
+}
+
+// Creates all flows of batch file at once and streams their results. Flows
+// are either kept renewed until SIGINT/SIGTERM (--keep) or waited for until
+// all of them finish or time out. Returns exit code as in single flow mode.
+static int run_batch(struct pcp_params *p)
+{
+    struct batch b;
+    struct flow_spec *specs = NULL;
+    pcp_flow_req_t *reqs;
+    pcp_flow_t **out;
+    FILE *in = stdin;
+    size_t errors;
+    size_t i;
+    int has_text = 0;
+    int ret_val = 0;
+
+    if (strcmp(p->batch_file, "-")) {
+        in = fopen(p->batch_file, "r");
+        if (!in) {
+            fprintf(stderr, "Can't open batch file %s!\n", p->batch_file);
+            return 1;
+        }
+    }
+
+    memset(&b, 0, sizeof(b));
+    b.fast_return = p->fast_return;
+    errors = read_batch(p, in, &b, &specs);
+    if (in != stdin) {
+        fclose(in);
+    }
+    if (errors) {
+        ret_val = 1;
+    }
+
+    reqs = (pcp_flow_req_t *)calloc(b.count + 1, sizeof(*reqs));
+    out = (pcp_flow_t **)calloc(b.count + 1, sizeof(*out));
+    if ((!reqs) || (!out)) {
+        fprintf(stderr, "Not enough memory for %zu flows.\n", b.count);
+        free(reqs);
+        free(out);
+        free(specs);
+        free(b.flows);
+        pcp_terminate(p->ctx, 0);
+        return 1;
+    }
+    for (i = 0; i < b.count; ++i) {
+        reqs[i].src_addr = (struct sockaddr *)&specs[i].src;
+        reqs[i].dst_addr = (struct sockaddr *)&specs[i].dst;
+        reqs[i].ext_addr = specs[i].has_ext ?
+                (struct sockaddr *)&specs[i].ext : NULL;
+        reqs[i].protocol = specs[i].protocol;
+        reqs[i].lifetime = specs[i].lifetime;
+        reqs[i].userdata = &b.flows[i];
+        has_text |= !b.flows[i].json;
+    }
+
+    // per message debug log would drown streamed results
+    if (pcp_log_level > PCP_LOGLVL_WARN) {
+        pcp_log_level = PCP_LOGLVL_WARN;
+    }
+    if (has_text) {
+        printf("%-6s " EXT_ADDR_HEADER_FMT, "Line",
+                "PCP Server IP",
+                "Prot",
+                "Int. IP", "port",
+                "Dst. IP", "port",
+                "Ext. IP", "port",
+                "Res", "State","Ends");
+        fflush(stdout);
+    }
+
+    pcp_set_flow_change_cb(p->ctx, batch_flow_change, &b);
+    pcp_new_flows(p->ctx, reqs, b.count, out);
+    for (i = 0; i < b.count; ++i) {
+        b.flows[i].flow = out[i];
+        if (!out[i]) {
+            fprintf(stderr, "%s:%zu: Could not create flow.\n", p->batch_file,
+                    b.flows[i].line);
+            b.flows[i].done = 1;
+            b.flows[i].ret_val = 1;
+            continue;
+        }
+        set_flow_options(out[i], p, &specs[i]);
+        b.pending++;
+    }
+    free(reqs);
+    free(out);
+    free(specs);
+
+    run_flows(p->ctx, p->timeout_set ? p->timeout : BATCH_DEFAULT_TIMEOUT,
+            p->keep, &b.pending);
+
+    for (i = 0; i < b.count; ++i) {
+        struct batch_flow *bf = &b.flows[i];
+
+        if (!bf->done) {
+            pcp_flow_info_t *info_buf, *info;
+            size_t cnt = 0;
+
+            info_buf = pcp_flow_get_info(bf->flow, &cnt);
+            for (info = info_buf; cnt > 0; cnt--, info++) {
+                print_batch_info(bf, info);
+            }
+            free(info_buf);
+            bf->ret_val = 2;
+        }
+        if (bf->ret_val > ret_val) {
+            ret_val = bf->ret_val;
+        }
+    }
+
+    // kept flows are removed from PCP server on exit
+    pcp_terminate(p->ctx, p->keep);
+    free(b.flows);
+
+    return ret_val;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//                      Benchmark mode
+
+#define BENCH_BASE_PORT 20000
+#define BENCH_PEER_ADDR "192.0.2.1"
+#define BENCH_PEER_PORT 80
+// every BENCH_PEER_EVERY-th flow is PEER
+#define BENCH_PEER_EVERY 4
+
+struct bench_flow {
+    struct timeval start;
+    uint32_t time_us; //from creation to result
+    uint8_t done;
+    pcp_fstate_e state;
+    pcp_flow_t *flow;
+};
+
+struct bench {
+    struct bench_flow *flows;
+    size_t pending;
+    uint8_t fast_return;
+    struct timeval last; //time of last result
+};
+
+// called for each PCP server of flow on change of its state
+static void bench_flow_change(pcp_flow_t *f, struct sockaddr *src_addr UNUSED,
+        struct sockaddr *ext_addr UNUSED, pcp_fstate_e s UNUSED, void *cb_arg)
+{
+    struct bench *b = (struct bench *)cb_arg;
+    struct bench_flow *bf = (struct bench_flow *)pcp_flow_get_user_data(f);
+    struct timeval diff;
+    pcp_fstate_e state;
+
+    if ((!bf) || (bf->done) || (!bf->flow)
+            || (pcp_eval_flow_state(bf->flow, &state) == 0)) {
+        return;
+    }
+    if ((!b->fast_return) && (state == pcp_state_partial_result)) {
+        return;
+    }
+    gettimeofday(&b->last, NULL);
+    timeval_subtract(&diff, &b->last, &bf->start);
+    bf->time_us = (uint32_t)(diff.tv_sec * 1000000 + diff.tv_usec);
+    bf->state = state;
+    bf->done = 1;
+    b->pending--;
+}
+
+static void set_sa_port(struct sockaddr_storage *sa, uint16_t port)
+{
+    if (sa->ss_family == AF_INET) {
+        ((struct sockaddr_in *)sa)->sin_port = htons(port);
+    } else if (sa->ss_family == AF_INET6) {
+        ((struct sockaddr_in6 *)sa)->sin6_port = htons(port);
+    }
+}
+
+static uint16_t get_sa_port(struct sockaddr_storage *sa)
+{
+    if (sa->ss_family == AF_INET) {
+        return ntohs(((struct sockaddr_in *)sa)->sin_port);
+    } else if (sa->ss_family == AF_INET6) {
+        return ntohs(((struct sockaddr_in6 *)sa)->sin6_port);
+    }
+    return 0;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+#ifndef WIN32
+static double rusage_ms(struct timeval *tv)
+{
+    return tv->tv_sec * 1000.0 + tv->tv_usec / 1000.0;
+}
+
+static void print_cpu(const char *name, struct rusage *from, struct rusage *to)
+{
+    printf("  CPU %-16s user %.1f ms, system %.1f ms\n", name,
+            rusage_ms(&to->ru_utime) - rusage_ms(&from->ru_utime),
+            rusage_ms(&to->ru_stime) - rusage_ms(&from->ru_stime));
+}
+#endif
+
+// Maps p->bench flows: ports counted up from the one of -i (or
+// BENCH_BASE_PORT), TCP and UDP in turn and every BENCH_PEER_EVERY-th one
+// PEER to -p (or port BENCH_PEER_PORT of PCP server). Prints counts of results, percentiles of
+// time from flow creation to its result, messages sent and CPU time.
+static int run_bench(struct pcp_params *p)
+{
+    struct bench b;
+    struct flow_spec fs, peer_fs;
+    struct sockaddr_storage no_dst;
+    struct timeval start, diff;
+    pcp_stats_t stats;
+    uint32_t *times;
+    size_t counts[pcp_state_failed + 1];
+    size_t i, n = p->bench, succeeded = 0, peers = 0, not_created = 0;
+    uint16_t base_port;
+    double secs;
+    int ret_val = 0;
+#ifndef WIN32
+    struct rusage ru_start, ru_created, ru_end;
+#endif
+
+    parse_flow_spec(p, &fs);
+    if (fs.src.ss_family == 0) {
+        sock_pton(":0", (struct sockaddr *)&fs.src);
+    }
+    if (fs.dst.ss_family == 0) {
+        // same interface as PCP server, as the source address is wildcard
+        if ((!p->pcp_servers) || (sock_pton(p->pcp_servers->server,
+                (struct sockaddr *)&fs.dst))) {
+            sock_pton(BENCH_PEER_ADDR, (struct sockaddr *)&fs.dst);
+        }
+        set_sa_port(&fs.dst, BENCH_PEER_PORT);
+    }
+    base_port = get_sa_port(&fs.src);
+    if (base_port == 0) {
+        base_port = BENCH_BASE_PORT;
+    }
+    // options of MAP opcode only
+    peer_fs = fs;
+    peer_fs.opt_filter = 0;
+    peer_fs.opt_pfailure = 0;
+    memset(&no_dst, 0, sizeof(no_dst));
+
+    memset(&b, 0, sizeof(b));
+    b.fast_return = p->fast_return;
+    b.flows = (struct bench_flow *)calloc(n, sizeof(*b.flows));
+    times = (uint32_t *)calloc(n, sizeof(*times));
+    if ((!b.flows) || (!times)) {
+        fprintf(stderr, "Not enough memory for %zu flows.\n", n);
+        free(b.flows);
+        free(times);
+        pcp_terminate(p->ctx, 0);
+        return 1;
+    }
+
+    if (pcp_log_level > PCP_LOGLVL_WARN) {
+        pcp_log_level = PCP_LOGLVL_WARN;
+    }
+    pcp_set_flow_change_cb(p->ctx, bench_flow_change, &b);
+
+#ifndef WIN32
+    getrusage(RUSAGE_SELF, &ru_start);
+#endif
+    gettimeofday(&start, NULL);
+    for (i = 0; i < n; ++i) {
+        struct bench_flow *bf = &b.flows[i];
+        int is_peer = (i % BENCH_PEER_EVERY) == BENCH_PEER_EVERY - 1;
+        // ports from base_port up to 65535, then from 1024 again
+        uint16_t port = (uint16_t)(1024 +
+                (base_port - 1024 + i / 2) % (65536 - 1024));
+
+        set_sa_port(&fs.src, port);
+        gettimeofday(&bf->start, NULL);
+        bf->flow = pcp_new_flow(p->ctx, (struct sockaddr *)&fs.src,
+                is_peer ? (struct sockaddr *)&fs.dst : (struct sockaddr *)&no_dst,
+                fs.has_ext ? (struct sockaddr *)&fs.ext : NULL,
+                (i & 1) ? IPPROTO_UDP : IPPROTO_TCP, fs.lifetime, bf);
+        if (!bf->flow) {
+            bf->done = 1;
+            bf->state = pcp_state_failed;
+            not_created++;
+            continue;
+        }
+        set_flow_options(bf->flow, p, is_peer ? &peer_fs : &fs);
+        peers += is_peer;
+        b.pending++;
+    }
+#ifndef WIN32
+    getrusage(RUSAGE_SELF, &ru_created);
+#endif
+
+    run_flows(p->ctx, p->timeout_set ? p->timeout : BATCH_DEFAULT_TIMEOUT,
+            0, &b.pending);
+
+#ifndef WIN32
+    getrusage(RUSAGE_SELF, &ru_end);
+#endif
+    if (b.pending) {
+        gettimeofday(&b.last, NULL);
+    }
+    timeval_subtract(&diff, &b.last, &start);
+    secs = diff.tv_sec + diff.tv_usec / 1e6;
+    pcp_get_stats(p->ctx, &stats);
+
+    memset(counts, 0, sizeof(counts));
+    for (i = 0; i < n; ++i) {
+        struct bench_flow *bf = &b.flows[i];
+        pcp_fstate_e state = bf->done ? bf->state : pcp_state_processing;
+        int flow_ret = batch_ret_val(state);
+
+        if (flow_ret == 0) {
+            times[succeeded++] = bf->time_us;
+        } else if (state <= pcp_state_failed) {
+            counts[state]++;
+        }
+        if (flow_ret > ret_val) {
+            ret_val = flow_ret;
+        }
+    }
+
+    printf("Mapped %zu flows (%zu MAP, %zu PEER) in %.3f s\n", n,
+            n - not_created - peers, peers, secs);
+    printf("  Succeeded:            %zu\n", succeeded);
+    printf("  Short lifetime error: %zu\n",
+            counts[pcp_state_short_lifetime_error]);
+    printf("  Failed:               %zu\n",
+            counts[pcp_state_failed] - not_created);
+    if (not_created) {
+        printf("  Not created:          %zu\n", not_created);
+    }
+    printf("  Timed out:            %zu\n", counts[pcp_state_processing]);
+    if (succeeded > 0) {
+        qsort(times, succeeded, sizeof(*times), cmp_u32);
+        printf("  Time to mapping p50/p90/p99/max: "
+                "%.3f / %.3f / %.3f / %.3f ms\n",
+                times[succeeded / 2] / 1e3, times[succeeded * 90 / 100] / 1e3,
+                times[succeeded * 99 / 100] / 1e3, times[succeeded - 1] / 1e3);
+    }
+    printf("  Requests sent:        %llu (%llu retransmitted)\n",
+            (unsigned long long)stats.sent,
+            (unsigned long long)stats.retransmitted);
+    printf("  Responses received:   %llu\n", (unsigned long long)stats.received);
+    printf("  Request rate:         %.0f requests/s\n",
+            secs > 0 ? stats.sent / secs : 0);
+#ifndef WIN32
+    print_cpu("creating flows:", &ru_start, &ru_created);
+    print_cpu("handling events:", &ru_created, &ru_end);
+    printf("  CPU per flow:         %.1f us\n",
+            (rusage_ms(&ru_end.ru_utime) + rusage_ms(&ru_end.ru_stime)
+            - rusage_ms(&ru_start.ru_utime) - rusage_ms(&ru_start.ru_stime))
+            * 1000 / n);
+#endif
+    fflush(stdout);
+
+    // benchmark leaves no mappings behind
+    pcp_terminate(p->ctx, 1);
+    free(times);
+    free(b.flows);
+
+    return ret_val;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//                      Daemon mode
+
+// Maps flows of local processes until SIGINT/SIGTERM, then closes them.
+static int run_serve(struct pcp_params *p)
+{
+    size_t pending = 0;
+
+    if (pcp_daemon_listen(p->ctx, p->serve_path) != PCP_ERR_SUCCESS) {
+        fprintf(stderr, "Can't listen on %s!\n", p->serve_path);
+        pcp_terminate(p->ctx, 0);
+        return 1;
+    }
+    printf("Serving local flows on %s\n", p->serve_path);
+    fflush(stdout);
+
+    run_flows(p->ctx, 0, 1, &pending);
+
+    pcp_terminate(p->ctx, 1);
+    return 0;
+}
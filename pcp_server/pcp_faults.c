@@ -0,0 +1,495 @@
+/*
+ * Copyright (c) 2014 by Cisco Systems, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#else
+#include "default_config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#ifdef WIN32
+#include <winsock2.h>
+#include <windows.h>
+#include "pcp_gettimeofday.h"
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+#include "pcp_msg_structs.h"
+#include "pcp_faults.h"
+
+#define PFI_INITIAL_QUEUE 1024u
+// room for junk appended to malformed reply
+#define PFI_MAX_REPLY (PCP_MAX_LEN + 4)
+
+typedef enum {
+    pfi_malform_response_bit,
+    pfi_malform_opcode,
+    pfi_malform_padding,
+    pfi_malform_count
+} pfi_malform_e;
+
+// queued reply, address and data are allocated with it
+typedef struct pfi_reply {
+    PCP_SOCKET sock;
+    socklen_t addr_len;
+    int len;
+    struct sockaddr_storage addr;
+    char data[1];
+} pfi_reply_t;
+
+typedef struct pfi_slot {
+    uint64_t due;           // microseconds
+    uint64_t seq;           // keeps order of replies due at the same time
+    pfi_reply_t *reply;
+} pfi_slot_t;
+
+struct pcp_faults {
+    pfi_config_t cfg;
+    uint32_t rnd;
+    pfi_slot_t *heap;
+    uint32_t queued;
+    uint32_t cap;
+    uint64_t seq;
+    pfi_stats_t stats;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//                              Configuration
+
+static int pfi_parse_rate(const char *value, double *rate)
+{
+    char *end;
+    double r = strtod(value, &end);
+
+    if ((end == value) || ((*end != '\0') && (*end != '%'))
+            || (r < 0) || (r > 100)) {
+        return -1;
+    }
+    *rate = r;
+    return 0;
+}
+
+static int pfi_parse_uint(const char *value, uint32_t *out)
+{
+    char *end;
+    unsigned long v = strtoul(value, &end, 10);
+
+    if ((end == value) || (*end != '\0') || (value[0] == '-')
+            || (v > UINT32_MAX)) {
+        return -1;
+    }
+    *out = (uint32_t)v;
+    return 0;
+}
+
+int pfi_set_option(pfi_config_t *cfg, const char *name, const char *value)
+{
+    static const struct {
+        const char *name;
+        size_t offset;
+    } rates[] = {
+        { "loss", offsetof(pfi_config_t, loss) },
+        { "duplicate", offsetof(pfi_config_t, duplicate) },
+        { "reorder", offsetof(pfi_config_t, reorder) },
+        { "truncate", offsetof(pfi_config_t, truncate) },
+        { "malform", offsetof(pfi_config_t, malform) },
+        { "epoch-reset", offsetof(pfi_config_t, epoch_reset) },
+    };
+    size_t i;
+
+    for (i = 0; i < sizeof(rates) / sizeof(rates[0]); ++i) {
+        if (!strcmp(name, rates[i].name)) {
+            return pfi_parse_rate(value,
+                    (double *)((char *)cfg + rates[i].offset));
+        }
+    }
+    if (!strcmp(name, "delay")) {
+        return pfi_parse_uint(value, &cfg->delay_ms);
+    }
+    if (!strcmp(name, "jitter")) {
+        return pfi_parse_uint(value, &cfg->jitter_ms);
+    }
+    if (!strcmp(name, "seed")) {
+        return pfi_parse_uint(value, &cfg->seed);
+    }
+    return 1;
+}
+
+int pfi_load_rules(pfi_config_t *cfg, const char *file)
+{
+    char line[256];
+    FILE *fp = fopen(file, "r");
+    int line_no = 0;
+
+    if (!fp) {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        char *name = line, *value, *end;
+
+        line_no++;
+        if ((end = strchr(line, '#')) != NULL) {
+            *end = '\0';
+        }
+        while (isspace((unsigned char)*name)) {
+            name++;
+        }
+        if (*name == '\0') {
+            continue;
+        }
+        value = name;
+        while ((*value != '\0') && (!isspace((unsigned char)*value))) {
+            value++;
+        }
+        if (*value != '\0') {
+            *value++ = '\0';
+        }
+        while (isspace((unsigned char)*value)) {
+            value++;
+        }
+        end = value + strlen(value);
+        while ((end > value) && (isspace((unsigned char)end[-1]))) {
+            *--end = '\0';
+        }
+        if (pfi_set_option(cfg, name, value) != 0) {
+            fclose(fp);
+            return line_no;
+        }
+    }
+    fclose(fp);
+    return 0;
+}
+
+int pfi_enabled(const pfi_config_t *cfg)
+{
+    return (cfg->loss > 0) || (cfg->duplicate > 0) || (cfg->reorder > 0)
+            || (cfg->truncate > 0) || (cfg->malform > 0)
+            || (cfg->epoch_reset > 0) || (cfg->delay_ms > 0)
+            || (cfg->jitter_ms > 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//                                 Random
+
+static uint32_t pfi_random(pcp_faults_t *f)
+{
+    // xorshift32
+    f->rnd ^= f->rnd << 13;
+    f->rnd ^= f->rnd >> 17;
+    f->rnd ^= f->rnd << 5;
+    return f->rnd;
+}
+
+static int pfi_hit(pcp_faults_t *f, double rate)
+{
+    if (rate <= 0) {
+        return 0;
+    }
+    // rate is kept with precision of 0.0001 %
+    return (pfi_random(f) % 1000000) < (uint32_t)(rate * 10000);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//                              Delay queue
+
+static uint64_t pfi_now_us(void)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_usec;
+}
+
+static int pfi_slot_before(const pfi_slot_t *a, const pfi_slot_t *b)
+{
+    return (a->due < b->due) || ((a->due == b->due) && (a->seq < b->seq));
+}
+
+static int pfi_queue(pcp_faults_t *f, uint64_t due, PCP_SOCKET s,
+        const char *buf, int len, const struct sockaddr *addr,
+        socklen_t addr_len)
+{
+    pfi_reply_t *r;
+    pfi_slot_t slot;
+    uint32_t i;
+
+    if (f->queued == f->cap) {
+        uint32_t cap = f->cap ? f->cap * 2 : PFI_INITIAL_QUEUE;
+        pfi_slot_t *heap = (pfi_slot_t *)realloc(f->heap,
+                (size_t)cap * sizeof(*heap));
+
+        if (!heap) {
+            return -1;
+        }
+        f->heap = heap;
+        f->cap = cap;
+    }
+
+    r = (pfi_reply_t *)malloc(sizeof(*r) + len);
+    if (!r) {
+        return -1;
+    }
+    r->sock = s;
+    memcpy(&r->addr, addr, addr_len);
+    r->addr_len = addr_len;
+    r->len = len;
+    memcpy(r->data, buf, len);
+
+    slot.due = due;
+    slot.seq = f->seq++;
+    slot.reply = r;
+
+    // sift up
+    i = f->queued++;
+    while (i > 0) {
+        uint32_t parent = (i - 1) / 2;
+
+        if (!pfi_slot_before(&slot, &f->heap[parent])) {
+            break;
+        }
+        f->heap[i] = f->heap[parent];
+        i = parent;
+    }
+    f->heap[i] = slot;
+
+    if (f->queued > f->stats.max_queued) {
+        f->stats.max_queued = f->queued;
+    }
+    return 0;
+}
+
+static pfi_reply_t *pfi_pop(pcp_faults_t *f)
+{
+    pfi_reply_t *top = f->heap[0].reply;
+    pfi_slot_t last = f->heap[--f->queued];
+    uint32_t i = 0;
+
+    // sift down
+    for (;;) {
+        uint32_t c = 2 * i + 1;
+
+        if (c >= f->queued) {
+            break;
+        }
+        if ((c + 1 < f->queued)
+                && (pfi_slot_before(&f->heap[c + 1], &f->heap[c]))) {
+            c++;
+        }
+        if (!pfi_slot_before(&f->heap[c], &last)) {
+            break;
+        }
+        f->heap[i] = f->heap[c];
+        i = c;
+    }
+    if (f->queued > 0) {
+        f->heap[i] = last;
+    }
+    return top;
+}
+
+static void pfi_send(PCP_SOCKET s, const char *buf, int len,
+        const struct sockaddr *addr, socklen_t addr_len)
+{
+    sendto(s, buf, len, 0, addr, addr_len);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//                                 Faults
+
+pcp_faults_t *pfi_create(const pfi_config_t *cfg, uint32_t stream)
+{
+    pcp_faults_t *f = (pcp_faults_t *)calloc(1, sizeof(*f));
+
+    if (!f) {
+        return NULL;
+    }
+    f->cfg = *cfg;
+    f->rnd = cfg->seed ? cfg->seed : (uint32_t)time(NULL);
+    // each worker gets its own stream of the same seed
+    f->rnd ^= (stream + 1) * 0x9E3779B9u;
+    if (f->rnd == 0) {
+        f->rnd = 1;
+    }
+    return f;
+}
+
+void pfi_destroy(pcp_faults_t *f)
+{
+    if (!f) {
+        return;
+    }
+    while (f->queued > 0) {
+        free(pfi_pop(f));
+    }
+    free(f->heap);
+    free(f);
+}
+
+int pfi_epoch_reset(pcp_faults_t *f)
+{
+    if (!pfi_hit(f, f->cfg.epoch_reset)) {
+        return 0;
+    }
+    f->stats.epoch_resets++;
+    return 1;
+}
+
+// returns nonzero if the reply was changed
+static int pfi_malform(pcp_faults_t *f, char *buf, int *len)
+{
+    pcp_response_t *resp = (pcp_response_t *)buf;
+
+    if (*len < (int)sizeof(pcp_response_t)) {
+        return 0;
+    }
+    switch (pfi_random(f) % pfi_malform_count) {
+        case pfi_malform_response_bit:
+            resp->r_opcode &= 0x7f;
+            break;
+        case pfi_malform_opcode:
+            resp->r_opcode = 0x80 | 0x7f;
+            break;
+        default:
+            // length is not multiple of 4
+            memset(buf + *len, 0xA5, 3);
+            *len += 3;
+            break;
+    }
+    return 1;
+}
+
+// sends reply now or after delay
+static void pfi_deliver(pcp_faults_t *f, uint64_t now, PCP_SOCKET s,
+        const char *buf, int len, const struct sockaddr *addr,
+        socklen_t addr_len)
+{
+    uint64_t delay_ms = f->cfg.delay_ms;
+
+    if (f->cfg.jitter_ms > 0) {
+        delay_ms += pfi_random(f) % (f->cfg.jitter_ms + 1);
+    }
+    if (pfi_hit(f, f->cfg.reorder)) {
+        delay_ms += PFI_REORDER_HOLD_MS;
+        f->stats.reordered++;
+    }
+    if ((delay_ms == 0) || (pfi_queue(f, now + delay_ms * 1000, s, buf, len,
+            addr, addr_len))) {
+        pfi_send(s, buf, len, addr, addr_len);
+        return;
+    }
+    f->stats.delayed++;
+}
+
+void pfi_submit(pcp_faults_t *f, PCP_SOCKET s, const char *buf, int len,
+        const struct sockaddr *addr, socklen_t addr_len)
+{
+    char reply[PFI_MAX_REPLY];
+    uint64_t now;
+
+    f->stats.replies++;
+    if ((len <= 0) || (len > PCP_MAX_LEN)) {
+        return;
+    }
+    if (pfi_hit(f, f->cfg.loss)) {
+        f->stats.lost++;
+        return;
+    }
+
+    memcpy(reply, buf, len);
+    if (pfi_hit(f, f->cfg.truncate)) {
+        len /= 2;
+        f->stats.truncated++;
+    }
+    if ((pfi_hit(f, f->cfg.malform)) && (pfi_malform(f, reply, &len))) {
+        f->stats.malformed++;
+    }
+
+    now = pfi_now_us();
+    pfi_deliver(f, now, s, reply, len, addr, addr_len);
+    if (pfi_hit(f, f->cfg.duplicate)) {
+        pfi_deliver(f, now, s, reply, len, addr, addr_len);
+        f->stats.duplicated++;
+    }
+}
+
+int pfi_wait_ms(pcp_faults_t *f)
+{
+    uint64_t now;
+
+    if (f->queued == 0) {
+        return -1;
+    }
+    now = pfi_now_us();
+    if (f->heap[0].due <= now) {
+        return 0;
+    }
+    // rounded up so that the reply is due after the wait
+    return (int)((f->heap[0].due - now + 999) / 1000);
+}
+
+void pfi_flush(pcp_faults_t *f)
+{
+    uint64_t now = pfi_now_us();
+
+    while ((f->queued > 0) && (f->heap[0].due <= now)) {
+        pfi_reply_t *r = pfi_pop(f);
+
+        pfi_send(r->sock, r->data, r->len, (struct sockaddr *)&r->addr,
+                r->addr_len);
+        free(r);
+    }
+}
+
+void pfi_drain(pcp_faults_t *f)
+{
+    int wait;
+
+    while ((wait = pfi_wait_ms(f)) >= 0) {
+        if (wait > 0) {
+#ifdef WIN32
+            Sleep(wait);
+#else
+            usleep((useconds_t)wait * 1000);
+#endif
+        }
+        pfi_flush(f);
+    }
+}
+
+void pfi_get_stats(pcp_faults_t *f, pfi_stats_t *stats)
+{
+    *stats = f->stats;
+}
@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2014 by Cisco Systems, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef PCP_FAULTS_H_
+#define PCP_FAULTS_H_
+
+#include <stdint.h>
+#include "pcp_socket.h"
+
+// Fault injection of the test PCP server. Replies are lost, delayed (with
+// jitter), duplicated, reordered, truncated or malformed at given rates and
+// epoch of the server is reset. Delayed replies wait in a binary heap ordered
+// by time they are due.
+
+// how long reordered reply is held back, so that later replies overtake it
+#define PFI_REORDER_HOLD_MS 100
+
+typedef struct pfi_config {
+    // rates in percent of replies
+    double loss;
+    double duplicate;
+    double reorder;
+    double truncate;
+    double malform;
+    double epoch_reset;
+    uint32_t delay_ms;
+    uint32_t jitter_ms;
+    uint32_t seed;
+} pfi_config_t;
+
+typedef struct pfi_stats {
+    uint64_t replies;
+    uint64_t lost;
+    uint64_t delayed;
+    uint64_t duplicated;
+    uint64_t reordered;
+    uint64_t truncated;
+    uint64_t malformed;
+    uint64_t epoch_resets;
+    uint32_t max_queued;
+} pfi_stats_t;
+
+typedef struct pcp_faults pcp_faults_t;
+
+// Sets option of name to value. Returns 0 on success, 1 if name is not fault
+// option and -1 if value is bad.
+int pfi_set_option(pfi_config_t *cfg, const char *name, const char *value);
+
+// Reads options from file, one "name value" per line, # starts a comment.
+// Returns 0 on success, otherwise number of the bad line or -1 if the file
+// can't be read.
+int pfi_load_rules(pfi_config_t *cfg, const char *file);
+
+int pfi_enabled(const pfi_config_t *cfg);
+
+// stream is index of random stream, e.g. of worker thread
+pcp_faults_t *pfi_create(const pfi_config_t *cfg, uint32_t stream);
+
+void pfi_destroy(pcp_faults_t *f);
+
+// decides whether epoch of the server is reset before next reply
+int pfi_epoch_reset(pcp_faults_t *f);
+
+// sends reply through socket s, or queues it, after faults are applied
+void pfi_submit(pcp_faults_t *f, PCP_SOCKET s, const char *buf, int len,
+        const struct sockaddr *addr, socklen_t addr_len);
+
+// milliseconds until next queued reply is due, -1 if there is none
+int pfi_wait_ms(pcp_faults_t *f);
+
+// sends queued replies which are due
+void pfi_flush(pcp_faults_t *f);
+
+// waits for all queued replies and sends them
+void pfi_drain(pcp_faults_t *f);
+
+void pfi_get_stats(pcp_faults_t *f, pfi_stats_t *stats);
+
+#endif /* PCP_FAULTS_H_ */
@@ -0,0 +1,1092 @@
+/*
+ * Copyright (c) 2014 by Cisco Systems, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * pcp-loadgen sends MAP, PEER, ANNOUNCE or SADSCP requests to a PCP server
+ * at a given rate or as fast as the server answers, matches responses to
+ * requests and reports throughput and round trip percentiles.
+ */
+
+#ifdef __linux__
+// recvmmsg and sendmmsg
+#define _GNU_SOURCE
+#define PCP_LOADGEN_MMSG
+#endif
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#else
+#include "default_config.h"
+#endif
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include "getopt.h"
+#include "pcp_socket.h"
+
+#ifdef WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include "pcp_gettimeofday.h"
+#else
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#endif
+
+#include "pcp_msg_structs.h"
+#include "pcp_utils.h"
+#include "pcp.h"
+
+#define PCP_PORT "5351"
+#define LOADGEN_DEFAULT_REQUESTS 100000
+#define LOADGEN_DEFAULT_WINDOW 128
+#define LOADGEN_DEFAULT_BATCH 32
+#define LOADGEN_MAX_BATCH 1024
+#define LOADGEN_MAX_SOCKETS 64
+#define LOADGEN_DEFAULT_TIMEOUT_MS 1000
+#define LOADGEN_DEFAULT_LIFETIME 3600
+#define LOADGEN_DEFAULT_PORT_BASE 1024
+#define LOADGEN_SOCKET_BUFFER (4 * 1024 * 1024)
+#define PCP_HDR_LEN 24
+#define NO_FLOW UINT32_MAX
+
+#define xstr(s) str(s)
+#define str(s) #s
+
+typedef struct loadgen_opts {
+    const char *server;
+    uint8_t version;
+    uint8_t opcode;
+    uint8_t protocol;
+    uint32_t lifetime;
+    uint64_t requests;
+    double duration; //seconds, 0 until all requests are sent
+    double rate; //requests per second, 0 as fast as window permits
+    uint32_t window;
+    uint32_t flows;
+    unsigned batch;
+    unsigned sockets;
+    uint32_t timeout_ms;
+    uint16_t port_base;
+    const char *int_ip;
+    const char *peer;
+    const char *third_party;
+    const char *filter;
+    int prefer_failure;
+    const char *app_name;
+    uint8_t tolerance;
+} loadgen_opts_t;
+
+// flows are linked either in list of free flows or in list of requests
+// waiting for response, both in order of time
+typedef struct flow_list {
+    uint32_t head;
+    uint32_t tail;
+} flow_list_t;
+
+typedef struct datagrams {
+    uint8_t *bufs; //LOADGEN_MAX_BATCH buffers of PCP_MAX_LEN
+    size_t lens[LOADGEN_MAX_BATCH];
+#ifdef PCP_LOADGEN_MMSG
+    struct iovec iovs[LOADGEN_MAX_BATCH];
+    struct mmsghdr msgs[LOADGEN_MAX_BATCH];
+#endif
+} datagrams_t;
+
+typedef struct loadgen {
+    const loadgen_opts_t *o;
+    PCP_SOCKET socks[LOADGEN_MAX_SOCKETS];
+    // request is copied from template, flow is written to nonce or port
+    uint8_t tmpl[PCP_MAX_LEN];
+    size_t tmpl_len;
+    size_t nonce_off;
+    size_t port_off;
+    uint32_t run_id[2];
+    // per flow
+    uint64_t *sent_us; //0 if there is no request waiting for response
+    uint32_t *next;
+    uint32_t *prev;
+    flow_list_t free_flows;
+    flow_list_t waiting;
+    uint32_t nwaiting;
+    // round trips in microseconds
+    uint32_t *rtts;
+    uint64_t rtts_cap;
+    // counters
+    uint64_t sent;
+    uint64_t answered;
+    uint64_t lost;
+    uint64_t unexpected;
+    uint64_t send_errors;
+    uint64_t results[256];
+    uint64_t last_answer_us;
+} loadgen_t;
+
+static const char *result_names[] = {
+    "SUCCESS", "UNSUPP_VERSION", "NOT_AUTHORIZED", "MALFORMED_REQUEST",
+    "UNSUPP_OPCODE", "UNSUPP_OPTION", "MALFORMED_OPTION", "NETWORK_FAILURE",
+    "NO_RESOURCES", "UNSUPP_PROTOCOL", "USER_EX_QUOTA",
+    "CANNOT_PROVIDE_EXTERNAL", "ADDRESS_MISMATCH", "EXCESSIVE_REMOTE_PEERS"
+};
+
+static const char *opcode_names[] = { "ANNOUNCE", "MAP", "PEER", "SADSCP" };
+
+static volatile sig_atomic_t loadgen_stop = 0;
+
+// first signal stops sending, second one waiting for responses
+static void loadgen_signal(int sig)
+{
+    (void)sig;
+    loadgen_stop++;
+}
+
+static uint64_t now_us(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + (uint64_t)tv.tv_usec;
+}
+
+// addr[:port], [addr6][:port] or addr6
+static int parse_addr(const char *str, const char *def_port,
+        struct sockaddr_storage *ss, socklen_t *ss_len)
+{
+    char host[INET6_ADDRSTRLEN + 16];
+    char *h = host, *port = NULL, *c;
+    struct addrinfo hints, *ai;
+
+    if (strlen(str) >= sizeof(host)) {
+        return -1;
+    }
+    strcpy(host, str);
+    if (host[0] == '[') {
+        h = host + 1;
+        c = strchr(h, ']');
+        if (c == NULL) {
+            return -1;
+        }
+        *c = 0;
+        if (c[1] == ':') {
+            port = c + 2;
+        }
+    } else if (((c = strchr(host, ':')) != NULL) && (!strchr(c + 1, ':'))) {
+        *c = 0;
+        port = c + 1;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+    if (getaddrinfo(h, port ? port : def_port, &hints, &ai) != 0) {
+        return -1;
+    }
+    memcpy(ss, ai->ai_addr, ai->ai_addrlen);
+    *ss_len = (socklen_t)ai->ai_addrlen;
+    freeaddrinfo(ai);
+    return 0;
+}
+
+// IPv6 or IPv4 mapped address and port in network byte order
+static void addr_to_ip6(const struct sockaddr_storage *ss, uint32_t ip[4],
+        uint16_t *port)
+{
+    if (ss->ss_family == AF_INET) {
+        const struct sockaddr_in *sin = (const struct sockaddr_in *)ss;
+
+        ip[0] = ip[1] = 0;
+        ip[2] = htonl(0xFFFF);
+        ip[3] = sin->sin_addr.s_addr;
+        if (port) {
+            *port = sin->sin_port;
+        }
+    } else {
+        const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)ss;
+
+        memcpy(ip, &sin6->sin6_addr, 16);
+        if (port) {
+            *port = sin6->sin6_port;
+        }
+    }
+}
+
+static void list_append(loadgen_t *g, flow_list_t *l, uint32_t f)
+{
+    g->next[f] = NO_FLOW;
+    g->prev[f] = l->tail;
+    if (l->tail != NO_FLOW) {
+        g->next[l->tail] = f;
+    } else {
+        l->head = f;
+    }
+    l->tail = f;
+}
+
+static void list_remove(loadgen_t *g, flow_list_t *l, uint32_t f)
+{
+    if (g->prev[f] != NO_FLOW) {
+        g->next[g->prev[f]] = g->next[f];
+    } else {
+        l->head = g->next[f];
+    }
+    if (g->next[f] != NO_FLOW) {
+        g->prev[g->next[f]] = g->prev[f];
+    } else {
+        l->tail = g->prev[f];
+    }
+}
+
+static void *add_option(uint8_t *cur, uint8_t code, uint16_t len)
+{
+    pcp_options_hdr_t *hdr = (pcp_options_hdr_t *)cur;
+
+    hdr->code = code;
+    hdr->reserved = 0;
+    hdr->len = htons(len);
+    return hdr->next_data;
+}
+
+// Builds request template of opcode and version with options. Returns 0 or
+// -1 with message printed if options don't fit the request.
+static int build_template(loadgen_t *g, const struct sockaddr_storage *local)
+{
+    const loadgen_opts_t *o = g->o;
+    pcp_request_t *req = (pcp_request_t *)g->tmpl;
+    struct sockaddr_storage ss;
+    socklen_t ss_len;
+    uint8_t *cur = req->next_data;
+
+    memset(g->tmpl, 0, sizeof(g->tmpl));
+    req->ver = o->version;
+    req->r_opcode = o->opcode;
+    req->req_lifetime = htonl(o->lifetime);
+    if (o->int_ip) {
+        if (parse_addr(o->int_ip, "0", &ss, &ss_len)) {
+            printf("Bad internal address %s \n", o->int_ip);
+            return -1;
+        }
+        addr_to_ip6(&ss, req->ip, NULL);
+    } else {
+        addr_to_ip6(local, req->ip, NULL);
+    }
+
+    if ((o->version == 2) && (o->opcode != PCP_OPCODE_ANNOUNCE)) {
+        // run ID in first and last word of nonce, flow in the middle one
+        g->nonce_off = (size_t)(cur - g->tmpl);
+        memcpy(cur, &g->run_id[0], 4);
+        memcpy(cur + 8, &g->run_id[1], 4);
+        cur += sizeof(struct pcp_nonce);
+    }
+
+    if ((o->opcode == PCP_OPCODE_MAP) || (o->opcode == PCP_OPCODE_PEER)) {
+        // MAP and PEER of both versions continue with MAP v1 fields
+        pcp_map_v1_t *map = (pcp_map_v1_t *)cur;
+
+        map->protocol = o->protocol;
+        g->port_off = (size_t)((uint8_t *)&map->int_port - g->tmpl);
+        cur = map->next_data;
+        if (o->opcode == PCP_OPCODE_PEER) {
+            pcp_peer_v1_t *peer = (pcp_peer_v1_t *)map;
+
+            if (parse_addr(o->peer, "80", &ss, &ss_len)) {
+                printf("Bad peer address %s \n", o->peer);
+                return -1;
+            }
+            addr_to_ip6(&ss, peer->peer_ip, &peer->peer_port);
+            cur = peer->next_data;
+        }
+    } else if (o->opcode == PCP_OPCODE_SADSCP) {
+        pcp_sadscp_req_t *sadscp = (pcp_sadscp_req_t *)(cur
+                - sizeof(struct pcp_nonce));
+        size_t name_len = strlen(o->app_name);
+
+        if (o->version != 2) {
+            printf("SADSCP is defined for version 2 only\n");
+            return -1;
+        }
+        if (name_len > 128) {
+            printf("Application name is too long\n");
+            return -1;
+        }
+        sadscp->tolerance_fields = o->tolerance;
+        memcpy(sadscp->app_name, o->app_name, name_len);
+        // app name is padded to multiple of 4
+        name_len += (4 - ((name_len + 2) % 4)) % 4;
+        sadscp->app_name_length = (uint8_t)name_len;
+        cur = (uint8_t *)sadscp->app_name + name_len;
+    }
+
+    if (o->third_party) {
+        uint32_t *ip = (uint32_t *)add_option(cur, PCP_OPTION_3RD_PARTY, 16);
+
+        if (parse_addr(o->third_party, "0", &ss, &ss_len)) {
+            printf("Bad third party address %s \n", o->third_party);
+            return -1;
+        }
+        addr_to_ip6(&ss, ip, NULL);
+        cur = (uint8_t *)(ip + 4);
+    }
+    if (o->prefer_failure) {
+        cur = (uint8_t *)add_option(cur, PCP_OPTION_PREF_FAIL, 0);
+    }
+    if (o->filter) {
+        pcp_filter_option_t *f = (pcp_filter_option_t *)cur;
+        char addr[INET6_ADDRSTRLEN + 16];
+        const char *slash = strrchr(o->filter, '/');
+        int prefix;
+
+        if ((slash == NULL) || ((size_t)(slash - o->filter) >= sizeof(addr))) {
+            printf("Bad filter %s \n", o->filter);
+            return -1;
+        }
+        memcpy(addr, o->filter, (size_t)(slash - o->filter));
+        addr[slash - o->filter] = 0;
+        prefix = atoi(slash + 1);
+        if ((parse_addr(addr, "0", &ss, &ss_len)) || (prefix < 0)
+                || (prefix > (ss.ss_family == AF_INET ? 32 : 128))) {
+            printf("Bad filter %s \n", o->filter);
+            return -1;
+        }
+        add_option(cur, PCP_OPTION_FILTER,
+                sizeof(*f) - sizeof(pcp_options_hdr_t));
+        addr_to_ip6(&ss, f->filter_peer_ip, &f->filter_peer_port);
+        f->filter_prefix = (uint8_t)(ss.ss_family == AF_INET ?
+                prefix + 96 : prefix);
+        cur = f->next_data;
+    }
+
+    g->tmpl_len = (size_t)(cur - g->tmpl);
+    if (g->tmpl_len > PCP_MAX_LEN) {
+        printf("Request is longer than " xstr(PCP_MAX_LEN) " bytes\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void fill_request(loadgen_t *g, uint32_t f, uint8_t *buf)
+{
+    memcpy(buf, g->tmpl, g->tmpl_len);
+    if (g->nonce_off) {
+        uint32_t n = htonl(f);
+
+        memcpy(buf + g->nonce_off + 4, &n, 4);
+    }
+    if (g->port_off) {
+        uint16_t port = htons((uint16_t)(g->o->port_base + f));
+
+        memcpy(buf + g->port_off, &port, 2);
+    }
+}
+
+// Flow of the request the response answers, NO_FLOW if there is none
+// waiting. Responses without nonce or internal port (ANNOUNCE, short error
+// responses) answer the oldest request.
+static uint32_t match_response(loadgen_t *g, const uint8_t *buf, size_t len)
+{
+    uint32_t f = NO_FLOW;
+
+    if ((len < 4) || (!(buf[1] & 0x80)) || ((buf[1] & 0x7f) != g->o->opcode)) {
+        return NO_FLOW;
+    }
+    if ((g->nonce_off) && (len >= g->nonce_off + sizeof(struct pcp_nonce))) {
+        uint32_t n;
+
+        if ((memcmp(buf + g->nonce_off, &g->run_id[0], 4) != 0)
+                || (memcmp(buf + g->nonce_off + 8, &g->run_id[1], 4) != 0)) {
+            return NO_FLOW;
+        }
+        memcpy(&n, buf + g->nonce_off + 4, 4);
+        f = ntohl(n);
+    } else if ((g->port_off) && (len >= g->port_off + 2)) {
+        f = (uint32_t)((buf[g->port_off] << 8) | buf[g->port_off + 1]);
+        f = f >= g->o->port_base ? f - g->o->port_base : NO_FLOW;
+    } else {
+        return g->waiting.head;
+    }
+    if ((f >= g->o->flows) || (g->sent_us[f] == 0)) {
+        return NO_FLOW;
+    }
+    return f;
+}
+
+static void datagrams_init(datagrams_t *d)
+{
+    d->bufs = (uint8_t *)malloc((size_t)LOADGEN_MAX_BATCH * PCP_MAX_LEN);
+    if (d->bufs == NULL) {
+        perror("pcp-loadgen");
+        exit(1);
+    }
+#ifdef PCP_LOADGEN_MMSG
+    {
+        int i;
+
+        memset(d->msgs, 0, sizeof(d->msgs));
+        for (i = 0; i < LOADGEN_MAX_BATCH; ++i) {
+            d->iovs[i].iov_base = d->bufs + (size_t)i * PCP_MAX_LEN;
+            d->msgs[i].msg_hdr.msg_iov = &d->iovs[i];
+            d->msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+    }
+#endif
+}
+
+// Sends n datagrams on connected socket, returns number of sent ones.
+static int send_datagrams(PCP_SOCKET sockfd, datagrams_t *d, int n)
+{
+    int done = 0;
+
+#ifdef PCP_LOADGEN_MMSG
+    int i;
+
+    for (i = 0; i < n; ++i) {
+        d->iovs[i].iov_len = d->lens[i];
+    }
+    while (done < n) {
+        int ret = sendmmsg(sockfd, d->msgs + done, (unsigned)(n - done), 0);
+
+        if (ret <= 0) {
+            if ((ret < 0) && (errno == EINTR)) {
+                continue;
+            }
+            break;
+        }
+        done += ret;
+    }
+#else
+    for (; done < n; ++done) {
+        if (send(sockfd, (const char *)d->bufs + (size_t)done * PCP_MAX_LEN,
+                (int)d->lens[done], 0) < 0) {
+            break;
+        }
+    }
+#endif
+    return done;
+}
+
+static int wait_readable(loadgen_t *g, uint64_t wait_us, fd_set *fds)
+{
+    struct timeval tv;
+    int maxfd = 0;
+    unsigned i;
+
+    FD_ZERO(fds);
+    for (i = 0; i < g->o->sockets; ++i) {
+        FD_SET(g->socks[i], fds);
+        if ((int)g->socks[i] > maxfd) {
+            maxfd = (int)g->socks[i];
+        }
+    }
+    tv.tv_sec = (long)(wait_us / 1000000);
+    tv.tv_usec = (long)(wait_us % 1000000);
+    return select(maxfd + 1, fds, NULL, NULL, &tv) > 0;
+}
+
+// Receives datagrams waiting on socket, up to LOADGEN_MAX_BATCH. Returns
+// number of received ones.
+static int recv_datagrams(PCP_SOCKET sockfd, datagrams_t *d)
+{
+#ifdef PCP_LOADGEN_MMSG
+    int i, n;
+
+    for (i = 0; i < LOADGEN_MAX_BATCH; ++i) {
+        d->iovs[i].iov_len = PCP_MAX_LEN;
+    }
+    n = recvmmsg(sockfd, d->msgs, LOADGEN_MAX_BATCH, MSG_DONTWAIT, NULL);
+    for (i = 0; i < n; ++i) {
+        d->lens[i] = d->msgs[i].msg_len;
+    }
+    return n > 0 ? n : 0;
+#else
+    fd_set fds;
+    struct timeval tv = { 0, 0 };
+    int n = 0;
+
+    while (n < LOADGEN_MAX_BATCH) {
+        int len;
+
+        FD_ZERO(&fds);
+        FD_SET(sockfd, &fds);
+        if (select((int)sockfd + 1, &fds, NULL, NULL, &tv) <= 0) {
+            break;
+        }
+        len = (int)recv(sockfd, (char *)d->bufs + (size_t)n * PCP_MAX_LEN,
+                PCP_MAX_LEN, 0);
+        if (len < 0) {
+            break;
+        }
+        d->lens[n++] = (size_t)len;
+    }
+    return n;
+#endif
+}
+
+static void record_answer(loadgen_t *g, uint32_t f, const uint8_t *buf,
+        uint64_t now)
+{
+    if (g->answered == g->rtts_cap) {
+        uint64_t cap = g->rtts_cap ? g->rtts_cap * 2 : 65536;
+        uint32_t *rtts = (uint32_t *)realloc(g->rtts, cap * sizeof(*rtts));
+
+        if (rtts == NULL) {
+            perror("pcp-loadgen");
+            exit(1);
+        }
+        g->rtts = rtts;
+        g->rtts_cap = cap;
+    }
+    g->rtts[g->answered++] = (uint32_t)(now - g->sent_us[f]);
+    g->results[buf[3]]++;
+    g->last_answer_us = now;
+    g->sent_us[f] = 0;
+    list_remove(g, &g->waiting, f);
+    g->nwaiting--;
+    list_append(g, &g->free_flows, f);
+}
+
+static void receive_responses(loadgen_t *g, datagrams_t *d, fd_set *fds)
+{
+    unsigned s;
+
+    for (s = 0; s < g->o->sockets; ++s) {
+        int n, i;
+
+        if (!FD_ISSET(g->socks[s], fds)) {
+            continue;
+        }
+        do {
+            uint64_t now;
+
+            n = recv_datagrams(g->socks[s], d);
+            now = now_us();
+            for (i = 0; i < n; ++i) {
+                const uint8_t *buf = d->bufs + (size_t)i * PCP_MAX_LEN;
+                uint32_t f = match_response(g, buf, d->lens[i]);
+
+                if (f == NO_FLOW) {
+                    g->unexpected++;
+                } else {
+                    record_answer(g, f, buf, now);
+                }
+            }
+        } while (n == LOADGEN_MAX_BATCH);
+    }
+}
+
+// Requests not answered in time, the oldest ones are at head of the list.
+// Returns time when the oldest waiting request expires.
+static uint64_t expire_requests(loadgen_t *g, uint64_t now)
+{
+    uint64_t timeout_us = (uint64_t)g->o->timeout_ms * 1000;
+
+    while (g->waiting.head != NO_FLOW) {
+        uint32_t f = g->waiting.head;
+
+        if (g->sent_us[f] + timeout_us > now) {
+            return g->sent_us[f] + timeout_us;
+        }
+        g->lost++;
+        g->sent_us[f] = 0;
+        list_remove(g, &g->waiting, f);
+        g->nwaiting--;
+        list_append(g, &g->free_flows, f);
+    }
+    return UINT64_MAX;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static void print_summary(loadgen_t *g, uint64_t start, uint64_t send_end)
+{
+    const loadgen_opts_t *o = g->o;
+    double send_secs = (send_end - start) / 1e6;
+    int i;
+
+    printf("Sent %llu %s v%u requests to %s in %.3f s (%.0f requests/s)\n",
+            (unsigned long long)g->sent, opcode_names[o->opcode], o->version,
+            o->server, send_secs, send_secs > 0 ? g->sent / send_secs : 0);
+    printf("  Answered:            %llu\n", (unsigned long long)g->answered);
+    printf("  Not answered:        %llu\n",
+            (unsigned long long)(g->lost + g->nwaiting));
+    printf("  Unexpected:          %llu\n", (unsigned long long)g->unexpected);
+    if (g->send_errors) {
+        printf("  Send errors:         %llu\n",
+                (unsigned long long)g->send_errors);
+    }
+    for (i = 0; i < 256; ++i) {
+        if (g->results[i] == 0) {
+            continue;
+        }
+        if (i < (int)(sizeof(result_names) / sizeof(result_names[0]))) {
+            printf("  %-20s %llu\n", result_names[i],
+                    (unsigned long long)g->results[i]);
+        } else {
+            printf("  Result %-13d %llu\n", i,
+                    (unsigned long long)g->results[i]);
+        }
+    }
+    if (g->answered > 0) {
+        double secs = (g->last_answer_us - start) / 1e6;
+        uint64_t n = g->answered;
+
+        qsort(g->rtts, n, sizeof(*g->rtts), cmp_u32);
+        printf("  Response rate:       %.0f responses/s\n",
+                secs > 0 ? n / secs : 0);
+        printf("  Round trip p50/p90/p99/p99.9/max: "
+                "%.3f / %.3f / %.3f / %.3f / %.3f ms\n",
+                g->rtts[n / 2] / 1e3, g->rtts[n * 90 / 100] / 1e3,
+                g->rtts[n * 99 / 100] / 1e3, g->rtts[n * 999 / 1000] / 1e3,
+                g->rtts[n - 1] / 1e3);
+    }
+    fflush(stdout);
+}
+
+static void open_sockets(loadgen_t *g, struct sockaddr_storage *local)
+{
+    struct sockaddr_storage server;
+    socklen_t server_len, local_len = sizeof(*local);
+    int bufsize = LOADGEN_SOCKET_BUFFER;
+    unsigned i;
+
+    if (parse_addr(g->o->server, PCP_PORT, &server, &server_len)) {
+        printf("Bad server address %s \n", g->o->server);
+        exit(1);
+    }
+    // each socket has its own port, so servers spreading clients by port
+    // among threads get all of them busy
+    for (i = 0; i < g->o->sockets; ++i) {
+        g->socks[i] = socket(server.ss_family, SOCK_DGRAM, 0);
+        if (g->socks[i] == PCP_INVALID_SOCKET) {
+            perror("pcp-loadgen: socket");
+            exit(1);
+        }
+        setsockopt(g->socks[i], SOL_SOCKET, SO_SNDBUF, (char *)&bufsize,
+                sizeof(bufsize));
+        setsockopt(g->socks[i], SOL_SOCKET, SO_RCVBUF, (char *)&bufsize,
+                sizeof(bufsize));
+        if (connect(g->socks[i], (struct sockaddr *)&server, server_len)) {
+            perror("pcp-loadgen: connect");
+            exit(1);
+        }
+    }
+    if (getsockname(g->socks[0], (struct sockaddr *)local, &local_len)) {
+        perror("pcp-loadgen: getsockname");
+        exit(1);
+    }
+}
+
+static int run(const loadgen_opts_t *o)
+{
+    loadgen_t g;
+    datagrams_t d;
+    struct sockaddr_storage local;
+    uint32_t batch_flows[LOADGEN_MAX_BATCH];
+    uint64_t start, end = 0, send_end = 0;
+    unsigned next_sock = 0, i;
+    int sending = 1;
+
+    memset(&g, 0, sizeof(g));
+    g.o = o;
+    srand((unsigned)now_us());
+    g.run_id[0] = (uint32_t)rand() ^ ((uint32_t)rand() << 16);
+    g.run_id[1] = (uint32_t)rand() ^ ((uint32_t)rand() << 16);
+    open_sockets(&g, &local);
+    if (build_template(&g, &local)) {
+        return 1;
+    }
+
+    g.sent_us = (uint64_t *)calloc(o->flows, sizeof(*g.sent_us));
+    g.next = (uint32_t *)calloc(o->flows, sizeof(*g.next));
+    g.prev = (uint32_t *)calloc(o->flows, sizeof(*g.prev));
+    if ((g.sent_us == NULL) || (g.next == NULL) || (g.prev == NULL)) {
+        perror("pcp-loadgen");
+        exit(1);
+    }
+    g.free_flows.head = g.free_flows.tail = NO_FLOW;
+    g.waiting.head = g.waiting.tail = NO_FLOW;
+    for (i = 0; i < o->flows; ++i) {
+        list_append(&g, &g.free_flows, i);
+    }
+    datagrams_init(&d);
+
+    start = now_us();
+    if (o->duration > 0) {
+        end = start + (uint64_t)(o->duration * 1e6);
+    }
+    while (1) {
+        uint64_t now = now_us(), wait_us = 100000, expires;
+        unsigned n = o->batch;
+        fd_set fds;
+
+        if ((sending) && ((loadgen_stop) || (g.sent >= o->requests)
+                || ((end) && (now >= end)))) {
+            sending = 0;
+            send_end = now;
+        }
+        if ((!sending) && ((g.nwaiting == 0) || (loadgen_stop > 1))) {
+            break;
+        }
+
+        if (sending) {
+            if (n > o->window - g.nwaiting) {
+                n = o->window - g.nwaiting;
+            }
+            if (n > o->requests - g.sent) {
+                n = (unsigned)(o->requests - g.sent);
+            }
+            if (o->rate > 0) {
+                uint64_t allowed = (uint64_t)((now - start) * o->rate / 1e6)
+                        + 1;
+
+                if (allowed <= g.sent) {
+                    uint64_t due = start + (uint64_t)(g.sent * 1e6 / o->rate);
+
+                    n = 0;
+                    wait_us = due > now ? due - now : 0;
+                } else if (n > allowed - g.sent) {
+                    n = (unsigned)(allowed - g.sent);
+                }
+            }
+        }
+        if ((sending) && (n > 0)) {
+            unsigned sent;
+
+            for (i = 0; i < n; ++i) {
+                batch_flows[i] = g.free_flows.head;
+                list_remove(&g, &g.free_flows, batch_flows[i]);
+                fill_request(&g, batch_flows[i],
+                        d.bufs + (size_t)i * PCP_MAX_LEN);
+                d.lens[i] = g.tmpl_len;
+            }
+            sent = (unsigned)send_datagrams(g.socks[next_sock], &d, (int)n);
+            next_sock = (next_sock + 1) % o->sockets;
+            now = now_us();
+            for (i = 0; i < n; ++i) {
+                if (i < sent) {
+                    g.sent_us[batch_flows[i]] = now;
+                    list_append(&g, &g.waiting, batch_flows[i]);
+                    g.nwaiting++;
+                } else {
+                    list_append(&g, &g.free_flows, batch_flows[i]);
+                }
+            }
+            g.sent += sent;
+            g.send_errors += n - sent;
+            // keep sending while the window permits, just pick up responses
+            wait_us = sent == n ? 0 : 1000;
+        }
+
+        expires = expire_requests(&g, now);
+        if ((expires != UINT64_MAX) && (expires - now < wait_us)) {
+            wait_us = expires > now ? expires - now : 0;
+        }
+        if ((end) && (sending) && (end > now) && (end - now < wait_us)) {
+            wait_us = end - now;
+        }
+        if (wait_readable(&g, wait_us, &fds)) {
+            receive_responses(&g, &d, &fds);
+        }
+    }
+    if (send_end == 0) {
+        send_end = now_us();
+    }
+
+    print_summary(&g, start, send_end);
+    for (i = 0; i < o->sockets; ++i) {
+        CLOSE(g.socks[i]);
+    }
+    free(d.bufs);
+    free(g.sent_us);
+    free(g.next);
+    free(g.prev);
+    free(g.rtts);
+    return (g.sent > 0) && (g.answered == g.sent) ? 0 : 1;
+}
+
+static void print_usage(void)
+{
+    printf("\n");
+    printf("Usage: pcp-loadgen [options]\n");
+    printf("Sends PCP requests to a server, matches responses to them and\n"
+           "prints throughput and round trip percentiles. Exits with 0 if\n"
+           "every request was answered.\n");
+    printf("-h, --help \t  Display this help \n");
+    printf("--server addr[:port]  Server to send requests to.\n"
+           "          \t   DEFAULT: 127.0.0.1:" PCP_PORT "\n");
+    printf("--opcode op \t  map, peer, announce or sadscp. DEFAULT: map\n");
+    printf("--version #v \t  PCP version 1 or 2. DEFAULT: 2\n");
+    printf("--requests #num  Number of requests to send.\n"
+           "          \t   DEFAULT: " xstr(LOADGEN_DEFAULT_REQUESTS) "\n");
+    printf("--duration #sec  Stop sending after #sec\n");
+    printf("--rate #num \t  Requests per second, 0 as fast as --window\n"
+           "          \t   permits. DEFAULT: 0\n");
+    printf("--window #num \t  Requests waiting for response at most.\n"
+           "          \t   DEFAULT: " xstr(LOADGEN_DEFAULT_WINDOW) "\n");
+    printf("--flows #num \t  Internal ports (and nonces) requests cycle\n"
+           "          \t   through. DEFAULT: 4 x window\n");
+    printf("--batch #num \t  Requests sent by one system call, at most\n"
+           "          \t   " xstr(LOADGEN_MAX_BATCH) ". DEFAULT: "
+           xstr(LOADGEN_DEFAULT_BATCH) "\n");
+    printf("--sockets #num \t  Send from #num source ports. DEFAULT: 1\n");
+    printf("--timeout #ms \t  Wait for response #ms.\n"
+           "          \t   DEFAULT: " xstr(LOADGEN_DEFAULT_TIMEOUT_MS) "\n");
+    printf("--lifetime #sec  Requested lifetime.\n"
+           "          \t   DEFAULT: " xstr(LOADGEN_DEFAULT_LIFETIME) "\n");
+    printf("--protocol #num  Protocol of MAP and PEER, tcp, udp or number.\n"
+           "          \t   DEFAULT: udp\n");
+    printf("--port-base #port  Internal port of the first flow.\n"
+           "          \t   DEFAULT: " xstr(LOADGEN_DEFAULT_PORT_BASE) "\n");
+    printf("--int-ip addr \t  Client address in requests.\n"
+           "          \t   DEFAULT: source address\n");
+    printf("--peer addr[:port]  Remote peer of PEER. DEFAULT: 192.0.2.1:80\n");
+    printf("--third-party addr  Add THIRD_PARTY option\n");
+    printf("--prefer-failure  Add PREFER_FAILURE option\n");
+    printf("--filter addr[:port]/prefix  Add FILTER option\n");
+    printf("--app-name name  Application name of SADSCP. DEFAULT: loadgen\n");
+    printf("--tolerance #d,#l,#j  Delay, loss and jitter tolerance of\n"
+           "          \t   SADSCP, 0-3 each. DEFAULT: 0,0,0\n");
+}
+
+#ifndef no_argument
+#define no_argument 0
+#endif
+
+#ifndef required_argument
+#define required_argument 1
+#endif
+
+static void bad_value(const char *name, const char *value)
+{
+    printf("Bad value for option --%s %s \n", name, value);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    loadgen_opts_t o;
+    int c, option_index = 0, ret;
+    unsigned d, l, j;
+
+    static struct option long_options[] = {
+            { "help", no_argument, 0, 0 },
+            { "server", required_argument, 0, 0 },
+            { "opcode", required_argument, 0, 0 },
+            { "version", required_argument, 0, 0 },
+            { "requests", required_argument, 0, 0 },
+            { "duration", required_argument, 0, 0 },
+            { "rate", required_argument, 0, 0 },
+            { "window", required_argument, 0, 0 },
+            { "flows", required_argument, 0, 0 },
+            { "batch", required_argument, 0, 0 },
+            { "sockets", required_argument, 0, 0 },
+            { "timeout", required_argument, 0, 0 },
+            { "lifetime", required_argument, 0, 0 },
+            { "protocol", required_argument, 0, 0 },
+            { "port-base", required_argument, 0, 0 },
+            { "int-ip", required_argument, 0, 0 },
+            { "peer", required_argument, 0, 0 },
+            { "third-party", required_argument, 0, 0 },
+            { "prefer-failure", no_argument, 0, 0 },
+            { "filter", required_argument, 0, 0 },
+            { "app-name", required_argument, 0, 0 },
+            { "tolerance", required_argument, 0, 0 },
+            { 0, 0, 0, 0 }
+    };
+
+    memset(&o, 0, sizeof(o));
+    o.server = "127.0.0.1:" PCP_PORT;
+    o.version = 2;
+    o.opcode = PCP_OPCODE_MAP;
+    o.protocol = IPPROTO_UDP;
+    o.lifetime = LOADGEN_DEFAULT_LIFETIME;
+    o.requests = LOADGEN_DEFAULT_REQUESTS;
+    o.window = LOADGEN_DEFAULT_WINDOW;
+    o.batch = LOADGEN_DEFAULT_BATCH;
+    o.sockets = 1;
+    o.timeout_ms = LOADGEN_DEFAULT_TIMEOUT_MS;
+    o.port_base = LOADGEN_DEFAULT_PORT_BASE;
+    o.peer = "192.0.2.1:80";
+    o.app_name = "loadgen";
+
+    opterr = 0;
+    while ((c = getopt_long(argc, argv, "h", long_options, &option_index))
+            != -1) {
+        const char *name;
+
+        if (c != 0) {
+            print_usage();
+            exit(1);
+        }
+        name = long_options[option_index].name;
+        if (!strcmp(name, "help")) {
+            print_usage();
+            exit(1);
+        } else if (!strcmp(name, "server")) {
+            o.server = optarg;
+        } else if (!strcmp(name, "opcode")) {
+            for (c = 0; c < 4; ++c) {
+                char lower[16];
+                size_t k;
+
+                for (k = 0; (opcode_names[c][k]) && (k < sizeof(lower) - 1);
+                        ++k) {
+                    lower[k] = (char)(opcode_names[c][k] - 'A' + 'a');
+                }
+                lower[k] = 0;
+                if (!strcmp(lower, optarg)) {
+                    break;
+                }
+            }
+            if (c == 4) {
+                bad_value(name, optarg);
+            }
+            o.opcode = (uint8_t)c;
+        } else if (!strcmp(name, "version")) {
+            c = atoi(optarg);
+            if ((c < 1) || (c > 2)) {
+                bad_value(name, optarg);
+            }
+            o.version = (uint8_t)c;
+        } else if (!strcmp(name, "requests")) {
+            o.requests = strtoull(optarg, NULL, 10);
+            if (o.requests == 0) {
+                bad_value(name, optarg);
+            }
+        } else if (!strcmp(name, "duration")) {
+            o.duration = atof(optarg);
+            if (o.duration <= 0) {
+                bad_value(name, optarg);
+            }
+        } else if (!strcmp(name, "rate")) {
+            o.rate = atof(optarg);
+            if (o.rate < 0) {
+                bad_value(name, optarg);
+            }
+        } else if (!strcmp(name, "window")) {
+            o.window = (uint32_t)atoi(optarg);
+            if (o.window < 1) {
+                bad_value(name, optarg);
+            }
+        } else if (!strcmp(name, "flows")) {
+            o.flows = (uint32_t)atoi(optarg);
+            if (o.flows < 1) {
+                bad_value(name, optarg);
+            }
+        } else if (!strcmp(name, "batch")) {
+            o.batch = (unsigned)atoi(optarg);
+            if ((o.batch < 1) || (o.batch > LOADGEN_MAX_BATCH)) {
+                bad_value(name, optarg);
+            }
+        } else if (!strcmp(name, "sockets")) {
+            o.sockets = (unsigned)atoi(optarg);
+            if ((o.sockets < 1) || (o.sockets > LOADGEN_MAX_SOCKETS)) {
+                bad_value(name, optarg);
+            }
+        } else if (!strcmp(name, "timeout")) {
+            o.timeout_ms = (uint32_t)atoi(optarg);
+            if (o.timeout_ms < 1) {
+                bad_value(name, optarg);
+            }
+        } else if (!strcmp(name, "lifetime")) {
+            o.lifetime = (uint32_t)strtoul(optarg, NULL, 10);
+        } else if (!strcmp(name, "protocol")) {
+            if (!strcmp(optarg, "udp")) {
+                o.protocol = IPPROTO_UDP;
+            } else if (!strcmp(optarg, "tcp")) {
+                o.protocol = IPPROTO_TCP;
+            } else {
+                c = atoi(optarg);
+                if ((c < 0) || (c > 255)) {
+                    bad_value(name, optarg);
+                }
+                o.protocol = (uint8_t)c;
+            }
+        } else if (!strcmp(name, "port-base")) {
+            c = atoi(optarg);
+            if ((c < 1) || (c > 65535)) {
+                bad_value(name, optarg);
+            }
+            o.port_base = (uint16_t)c;
+        } else if (!strcmp(name, "int-ip")) {
+            o.int_ip = optarg;
+        } else if (!strcmp(name, "peer")) {
+            o.peer = optarg;
+        } else if (!strcmp(name, "third-party")) {
+            o.third_party = optarg;
+        } else if (!strcmp(name, "prefer-failure")) {
+            o.prefer_failure = 1;
+        } else if (!strcmp(name, "filter")) {
+            o.filter = optarg;
+        } else if (!strcmp(name, "app-name")) {
+            o.app_name = optarg;
+        } else if (!strcmp(name, "tolerance")) {
+            if ((sscanf(optarg, "%u,%u,%u", &d, &l, &j) != 3) || (d > 3)
+                    || (l > 3) || (j > 3)) {
+                bad_value(name, optarg);
+            }
+            o.tolerance = (uint8_t)((d << 6) | (l << 4) | (j << 2));
+        }
+    }
+    if (optind != argc) {
+        print_usage();
+        exit(1);
+    }
+    if (o.flows == 0) {
+        o.flows = o.window * 4;
+    }
+    // every flow has its own internal port
+    if (o.flows > 65536u - o.port_base) {
+        o.flows = 65536u - o.port_base;
+    }
+    if (o.window > o.flows) {
+        o.window = o.flows;
+    }
+
+    PD_SOCKET_STARTUP();
+    signal(SIGINT, loadgen_signal);
+    signal(SIGTERM, loadgen_signal);
+
+    ret = run(&o);
+
+    PD_SOCKET_CLEANUP();
+    return ret;
+}
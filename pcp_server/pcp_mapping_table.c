@@ -0,0 +1,719 @@
+/*
+ * Copyright (c) 2014 by Cisco Systems, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#else
+#include "default_config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#ifndef WIN32
+#include <arpa/inet.h>
+#endif
+#include "pcp_msg_structs.h"
+#include "pcp_mapping_table.h"
+
+#define PMT_NONE UINT32_MAX
+#define PMT_WHEEL_SIZE 4096u
+#define PMT_PORT_WORDS (65536 / 64)
+#define PMT_SUMMARY_WORDS (PMT_PORT_WORDS / 64)
+#define PMT_INITIAL_SIZE 1024u
+
+typedef struct pmt_mapping {
+    struct in6_addr int_ip;
+    uint32_t nonce[3];
+    uint32_t expires;
+    uint32_t hnext;         // hash chain, or free list
+    uint32_t wprev;         // timer wheel slot list
+    uint32_t wnext;
+    uint32_t host;
+    uint16_t int_port;
+    uint16_t ext_port;
+    uint16_t ext_ip_idx;
+    uint8_t protocol;
+} pmt_mapping_t;
+
+// internal address and its number of mappings, for quota
+typedef struct pmt_host {
+    struct in6_addr ip;
+    uint32_t hnext;
+    uint32_t count;
+} pmt_host_t;
+
+// Ports of one external address. Bit in full[] is set when the word in used[]
+// has no free port, so first free port is found by two bit scans.
+typedef struct pmt_pool {
+    uint64_t used[PMT_PORT_WORDS];
+    uint64_t full[PMT_SUMMARY_WORDS];
+    uint32_t free_ports;
+} pmt_pool_t;
+
+struct pcp_mapping_table {
+    pmt_config_t cfg;
+    pmt_pool_t *pools;
+    pmt_mapping_t *maps;
+    uint32_t maps_cap;
+    uint32_t maps_free;
+    uint32_t *buckets;
+    uint32_t bucket_mask;
+    pmt_host_t *hosts;
+    uint32_t hosts_cap;
+    uint32_t hosts_free;
+    uint32_t *host_buckets;
+    uint32_t host_bucket_mask;
+    uint32_t wheel[PMT_WHEEL_SIZE];
+    uint32_t expired_to;
+    pmt_stats_t stats;
+};
+
+static inline int pmt_ctz64(uint64_t x)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctzll(x);
+#else
+    int n = 0;
+
+    while (!(x & 1)) {
+        x >>= 1;
+        n++;
+    }
+    return n;
+#endif
+}
+
+static uint32_t pmt_hash(const struct in6_addr *ip, uint32_t extra)
+{
+    uint32_t w[4];
+    uint64_t h = (extra + 1) * 0x9E3779B97F4A7C15ull;
+    int i;
+
+    memcpy(w, ip, sizeof(w));
+    for (i = 0; i < 4; ++i) {
+        h = (h ^ w[i]) * 0x9E3779B97F4A7C15ull;
+        h ^= h >> 29;
+    }
+    return (uint32_t)(h >> 32);
+}
+
+static inline uint32_t pmt_map_hash(const struct in6_addr *ip, uint16_t port,
+        uint8_t protocol)
+{
+    return pmt_hash(ip, ((uint32_t)port << 8) | protocol);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//                       External addresses and ports
+
+static void pmt_ext_ip(pcp_mapping_table_t *mt, uint32_t idx,
+        struct in6_addr *ip)
+{
+    uint32_t low;
+
+    *ip = mt->cfg.ext_ip;
+    memcpy(&low, &ip->s6_addr[12], sizeof(low));
+    low = htonl(ntohl(low) + idx);
+    memcpy(&ip->s6_addr[12], &low, sizeof(low));
+}
+
+static int pmt_ext_ip_idx(pcp_mapping_table_t *mt, const struct in6_addr *ip)
+{
+    uint32_t base, low;
+
+    if (memcmp(ip, &mt->cfg.ext_ip, 12) != 0) {
+        return -1;
+    }
+    memcpy(&base, &mt->cfg.ext_ip.s6_addr[12], sizeof(base));
+    memcpy(&low, &ip->s6_addr[12], sizeof(low));
+    low = ntohl(low) - ntohl(base);
+
+    return low < mt->cfg.ext_ip_count ? (int)low : -1;
+}
+
+static int pool_take(pmt_pool_t *p, uint16_t port)
+{
+    uint32_t w = port >> 6;
+    uint64_t bit = 1ull << (port & 63);
+
+    if (p->used[w] & bit) {
+        return 0;
+    }
+    p->used[w] |= bit;
+    if (p->used[w] == ~0ull) {
+        p->full[w >> 6] |= 1ull << (w & 63);
+    }
+    p->free_ports--;
+    return 1;
+}
+
+static void pool_release(pmt_pool_t *p, uint16_t port)
+{
+    uint32_t w = port >> 6;
+
+    p->used[w] &= ~(1ull << (port & 63));
+    p->full[w >> 6] &= ~(1ull << (w & 63));
+    p->free_ports++;
+}
+
+// Marks ports out of <min, max> as used, one word at a time.
+static void pool_init(pmt_pool_t *p, uint16_t min, uint16_t max)
+{
+    uint32_t w;
+
+    memset(p->full, 0, sizeof(p->full));
+    for (w = 0; w < PMT_PORT_WORDS; ++w) {
+        uint32_t lo = w * 64;
+        uint32_t hi = lo + 63;
+        uint64_t used = 0;
+
+        if ((hi < min) || (lo > max)) {
+            used = ~0ull;
+        } else {
+            if (lo < min) {
+                used |= (1ull << (min - lo)) - 1;
+            }
+            if (hi > max) {
+                used |= ~0ull << (max - lo + 1);
+            }
+        }
+        p->used[w] = used;
+        if (used == ~0ull) {
+            p->full[w >> 6] |= 1ull << (w & 63);
+        }
+    }
+    p->free_ports = (uint32_t)(max - min) + 1;
+}
+
+static int pool_first_free(pmt_pool_t *p)
+{
+    uint32_t s;
+
+    for (s = 0; s < PMT_SUMMARY_WORDS; ++s) {
+        if (~p->full[s]) {
+            uint32_t w = s * 64 + pmt_ctz64(~p->full[s]);
+
+            return (int)(w * 64 + pmt_ctz64(~p->used[w]));
+        }
+    }
+    return -1;
+}
+
+static uint8_t pmt_alloc_port(pcp_mapping_table_t *mt,
+        const pmt_request_t *req, uint16_t *ip_idx, uint16_t *port)
+{
+    uint32_t cnt = mt->cfg.ext_ip_count;
+    int sugg_idx = pmt_ext_ip_idx(mt, &req->sugg_ip);
+    uint32_t pref, i;
+
+    // internal address keeps the same external address (paired pooling)
+    pref = sugg_idx >= 0 ? (uint32_t)sugg_idx
+            : pmt_hash(&req->int_ip, 0) % cnt;
+
+    if (req->sugg_port != 0) {
+        if ((req->sugg_port >= mt->cfg.port_min)
+                && (req->sugg_port <= mt->cfg.port_max)
+                && (pool_take(&mt->pools[pref], req->sugg_port))) {
+            *ip_idx = (uint16_t)pref;
+            *port = req->sugg_port;
+            return PCP_RES_SUCCESS;
+        }
+        if (req->prefer_failure) {
+            return PCP_RES_CANNOT_PROVIDE_EXTERNAL;
+        }
+    }
+
+    for (i = 0; i < cnt; ++i) {
+        uint32_t idx = (pref + i) % cnt;
+
+        if (mt->pools[idx].free_ports != 0) {
+            *ip_idx = (uint16_t)idx;
+            *port = (uint16_t)pool_first_free(&mt->pools[idx]);
+            pool_take(&mt->pools[idx], *port);
+            return PCP_RES_SUCCESS;
+        }
+    }
+    return PCP_RES_NO_RESOURCES;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//                        Internal addresses (quota)
+
+static uint32_t pmt_host_find(pcp_mapping_table_t *mt,
+        const struct in6_addr *ip)
+{
+    uint32_t i = mt->host_buckets[pmt_hash(ip, 0) & mt->host_bucket_mask];
+
+    while ((i != PMT_NONE) && (memcmp(&mt->hosts[i].ip, ip, sizeof(*ip)))) {
+        i = mt->hosts[i].hnext;
+    }
+    return i;
+}
+
+static int pmt_host_rehash(pcp_mapping_table_t *mt)
+{
+    uint32_t size = (mt->host_bucket_mask + 1) * 2;
+    uint32_t *buckets = (uint32_t *)malloc(size * sizeof(*buckets));
+    uint32_t b;
+
+    if (!buckets) {
+        return -1;
+    }
+    memset(buckets, 0xFF, size * sizeof(*buckets));
+    for (b = 0; b <= mt->host_bucket_mask; ++b) {
+        uint32_t i = mt->host_buckets[b];
+
+        while (i != PMT_NONE) {
+            uint32_t next = mt->hosts[i].hnext;
+            uint32_t nb = pmt_hash(&mt->hosts[i].ip, 0) & (size - 1);
+
+            mt->hosts[i].hnext = buckets[nb];
+            buckets[nb] = i;
+            i = next;
+        }
+    }
+    free(mt->host_buckets);
+    mt->host_buckets = buckets;
+    mt->host_bucket_mask = size - 1;
+    return 0;
+}
+
+static uint32_t pmt_host_get(pcp_mapping_table_t *mt,
+        const struct in6_addr *ip)
+{
+    uint32_t i = pmt_host_find(mt, ip);
+    uint32_t b;
+
+    if (i != PMT_NONE) {
+        return i;
+    }
+
+    if (mt->hosts_free == PMT_NONE) {
+        uint32_t cap = mt->hosts_cap * 2;
+        pmt_host_t *hosts = (pmt_host_t *)realloc(mt->hosts,
+                (size_t)cap * sizeof(*hosts));
+
+        if (!hosts) {
+            return PMT_NONE;
+        }
+        for (i = mt->hosts_cap; i < cap; ++i) {
+            hosts[i].hnext = i + 1 < cap ? i + 1 : PMT_NONE;
+        }
+        mt->hosts_free = mt->hosts_cap;
+        mt->hosts = hosts;
+        mt->hosts_cap = cap;
+    }
+    if ((mt->stats.hosts > mt->host_bucket_mask) && (pmt_host_rehash(mt))) {
+        return PMT_NONE;
+    }
+
+    i = mt->hosts_free;
+    mt->hosts_free = mt->hosts[i].hnext;
+    mt->hosts[i].ip = *ip;
+    mt->hosts[i].count = 0;
+    b = pmt_hash(ip, 0) & mt->host_bucket_mask;
+    mt->hosts[i].hnext = mt->host_buckets[b];
+    mt->host_buckets[b] = i;
+    mt->stats.hosts++;
+
+    return i;
+}
+
+// removes internal address without mappings
+static void pmt_host_put(pcp_mapping_table_t *mt, uint32_t h)
+{
+    uint32_t *pi;
+
+    if (mt->hosts[h].count != 0) {
+        return;
+    }
+    pi = &mt->host_buckets[pmt_hash(&mt->hosts[h].ip, 0)
+            & mt->host_bucket_mask];
+    while (*pi != h) {
+        pi = &mt->hosts[*pi].hnext;
+    }
+    *pi = mt->hosts[h].hnext;
+    mt->hosts[h].hnext = mt->hosts_free;
+    mt->hosts_free = h;
+    mt->stats.hosts--;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//                             Mappings
+
+static uint32_t pmt_find(pcp_mapping_table_t *mt, const pmt_request_t *req)
+{
+    uint32_t i = mt->buckets[pmt_map_hash(&req->int_ip, req->int_port,
+            req->protocol) & mt->bucket_mask];
+
+    while (i != PMT_NONE) {
+        pmt_mapping_t *m = &mt->maps[i];
+
+        if ((m->int_port == req->int_port) && (m->protocol == req->protocol)
+                && (!memcmp(&m->int_ip, &req->int_ip, sizeof(m->int_ip)))) {
+            return i;
+        }
+        i = m->hnext;
+    }
+    return PMT_NONE;
+}
+
+static int pmt_rehash(pcp_mapping_table_t *mt)
+{
+    uint32_t size = (mt->bucket_mask + 1) * 2;
+    uint32_t *buckets = (uint32_t *)malloc((size_t)size * sizeof(*buckets));
+    uint32_t b;
+
+    if (!buckets) {
+        return -1;
+    }
+    memset(buckets, 0xFF, (size_t)size * sizeof(*buckets));
+    for (b = 0; b <= mt->bucket_mask; ++b) {
+        uint32_t i = mt->buckets[b];
+
+        while (i != PMT_NONE) {
+            pmt_mapping_t *m = &mt->maps[i];
+            uint32_t next = m->hnext;
+            uint32_t nb = pmt_map_hash(&m->int_ip, m->int_port, m->protocol)
+                    & (size - 1);
+
+            m->hnext = buckets[nb];
+            buckets[nb] = i;
+            i = next;
+        }
+    }
+    free(mt->buckets);
+    mt->buckets = buckets;
+    mt->bucket_mask = size - 1;
+    return 0;
+}
+
+static uint32_t pmt_alloc_mapping(pcp_mapping_table_t *mt)
+{
+    uint32_t i;
+
+    if (mt->maps_free == PMT_NONE) {
+        uint32_t cap = mt->maps_cap * 2;
+        pmt_mapping_t *maps;
+
+        if (cap <= mt->maps_cap) {
+            return PMT_NONE;
+        }
+        maps = (pmt_mapping_t *)realloc(mt->maps, (size_t)cap * sizeof(*maps));
+        if (!maps) {
+            return PMT_NONE;
+        }
+        for (i = mt->maps_cap; i < cap; ++i) {
+            maps[i].hnext = i + 1 < cap ? i + 1 : PMT_NONE;
+        }
+        mt->maps_free = mt->maps_cap;
+        mt->maps = maps;
+        mt->maps_cap = cap;
+    }
+    if ((mt->stats.mappings > mt->bucket_mask) && (pmt_rehash(mt))) {
+        return PMT_NONE;
+    }
+
+    i = mt->maps_free;
+    mt->maps_free = mt->maps[i].hnext;
+    return i;
+}
+
+static void wheel_link(pcp_mapping_table_t *mt, uint32_t i)
+{
+    pmt_mapping_t *m = &mt->maps[i];
+    uint32_t *slot = &mt->wheel[m->expires & (PMT_WHEEL_SIZE - 1)];
+
+    m->wprev = PMT_NONE;
+    m->wnext = *slot;
+    if (*slot != PMT_NONE) {
+        mt->maps[*slot].wprev = i;
+    }
+    *slot = i;
+}
+
+static void wheel_unlink(pcp_mapping_table_t *mt, uint32_t i)
+{
+    pmt_mapping_t *m = &mt->maps[i];
+
+    if (m->wprev != PMT_NONE) {
+        mt->maps[m->wprev].wnext = m->wnext;
+    } else {
+        mt->wheel[m->expires & (PMT_WHEEL_SIZE - 1)] = m->wnext;
+    }
+    if (m->wnext != PMT_NONE) {
+        mt->maps[m->wnext].wprev = m->wprev;
+    }
+}
+
+static void pmt_remove(pcp_mapping_table_t *mt, uint32_t i)
+{
+    pmt_mapping_t *m = &mt->maps[i];
+    uint32_t *pi = &mt->buckets[pmt_map_hash(&m->int_ip, m->int_port,
+            m->protocol) & mt->bucket_mask];
+
+    while (*pi != i) {
+        pi = &mt->maps[*pi].hnext;
+    }
+    *pi = m->hnext;
+    wheel_unlink(mt, i);
+    pool_release(&mt->pools[m->ext_ip_idx], m->ext_port);
+    mt->hosts[m->host].count--;
+    pmt_host_put(mt, m->host);
+
+    m->hnext = mt->maps_free;
+    mt->maps_free = i;
+    mt->stats.mappings--;
+}
+
+void pmt_expire(pcp_mapping_table_t *mt, uint32_t now)
+{
+    uint32_t steps, t;
+
+    if (now <= mt->expired_to) {
+        return;
+    }
+
+    // slots are visited once per second, all of them after longer pause
+    steps = now - mt->expired_to;
+    if (steps > PMT_WHEEL_SIZE) {
+        steps = PMT_WHEEL_SIZE;
+    }
+    for (t = 1; t <= steps; ++t) {
+        uint32_t i = mt->wheel[(mt->expired_to + t) & (PMT_WHEEL_SIZE - 1)];
+
+        while (i != PMT_NONE) {
+            uint32_t next = mt->maps[i].wnext;
+
+            // later rounds of the wheel stay in the slot
+            if (mt->maps[i].expires <= now) {
+                pmt_remove(mt, i);
+                mt->stats.expired++;
+            }
+            i = next;
+        }
+    }
+    mt->expired_to = now;
+}
+
+void pmt_clear(pcp_mapping_table_t *mt)
+{
+    uint32_t t;
+
+    for (t = 0; t < PMT_WHEEL_SIZE; ++t) {
+        while (mt->wheel[t] != PMT_NONE) {
+            pmt_remove(mt, mt->wheel[t]);
+        }
+    }
+    mt->expired_to = 0;
+}
+
+static uint8_t pmt_reject(pcp_mapping_table_t *mt, pmt_result_t *res,
+        uint8_t result_code, uint32_t lifetime)
+{
+    mt->stats.rejected++;
+    res->result_code = result_code;
+    res->lifetime = lifetime;
+    return result_code;
+}
+
+uint8_t pmt_process(pcp_mapping_table_t *mt, const pmt_request_t *req,
+        uint32_t now, pmt_result_t *res)
+{
+    uint32_t lifetime = req->lifetime;
+    pmt_mapping_t *m;
+    uint32_t i, host;
+    uint16_t ip_idx = 0, port = 0;
+    uint8_t result_code;
+
+    pmt_expire(mt, now);
+
+    res->result_code = PCP_RES_SUCCESS;
+    res->ext_ip = req->sugg_ip;
+    res->ext_port = req->sugg_port;
+    if (lifetime > mt->cfg.max_lifetime) {
+        lifetime = mt->cfg.max_lifetime;
+    }
+    res->lifetime = lifetime;
+
+    i = pmt_find(mt, req);
+    if (i != PMT_NONE) {
+        m = &mt->maps[i];
+        // mapping belongs to another client
+        if (memcmp(m->nonce, req->nonce, sizeof(m->nonce))) {
+            return pmt_reject(mt, res, PCP_RES_NOT_AUTHORIZED,
+                    PMT_LONG_ERROR_LIFETIME);
+        }
+        pmt_ext_ip(mt, m->ext_ip_idx, &res->ext_ip);
+        res->ext_port = m->ext_port;
+        if (lifetime == 0) {
+            pmt_remove(mt, i);
+            mt->stats.deleted++;
+        } else {
+            wheel_unlink(mt, i);
+            m->expires = now + lifetime;
+            wheel_link(mt, i);
+            mt->stats.renewed++;
+        }
+        return PCP_RES_SUCCESS;
+    }
+
+    // nothing to delete
+    if (lifetime == 0) {
+        return PCP_RES_SUCCESS;
+    }
+
+    if ((mt->cfg.max_mappings != 0)
+            && (mt->stats.mappings >= mt->cfg.max_mappings)) {
+        return pmt_reject(mt, res, PCP_RES_NO_RESOURCES,
+                PMT_SHORT_ERROR_LIFETIME);
+    }
+
+    host = pmt_host_get(mt, &req->int_ip);
+    if (host == PMT_NONE) {
+        return pmt_reject(mt, res, PCP_RES_NO_RESOURCES,
+                PMT_SHORT_ERROR_LIFETIME);
+    }
+    if ((mt->cfg.quota != 0) && (mt->hosts[host].count >= mt->cfg.quota)) {
+        return pmt_reject(mt, res, PCP_RES_USER_EX_QUOTA,
+                PMT_SHORT_ERROR_LIFETIME);
+    }
+
+    result_code = pmt_alloc_port(mt, req, &ip_idx, &port);
+    if (result_code == PCP_RES_SUCCESS) {
+        i = pmt_alloc_mapping(mt);
+        if (i == PMT_NONE) {
+            pool_release(&mt->pools[ip_idx], port);
+            result_code = PCP_RES_NO_RESOURCES;
+        }
+    }
+    if (result_code != PCP_RES_SUCCESS) {
+        pmt_host_put(mt, host);
+        return pmt_reject(mt, res, result_code, PMT_SHORT_ERROR_LIFETIME);
+    }
+
+    m = &mt->maps[i];
+    m->int_ip = req->int_ip;
+    memcpy(m->nonce, req->nonce, sizeof(m->nonce));
+    m->int_port = req->int_port;
+    m->protocol = req->protocol;
+    m->ext_ip_idx = ip_idx;
+    m->ext_port = port;
+    m->expires = now + lifetime;
+    m->host = host;
+    {
+        uint32_t b = pmt_map_hash(&m->int_ip, m->int_port, m->protocol)
+                & mt->bucket_mask;
+
+        m->hnext = mt->buckets[b];
+        mt->buckets[b] = i;
+    }
+    wheel_link(mt, i);
+    mt->hosts[host].count++;
+    mt->stats.mappings++;
+    mt->stats.created++;
+
+    pmt_ext_ip(mt, ip_idx, &res->ext_ip);
+    res->ext_port = port;
+    return PCP_RES_SUCCESS;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//                           Table lifecycle
+
+pcp_mapping_table_t *pmt_create(const pmt_config_t *cfg)
+{
+    pcp_mapping_table_t *mt;
+    uint32_t i;
+
+    if ((!cfg) || (cfg->ext_ip_count == 0)
+            || (cfg->ext_ip_count > PMT_MAX_EXT_IPS)
+            || (cfg->port_min == 0) || (cfg->port_min > cfg->port_max)) {
+        return NULL;
+    }
+
+    mt = (pcp_mapping_table_t *)calloc(1, sizeof(*mt));
+    if (!mt) {
+        return NULL;
+    }
+    mt->cfg = *cfg;
+    if (mt->cfg.max_lifetime == 0) {
+        mt->cfg.max_lifetime = PMT_DEFAULT_MAX_LIFETIME;
+    }
+    memset(mt->wheel, 0xFF, sizeof(mt->wheel));
+
+    mt->pools = (pmt_pool_t *)calloc(cfg->ext_ip_count, sizeof(*mt->pools));
+    mt->maps = (pmt_mapping_t *)malloc(PMT_INITIAL_SIZE * sizeof(*mt->maps));
+    mt->buckets = (uint32_t *)malloc(PMT_INITIAL_SIZE * sizeof(uint32_t));
+    mt->hosts = (pmt_host_t *)malloc(PMT_INITIAL_SIZE * sizeof(*mt->hosts));
+    mt->host_buckets = (uint32_t *)malloc(PMT_INITIAL_SIZE * sizeof(uint32_t));
+    if ((!mt->pools) || (!mt->maps) || (!mt->buckets) || (!mt->hosts)
+            || (!mt->host_buckets)) {
+        pmt_destroy(mt);
+        return NULL;
+    }
+
+    mt->maps_cap = mt->hosts_cap = PMT_INITIAL_SIZE;
+    mt->bucket_mask = mt->host_bucket_mask = PMT_INITIAL_SIZE - 1;
+    memset(mt->buckets, 0xFF, PMT_INITIAL_SIZE * sizeof(uint32_t));
+    memset(mt->host_buckets, 0xFF, PMT_INITIAL_SIZE * sizeof(uint32_t));
+    for (i = 0; i < PMT_INITIAL_SIZE; ++i) {
+        mt->maps[i].hnext = i + 1 < PMT_INITIAL_SIZE ? i + 1 : PMT_NONE;
+        mt->hosts[i].hnext = i + 1 < PMT_INITIAL_SIZE ? i + 1 : PMT_NONE;
+    }
+    mt->maps_free = mt->hosts_free = 0;
+
+    // ports out of range are never free; port 0 is not used either
+    for (i = 0; i < cfg->ext_ip_count; ++i) {
+        pool_init(&mt->pools[i], cfg->port_min, cfg->port_max);
+    }
+
+    return mt;
+}
+
+void pmt_destroy(pcp_mapping_table_t *mt)
+{
+    if (!mt) {
+        return;
+    }
+    free(mt->pools);
+    free(mt->maps);
+    free(mt->buckets);
+    free(mt->hosts);
+    free(mt->host_buckets);
+    free(mt);
+}
+
+void pmt_get_stats(pcp_mapping_table_t *mt, pmt_stats_t *stats)
+{
+    *stats = mt->stats;
+    stats->memory = sizeof(*mt)
+            + mt->cfg.ext_ip_count * sizeof(*mt->pools)
+            + (size_t)mt->maps_cap * sizeof(*mt->maps)
+            + ((size_t)mt->bucket_mask + 1) * sizeof(uint32_t)
+            + (size_t)mt->hosts_cap * sizeof(*mt->hosts)
+            + ((size_t)mt->host_bucket_mask + 1) * sizeof(uint32_t);
+}
@@ -0,0 +1,110 @@
+/*
+ * Copyright (c) 2014 by Cisco Systems, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef PCP_MAPPING_TABLE_H_
+#define PCP_MAPPING_TABLE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#ifdef WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <netinet/in.h>
+#endif
+
+// Mapping table of the test PCP server. Mappings are identified by internal
+// address, protocol and internal port; nonce proves ownership of a mapping.
+// External ports are allocated from a bitmap per external address and
+// mappings expire on a timer wheel with one second slots.
+
+#define PMT_MAX_EXT_IPS 1024
+#define PMT_DEFAULT_MAX_LIFETIME 7200
+// lifetime of NO_RESOURCES, USER_EX_QUOTA and CANNOT_PROVIDE_EXTERNAL
+#define PMT_SHORT_ERROR_LIFETIME 30
+// lifetime of NOT_AUTHORIZED
+#define PMT_LONG_ERROR_LIFETIME 1800
+
+typedef struct pmt_config {
+    struct in6_addr ext_ip;     // first external address
+    uint32_t ext_ip_count;      // consecutive external addresses
+    uint16_t port_min;
+    uint16_t port_max;
+    uint32_t max_lifetime;
+    uint32_t max_mappings;      // 0 - limited by ports only
+    uint32_t quota;             // mappings per internal address, 0 - none
+} pmt_config_t;
+
+typedef struct pmt_request {
+    struct in6_addr int_ip;
+    uint32_t nonce[3];
+    uint16_t int_port;          // host byte order
+    uint8_t protocol;
+    uint8_t prefer_failure;
+    struct in6_addr sugg_ip;
+    uint16_t sugg_port;         // host byte order, 0 - no suggestion
+    uint32_t lifetime;
+} pmt_request_t;
+
+typedef struct pmt_result {
+    uint8_t result_code;
+    uint32_t lifetime;
+    struct in6_addr ext_ip;
+    uint16_t ext_port;          // host byte order
+} pmt_result_t;
+
+typedef struct pmt_stats {
+    uint32_t mappings;
+    uint32_t hosts;
+    uint64_t created;
+    uint64_t renewed;
+    uint64_t deleted;
+    uint64_t expired;
+    uint64_t rejected;
+    size_t memory;
+} pmt_stats_t;
+
+typedef struct pcp_mapping_table pcp_mapping_table_t;
+
+pcp_mapping_table_t *pmt_create(const pmt_config_t *cfg);
+
+void pmt_destroy(pcp_mapping_table_t *mt);
+
+// Creates, renews or deletes (lifetime 0) mapping. now is in seconds and
+// must not decrease between calls. Returns PCP result code, also set in res.
+uint8_t pmt_process(pcp_mapping_table_t *mt, const pmt_request_t *req,
+        uint32_t now, pmt_result_t *res);
+
+// removes mappings which expired before or at now
+void pmt_expire(pcp_mapping_table_t *mt, uint32_t now);
+
+// Removes all mappings as they are lost when the server restarts. Time of
+// next pmt_process starts again from 0.
+void pmt_clear(pcp_mapping_table_t *mt);
+
+void pmt_get_stats(pcp_mapping_table_t *mt, pmt_stats_t *stats);
+
+#endif /* PCP_MAPPING_TABLE_H_ */
@@ -0,0 +1,927 @@
+/*
+ * Copyright (c) 2014 by Cisco Systems, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * pcp-replay sends PCP requests of a capture to a PCP server and compares
+ * the responses with the recorded ones, or stands in for the recorded server
+ * and answers client requests with the recorded responses.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#else
+#include "default_config.h"
+#endif
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include "getopt.h"
+#include "pcp_socket.h"
+
+#ifdef WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include "pcp_gettimeofday.h"
+#else
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#endif
+
+#include "pcp_msg_structs.h"
+#include "pcp_utils.h"
+#include "pcp.h"
+#include "pcp_pcap.h"
+
+#define PCP_PORT "5351"
+#define REPLAY_DEFAULT_WINDOW 64
+#define REPLAY_DEFAULT_TIMEOUT_MS 1000
+// how far back a response looks for its request
+#define REPLAY_PAIR_WINDOW 1024
+#define PCP_HDR_LEN 24
+#define PCP_NONCE_LEN 12
+
+#define xstr(s) str(s)
+#define str(s) #s
+
+typedef struct msg_key {
+    uint8_t ver; //only compared in respond mode
+    uint8_t opcode;
+    uint8_t protocol;
+    uint16_t int_port;
+    uint16_t peer_port;
+    uint32_t peer_ip[4];
+    uint32_t nonce[3];
+} msg_key_t;
+
+typedef struct replay_msg {
+    uint64_t ts_us; //since the first datagram
+    struct sockaddr_storage src;
+    struct sockaddr_storage dst;
+    uint8_t *data;
+    size_t len;
+    uint8_t response;
+    uint8_t used;
+    msg_key_t key;
+    long pair; //recorded response of request, -1 if there is none
+} replay_msg_t;
+
+typedef struct recording {
+    replay_msg_t *msgs;
+    size_t count;
+} recording_t;
+
+typedef struct replay_opts {
+    const char *server;
+    const char *respond;
+    double speed;
+    unsigned window;
+    uint32_t timeout_ms;
+    int strict;
+    int verbose;
+} replay_opts_t;
+
+static volatile sig_atomic_t replay_stop = 0;
+
+static void replay_signal(int sig)
+{
+    (void)sig;
+    replay_stop = 1;
+}
+
+static uint64_t now_us(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + (uint64_t)tv.tv_usec;
+}
+
+static int is_response(const uint8_t *data, size_t len)
+{
+    return (len >= 2) && (data[1] & 0x80);
+}
+
+static int has_nonce(const uint8_t *data, size_t len)
+{
+    uint8_t opcode = data[1] & 0x7f;
+
+    return (data[0] >= 2) && (len >= PCP_HDR_LEN + PCP_NONCE_LEN)
+            && ((opcode == PCP_OPCODE_MAP) || (opcode == PCP_OPCODE_PEER)
+                    || (opcode == PCP_OPCODE_SADSCP));
+}
+
+// Identifies request and its response. Nonce and version are left out where
+// they can't be relied on.
+static void get_key(const uint8_t *data, size_t len, int with_nonce,
+        int with_ver, msg_key_t *key)
+{
+    size_t base = PCP_HDR_LEN;
+
+    memset(key, 0, sizeof(*key));
+    if (len < 2) {
+        return;
+    }
+    key->ver = with_ver ? data[0] : 0;
+    key->opcode = data[1] & 0x7f;
+
+    if (data[0] == 0) {
+        // NAT-PMP: internal port follows header of request and response
+        size_t port_off = is_response(data, len) ? 8 : 4;
+
+        if ((key->opcode != NATPMP_OPCODE_ANNOUNCE) && (len >= port_off + 2)) {
+            memcpy(&key->int_port, data + port_off, 2);
+        }
+        return;
+    }
+
+    if (has_nonce(data, len)) {
+        if (with_nonce) {
+            memcpy(key->nonce, data + base, PCP_NONCE_LEN);
+        }
+        base += PCP_NONCE_LEN;
+    }
+    // MAP and PEER of both versions have the same layout after the nonce
+    if (((key->opcode == PCP_OPCODE_MAP) || (key->opcode == PCP_OPCODE_PEER))
+            && (len >= base + sizeof(pcp_map_v1_t))) {
+        const pcp_map_v1_t *m = (const pcp_map_v1_t *)(data + base);
+
+        key->protocol = m->protocol;
+        key->int_port = m->int_port;
+        if ((key->opcode == PCP_OPCODE_PEER)
+                && (len >= base + sizeof(pcp_peer_v1_t))) {
+            const pcp_peer_v1_t *p = (const pcp_peer_v1_t *)(data + base);
+
+            key->peer_port = p->peer_port;
+            memcpy(key->peer_ip, p->peer_ip, sizeof(key->peer_ip));
+        }
+    }
+}
+
+static int same_addr(const struct sockaddr_storage *a,
+        const struct sockaddr_storage *b)
+{
+    if (a->ss_family != b->ss_family) {
+        return 0;
+    }
+    if (a->ss_family == AF_INET) {
+        const struct sockaddr_in *x = (const struct sockaddr_in *)a;
+        const struct sockaddr_in *y = (const struct sockaddr_in *)b;
+
+        return (x->sin_port == y->sin_port)
+                && (x->sin_addr.s_addr == y->sin_addr.s_addr);
+    } else {
+        const struct sockaddr_in6 *x = (const struct sockaddr_in6 *)a;
+        const struct sockaddr_in6 *y = (const struct sockaddr_in6 *)b;
+
+        return (x->sin6_port == y->sin6_port)
+                && (!memcmp(&x->sin6_addr, &y->sin6_addr, sizeof(x->sin6_addr)));
+    }
+}
+
+// Response is paired with the earliest unanswered request of the same key
+// sent to its destination, or of the same opcode if the key doesn't match,
+// as with a response of other version.
+static void pair_response(recording_t *r, size_t resp)
+{
+    replay_msg_t *m = &r->msgs[resp];
+    size_t i = resp > REPLAY_PAIR_WINDOW ? resp - REPLAY_PAIR_WINDOW : 0;
+    long by_key = -1, by_opcode = -1;
+
+    for (; i < resp; ++i) {
+        replay_msg_t *q = &r->msgs[i];
+
+        if ((q->response) || (q->pair >= 0) || (!same_addr(&q->src, &m->dst))
+                || (!same_addr(&q->dst, &m->src))
+                || (q->key.opcode != m->key.opcode)) {
+            continue;
+        }
+        if (!memcmp(&q->key, &m->key, sizeof(q->key))) {
+            by_key = (long)i;
+            break;
+        }
+        if (by_opcode < 0) {
+            by_opcode = (long)i;
+        }
+    }
+    if (by_key < 0) {
+        by_key = by_opcode;
+    }
+    if (by_key >= 0) {
+        r->msgs[by_key].pair = (long)resp;
+    }
+}
+
+static int load_recording(const char *path, recording_t *r)
+{
+    pcp_pcap_t *p;
+    pcp_pcap_rec_t *rec;
+    size_t cap = 0;
+    uint64_t first = 0;
+    int ret;
+
+    memset(r, 0, sizeof(*r));
+    p = pcp_pcap_open(path);
+    rec = (pcp_pcap_rec_t *)malloc(sizeof(*rec));
+    if ((p == NULL) || (rec == NULL)) {
+        printf("Failed to read capture %s \n", path);
+        pcp_pcap_close(p);
+        free(rec);
+        return -1;
+    }
+
+    while ((ret = pcp_pcap_read(p, rec)) > 0) {
+        replay_msg_t *m;
+        uint64_t ts = (uint64_t)rec->ts.tv_sec * 1000000 + rec->ts.tv_usec;
+
+        // anything else on the captured link
+        if ((rec->len < 2) || ((rec->data[0] > PCP_MAX_SUPPORTED_VERSION))) {
+            continue;
+        }
+        if (r->count == cap) {
+            replay_msg_t *n;
+
+            cap = cap ? cap * 2 : 1024;
+            n = (replay_msg_t *)realloc(r->msgs, cap * sizeof(*n));
+            if (n == NULL) {
+                ret = -1;
+                break;
+            }
+            r->msgs = n;
+        }
+        m = &r->msgs[r->count];
+        memset(m, 0, sizeof(*m));
+        m->data = (uint8_t *)malloc(rec->len);
+        if (m->data == NULL) {
+            ret = -1;
+            break;
+        }
+        if (r->count == 0) {
+            first = ts;
+        }
+        m->ts_us = ts > first ? ts - first : 0;
+        m->src = rec->src;
+        m->dst = rec->dst;
+        m->len = rec->len;
+        memcpy(m->data, rec->data, rec->len);
+        m->response = (uint8_t)is_response(m->data, m->len);
+        m->pair = -1;
+        get_key(m->data, m->len, 1, 0, &m->key);
+        if (m->response) {
+            pair_response(r, r->count);
+        }
+        r->count++;
+    }
+
+    pcp_pcap_close(p);
+    free(rec);
+    if (ret < 0) {
+        printf("Capture %s is corrupted or too big \n", path);
+        return -1;
+    }
+    return 0;
+}
+
+static void free_recording(recording_t *r)
+{
+    size_t i;
+
+    for (i = 0; i < r->count; ++i) {
+        free(r->msgs[i].data);
+    }
+    free(r->msgs);
+    memset(r, 0, sizeof(*r));
+}
+
+static const char *addr_str(const struct sockaddr_storage *ss, char *buf,
+        size_t len)
+{
+    char ip[INET6_ADDRSTRLEN];
+    uint16_t port;
+
+    if (ss->ss_family == AF_INET) {
+        const struct sockaddr_in *s = (const struct sockaddr_in *)ss;
+
+        inet_ntop(AF_INET, &s->sin_addr, ip, sizeof(ip));
+        port = ntohs(s->sin_port);
+        snprintf(buf, len, "%s:%u", ip, port);
+    } else {
+        const struct sockaddr_in6 *s = (const struct sockaddr_in6 *)ss;
+
+        inet_ntop(AF_INET6, &s->sin6_addr, ip, sizeof(ip));
+        port = ntohs(s->sin6_port);
+        snprintf(buf, len, "[%s]:%u", ip, port);
+    }
+    return buf;
+}
+
+// result code of response, NAT-PMP ones are 16-bit
+static int result_code(const uint8_t *data, size_t len)
+{
+    if (data[0] == 0) {
+        return len >= 4 ? (data[2] << 8) | data[3] : -1;
+    }
+    return len >= 4 ? data[3] : -1;
+}
+
+// offset of external port of MAP and PEER response, 0 if there is none
+static size_t ext_port_offset(const uint8_t *data, size_t len)
+{
+    uint8_t opcode = data[1] & 0x7f;
+    size_t off;
+
+    if (data[0] == 0) {
+        off = 10;
+        return ((opcode != NATPMP_OPCODE_ANNOUNCE) && (len >= off + 2)) ?
+                off : 0;
+    }
+    if ((opcode != PCP_OPCODE_MAP) && (opcode != PCP_OPCODE_PEER)) {
+        return 0;
+    }
+    off = PCP_HDR_LEN + (data[0] >= 2 ? PCP_NONCE_LEN : 0)
+            + offsetof(pcp_map_v1_t, ext_port);
+    return len >= off + 2 + sizeof(((pcp_map_v1_t *)0)->ext_ip) ? off : 0;
+}
+
+static void print_msg(size_t i, const replay_msg_t *m)
+{
+    char src[INET6_ADDRSTRLEN + 8], dst[INET6_ADDRSTRLEN + 8];
+
+    printf("%6zu %10.6f %-24s -> %-24s v%u %-8s op %u %4zu B",
+            i, m->ts_us / 1e6,
+            addr_str(&m->src, src, sizeof(src)),
+            addr_str(&m->dst, dst, sizeof(dst)), m->data[0],
+            m->response ? "response" : "request", m->data[1] & 0x7f, m->len);
+    if (m->response) {
+        printf(" result %d", result_code(m->data, m->len));
+    } else if (m->pair >= 0) {
+        printf(" answered by %ld", m->pair);
+    }
+    printf("\n");
+}
+
+// addr[:port], [addr6][:port] or addr6
+static int parse_addr(const char *str, struct sockaddr_storage *ss,
+        socklen_t *ss_len)
+{
+    char host[INET6_ADDRSTRLEN + 16];
+    char *h = host, *port = NULL, *c;
+    struct addrinfo hints, *ai;
+
+    if (strlen(str) >= sizeof(host)) {
+        return -1;
+    }
+    strcpy(host, str);
+    if (host[0] == '[') {
+        h = host + 1;
+        c = strchr(h, ']');
+        if (c == NULL) {
+            return -1;
+        }
+        *c = 0;
+        if (c[1] == ':') {
+            port = c + 2;
+        }
+    } else if (((c = strchr(host, ':')) != NULL) && (!strchr(c + 1, ':'))) {
+        *c = 0;
+        port = c + 1;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+    if (getaddrinfo(h, port ? port : PCP_PORT, &hints, &ai) != 0) {
+        return -1;
+    }
+    memcpy(ss, ai->ai_addr, ai->ai_addrlen);
+    *ss_len = (socklen_t)ai->ai_addrlen;
+    freeaddrinfo(ai);
+    return 0;
+}
+
+static int wait_readable(PCP_SOCKET sockfd, uint64_t wait_us)
+{
+    fd_set fds;
+    struct timeval tv;
+
+    FD_ZERO(&fds);
+    FD_SET(sockfd, &fds);
+    tv.tv_sec = (long)(wait_us / 1000000);
+    tv.tv_usec = (long)(wait_us % 1000000);
+    return select((int)sockfd + 1, &fds, NULL, NULL, &tv) > 0;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+typedef struct outstanding {
+    size_t req; //index of request in recording
+    uint64_t sent_us;
+    msg_key_t key;
+} outstanding_t;
+
+// Differences of received response from the recorded one, printed with
+// --verbose. Returns nonzero if they differ.
+static int compare_response(const replay_opts_t *o, const replay_msg_t *req,
+        const replay_msg_t *rec, const uint8_t *buf, size_t len)
+{
+    int rec_res = result_code(rec->data, rec->len);
+    int res = result_code(buf, len);
+    size_t off, rec_off;
+    int differ = rec_res != res;
+
+    off = ext_port_offset(buf, len);
+    rec_off = ext_port_offset(rec->data, rec->len);
+    if ((o->strict) && (!differ) && (res == 0) && (off) && (rec_off)) {
+        // external port and address (not in NAT-PMP MAP response)
+        size_t cmp_len = buf[0] == 0 ? 2 : 2 + 16;
+
+        differ = (rec_off != off) || (rec->len < rec_off + cmp_len)
+                || (memcmp(rec->data + rec_off, buf + off, cmp_len) != 0);
+    }
+    if ((differ) && (o->verbose)) {
+        printf("Response to request at %.6f differs: result %d (recorded %d)",
+                req->ts_us / 1e6, res, rec_res);
+        if ((off) && (rec_off)) {
+            printf(", external port %u (recorded %u)",
+                    (buf[off] << 8) | buf[off + 1],
+                    (rec->data[rec_off] << 8) | rec->data[rec_off + 1]);
+        }
+        printf("\n");
+    }
+    return differ;
+}
+
+static int replay_requests(recording_t *r, const replay_opts_t *o)
+{
+    struct sockaddr_storage server;
+    socklen_t server_len;
+    PCP_SOCKET sockfd;
+    outstanding_t *out;
+    uint64_t *rtts;
+    uint64_t start, now, last_us = 0;
+    uint64_t timeout_us = (uint64_t)o->timeout_ms * 1000;
+    size_t next = 0, nout = 0, nreq = 0, sent = 0, answered = 0, lost = 0;
+    size_t mismatched = 0, unexpected = 0, i;
+    uint8_t buf[PCP_MAX_LEN];
+
+    if (parse_addr(o->server, &server, &server_len)) {
+        printf("Bad server address %s \n", o->server);
+        return 1;
+    }
+    for (i = 0; i < r->count; ++i) {
+        nreq += !r->msgs[i].response;
+    }
+    sockfd = socket(server.ss_family, SOCK_DGRAM, 0);
+    out = (outstanding_t *)calloc(o->window, sizeof(*out));
+    rtts = (uint64_t *)calloc(nreq + 1, sizeof(*rtts));
+    if ((sockfd == PCP_INVALID_SOCKET) || (out == NULL) || (rtts == NULL)) {
+        perror("pcp-replay");
+        exit(1);
+    }
+
+    start = now_us();
+    while (!replay_stop) {
+        uint64_t wait_us = 100000;
+
+        // skip responses, send requests that are due while window permits
+        now = now_us();
+        while ((next < r->count) && (r->msgs[next].response)) {
+            next++;
+        }
+        while ((next < r->count) && (nout < o->window)) {
+            replay_msg_t *m = &r->msgs[next];
+
+            if (!m->response) {
+                uint64_t due = o->speed > 0 ?
+                        start + (uint64_t)(m->ts_us / o->speed) : now;
+
+                if (due > now) {
+                    wait_us = due - now;
+                    break;
+                }
+                if (sendto(sockfd, (const char *)m->data, (int)m->len, 0,
+                        (struct sockaddr *)&server, server_len) < 0) {
+                    perror("sendto");
+                    break;
+                }
+                out[nout].req = next;
+                out[nout].sent_us = now_us();
+                get_key(m->data, m->len, 1, 0, &out[nout].key);
+                nout++;
+                sent++;
+            }
+            next++;
+        }
+        if ((next >= r->count) && (nout == 0)) {
+            break;
+        }
+        if (nout > 0) {
+            uint64_t expires = out[0].sent_us + timeout_us;
+
+            now = now_us();
+            wait_us = expires > now ?
+                    (expires - now < wait_us ? expires - now : wait_us) : 0;
+        }
+
+        if (wait_readable(sockfd, wait_us)) {
+            do {
+                msg_key_t key;
+                int len = (int)recvfrom(sockfd, (char *)buf, sizeof(buf), 0,
+                        NULL, NULL);
+
+                if (len < 2) {
+                    break;
+                }
+                now = now_us();
+                get_key(buf, (size_t)len, 1, 0, &key);
+                // the oldest request of the same key, any of the same opcode
+                // for responses of other version
+                for (i = 0; i < nout; ++i) {
+                    if (!memcmp(&out[i].key, &key, sizeof(key))) {
+                        break;
+                    }
+                }
+                if (i == nout) {
+                    for (i = 0; i < nout; ++i) {
+                        if (out[i].key.opcode == key.opcode) {
+                            break;
+                        }
+                    }
+                }
+                if (i == nout) {
+                    unexpected++;
+                    continue;
+                }
+                rtts[answered++] = now - out[i].sent_us;
+                last_us = now;
+                if (r->msgs[out[i].req].pair >= 0) {
+                    mismatched += compare_response(o, &r->msgs[out[i].req],
+                            &r->msgs[r->msgs[out[i].req].pair], buf,
+                            (size_t)len);
+                }
+                memmove(out + i, out + i + 1, (nout - i - 1) * sizeof(*out));
+                nout--;
+            } while (wait_readable(sockfd, 0));
+        }
+
+        // outstanding requests are sorted by time they were sent
+        now = now_us();
+        while ((nout > 0) && (out[0].sent_us + timeout_us <= now)) {
+            if (o->verbose) {
+                printf("No response to request at %.6f \n",
+                        r->msgs[out[0].req].ts_us / 1e6);
+            }
+            lost++;
+            memmove(out, out + 1, (nout - 1) * sizeof(*out));
+            nout--;
+        }
+    }
+    CLOSE(sockfd);
+
+    printf("Replayed %zu of %zu requests to %s\n", sent, nreq, o->server);
+    printf("  Answered:            %zu\n", answered);
+    printf("  Not answered:        %zu\n", lost + nout);
+    printf("  Different results:   %zu\n", mismatched);
+    printf("  Unexpected:          %zu\n", unexpected);
+    if (answered > 0) {
+        double secs = (last_us - start) / 1e6;
+
+        qsort(rtts, answered, sizeof(*rtts), cmp_u64);
+        printf("  Elapsed:             %.3f s (recorded %.3f s)\n", secs,
+                r->count ? r->msgs[r->count - 1].ts_us / 1e6 : 0);
+        printf("  Rate:                %.0f requests/s\n",
+                secs > 0 ? answered / secs : 0);
+        printf("  Round trip p50/p99/max: %.3f / %.3f / %.3f ms\n",
+                rtts[answered / 2] / 1e3, rtts[answered * 99 / 100] / 1e3,
+                rtts[answered - 1] / 1e3);
+    }
+    fflush(stdout);
+
+    free(out);
+    free(rtts);
+    return (sent == nreq) && (answered == nreq) && (mismatched == 0) ? 0 : 1;
+}
+
+typedef struct pending {
+    uint64_t due_us;
+    size_t resp;
+    struct sockaddr_storage client;
+    socklen_t client_len;
+    uint8_t nonce[PCP_NONCE_LEN];
+    uint8_t has_nonce;
+} pending_t;
+
+// Recorded request of the key, the oldest one not used yet, which was
+// answered. Requests before first are all used.
+static long find_request(recording_t *r, const msg_key_t *key, size_t *first)
+{
+    size_t i;
+
+    while ((*first < r->count) && ((r->msgs[*first].response)
+            || (r->msgs[*first].used) || (r->msgs[*first].pair < 0))) {
+        (*first)++;
+    }
+    for (i = *first; i < r->count; ++i) {
+        replay_msg_t *m = &r->msgs[i];
+        msg_key_t k;
+
+        if ((m->response) || (m->used) || (m->pair < 0)) {
+            continue;
+        }
+        get_key(m->data, m->len, 0, 1, &k);
+        if (!memcmp(&k, key, sizeof(k))) {
+            m->used = 1;
+            return (long)i;
+        }
+    }
+    return -1;
+}
+
+static int respond_requests(recording_t *r, const replay_opts_t *o)
+{
+    struct sockaddr_storage listen_addr;
+    socklen_t listen_len;
+    PCP_SOCKET sockfd;
+    pending_t *pend;
+    size_t npend = 0, cap = 0, first = 0, i;
+    size_t received = 0, answered = 0, unmatched = 0, pairs = 0;
+    uint64_t end = o->timeout_ms ? now_us() + (uint64_t)o->timeout_ms * 1000 : 0;
+    uint8_t buf[PCP_MAX_LEN];
+    int yes = 1;
+
+    if (parse_addr(o->respond, &listen_addr, &listen_len)) {
+        printf("Bad listen address %s \n", o->respond);
+        return 1;
+    }
+    for (i = 0; i < r->count; ++i) {
+        pairs += (!r->msgs[i].response) && (r->msgs[i].pair >= 0);
+    }
+    cap = pairs + 1;
+    pend = (pending_t *)calloc(cap, sizeof(*pend));
+    sockfd = socket(listen_addr.ss_family, SOCK_DGRAM, 0);
+    if ((pend == NULL) || (sockfd == PCP_INVALID_SOCKET)) {
+        perror("pcp-replay");
+        exit(1);
+    }
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, (char *)&yes, sizeof(yes));
+    if (bind(sockfd, (struct sockaddr *)&listen_addr, listen_len) != 0) {
+        perror("pcp-replay: bind");
+        exit(2);
+    }
+    printf("Answering requests on %s with %zu recorded responses\n",
+            o->respond, pairs);
+    fflush(stdout);
+
+    while ((!replay_stop) && ((end == 0) || (now_us() < end))) {
+        uint64_t now = now_us(), wait_us = 100000;
+
+        // pending responses are sent when due, in order of requests
+        for (i = 0; i < npend; ) {
+            pending_t *p = &pend[i];
+
+            if (p->due_us <= now) {
+                replay_msg_t *m = &r->msgs[p->resp];
+
+                memcpy(buf, m->data, m->len);
+                if (p->has_nonce) {
+                    memcpy(buf + PCP_HDR_LEN, p->nonce, PCP_NONCE_LEN);
+                }
+                sendto(sockfd, (const char *)buf, (int)m->len, 0,
+                        (struct sockaddr *)&p->client, p->client_len);
+                answered++;
+                memmove(p, p + 1, (npend - i - 1) * sizeof(*p));
+                npend--;
+                continue;
+            }
+            if (p->due_us - now < wait_us) {
+                wait_us = p->due_us - now;
+            }
+            ++i;
+        }
+
+        if (!wait_readable(sockfd, wait_us)) {
+            continue;
+        }
+        do {
+            struct sockaddr_storage client;
+            socklen_t client_len = sizeof(client);
+            msg_key_t key;
+            replay_msg_t *resp;
+            long req;
+            int len = (int)recvfrom(sockfd, (char *)buf, sizeof(buf), 0,
+                    (struct sockaddr *)&client, &client_len);
+
+            if (len < 2) {
+                break;
+            }
+            received++;
+            get_key(buf, (size_t)len, 0, 1, &key);
+            req = find_request(r, &key, &first);
+            if ((req < 0) || (npend == cap)) {
+                if (o->verbose) {
+                    printf("No recorded response to version %u opcode %u "
+                           "request\n", buf[0], buf[1] & 0x7f);
+                }
+                unmatched++;
+                continue;
+            }
+
+            resp = &r->msgs[r->msgs[req].pair];
+            pend[npend].resp = (size_t)r->msgs[req].pair;
+            pend[npend].client = client;
+            pend[npend].client_len = client_len;
+            // the client picked another nonce than the recorded one
+            pend[npend].has_nonce = (has_nonce(buf, (size_t)len))
+                    && (has_nonce(resp->data, resp->len));
+            if (pend[npend].has_nonce) {
+                memcpy(pend[npend].nonce, buf + PCP_HDR_LEN, PCP_NONCE_LEN);
+            }
+            // recorded response time, scaled by speed
+            pend[npend].due_us = now_us();
+            if (o->speed > 0) {
+                pend[npend].due_us += (uint64_t)((resp->ts_us
+                        - r->msgs[req].ts_us) / o->speed);
+            }
+            npend++;
+        } while (wait_readable(sockfd, 0));
+    }
+    CLOSE(sockfd);
+
+    printf("Received %zu requests\n", received);
+    printf("  Answered:            %zu\n", answered);
+    printf("  Not recorded:        %zu\n", unmatched);
+    printf("  Recorded responses left: %zu\n", pairs - answered - npend);
+    fflush(stdout);
+
+    free(pend);
+    return 0;
+}
+
+static void print_usage(void)
+{
+    printf("\n");
+    printf("Usage: pcp-replay [options] capture.pcap\n");
+    printf("Replays PCP requests of the capture to a PCP server and compares\n"
+           "responses with the recorded ones. Exits with 0 if every request\n"
+           "got the recorded result.\n");
+    printf("-h, --help \t  Display this help \n");
+    printf("--server addr[:port]  Server to send requests to.\n"
+           "          \t   DEFAULT: 127.0.0.1:" PCP_PORT "\n");
+    printf("--respond addr[:port]  Act as the recorded server instead:\n"
+           "          \t   answer requests on addr with recorded responses\n");
+    printf("--list \t\t  Print datagrams of the capture and exit\n");
+    printf("--speed #x \t  Replay #x times faster than recorded,\n"
+           "          \t   0 as fast as --window permits. DEFAULT: 1\n");
+    printf("--window #num \t  Requests waiting for response at most.\n"
+           "          \t   DEFAULT: " xstr(REPLAY_DEFAULT_WINDOW) "\n");
+    printf("--timeout #ms \t  Wait for response #ms. With --respond, serve\n"
+           "          \t   for #ms (DEFAULT 0, until interrupted).\n"
+           "          \t   DEFAULT: " xstr(REPLAY_DEFAULT_TIMEOUT_MS) "\n");
+    printf("--strict \t  Compare also external address and port\n");
+    printf("--verbose \t  Print every difference\n");
+}
+
+#ifndef no_argument
+#define no_argument 0
+#endif
+
+#ifndef required_argument
+#define required_argument 1
+#endif
+
+int main(int argc, char *argv[])
+{
+    replay_opts_t o;
+    recording_t rec;
+    int list = 0, timeout_set = 0;
+    int c, option_index = 0, ret;
+    size_t i;
+
+    static struct option long_options[] = {
+            { "help", no_argument, 0, 0 },
+            { "server", required_argument, 0, 0 },
+            { "respond", required_argument, 0, 0 },
+            { "list", no_argument, 0, 0 },
+            { "speed", required_argument, 0, 0 },
+            { "window", required_argument, 0, 0 },
+            { "timeout", required_argument, 0, 0 },
+            { "strict", no_argument, 0, 0 },
+            { "verbose", no_argument, 0, 0 },
+            { 0, 0, 0, 0 }
+    };
+
+    memset(&o, 0, sizeof(o));
+    o.server = "127.0.0.1:" PCP_PORT;
+    o.speed = 1;
+    o.window = REPLAY_DEFAULT_WINDOW;
+    o.timeout_ms = REPLAY_DEFAULT_TIMEOUT_MS;
+
+    opterr = 0;
+    while ((c = getopt_long(argc, argv, "h", long_options, &option_index))
+            != -1) {
+        const char *name;
+
+        if (c != 0) {
+            print_usage();
+            exit(1);
+        }
+        name = long_options[option_index].name;
+        if (!strcmp(name, "help")) {
+            print_usage();
+            exit(1);
+        } else if (!strcmp(name, "server")) {
+            o.server = optarg;
+        } else if (!strcmp(name, "respond")) {
+            o.respond = optarg;
+        } else if (!strcmp(name, "list")) {
+            list = 1;
+        } else if (!strcmp(name, "speed")) {
+            o.speed = atof(optarg);
+            if (o.speed < 0) {
+                printf("Bad value for option --speed %s \n", optarg);
+                exit(1);
+            }
+        } else if (!strcmp(name, "window")) {
+            o.window = (unsigned)atoi(optarg);
+            if (o.window < 1) {
+                printf("Bad value for option --window %s \n", optarg);
+                exit(1);
+            }
+        } else if (!strcmp(name, "timeout")) {
+            o.timeout_ms = (uint32_t)atoi(optarg);
+            timeout_set = 1;
+        } else if (!strcmp(name, "strict")) {
+            o.strict = 1;
+        } else if (!strcmp(name, "verbose")) {
+            o.verbose = 1;
+        }
+    }
+    if (optind != argc - 1) {
+        print_usage();
+        exit(1);
+    }
+    if ((o.respond) && (!timeout_set)) {
+        o.timeout_ms = 0;
+    }
+
+    PD_SOCKET_STARTUP();
+    if (load_recording(argv[optind], &rec)) {
+        return 1;
+    }
+
+    signal(SIGINT, replay_signal);
+    signal(SIGTERM, replay_signal);
+
+    if (list) {
+        for (i = 0; i < rec.count; ++i) {
+            print_msg(i, &rec.msgs[i]);
+        }
+        ret = 0;
+    } else if (o.respond) {
+        ret = respond_requests(&rec, &o);
+    } else {
+        ret = replay_requests(&rec, &o);
+    }
+
+    free_recording(&rec);
+    PD_SOCKET_CLEANUP();
+    return ret;
+}
@@ -25,6 +25,14 @@
  * Author: bagljas
  */
 
+#ifdef __linux__
+// recvmmsg, sendmmsg and CPU affinity of worker threads
+#define _GNU_SOURCE
+#define PCP_SERVER_WORKERS
+// many server identities served by one epoll loop
+#define PCP_SERVER_IDENTITIES
+#endif
+
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #else
@@ -64,6 +72,15 @@
 #include <sys/time.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#ifdef PCP_SERVER_WORKERS
+#include <pthread.h>
+#include <sched.h>
+#include <poll.h>
+#endif
+#ifdef PCP_SERVER_IDENTITIES
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#endif
 
 #define PI_TIMEOUT_STRUCT struct timeval
 #define SET_PI_TIMEOUT(dest, source) do {\
@@ -75,11 +92,33 @@
 #include "pcp_msg_structs.h"
 #include "pcp_utils.h"
 #include "pcp.h"
+#include "pcp_mapping_table.h"
+#include "pcp_faults.h"
+#include "pcp_pcap.h"
 
 #define PCP_PORT "5351"
 #define PCP_TEST_MAX_VERSION 2
 
 #define MAX_LOG_FILE 64u
+#define MAX_IDENTITY_SPECS 64
+
+// requests are printed unless server runs in workers mode
+static int print_requests = 1;
+
+#define SRV_PRINT(fp, ...) do { \
+    if (print_requests) { \
+        DUPPRINT(fp, __VA_ARGS__); \
+    } \
+} while(0)
+
+#define SRV_PRINTF(...) do { \
+    if (print_requests) { \
+        printf(__VA_ARGS__); \
+    } \
+} while(0)
+
+// requests and responses are recorded by --capture, NULL if not
+static pcp_pcap_t *capture = NULL;
 
 typedef struct options_occur {
     int third_party_occur;
@@ -96,8 +135,26 @@ typedef struct server_info {
     char log_file[MAX_LOG_FILE];
     struct timeval tv;
     time_t epoch_time_start;
+    pcp_mapping_table_t *mappings;
+    // mappings table is created on first MAP or PEER request, if set
+    const pmt_config_t *mappings_cfg;
+    pfi_config_t faults;
 } server_info_t;
 
+// workers read epoch while --epoch-reset may change it
+#ifdef PCP_SERVER_WORKERS
+#define EPOCH_START(info) \
+    __atomic_load_n(&(info)->epoch_time_start, __ATOMIC_RELAXED)
+#define SET_EPOCH_START(info, t) \
+    __atomic_store_n(&(info)->epoch_time_start, (t), __ATOMIC_RELAXED)
+#else
+#define EPOCH_START(info) ((info)->epoch_time_start)
+#define SET_EPOCH_START(info, t) ((info)->epoch_time_start = (t))
+#endif
+
+#define TRACKS_MAPPINGS(info) \
+    (((info)->mappings != NULL) || ((info)->mappings_cfg != NULL))
+
 static void reset_option_occur(options_occur_t *opt_occ)
 {
 
@@ -117,7 +174,7 @@ static void *get_in_addr(struct sockaddr *sa)
 }
 
 static PCP_SOCKET createPCPsocket(const char* serverPort,
-    const char* serverAddress)
+    const char* serverAddress, int reuse_port)
 {
     PCP_SOCKET sockfd;
     struct addrinfo hints, *servinfo, *p;
@@ -145,6 +202,15 @@ static PCP_SOCKET createPCPsocket(const char* serverPort,
 
         // lose the pesky "address already in use" error message
         setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, (char *)&yes, sizeof(int));
+#ifdef SO_REUSEPORT
+        // workers share the port, kernel spreads clients among them
+        if (reuse_port) {
+            setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, (char *)&yes,
+                    sizeof(int));
+        }
+#else
+        (void)reuse_port;
+#endif
 
         if (bind(sockfd, p->ai_addr, p->ai_addrlen) == PCP_SOCKET_ERROR) { //LCOV_EXCL_START
             CLOSE(sockfd);
@@ -169,22 +235,22 @@ static PCP_SOCKET createPCPsocket(const char* serverPort,
 static void print_MAP_opcode_ver1(pcp_map_v1_t *map_buf, FILE *log_file)
 {
     char map_addr[INET6_ADDRSTRLEN];
-    DUPPRINT(log_file,"PCP protocol VERSION 1. \n");
-    DUPPRINT(log_file,"MAP protocol: \t\t %d\n", map_buf->protocol);
-    DUPPRINT(log_file,"MAP int port: \t\t %d\n", ntohs(map_buf->int_port));
-    DUPPRINT(log_file,"MAP ext port: \t\t %d\n", ntohs(map_buf->ext_port));
-    DUPPRINT(log_file,"MAP Ext IP: \t\t %s\n",
+    SRV_PRINT(log_file,"PCP protocol VERSION 1. \n");
+    SRV_PRINT(log_file,"MAP protocol: \t\t %d\n", map_buf->protocol);
+    SRV_PRINT(log_file,"MAP int port: \t\t %d\n", ntohs(map_buf->int_port));
+    SRV_PRINT(log_file,"MAP ext port: \t\t %d\n", ntohs(map_buf->ext_port));
+    SRV_PRINT(log_file,"MAP Ext IP: \t\t %s\n",
             inet_ntop(AF_INET6, map_buf->ext_ip, map_addr, INET6_ADDRSTRLEN));
 }
 
 static void print_MAP_opcode_ver2(pcp_map_v2_t *map_buf, FILE *log_file)
 {
     char map_addr[INET6_ADDRSTRLEN];
-    DUPPRINT(log_file,"PCP protocol VERSION 2. \n");
-    DUPPRINT(log_file,"MAP protocol: \t\t %d\n", map_buf->protocol);
-    DUPPRINT(log_file,"MAP int port: \t\t %d\n", ntohs(map_buf->int_port));
-    DUPPRINT(log_file,"MAP ext port: \t\t %d\n", ntohs(map_buf->ext_port));
-    DUPPRINT(log_file,"MAP Ext IP: \t\t %s\n",
+    SRV_PRINT(log_file,"PCP protocol VERSION 2. \n");
+    SRV_PRINT(log_file,"MAP protocol: \t\t %d\n", map_buf->protocol);
+    SRV_PRINT(log_file,"MAP int port: \t\t %d\n", ntohs(map_buf->int_port));
+    SRV_PRINT(log_file,"MAP ext port: \t\t %d\n", ntohs(map_buf->ext_port));
+    SRV_PRINT(log_file,"MAP Ext IP: \t\t %s\n",
             inet_ntop(AF_INET6, map_buf->ext_ip, map_addr, INET6_ADDRSTRLEN));
 }
 
@@ -193,17 +259,17 @@ static void print_PEER_opcode_ver1(pcp_peer_v1_t *peer_buf, FILE *log_file)
 
     char ext_addr[INET6_ADDRSTRLEN];
     char peer_addr[INET6_ADDRSTRLEN];
-    DUPPRINT(log_file,"PCP protocol VERSION 1. \n");
-    DUPPRINT(log_file,"PEER Opcode specific information. \n");
-    DUPPRINT(log_file,"Protocol: \t\t %d\n", peer_buf->protocol);
-    DUPPRINT(log_file,"Internal port: \t\t %d\n", ntohs(peer_buf->int_port));
-    DUPPRINT(log_file,"External IP: \t\t %s\n",
+    SRV_PRINT(log_file,"PCP protocol VERSION 1. \n");
+    SRV_PRINT(log_file,"PEER Opcode specific information. \n");
+    SRV_PRINT(log_file,"Protocol: \t\t %d\n", peer_buf->protocol);
+    SRV_PRINT(log_file,"Internal port: \t\t %d\n", ntohs(peer_buf->int_port));
+    SRV_PRINT(log_file,"External IP: \t\t %s\n",
             inet_ntop(AF_INET6, peer_buf->ext_ip, ext_addr, INET6_ADDRSTRLEN));
-    DUPPRINT(log_file,"External port port: \t\t %d\n", ntohs(peer_buf->ext_port));
-    DUPPRINT(log_file,"PEER IP: \t\t %s\n",
+    SRV_PRINT(log_file,"External port port: \t\t %d\n", ntohs(peer_buf->ext_port));
+    SRV_PRINT(log_file,"PEER IP: \t\t %s\n",
             inet_ntop(AF_INET6, peer_buf->peer_ip, peer_addr,
                     INET6_ADDRSTRLEN));
-    DUPPRINT(log_file,"PEER port port: \t\t %d\n", ntohs(peer_buf->peer_port));
+    SRV_PRINT(log_file,"PEER port port: \t\t %d\n", ntohs(peer_buf->peer_port));
 
 }
 
@@ -214,23 +280,23 @@ static void print_PEER_opcode_ver2(pcp_peer_v2_t *peer_buf, FILE *log_file)
     char peer_addr[INET6_ADDRSTRLEN];
 
 
-    DUPPRINT(log_file, "PCP protocol VERSION 2. \n");
-    DUPPRINT(log_file, "PEER Opcode specific information. \n");
-    DUPPRINT(log_file,"Protocol: \t\t %d\n", peer_buf->protocol);
-    DUPPRINT(log_file,"Internal port: \t\t %d\n", ntohs(peer_buf->int_port));
-    DUPPRINT(log_file,"External IP: \t\t %s\n",
+    SRV_PRINT(log_file, "PCP protocol VERSION 2. \n");
+    SRV_PRINT(log_file, "PEER Opcode specific information. \n");
+    SRV_PRINT(log_file,"Protocol: \t\t %d\n", peer_buf->protocol);
+    SRV_PRINT(log_file,"Internal port: \t\t %d\n", ntohs(peer_buf->int_port));
+    SRV_PRINT(log_file,"External IP: \t\t %s\n",
             inet_ntop(AF_INET6, peer_buf->ext_ip, ext_addr, INET6_ADDRSTRLEN));
-    DUPPRINT(log_file,"External port: \t\t %d\n", ntohs(peer_buf->ext_port));
+    SRV_PRINT(log_file,"External port: \t\t %d\n", ntohs(peer_buf->ext_port));
     if (IN6_IS_ADDR_V4MAPPED((struct in6_addr*) peer_buf->peer_ip)) {
-        DUPPRINT(log_file,"PEER IP: \t\t %s\n",
+        SRV_PRINT(log_file,"PEER IP: \t\t %s\n",
             inet_ntop(AF_INET, &(peer_buf->peer_ip[3]), peer_addr,
                     INET6_ADDRSTRLEN));
     } else {
-        DUPPRINT(log_file,"PEER IP: \t\t %s\n",
+        SRV_PRINT(log_file,"PEER IP: \t\t %s\n",
             inet_ntop(AF_INET6, &(peer_buf->peer_ip[0]), peer_addr,
                     INET6_ADDRSTRLEN));
     }
-    DUPPRINT(log_file,"PEER port: \t\t %d\n", ntohs(peer_buf->peer_port));
+    SRV_PRINT(log_file,"PEER port: \t\t %d\n", ntohs(peer_buf->peer_port));
 
 }
 
@@ -238,16 +304,16 @@ static int print_SADSCP_opcode_ver2(pcp_sadscp_req_t *sadscp_buf,
     FILE *log_file)
 {
 
-    DUPPRINT(log_file,"PCP protocol VERSION 2. \n");
-    DUPPRINT(log_file,"SADSCP Opcode specific information. \n");
-    DUPPRINT(log_file,"Jitter tolerance:\t %d\n",
+    SRV_PRINT(log_file,"PCP protocol VERSION 2. \n");
+    SRV_PRINT(log_file,"SADSCP Opcode specific information. \n");
+    SRV_PRINT(log_file,"Jitter tolerance:\t %d\n",
             (sadscp_buf->tolerance_fields >> 2) & 3);
-    DUPPRINT(log_file,"Loss tolerance: \t %d\n",
+    SRV_PRINT(log_file,"Loss tolerance: \t %d\n",
             (sadscp_buf->tolerance_fields >> 4) & 3);
-    DUPPRINT(log_file,"Delay tolerance:  \t %d\n",
+    SRV_PRINT(log_file,"Delay tolerance:  \t %d\n",
             (sadscp_buf->tolerance_fields >> 6) & 3);
-    DUPPRINT(log_file,"App name length: \t %d\n", sadscp_buf->app_name_length);
-    DUPPRINT(log_file,"App name:        \t %.*s\n",
+    SRV_PRINT(log_file,"App name length: \t %d\n", sadscp_buf->app_name_length);
+    SRV_PRINT(log_file,"App name:        \t %.*s\n",
             sadscp_buf->app_name_length, sadscp_buf->app_name);
     return sizeof(pcp_sadscp_req_t) + sadscp_buf->app_name_length;
 }
@@ -281,16 +347,16 @@ static int print_PCP_options(void* pcp_buf, int* remainingSize,
 
     case PCP_OPTION_3RD_PARTY:
         if (opt_occ->third_party_occur != 0) {
-            DUPPRINT(log_file, "THIRD PARTY OPTION was already present. \n");
+            SRV_PRINT(log_file, "THIRD PARTY OPTION was already present. \n");
             pcp_result_code = PCP_RES_MALFORMED_OPTION;
         } else {
             opt_occ->third_party_occur = 1;
         }
-        DUPPRINT(log_file, "\n");
-        DUPPRINT(log_file, "OPTION: \t Third party \n");
+        SRV_PRINT(log_file, "\n");
+        SRV_PRINT(log_file, "OPTION: \t Third party \n");
         opt_3rd = (pcp_3rd_party_option_t*) (pcp_buf_helper
                 + processed);
-        DUPPRINT(log_file, "Third PARTY IP: \t %s\n",
+        SRV_PRINT(log_file, "Third PARTY IP: \t %s\n",
                 inet_ntop(AF_INET6, opt_3rd->ip, third_addr, INET6_ADDRSTRLEN));
 
         processed += sizeof(pcp_3rd_party_option_t);
@@ -299,17 +365,17 @@ static int print_PCP_options(void* pcp_buf, int* remainingSize,
 
     case PCP_OPTION_PREF_FAIL:
         if (opcode != PCP_OPCODE_MAP) {
-            DUPPRINT(log_file, "Unsupported OPTION for given OPCODE.\n");
+            SRV_PRINT(log_file, "Unsupported OPTION for given OPCODE.\n");
             pcp_result_code = PCP_RES_MALFORMED_REQUEST;
         }
         if (opt_occ->pfailure_occur != 0) {
-            DUPPRINT(log_file, "PREFER FAILURE OPTION was already present. \n");
+            SRV_PRINT(log_file, "PREFER FAILURE OPTION was already present. \n");
             pcp_result_code = PCP_RES_MALFORMED_OPTION;
         } else {
             opt_occ->pfailure_occur = 1;
         }
-        DUPPRINT(log_file, "\n");
-        DUPPRINT(log_file, "OPTION: \t Prefer fail \n");
+        SRV_PRINT(log_file, "\n");
+        SRV_PRINT(log_file, "OPTION: \t Prefer fail \n");
         processed += sizeof(pcp_prefer_fail_option_t);
         remain -= sizeof(pcp_prefer_fail_option_t);
         break;
@@ -317,17 +383,17 @@ static int print_PCP_options(void* pcp_buf, int* remainingSize,
     case PCP_OPTION_FILTER:
 
         if (opcode != PCP_OPCODE_MAP) {
-            DUPPRINT(log_file, "Unsupported OPTION for given OPCODE.\n");
+            SRV_PRINT(log_file, "Unsupported OPTION for given OPCODE.\n");
             pcp_result_code = PCP_RES_MALFORMED_REQUEST;
         }
         opt_filter =
                 (pcp_filter_option_t*) (pcp_buf_helper+processed);
-        DUPPRINT(log_file, "\n");
-        DUPPRINT(log_file, "OPTION: \t Filter \n");
-        DUPPRINT(log_file, "\t PREFIX: %d \n", opt_filter->filter_prefix);
-        DUPPRINT(log_file, "\t FILTER PORT: %d \n",
+        SRV_PRINT(log_file, "\n");
+        SRV_PRINT(log_file, "OPTION: \t Filter \n");
+        SRV_PRINT(log_file, "\t PREFIX: %d \n", opt_filter->filter_prefix);
+        SRV_PRINT(log_file, "\t FILTER PORT: %d \n",
                                 htons(opt_filter->filter_peer_port));
-        DUPPRINT(log_file, "\t FILTER IP: %s \n",
+        SRV_PRINT(log_file, "\t FILTER IP: %s \n",
                 inet_ntop(AF_INET6, &opt_filter->filter_peer_ip,
                         filter_addr, sizeof(filter_addr)));
         processed += sizeof(pcp_filter_option_t);
@@ -335,59 +401,59 @@ static int print_PCP_options(void* pcp_buf, int* remainingSize,
         break;
 
     case PCP_OPTION_FLOW_PRIORITY:
-        DUPPRINT(log_file, "\n");
-        DUPPRINT(log_file, "OPTION: \t Flow priority\n");
+        SRV_PRINT(log_file, "\n");
+        SRV_PRINT(log_file, "OPTION: \t Flow priority\n");
         opt_flp =
                 (pcp_flow_priority_option_t*) (pcp_buf_helper + processed);
-        DUPPRINT(log_file, "\t DSCP UP: \t %d \n", opt_flp->dscp_up);
-        DUPPRINT(log_file, "\t DSCP DOWN: \t %d \n", opt_flp->dscp_down);
+        SRV_PRINT(log_file, "\t DSCP UP: \t %d \n", opt_flp->dscp_up);
+        SRV_PRINT(log_file, "\t DSCP DOWN: \t %d \n", opt_flp->dscp_down);
 
         processed += sizeof(pcp_flow_priority_option_t);
         remain -= sizeof(pcp_flow_priority_option_t);
         break;
 
     case PCP_OPTION_METADATA:
-        DUPPRINT(log_file, "\n");
-        DUPPRINT(log_file, "OPTION: \t Metadata \n");
+        SRV_PRINT(log_file, "\n");
+        SRV_PRINT(log_file, "OPTION: \t Metadata \n");
         opt_md = (pcp_metadata_option_t*) (pcp_buf_helper
                 + processed);
 
-        DUPPRINT(log_file, "\t METADATA ID \t %d \n", htonl(opt_md->metadata_id));
+        SRV_PRINT(log_file, "\t METADATA ID \t %d \n", htonl(opt_md->metadata_id));
         memcpy(metadata, opt_md->metadata, htons(opt_md->len));
-        DUPPRINT(log_file, "\t METADATA \t %s \n", metadata);
+        SRV_PRINT(log_file, "\t METADATA \t %s \n", metadata);
 
         processed += sizeof(pcp_options_hdr_t) + htons(opt_md->len);
         remain -= (sizeof(pcp_options_hdr_t) + htons(opt_md->len));
         break;
 
     case PCP_OPTION_LOCATION:
-        DUPPRINT(log_file, "\n");
-        DUPPRINT(log_file, "OPTION: \t Location \n");
+        SRV_PRINT(log_file, "\n");
+        SRV_PRINT(log_file, "OPTION: \t Location \n");
         opt_loc =
                 (pcp_location_option_t *) (pcp_buf_helper + processed);
-        DUPPRINT(log_file, "\t Location: \t %s\n", &(opt_loc->location[0]));
+        SRV_PRINT(log_file, "\t Location: \t %s\n", &(opt_loc->location[0]));
 
         processed += sizeof(pcp_location_option_t);
         remain -= sizeof(pcp_location_option_t);
         break;
 
     case PCP_OPTION_USERID:
-        DUPPRINT(log_file, "\n");
-        DUPPRINT(log_file, "OPTION: \t User ID\n");
+        SRV_PRINT(log_file, "\n");
+        SRV_PRINT(log_file, "OPTION: \t User ID\n");
         opt_user =
                 (pcp_userid_option_t *) (pcp_buf_helper + processed);
-        DUPPRINT(log_file, "\t User ID: \t %s\n", &(opt_user->userid[0]));
+        SRV_PRINT(log_file, "\t User ID: \t %s\n", &(opt_user->userid[0]));
 
         processed += sizeof(pcp_userid_option_t);
         remain -= sizeof(pcp_userid_option_t);
         break;
 
     case PCP_OPTION_DEVICEID:
-        DUPPRINT(log_file, "\n");
-        DUPPRINT(log_file, "OPTION: \t Device ID\n");
+        SRV_PRINT(log_file, "\n");
+        SRV_PRINT(log_file, "OPTION: \t Device ID\n");
         opt_dev =
                 (pcp_deviceid_option_t *) (pcp_buf_helper + processed);
-        DUPPRINT(log_file, "\t Device ID: \t %s\n", &(opt_dev->deviceid[0]));
+        SRV_PRINT(log_file, "\t Device ID: \t %s\n", &(opt_dev->deviceid[0]));
 
         processed += sizeof(pcp_deviceid_option_t);
         remain -= sizeof(pcp_deviceid_option_t);
@@ -395,9 +461,9 @@ static int print_PCP_options(void* pcp_buf, int* remainingSize,
 
 
     default:
-        DUPPRINT(log_file, "Unrecognized PCP OPTION: %d \n", opt_hdr->code);
-        DUPPRINT(log_file, "Unrecognized PCP OPTION remain: %d \n", remain);
-        DUPPRINT(log_file, "Unrecognized PCP OPTION processed: %d \n", processed);
+        SRV_PRINT(log_file, "Unrecognized PCP OPTION: %d \n", opt_hdr->code);
+        SRV_PRINT(log_file, "Unrecognized PCP OPTION remain: %d \n", remain);
+        SRV_PRINT(log_file, "Unrecognized PCP OPTION processed: %d \n", processed);
         remain = 0;
         break;
     }
@@ -432,10 +498,10 @@ static int printPCPreq(void * req, int req_size, options_occur_t *opt_occ,
     // discard request that exceeds maximal length, is shorter than 3,
     // or is not the multiple of 4
     if ((req_size > PCP_MAX_LEN) || (req_size < 4) || ((req_size & 3) != 0)) {
-        printf(
+        SRV_PRINTF(
             "Size of PCP packet is either smaller than 4 octets or larger "
             "than "xstr(PCP_MAX_LEN)" bytes or the size is not multiple of 4.\n");
-        printf("The size was: %d \n", req_size);
+        SRV_PRINTF("The size was: %d \n", req_size);
         return PCP_RES_MALFORMED_REQUEST;
     }
 
@@ -453,30 +519,31 @@ static int printPCPreq(void * req, int req_size, options_occur_t *opt_occ,
     processedSize = 0;
     //first print out info from common request header
     common_req = (pcp_request_t*) req_help;
-    DUPPRINT(log_file, "\n");
-    DUPPRINT(log_file, "PCP version:             %i\n", common_req->ver);
-    DUPPRINT(log_file, "PCP opcode:              %i\n", common_req->r_opcode & 0x7F);
-    DUPPRINT(log_file, "PCP R bit:               %i\n", (common_req->r_opcode & 0x80) != 0);
-    DUPPRINT(log_file, "PCP requested lifetime:  %d\n",
+    SRV_PRINT(log_file, "\n");
+    SRV_PRINT(log_file, "PCP version:             %i\n", common_req->ver);
+    SRV_PRINT(log_file, "PCP opcode:              %i\n", common_req->r_opcode & 0x7F);
+    SRV_PRINT(log_file, "PCP R bit:               %i\n", (common_req->r_opcode & 0x80) != 0);
+    SRV_PRINT(log_file, "PCP requested lifetime:  %d\n",
                                               htonl( common_req->req_lifetime));
 
     if (IN6_IS_ADDR_V4MAPPED((struct in6_addr*)common_req->ip)) {
-        DUPPRINT(log_file,"PEER IP: \t\t %s\n",
+        SRV_PRINT(log_file,"PEER IP: \t\t %s\n",
             inet_ntop(AF_INET, &(common_req->ip[3]), s,
                     INET6_ADDRSTRLEN));
     } else {
-        DUPPRINT(log_file,"PEER IP: \t\t %s\n",
+        SRV_PRINT(log_file,"PEER IP: \t\t %s\n",
             inet_ntop(AF_INET6, &(common_req->ip[0]), s,
                     INET6_ADDRSTRLEN));
     }
 
     remainingSize -= sizeof(pcp_request_t);
     processedSize += sizeof(pcp_request_t);
-    DUPPRINT(log_file, "\n");
+    SRV_PRINT(log_file, "\n");
 
 
     if ((common_req->ver > version)) {
-        return PCP_RES_UNSUPP_VERSION;
+        pcp_return_val = PCP_RES_UNSUPP_VERSION;
+        goto end;
     }
 
     // analyze two possible versions of protocol,
@@ -487,13 +554,14 @@ static int printPCPreq(void * req, int req_size, options_occur_t *opt_occ,
             pcp_map_v1_t* map;
             remainingSize -= sizeof(pcp_map_v1_t);
             if (remainingSize < 0) {
-                return PCP_RES_MALFORMED_OPTION;
+                pcp_return_val = PCP_RES_MALFORMED_OPTION;
+                goto end;
             }
             map = (pcp_map_v1_t*) (req_help + processedSize);
             print_MAP_opcode_ver1(map, log_file);
             processedSize += sizeof(pcp_map_v1_t);
 
-            printf("Remaining size is %d \n", remainingSize);
+            SRV_PRINTF("Remaining size is %d \n", remainingSize);
             while (remainingSize > 0) {
                 pcp_return_val = print_PCP_options(req, &remainingSize,
                         &processedSize, opt_occ, log_file);
@@ -505,9 +573,10 @@ static int printPCPreq(void * req, int req_size, options_occur_t *opt_occ,
 
             pcp_peer_v1_t* peer;
             remainingSize -= sizeof(pcp_map_v1_t);
-            printf("Remaining size is %d \n", remainingSize);
+            SRV_PRINTF("Remaining size is %d \n", remainingSize);
             if (remainingSize < 0) {
-                return PCP_RES_MALFORMED_OPTION;
+                pcp_return_val = PCP_RES_MALFORMED_OPTION;
+                goto end;
             }
 
             peer = (pcp_peer_v1_t*) (req_help + processedSize);
@@ -528,13 +597,14 @@ static int printPCPreq(void * req, int req_size, options_occur_t *opt_occ,
         if ((common_req->r_opcode & 0x7F) == PCP_OPCODE_MAP) {
             remainingSize -= sizeof(pcp_map_v2_t);
             if (remainingSize < 0) {
-                return PCP_RES_MALFORMED_OPTION;
+                pcp_return_val = PCP_RES_MALFORMED_OPTION;
+                goto end;
             }
             map = (pcp_map_v2_t*) (req_help + processedSize);
             print_MAP_opcode_ver2(map, log_file);
             processedSize += sizeof(pcp_map_v2_t);
 
-            printf("Remaining size is %d \n", remainingSize);
+            SRV_PRINTF("Remaining size is %d \n", remainingSize);
             while (remainingSize > 0) {
                 pcp_return_val = print_PCP_options(req, &remainingSize,
                         &processedSize, opt_occ, log_file);
@@ -546,9 +616,10 @@ static int printPCPreq(void * req, int req_size, options_occur_t *opt_occ,
 
             pcp_peer_v2_t* peer;
             remainingSize -= sizeof(pcp_peer_v2_t);
-            printf("Remaining size is %d \n", remainingSize);
+            SRV_PRINTF("Remaining size is %d \n", remainingSize);
             if (remainingSize < 0) {
-                return PCP_RES_MALFORMED_OPTION;
+                pcp_return_val = PCP_RES_MALFORMED_OPTION;
+                goto end;
             }
 
             peer = (pcp_peer_v2_t*) (req_help + processedSize);
@@ -569,7 +640,8 @@ static int printPCPreq(void * req, int req_size, options_occur_t *opt_occ,
             size_t sadscp_size;
 
             if (remainingSize < (int)sizeof(pcp_sadscp_req_t)) {
-                return PCP_RES_MALFORMED_REQUEST;
+                pcp_return_val = PCP_RES_MALFORMED_REQUEST;
+                goto end;
             }
 
             sadscp = (pcp_sadscp_req_t*)(req_help + processedSize);
@@ -585,9 +657,12 @@ static int printPCPreq(void * req, int req_size, options_occur_t *opt_occ,
 
         }
     } else {
-        return PCP_RES_UNSUPP_VERSION;
+        pcp_return_val = PCP_RES_UNSUPP_VERSION;
+    }
+end:
+    if (log_file != NULL) {
+        fclose(log_file);
     }
-    fflush(log_file);
     return pcp_return_val;
 }
 
@@ -602,14 +677,16 @@ static int create_response(char *request, int pcp_result_code,
     resp->reserved1[2] = 0;
     resp->r_opcode |= 0x80;
     resp->result_code = (uint8_t)pcp_result_code;
-    resp->epochtime = htonl((uint32_t) (time(NULL) - server_info->epoch_time_start));
+    resp->epochtime = htonl((uint32_t) (time(NULL) - EPOCH_START(server_info)));
 
     if (pcp_result_code == PCP_RES_UNSUPP_VERSION) {
         resp->ver = server_info->server_version;
         return 0;
     }
 
-    if ((resp->r_opcode & 0x7f) == PCP_OPCODE_MAP) {
+    // external address of tracked mappings is set by process_mapping
+    if (((resp->r_opcode & 0x7f) == PCP_OPCODE_MAP)
+            && (!TRACKS_MAPPINGS(server_info))) {
         if (resp->ver==1) {
             pcp_map_v1_t *m1 = (pcp_map_v1_t *)resp->next_data;
             memcpy(m1->ext_ip, &server_info->ext_ip, sizeof(m1->ext_ip));
@@ -628,8 +705,157 @@ static int create_response(char *request, int pcp_result_code,
     return 0;
 }
 
+// MAP and PEER requests create, renew and delete mappings in the mapping table.
+// Mapping part of the request is turned into the response and result code
+// for the response is returned.
+static int process_mapping(char *request, int pcp_result_code,
+        const options_occur_t *opt_occ, server_info_t *server_info)
+{
+    pcp_request_t *req = (pcp_request_t*) request;
+    uint8_t opcode = req->r_opcode & 0x7F;
+    // PEER starts with the same fields as MAP
+    uint8_t protocol;
+    uint16_t *int_port;
+    uint16_t *ext_port;
+    uint32_t *ext_ip;
+    pmt_request_t mreq;
+    pmt_result_t mres;
+
+    if ((!TRACKS_MAPPINGS(server_info)) || (pcp_result_code != PCP_RES_SUCCESS)
+            || ((opcode != PCP_OPCODE_MAP) && (opcode != PCP_OPCODE_PEER))) {
+        return pcp_result_code;
+    }
+
+    memset(&mreq, 0, sizeof(mreq));
+    if (req->ver == 1) {
+        pcp_map_v1_t *map1 = (pcp_map_v1_t*) req->next_data;
+
+        protocol = map1->protocol;
+        int_port = &map1->int_port;
+        ext_port = &map1->ext_port;
+        ext_ip = map1->ext_ip;
+    } else {
+        pcp_map_v2_t *map2 = (pcp_map_v2_t*) req->next_data;
+
+        memcpy(mreq.nonce, &map2->nonce, sizeof(mreq.nonce));
+        protocol = map2->protocol;
+        int_port = &map2->int_port;
+        ext_port = &map2->ext_port;
+        ext_ip = map2->ext_ip;
+    }
+
+    // mappings of all ports are not tracked
+    if (*int_port == 0) {
+        return pcp_result_code;
+    }
+
+    if (server_info->mappings == NULL) {
+        pmt_config_t cfg = *server_info->mappings_cfg;
+
+        cfg.ext_ip = server_info->ext_ip;
+        server_info->mappings = pmt_create(&cfg);
+        if (server_info->mappings == NULL) {
+            return PCP_RES_NO_RESOURCES;
+        }
+    }
+
+    memcpy(&mreq.int_ip, req->ip, sizeof(mreq.int_ip));
+    mreq.int_port = ntohs(*int_port);
+    mreq.protocol = protocol;
+    mreq.prefer_failure = (uint8_t)opt_occ->pfailure_occur;
+    memcpy(&mreq.sugg_ip, ext_ip, sizeof(mreq.sugg_ip));
+    mreq.sugg_port = ntohs(*ext_port);
+    mreq.lifetime = ntohl(req->req_lifetime);
+
+    pmt_process(server_info->mappings, &mreq,
+            (uint32_t) (time(NULL) - EPOCH_START(server_info)), &mres);
+
+    // lifetime of request is at the same place as lifetime of response
+    req->req_lifetime = htonl(mres.lifetime);
+    *ext_port = htons(mres.ext_port);
+    memcpy(ext_ip, &mres.ext_ip, sizeof(mres.ext_ip));
+
+    SRV_PRINTF("Mapping: result %d, lifetime %u, external port %d\n",
+            mres.result_code, mres.lifetime, mres.ext_port);
+
+    return mres.result_code;
+}
+
+// Requests are recorded as received, responses as created, before fault
+// injection changes or drops them.
+static void capture_datagram(PCP_SOCKET sockfd, const void *buf, int len,
+        struct sockaddr *peer, int response)
+{
+    struct sockaddr_storage local;
+    socklen_t local_len = sizeof(local);
+
+    if (capture == NULL) {
+        return;
+    }
+    if (getsockname(sockfd, (struct sockaddr *)&local, &local_len) != 0) {
+        memset(&local, 0, sizeof(local));
+    }
+    if (response) {
+        pcp_pcap_write(capture, NULL, (struct sockaddr *)&local, peer, buf,
+                (size_t)len);
+    } else {
+        pcp_pcap_write(capture, NULL, peer, (struct sockaddr *)&local, buf,
+                (size_t)len);
+    }
+}
+
+// Server restart: epoch time starts again and all mappings are lost.
+static void reset_epoch(server_info_t *server_info)
+{
+    SET_EPOCH_START(server_info, time(NULL));
+    if (server_info->mappings != NULL) {
+        pmt_clear(server_info->mappings);
+    }
+    SRV_PRINTF("PCP server: epoch reset\n");
+}
+
+static void print_faults_summary(const pfi_stats_t *stats)
+{
+    printf("Fault injection summary\n");
+    printf("  Replies:             %llu\n", (unsigned long long)stats->replies);
+    printf("  Lost:                %llu\n", (unsigned long long)stats->lost);
+    printf("  Delayed:             %llu\n", (unsigned long long)stats->delayed);
+    printf("  Duplicated:          %llu\n",
+            (unsigned long long)stats->duplicated);
+    printf("  Reordered:           %llu\n",
+            (unsigned long long)stats->reordered);
+    printf("  Truncated:           %llu\n",
+            (unsigned long long)stats->truncated);
+    printf("  Malformed:           %llu\n",
+            (unsigned long long)stats->malformed);
+    printf("  Epoch resets:        %llu\n",
+            (unsigned long long)stats->epoch_resets);
+    printf("  Longest delay queue: %u\n", stats->max_queued);
+    fflush(stdout);
+}
+
+static void print_mappings_summary(pcp_mapping_table_t *mappings)
+{
+    pmt_stats_t stats;
+
+    if (mappings == NULL) {
+        return;
+    }
+    pmt_get_stats(mappings, &stats);
+    printf("Mapping table summary\n");
+    printf("  Mappings:            %u\n", stats.mappings);
+    printf("  Internal addresses:  %u\n", stats.hosts);
+    printf("  Created:             %llu\n", (unsigned long long)stats.created);
+    printf("  Renewed:             %llu\n", (unsigned long long)stats.renewed);
+    printf("  Deleted:             %llu\n", (unsigned long long)stats.deleted);
+    printf("  Expired:             %llu\n", (unsigned long long)stats.expired);
+    printf("  Rejected:            %llu\n", (unsigned long long)stats.rejected);
+    printf("  Memory:              %.1f MiB\n", stats.memory / 1048576.0);
+    fflush(stdout);
+}
+
 static int execPCPServer(const char* serverPort, const char* serverAddress,
-        const server_info_t *server_info)
+        server_info_t *server_info)
 {
     PCP_SOCKET sockfd;
     int numbytes;
@@ -637,6 +863,7 @@ static int execPCPServer(const char* serverPort, const char* serverAddress,
     struct sockaddr_storage their_addr;
     int execute = 1;
     options_occur_t opt_occurence = { 0, 0 };
+    pcp_faults_t *faults = NULL;
 
     char buf[PCP_MAX_LEN];
     socklen_t addr_len=0;
@@ -661,7 +888,10 @@ static int execPCPServer(const char* serverPort, const char* serverAddress,
         execute = server_info->end_after_recv;
     }
 
-    sockfd = createPCPsocket(serverPort, serverAddress);
+    sockfd = createPCPsocket(serverPort, serverAddress, 0);
+    if (pfi_enabled(&server_info->faults)) {
+        CHECK_NULL_EXIT((faults = pfi_create(&server_info->faults, 0)));
+    }
 
     gettimeofday(&tod, NULL);
     timeout_time.tv_sec = tod.tv_sec + server_info->tv.tv_sec;
@@ -669,21 +899,40 @@ static int execPCPServer(const char* serverPort, const char* serverAddress,
 
     while (execute) {
         time_t recvtime;
-
-        if (server_info->end_after_recv != 0) {
-            execute--;
-        }
+        // wakes up to send delayed replies
+        int queue_wait = -1;
 
         recvtime = 0;
 
-        if (server_info->tv.tv_sec != 0 || server_info->tv.tv_usec != 0) {
-            struct timeval end_time;
+        if (faults) {
+            pfi_flush(faults);
+            queue_wait = pfi_wait_ms(faults);
+        }
+
+        if (server_info->tv.tv_sec != 0 || server_info->tv.tv_usec != 0
+                || faults) {
+            struct timeval end_time = { 0, 0 };
             PI_TIMEOUT_STRUCT pi_timeout;
-            gettimeofday(&tod, NULL);
 
-            if (timeval_subtract(&end_time, &timeout_time, &tod)) {//LCOV_EXCL_START
-                end_time.tv_sec = 0;
-                end_time.tv_usec = 0;
+            if (server_info->tv.tv_sec != 0 || server_info->tv.tv_usec != 0) {
+                gettimeofday(&tod, NULL);
+
+                if (timeval_subtract(&end_time, &timeout_time, &tod)) {//LCOV_EXCL_START
+                    end_time.tv_sec = 0;
+                    end_time.tv_usec = 0;
+                }//LCOV_EXCL_STOP
+            }
+
+            if (queue_wait >= 0) {
+                struct timeval wait_time = { queue_wait / 1000,
+                        (queue_wait % 1000) * 1000 + 1 };
+
+                if (((end_time.tv_sec == 0) && (end_time.tv_usec == 0))
+                        || (timeval_comp(&wait_time, &end_time) < 0)) {
+                    end_time = wait_time;
+                } else {
+                    queue_wait = -1;
+                }
             }
 
             SET_PI_TIMEOUT(pi_timeout, end_time);
@@ -697,11 +946,34 @@ static int execPCPServer(const char* serverPort, const char* serverAddress,
 
         addr_len = sizeof their_addr;
         if ((numbytes = recvfrom(sockfd, buf, PCP_MAX_LEN - 1, 0,
-                (struct sockaddr *) &their_addr, &addr_len)) == PCP_SOCKET_ERROR) {//LCOV_EXCL_START
-            perror("recvfrom");
+                (struct sockaddr *) &their_addr, &addr_len)) == PCP_SOCKET_ERROR) {
+            if (queue_wait >= 0) {
+                continue;
+            }
+            // --timeout expired, delayed replies are still sent below
+            if (server_info->tv.tv_sec != 0 || server_info->tv.tv_usec != 0) {
+                struct timeval left;
+
+                gettimeofday(&tod, NULL);
+                if ((timeval_subtract(&left, &timeout_time, &tod))
+                        || ((left.tv_sec == 0) && (left.tv_usec == 0))) {
+                    break;
+                }
+                continue;
+            }
+            perror("recvfrom");//LCOV_EXCL_START
             exit(1);
         }//LCOV_EXCL_STOP
         time(&recvtime);
+        capture_datagram(sockfd, buf, numbytes,
+                (struct sockaddr *) &their_addr, 0);
+
+        if (server_info->end_after_recv != 0) {
+            execute--;
+        }
+        if ((faults) && (pfi_epoch_reset(faults))) {
+            reset_epoch(server_info);
+        }
 
         printf("PCP server: got packet at %s from %s\n", ctime(&recvtime),
                 inet_ntop(their_addr.ss_family,
@@ -712,6 +984,10 @@ static int execPCPServer(const char* serverPort, const char* serverAddress,
 
         pcp_result_code = printPCPreq(buf, numbytes, &opt_occurence,
                 server_info->server_version, server_info->log_file);
+        if (server_info->default_result_code == 255) {
+            pcp_result_code = process_mapping(buf, pcp_result_code,
+                    &opt_occurence, server_info);
+        }
 
         // check if default result code should be returned
         // or the result code that was retrieved after message parsing
@@ -719,15 +995,31 @@ static int execPCPServer(const char* serverPort, const char* serverAddress,
                 (server_info->default_result_code == 255) ?
                         pcp_result_code : server_info->default_result_code,
                 server_info);
+        capture_datagram(sockfd, buf, numbytes,
+                (struct sockaddr *) &their_addr, 1);
 
         // send response to client
-        sendto(sockfd, buf, numbytes, 0, (struct sockaddr*) &their_addr,
-                addr_len);
+        if (faults) {
+            pfi_submit(faults, sockfd, buf, numbytes,
+                    (struct sockaddr*) &their_addr, addr_len);
+        } else {
+            sendto(sockfd, buf, numbytes, 0, (struct sockaddr*) &their_addr,
+                    addr_len);
+        }
 
         reset_option_occur(&opt_occurence);
         printf("\n");
     }
 
+    if (faults) {
+        pfi_stats_t stats;
+
+        pfi_drain(faults);
+        pfi_get_stats(faults, &stats);
+        print_faults_summary(&stats);
+        pfi_destroy(faults);
+    }
+    print_mappings_summary(server_info->mappings);
     printf("Closing sockfd \n");
     CLOSE(sockfd);
 
@@ -738,6 +1030,707 @@ static int execPCPServer(const char* serverPort, const char* serverAddress,
     return 0;
 }
 
+#ifdef PCP_SERVER_WORKERS
+
+#define WORKER_BATCH 64
+#define WORKER_TICK_MS 100
+
+typedef struct worker {
+    pthread_t thread;
+    unsigned index;
+    int cpu;
+    PCP_SOCKET sockfd;
+    server_info_t *server_info;
+    pcp_faults_t *faults;
+    struct timeval deadline;
+    // counters are private to worker and summed up after it finishes
+    uint64_t received;
+    uint64_t sent;
+    uint64_t errors;
+    uint64_t recv_calls;
+    struct timeval first_recv;
+    struct timeval last_send;
+} worker_t;
+
+static volatile sig_atomic_t workers_stop = 0;
+static uint32_t workers_requests = 0;
+static pthread_mutex_t mappings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void workers_signal(int sig)
+{
+    (void)sig;
+    workers_stop = 1;
+}
+
+// index-th of CPUs the server is allowed to run on
+static int worker_cpu(unsigned index)
+{
+    cpu_set_t set;
+    unsigned n = 0;
+    int cpu;
+
+    if ((sched_getaffinity(0, sizeof(set), &set) != 0)
+            || (CPU_COUNT(&set) == 0)) {
+        return -1;
+    }
+
+    index %= (unsigned)CPU_COUNT(&set);
+    for (cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if ((CPU_ISSET(cpu, &set)) && (n++ == index)) {
+            return cpu;
+        }
+    }
+    return -1;
+}
+
+// deadline 0 is never up
+static int time_is_up(struct timeval *deadline)
+{
+    struct timeval now;
+
+    if ((deadline->tv_sec == 0) && (deadline->tv_usec == 0)) {
+        return 0;
+    }
+    gettimeofday(&now, NULL);
+    return timeval_comp(&now, deadline) >= 0;
+}
+
+// requests received by one recvmmsg, turned into responses in place
+typedef struct batch {
+    char bufs[WORKER_BATCH][PCP_MAX_LEN];
+    struct sockaddr_storage addrs[WORKER_BATCH];
+    struct iovec iovs[WORKER_BATCH];
+    struct mmsghdr msgs[WORKER_BATCH];
+} batch_t;
+
+static void batch_init(batch_t *b)
+{
+    int i;
+
+    memset(b->msgs, 0, sizeof(b->msgs));
+    for (i = 0; i < WORKER_BATCH; ++i) {
+        b->iovs[i].iov_base = b->bufs[i];
+        b->msgs[i].msg_hdr.msg_iov = &b->iovs[i];
+        b->msgs[i].msg_hdr.msg_iovlen = 1;
+        b->msgs[i].msg_hdr.msg_name = &b->addrs[i];
+    }
+}
+
+// Receives batch of requests and responds to them. Mappings and epoch of
+// server_info are changed under lock, if server_info is shared by threads.
+// Returns number of requests, 0 if there was none or -1 on socket error.
+static int serve_batch(batch_t *b, PCP_SOCKET sockfd, int flags,
+        server_info_t *server_info, pcp_faults_t *faults,
+        pthread_mutex_t *lock, uint64_t *sent, uint64_t *errors)
+{
+    options_occur_t opt_occurence = { 0, 0 };
+    int i, n, done = 0;
+
+    for (i = 0; i < WORKER_BATCH; ++i) {
+        b->iovs[i].iov_len = PCP_MAX_LEN - 1;
+        b->msgs[i].msg_hdr.msg_namelen = sizeof(b->addrs[i]);
+    }
+
+    n = recvmmsg(sockfd, b->msgs, WORKER_BATCH, flags, NULL);
+    if (n <= 0) {
+        if ((n < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK)
+                && (errno != EINTR)) {
+            perror("recvmmsg");
+            return -1;
+        }
+        return 0;
+    }
+
+    for (i = 0; i < n; ++i) {
+        int pcp_result_code;
+
+        capture_datagram(sockfd, b->bufs[i], (int)b->msgs[i].msg_len,
+                (struct sockaddr *)&b->addrs[i], 0);
+        if ((faults) && (pfi_epoch_reset(faults))) {
+            if (lock) {
+                pthread_mutex_lock(lock);
+            }
+            reset_epoch(server_info);
+            if (lock) {
+                pthread_mutex_unlock(lock);
+            }
+        }
+        pcp_result_code = printPCPreq(b->bufs[i], (int)b->msgs[i].msg_len,
+                &opt_occurence, server_info->server_version, NULL);
+
+        if (server_info->default_result_code != 255) {
+            pcp_result_code = server_info->default_result_code;
+        } else if (TRACKS_MAPPINGS(server_info)) {
+            if (lock) {
+                pthread_mutex_lock(lock);
+            }
+            pcp_result_code = process_mapping(b->bufs[i], pcp_result_code,
+                    &opt_occurence, server_info);
+            if (lock) {
+                pthread_mutex_unlock(lock);
+            }
+        }
+        *errors += (pcp_result_code != PCP_RES_SUCCESS);
+        create_response(b->bufs[i], pcp_result_code, server_info);
+        capture_datagram(sockfd, b->bufs[i], (int)b->msgs[i].msg_len,
+                (struct sockaddr *)&b->addrs[i], 1);
+        reset_option_occur(&opt_occurence);
+        b->iovs[i].iov_len = b->msgs[i].msg_len;
+    }
+
+    if (faults) {
+        for (i = 0; i < n; ++i) {
+            pfi_submit(faults, sockfd, b->bufs[i], (int)b->iovs[i].iov_len,
+                    (struct sockaddr *)&b->addrs[i],
+                    b->msgs[i].msg_hdr.msg_namelen);
+        }
+        done = n;
+    }
+
+    while (done < n) {
+        int ret = sendmmsg(sockfd, b->msgs + done, n - done, 0);
+
+        if (ret <= 0) {
+            if ((ret < 0) && (errno == EINTR)) {
+                continue;
+            }
+            break;
+        }
+        done += ret;
+    }
+    *sent += done;
+
+    return n;
+}
+
+static void *worker_run(void *arg)
+{
+    worker_t *w = (worker_t *)arg;
+    server_info_t *server_info = w->server_info;
+    struct timeval tick = { 0, WORKER_TICK_MS * 1000 };
+    batch_t batch;
+
+    if (w->cpu >= 0) {
+        cpu_set_t set;
+
+        CPU_ZERO(&set);
+        CPU_SET(w->cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+
+    // wake up regularly to check for end of the run
+    setsockopt(w->sockfd, SOL_SOCKET, SO_RCVTIMEO, (char*)&tick, sizeof(tick));
+    batch_init(&batch);
+
+    while ((!workers_stop) && (!time_is_up(&w->deadline))) {
+        int n;
+        int flags = MSG_WAITFORONE;
+
+        // delayed replies are sent between batches of requests
+        if (w->faults) {
+            struct pollfd pfd = { w->sockfd, POLLIN, 0 };
+            int wait;
+
+            pfi_flush(w->faults);
+            wait = pfi_wait_ms(w->faults);
+            if ((wait < 0) || (wait > WORKER_TICK_MS)) {
+                wait = WORKER_TICK_MS;
+            }
+            if (poll(&pfd, 1, wait) <= 0) {
+                continue;
+            }
+            flags |= MSG_DONTWAIT;
+        }
+
+        n = serve_batch(&batch, w->sockfd, flags, server_info, w->faults,
+                &mappings_lock, &w->sent, &w->errors);
+        if (n < 0) {
+            break;
+        } else if (n == 0) {
+            continue;
+        }
+        if (w->received == 0) {
+            gettimeofday(&w->first_recv, NULL);
+        }
+        w->recv_calls++;
+        w->received += n;
+        gettimeofday(&w->last_send, NULL);
+
+        if ((server_info->end_after_recv != 0)
+                && (__sync_add_and_fetch(&workers_requests, (uint32_t)n)
+                        >= server_info->end_after_recv)) {
+            workers_stop = 1;
+        }
+    }
+
+    if (w->faults) {
+        pfi_drain(w->faults);
+    }
+    return NULL;
+}
+
+static void print_workers_summary(worker_t *workers, unsigned nworkers)
+{
+    struct timeval busy_start = { 0, 0 }, busy_end = { 0, 0 }, busy;
+    uint64_t received = 0, sent = 0, errors = 0, recv_calls = 0;
+    double busy_ms = 0;
+    unsigned i;
+
+    for (i = 0; i < nworkers; ++i) {
+        worker_t *w = &workers[i];
+
+        if (w->received != 0) {
+            if ((received == 0)
+                    || (timeval_comp(&w->first_recv, &busy_start) < 0)) {
+                busy_start = w->first_recv;
+            }
+            if (timeval_comp(&w->last_send, &busy_end) > 0) {
+                busy_end = w->last_send;
+            }
+        }
+        received += w->received;
+        sent += w->sent;
+        errors += w->errors;
+        recv_calls += w->recv_calls;
+    }
+
+    if (received != 0) {
+        timeval_subtract(&busy, &busy_end, &busy_start);
+        busy_ms = busy.tv_sec * 1000.0 + busy.tv_usec / 1000.0;
+    }
+
+    printf("PCP server workers summary\n");
+    printf("  Workers:             %u\n", nworkers);
+    printf("  Requests received:   %llu\n", (unsigned long long)received);
+    printf("  Responses sent:      %llu\n", (unsigned long long)sent);
+    printf("  Error responses:     %llu\n", (unsigned long long)errors);
+    printf("  Requests per recv:   %.1f\n",
+            recv_calls ? (double)received / recv_calls : 0.0);
+    printf("  Busy time:           %.1f ms\n", busy_ms);
+    printf("  Throughput:          %.0f requests/s\n",
+            busy_ms > 0 ? received * 1000.0 / busy_ms : 0.0);
+    for (i = 0; i < nworkers; ++i) {
+        printf("  Worker %-3u CPU %-4d %llu requests\n", workers[i].index,
+                workers[i].cpu, (unsigned long long)workers[i].received);
+    }
+    fflush(stdout);
+}
+
+// Each worker thread has its own SO_REUSEPORT socket and is pinned to a CPU.
+// Requests are not printed, only summary is after the server finishes.
+static int execPCPWorkers(const char* serverPort, const char* serverAddress,
+        server_info_t *server_info, unsigned nworkers)
+{
+    worker_t *workers;
+    struct timeval deadline = { 0, 0 };
+    unsigned i;
+
+    CHECK_NULL_EXIT((workers = (worker_t*)calloc(nworkers, sizeof(*workers))));
+
+    print_requests = 0;
+    signal(SIGINT, workers_signal);
+    signal(SIGTERM, workers_signal);
+
+    if (server_info->tv.tv_sec != 0 || server_info->tv.tv_usec != 0) {
+        gettimeofday(&deadline, NULL);
+        deadline.tv_sec += server_info->tv.tv_sec;
+        deadline.tv_usec += server_info->tv.tv_usec;
+        timeval_align(&deadline);
+    }
+
+    for (i = 0; i < nworkers; ++i) {
+        workers[i].index = i;
+        workers[i].cpu = worker_cpu(i);
+        workers[i].server_info = server_info;
+        workers[i].deadline = deadline;
+        workers[i].sockfd = createPCPsocket(serverPort, serverAddress, 1);
+        if (pfi_enabled(&server_info->faults)) {
+            CHECK_NULL_EXIT((workers[i].faults = pfi_create(
+                    &server_info->faults, i)));
+        }
+    }
+
+    for (i = 0; i < nworkers; ++i) {
+        int err = pthread_create(&workers[i].thread, NULL, worker_run,
+                &workers[i]);
+
+        if (err != 0) {//LCOV_EXCL_START
+            fprintf(stderr, "PCP server: failed to start worker: %s\n",
+                    strerror(err));
+            exit(1);
+        }//LCOV_EXCL_STOP
+    }
+    printf("Started %u workers\n", nworkers);
+    fflush(stdout);
+
+    for (i = 0; i < nworkers; ++i) {
+        pthread_join(workers[i].thread, NULL);
+        CLOSE(workers[i].sockfd);
+    }
+
+    print_workers_summary(workers, nworkers);
+    if (pfi_enabled(&server_info->faults)) {
+        pfi_stats_t total, stats;
+
+        memset(&total, 0, sizeof(total));
+        for (i = 0; i < nworkers; ++i) {
+            pfi_get_stats(workers[i].faults, &stats);
+            total.replies += stats.replies;
+            total.lost += stats.lost;
+            total.delayed += stats.delayed;
+            total.duplicated += stats.duplicated;
+            total.reordered += stats.reordered;
+            total.truncated += stats.truncated;
+            total.malformed += stats.malformed;
+            total.epoch_resets += stats.epoch_resets;
+            total.max_queued += stats.max_queued;
+            pfi_destroy(workers[i].faults);
+        }
+        print_faults_summary(&total);
+    }
+    print_mappings_summary(server_info->mappings);
+    free(workers);
+
+    return 0;
+}
+
+#endif //PCP_SERVER_WORKERS
+
+#ifdef PCP_SERVER_IDENTITIES
+
+#define MAX_IDENTITIES 65536
+#define IDENTITY_EVENTS 64
+
+// one simulated PCP server with its own version, epoch, result code and
+// mapping table
+typedef struct identity {
+    PCP_SOCKET sockfd;
+    server_info_t info;
+    char addr[INET6_ADDRSTRLEN];
+    uint16_t port;
+    uint64_t received;
+    uint64_t sent;
+    uint64_t errors;
+} identity_t;
+
+typedef struct identities {
+    identity_t *list;
+    unsigned count;
+} identities_t;
+
+static int parse_identity_option(server_info_t *info, char *opt)
+{
+    char *value = strchr(opt, '=');
+    int v;
+
+    if (!value) {
+        return -1;
+    }
+    *value++ = '\0';
+    if (!strcmp(opt, "ext-ip")) {
+        return inet_pton(AF_INET6, value, &info->ext_ip) == 1 ? 0 : -1;
+    }
+    v = atoi(value);
+    if (!strcmp(opt, "v") && (v >= 1) && (v <= PCP_TEST_MAX_VERSION)) {
+        info->server_version = (uint8_t)v;
+    } else if (!strcmp(opt, "r") && (((v >= 0) && (v <= 13)) || (v == 255))) {
+        info->default_result_code = (uint8_t)v;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+// Adds identities of spec "address[/prefix][@port[-port]][,option=value...]",
+// one for each address of the prefix and each port. Options v, r and ext-ip
+// override server version, result code and external address.
+static int add_identities(identities_t *ids, const char *spec,
+        const server_info_t *defaults)
+{
+    char buf[256];
+    char *opts, *ports, *prefix, *opt;
+    server_info_t info = *defaults;
+    unsigned port_min = atoi(PCP_PORT), port_max, bits, i, p;
+    uint64_t count;
+    struct in6_addr ip6;
+    struct in_addr ip4;
+    int family;
+    identity_t *list;
+
+    if (strlen(spec) >= sizeof(buf)) {
+        return -1;
+    }
+    strcpy(buf, spec);
+
+    if ((opts = strchr(buf, ',')) != NULL) {
+        *opts++ = '\0';
+        for (opt = strtok(opts, ","); opt; opt = strtok(NULL, ",")) {
+            if (parse_identity_option(&info, opt)) {
+                return -1;
+            }
+        }
+    }
+
+    port_max = port_min;
+    if ((ports = strchr(buf, '@')) != NULL) {
+        *ports++ = '\0';
+        switch (sscanf(ports, "%u-%u", &port_min, &port_max)) {
+            case 1:
+                port_max = port_min;
+                break;
+            case 2:
+                break;
+            default:
+                return -1;
+        }
+        if ((port_min < 1) || (port_max > 65535) || (port_min > port_max)) {
+            return -1;
+        }
+    }
+
+    if ((prefix = strchr(buf, '/')) != NULL) {
+        *prefix++ = '\0';
+    }
+    if (inet_pton(AF_INET, buf, &ip4) == 1) {
+        family = AF_INET;
+        bits = 32;
+    } else if (inet_pton(AF_INET6, buf, &ip6) == 1) {
+        family = AF_INET6;
+        bits = 128;
+    } else {
+        return -1;
+    }
+    if (prefix) {
+        unsigned len = (unsigned)atoi(prefix);
+
+        // only the low 16 bits of address are enumerated
+        if ((len > bits) || (bits - len > 16)) {
+            return -1;
+        }
+        bits -= len;
+    } else {
+        bits = 0;
+    }
+
+    // 2^16 addresses times 2^16 ports does not fit in 32 bits
+    count = (uint64_t)(1u << bits) * (port_max - port_min + 1);
+    if (count > MAX_IDENTITIES - ids->count) {
+        return -1;
+    }
+    list = (identity_t *)realloc(ids->list,
+            (ids->count + (size_t)count) * sizeof(*list));
+    if (!list) {
+        return -1;
+    }
+    ids->list = list;
+
+    for (i = 0; i < (1u << bits); ++i) {
+        for (p = port_min; p <= port_max; ++p) {
+            identity_t *id = &ids->list[ids->count++];
+
+            memset(id, 0, sizeof(*id));
+            id->info = info;
+            id->port = (uint16_t)p;
+            if (family == AF_INET) {
+                struct in_addr a;
+
+                a.s_addr = htonl((ntohl(ip4.s_addr) & ~((1u << bits) - 1))
+                        + i);
+                inet_ntop(AF_INET, &a, id->addr, sizeof(id->addr));
+            } else {
+                struct in6_addr a = ip6;
+                uint16_t low = (uint16_t)(((a.s6_addr[14] << 8)
+                        | a.s6_addr[15]) & ~((1u << bits) - 1)) + i;
+
+                a.s6_addr[14] = (uint8_t)(low >> 8);
+                a.s6_addr[15] = (uint8_t)low;
+                inet_ntop(AF_INET6, &a, id->addr, sizeof(id->addr));
+            }
+        }
+    }
+    return 0;
+}
+
+// each identity takes one descriptor
+static void raise_fd_limit(unsigned count)
+{
+    struct rlimit rl;
+
+    if ((getrlimit(RLIMIT_NOFILE, &rl) == 0) && (rl.rlim_cur < count + 64)) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+static void print_identities_summary(identities_t *ids, double busy_ms)
+{
+    uint64_t received = 0, sent = 0, errors = 0, mappings = 0;
+    unsigned i, idle = 0, busiest = 0;
+
+    for (i = 0; i < ids->count; ++i) {
+        identity_t *id = &ids->list[i];
+
+        received += id->received;
+        sent += id->sent;
+        errors += id->errors;
+        idle += (id->received == 0);
+        if (id->received > ids->list[busiest].received) {
+            busiest = i;
+        }
+        if (id->info.mappings) {
+            pmt_stats_t stats;
+
+            pmt_get_stats(id->info.mappings, &stats);
+            mappings += stats.mappings;
+        }
+    }
+
+    printf("PCP server identities summary\n");
+    printf("  Identities:          %u\n", ids->count);
+    printf("  Idle identities:     %u\n", idle);
+    printf("  Requests received:   %llu\n", (unsigned long long)received);
+    printf("  Responses sent:      %llu\n", (unsigned long long)sent);
+    printf("  Error responses:     %llu\n", (unsigned long long)errors);
+    printf("  Busiest identity:    %s port %u, %llu requests\n",
+            ids->list[busiest].addr, ids->list[busiest].port,
+            (unsigned long long)ids->list[busiest].received);
+    printf("  Mappings:            %llu\n", (unsigned long long)mappings);
+    printf("  Busy time:           %.1f ms\n", busy_ms);
+    printf("  Throughput:          %.0f requests/s\n",
+            busy_ms > 0 ? received * 1000.0 / busy_ms : 0.0);
+    fflush(stdout);
+}
+
+// All identities are served by one thread. Requests are not printed, only
+// summary is after the server finishes.
+static int execPCPIdentities(identities_t *ids, server_info_t *defaults,
+        const pmt_config_t *mappings_cfg)
+{
+    struct epoll_event events[IDENTITY_EVENTS];
+    struct timeval deadline = { 0, 0 }, first_recv = { 0, 0 }, last_send;
+    struct timeval busy;
+    batch_t *batch;
+    pcp_faults_t *faults = NULL;
+    uint64_t received = 0;
+    double busy_ms = 0;
+    unsigned i;
+    int epfd;
+
+    CHECK_NULL_EXIT((batch = (batch_t*)malloc(sizeof(*batch))));
+    batch_init(batch);
+
+    print_requests = 0;
+    signal(SIGINT, workers_signal);
+    signal(SIGTERM, workers_signal);
+    raise_fd_limit(ids->count);
+
+    if ((epfd = epoll_create1(0)) < 0) {//LCOV_EXCL_START
+        perror("epoll_create1");
+        exit(1);
+    }//LCOV_EXCL_STOP
+
+    for (i = 0; i < ids->count; ++i) {
+        identity_t *id = &ids->list[i];
+        struct epoll_event ev;
+        char port[8];
+
+        // tables of identities are created on their first mapping
+        id->info.mappings_cfg = mappings_cfg;
+        snprintf(port, sizeof(port), "%u", id->port);
+        id->sockfd = createPCPsocket(port, id->addr, 0);
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = id;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, id->sockfd, &ev) < 0) {//LCOV_EXCL_START
+            perror("epoll_ctl");
+            exit(1);
+        }//LCOV_EXCL_STOP
+    }
+
+    if (pfi_enabled(&defaults->faults)) {
+        CHECK_NULL_EXIT((faults = pfi_create(&defaults->faults, 0)));
+    }
+
+    if (defaults->tv.tv_sec != 0 || defaults->tv.tv_usec != 0) {
+        gettimeofday(&deadline, NULL);
+        deadline.tv_sec += defaults->tv.tv_sec;
+        deadline.tv_usec += defaults->tv.tv_usec;
+        timeval_align(&deadline);
+    }
+
+    printf("Serving %u identities\n", ids->count);
+    fflush(stdout);
+
+    while ((!workers_stop) && (!time_is_up(&deadline))) {
+        int n, wait = WORKER_TICK_MS;
+
+        if (faults) {
+            int queue_wait;
+
+            pfi_flush(faults);
+            queue_wait = pfi_wait_ms(faults);
+            if ((queue_wait >= 0) && (queue_wait < wait)) {
+                wait = queue_wait;
+            }
+        }
+
+        n = epoll_wait(epfd, events, IDENTITY_EVENTS, wait);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");//LCOV_EXCL_LINE
+            break;//LCOV_EXCL_LINE
+        }
+
+        for (i = 0; i < (unsigned)n; ++i) {
+            identity_t *id = (identity_t *)events[i].data.ptr;
+            int r = serve_batch(batch, id->sockfd, MSG_DONTWAIT, &id->info,
+                    faults, NULL, &id->sent, &id->errors);
+
+            if (r <= 0) {
+                continue;
+            }
+            if (received == 0) {
+                gettimeofday(&first_recv, NULL);
+            }
+            id->received += r;
+            received += r;
+            gettimeofday(&last_send, NULL);
+        }
+
+        if ((defaults->end_after_recv != 0)
+                && (received >= defaults->end_after_recv)) {
+            break;
+        }
+    }
+
+    if (received != 0) {
+        timeval_subtract(&busy, &last_send, &first_recv);
+        busy_ms = busy.tv_sec * 1000.0 + busy.tv_usec / 1000.0;
+    }
+    if (faults) {
+        pfi_stats_t stats;
+
+        pfi_drain(faults);
+        pfi_get_stats(faults, &stats);
+        print_faults_summary(&stats);
+        pfi_destroy(faults);
+    }
+    print_identities_summary(ids, busy_ms);
+
+    for (i = 0; i < ids->count; ++i) {
+        CLOSE(ids->list[i].sockfd);
+        pmt_destroy(ids->list[i].info.mappings);
+    }
+    CLOSE(epfd);
+    free(batch);
+
+    return 0;
+}
+
+#endif //PCP_SERVER_IDENTITIES
+
 static void print_usage(void)
 {
 
@@ -763,6 +1756,38 @@ static void print_usage(void)
     printf("--app-bit \t  set application bit in SADSCP opcode response\n");
     printf("--ret-dscp\t  return DSCP value for SADSCP opcode\n");
     printf("--log-file \t  Log Requests to file \n");
+    printf("--mappings \t  Keep table of mappings and allocate external ports\n");
+    printf("--ext-ip-count #num  Number of external addresses for mappings,\n"
+           "          \t   starting with --ext-ip. DEFAULT: 1\n");
+    printf("--port-range #min-#max  External ports for mappings.\n"
+           "          \t   DEFAULT: 1024-65535\n");
+    printf("--max-lifetime #sec  Longest lifetime of mapping. DEFAULT: "
+           xstr(PMT_DEFAULT_MAX_LIFETIME)"\n");
+    printf("--quota #num \t  Mappings per internal address. DEFAULT: 0 (none)\n");
+    printf("--max-mappings #num  Size of the mapping table. DEFAULT: 0 (none)\n");
+    printf("--workers #num  Serve requests by #num threads, each with its own\n"
+           "          \t   socket and CPU. Requests are not printed, summary\n"
+           "          \t   of throughput is printed at exit. (Linux only)\n");
+    printf("--loss #pct \t  Drop #pct %% of replies\n");
+    printf("--delay #ms \t  Send replies #ms later\n");
+    printf("--jitter #ms \t  Add random delay of up to #ms to replies\n");
+    printf("--duplicate #pct  Send #pct %% of replies twice\n");
+    printf("--reorder #pct \t  Hold back #pct %% of replies by "
+           xstr(PFI_REORDER_HOLD_MS) " ms\n");
+    printf("--truncate #pct  Cut #pct %% of replies to half\n");
+    printf("--malform #pct \t  Break header or length of #pct %% of replies\n");
+    printf("--epoch-reset #pct  Reset epoch time and mappings before\n"
+           "          \t   #pct %% of requests, as if the server restarted\n");
+    printf("--seed #num \t  Seed of random faults. DEFAULT: time\n");
+    printf("--faults file \t  Read fault options from file, one\n"
+           "          \t   \"option value\" per line, # starts comment\n");
+    printf("--identity addr[/prefix][@port[-port]][,v=#][,r=#][,ext-ip=addr]\n"
+           "          \t  Serve as a separate server on each address of\n"
+           "          \t   prefix and each port (DEFAULT: " PCP_PORT "), with its\n"
+           "          \t   own version, result code, epoch and mappings.\n"
+           "          \t   Can be repeated; -p and --ip are then not used.\n"
+           "          \t   Summary is printed at exit. (Linux only)\n");
+    printf("--capture file \t  Record requests and responses to pcap file\n");
 
 }
 
@@ -792,6 +1817,18 @@ int main(int argc, char *argv[])
     uint8_t app_bit = 0;
     uint8_t ret_dscp = 0;
     char *log_file = NULL;
+    int workers = 0;
+    int mappings = 0;
+    pmt_config_t mappings_cfg;
+    const char *identity_specs[MAX_IDENTITY_SPECS];
+    int identity_count = 0;
+    int ret;
+
+    memset(&server_info_storage, 0, sizeof(server_info_storage));
+    memset(&mappings_cfg, 0, sizeof(mappings_cfg));
+    mappings_cfg.ext_ip_count = 1;
+    mappings_cfg.port_min = 1024;
+    mappings_cfg.port_max = 65535;
 
     {
         int c;
@@ -806,6 +1843,25 @@ int main(int argc, char *argv[])
                 { "app-bit", no_argument, 0, 0 },
                 { "ret-dscp", required_argument, 0, 0 },
                 { "log-file", required_argument, 0, 0},
+                { "workers", required_argument, 0, 0},
+                { "mappings", no_argument, 0, 0},
+                { "ext-ip-count", required_argument, 0, 0},
+                { "port-range", required_argument, 0, 0},
+                { "max-lifetime", required_argument, 0, 0},
+                { "quota", required_argument, 0, 0},
+                { "max-mappings", required_argument, 0, 0},
+                { "faults", required_argument, 0, 0},
+                { "loss", required_argument, 0, 0},
+                { "delay", required_argument, 0, 0},
+                { "jitter", required_argument, 0, 0},
+                { "duplicate", required_argument, 0, 0},
+                { "reorder", required_argument, 0, 0},
+                { "truncate", required_argument, 0, 0},
+                { "malform", required_argument, 0, 0},
+                { "epoch-reset", required_argument, 0, 0},
+                { "seed", required_argument, 0, 0},
+                { "identity", required_argument, 0, 0},
+                { "capture", required_argument, 0, 0},
                 { 0, 0, 0, 0}
         };
 
@@ -851,6 +1907,84 @@ int main(int argc, char *argv[])
                     log_file = optarg;
                 }
 
+                if (!strcmp(long_options[option_index].name, "workers")) {
+                    workers = atoi(optarg);
+                    if (workers < 1) {
+                        printf("Bad value for option --workers %d \n",
+                                workers);
+                        exit(1);
+                    }
+                }
+
+                if (!strcmp(long_options[option_index].name, "mappings")) {
+                    mappings = 1;
+                }
+
+                if (!strcmp(long_options[option_index].name, "identity")) {
+                    if (identity_count == MAX_IDENTITY_SPECS) {
+                        printf("Too many --identity options \n");
+                        exit(1);
+                    }
+                    identity_specs[identity_count++] = optarg;
+                }
+
+                if (!strcmp(long_options[option_index].name, "capture")) {
+                    pcp_pcap_close(capture);
+                    capture = pcp_pcap_create(optarg);
+                    if (capture == NULL) {
+                        printf("Failed to create capture file %s \n", optarg);
+                        exit(1);
+                    }
+                }
+
+                if (!strcmp(long_options[option_index].name, "ext-ip-count")) {
+                    mappings_cfg.ext_ip_count = (uint32_t) atoi(optarg);
+                }
+
+                if (!strcmp(long_options[option_index].name, "port-range")) {
+                    unsigned lo, hi;
+
+                    if ((sscanf(optarg, "%u-%u", &lo, &hi) != 2) || (lo < 1)
+                            || (hi > 65535) || (lo > hi)) {
+                        printf("Bad value for option --port-range %s \n",
+                                optarg);
+                        exit(1);
+                    }
+                    mappings_cfg.port_min = (uint16_t) lo;
+                    mappings_cfg.port_max = (uint16_t) hi;
+                }
+
+                if (!strcmp(long_options[option_index].name, "max-lifetime")) {
+                    mappings_cfg.max_lifetime = (uint32_t) atoi(optarg);
+                }
+
+                if (!strcmp(long_options[option_index].name, "quota")) {
+                    mappings_cfg.quota = (uint32_t) atoi(optarg);
+                }
+
+                if (!strcmp(long_options[option_index].name, "max-mappings")) {
+                    mappings_cfg.max_mappings = (uint32_t) atoi(optarg);
+                }
+
+                if (!strcmp(long_options[option_index].name, "faults")) {
+                    ret = pfi_load_rules(&server_info_storage.faults, optarg);
+                    if (ret < 0) {
+                        printf("Failed to read fault rules from %s \n",
+                                optarg);
+                        exit(1);
+                    } else if (ret > 0) {
+                        printf("Bad fault rule at %s:%d \n", optarg, ret);
+                        exit(1);
+                    }
+                }
+
+                if (pfi_set_option(&server_info_storage.faults,
+                        long_options[option_index].name, optarg) < 0) {
+                    printf("Bad value for option --%s %s \n",
+                            long_options[option_index].name, optarg);
+                    exit(1);
+                }
+
                 if (!strcmp(long_options[option_index].name, "ip"))
                     server_ip = optarg;
 
@@ -927,6 +2061,66 @@ int main(int argc, char *argv[])
         server_info_storage.log_file[0] = 0;
     }
 
+    if (mappings) {
+        // TEST-NET-3 unless --ext-ip is set
+        if (IN6_IS_ADDR_UNSPECIFIED(&server_info_storage.ext_ip)) {
+            inet_pton(AF_INET6, "::ffff:203.0.113.1",
+                    &server_info_storage.ext_ip);
+        }
+        mappings_cfg.ext_ip = server_info_storage.ext_ip;
+        server_info_storage.mappings = pmt_create(&mappings_cfg);
+        if (server_info_storage.mappings == NULL) {
+            printf("Failed to create mapping table. Number of external "
+                   "addresses must be 1-" xstr(PMT_MAX_EXT_IPS) ".\n");
+            exit(1);
+        }
+        // identities get their own tables
+        if (identity_count > 0) {
+            pmt_destroy(server_info_storage.mappings);
+            server_info_storage.mappings = NULL;
+        }
+    }
+
+    if (identity_count > 0) {
+#ifdef PCP_SERVER_IDENTITIES
+        identities_t ids = { NULL, 0 };
+        int i;
+
+        if (workers > 0) {
+            printf("Option --workers can't be used with --identity \n");
+            exit(1);
+        }
+        for (i = 0; i < identity_count; ++i) {
+            if (add_identities(&ids, identity_specs[i], &server_info_storage)) {
+                printf("Bad value for option --identity %s \n",
+                        identity_specs[i]);
+                exit(1);
+            }
+        }
+        ret = execPCPIdentities(&ids, &server_info_storage,
+                mappings ? &mappings_cfg : NULL);
+        free(ids.list);
+        pcp_pcap_close(capture);
+        return ret;
+#else
+        printf("Identities are not supported on this platform.\n");
+        return 1;
+#endif
+    }
+
     printf("Server listening on %s:%s \n", server_ip, port);
-    return execPCPServer(port, server_ip, &server_info_storage);
+    if (workers > 0) {
+#ifdef PCP_SERVER_WORKERS
+        ret = execPCPWorkers(port, server_ip, &server_info_storage,
+                (unsigned)workers);
+#else
+        printf("Workers are not supported on this platform.\n");
+        ret = 1;
+#endif
+    } else {
+        ret = execPCPServer(port, server_ip, &server_info_storage);
+    }
+    pmt_destroy(server_info_storage.mappings);
+    pcp_pcap_close(capture);
+    return ret;
 }
@@ -66,6 +66,34 @@ Get_Status $? "test_lifetime_renewal      "
 $PATH_SCRIPT/test_server_reping.sh
 Get_Status $? "test_server_reping         "
 
+$PATH_SCRIPT/test_gateway_racing.sh
+Get_Status $? "test_gateway_racing        "
+
+$PATH_SCRIPT/test_server_mappings.sh
+Get_Status $? "test_server_mappings       "
+
+$PATH_SCRIPT/test_server_faults.sh
+Get_Status $? "test_server_faults         "
+
+$PATH_SCRIPT/test_server_identities.sh
+Get_Status $? "test_server_identities     "
+
+$PATH_SCRIPT/test_replay.sh
+Get_Status $? "test_replay                "
+$PATH_SCRIPT/test_transport.sh
+Get_Status $? "test_transport             "
+
+$PATH_SCRIPT/test_loadgen.sh
+Get_Status $? "test_loadgen               "
+
+$PATH_SCRIPT/test_batch.sh
+Get_Status $? "test_batch                 "
+
+$PATH_SCRIPT/test_bench.sh
+Get_Status $? "test_bench                 "
+$PATH_SCRIPT/test_daemon.sh
+Get_Status $? "test_daemon                "
+
 test_event_handler
 Get_Status $? "test_event_handler         "
 
@@ -90,6 +118,34 @@ Get_Status $? "test_pcp_msg               "
 $PATH_SCRIPT/test_server_reping.sh
 Get_Status $? "test_server_reping         "
 
+$PATH_SCRIPT/test_gateway_racing.sh
+Get_Status $? "test_gateway_racing        "
+
+$PATH_SCRIPT/test_server_mappings.sh
+Get_Status $? "test_server_mappings       "
+
+$PATH_SCRIPT/test_server_faults.sh
+Get_Status $? "test_server_faults         "
+
+$PATH_SCRIPT/test_server_identities.sh
+Get_Status $? "test_server_identities     "
+
+$PATH_SCRIPT/test_replay.sh
+Get_Status $? "test_replay                "
+$PATH_SCRIPT/test_transport.sh
+Get_Status $? "test_transport             "
+
+$PATH_SCRIPT/test_loadgen.sh
+Get_Status $? "test_loadgen               "
+
+$PATH_SCRIPT/test_batch.sh
+Get_Status $? "test_batch                 "
+
+$PATH_SCRIPT/test_bench.sh
+Get_Status $? "test_bench                 "
+$PATH_SCRIPT/test_daemon.sh
+Get_Status $? "test_daemon                "
+
 $PATH_SCRIPT/test_pcp_app.sh
 Get_Status $? "test_pcp_app               "
 
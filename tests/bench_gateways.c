@@ -0,0 +1,279 @@
+/*
+ *------------------------------------------------------------------
+ * bench_gateways.c
+ *
+ * Benchmark of gateway discovery from routing table dump. Synthetic
+ * dumps are served by a stand-in netlink socket.
+ *
+ *------------------------------------------------------------------
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#else
+#include "default_config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pcp.h"
+#include "pcp_utils.h"
+#include "pcp_socket.h"
+#include "gateway.h"
+
+#ifdef __linux__
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#define BENCH_DEFAULT_ROUTES 1000000
+#define BENCH_SEQ 1
+
+// pre-built dump, cut to datagrams on recv as kernel does
+struct nl_standin {
+    char *buf;
+    size_t len;
+    size_t pos;
+    size_t datagrams;
+};
+
+typedef enum {
+    ds_bgp_nexthops,
+    ds_distinct_gws,
+    ds_other_table,
+    ds_count
+} dump_set_e;
+
+static const char *dump_set_names[ds_count]={
+    "full table via 4 next-hops",
+    "65536 distinct next-hops",
+    "routes in other table",
+};
+
+static double elapsed_ms(struct timeval *start)
+{
+    struct timeval now, diff;
+
+    gettimeofday(&now, NULL);
+    timeval_subtract(&diff, &now, start);
+    return diff.tv_sec * 1000.0 + diff.tv_usec / 1000.0;
+}
+
+static void add_attr(struct nlmsghdr *nh, unsigned short type, uint32_t val)
+{
+    struct rtattr *rta=(struct rtattr *)((char *)nh + NLMSG_ALIGN(nh->nlmsg_len));
+
+    rta->rta_type=type;
+    rta->rta_len=RTA_LENGTH(sizeof(val));
+    memcpy(RTA_DATA(rta), &val, sizeof(val));
+    nh->nlmsg_len=NLMSG_ALIGN(nh->nlmsg_len) + RTA_ALIGN(rta->rta_len);
+}
+
+static size_t put_route(char *p, dump_set_e set, uint32_t i)
+{
+    struct nlmsghdr *nh=(struct nlmsghdr *)p;
+    struct rtmsg *rt=(struct rtmsg *)NLMSG_DATA(nh);
+    uint8_t table=RT_TABLE_MAIN;
+    uint32_t gw=0x0A000001 + (i & 3); //10.0.0.1-4
+
+    if (set == ds_distinct_gws) {
+        gw=0x0A000000 + (i & 0xFFFF);
+    } else if ((set == ds_other_table) && (i != 0)) {
+        table=100;
+    }
+
+    memset(nh, 0, NLMSG_SPACE(sizeof(*rt)));
+    nh->nlmsg_len=NLMSG_LENGTH(sizeof(*rt));
+    nh->nlmsg_type=RTM_NEWROUTE;
+    nh->nlmsg_flags=NLM_F_MULTI;
+    nh->nlmsg_seq=BENCH_SEQ;
+    rt->rtm_family=AF_INET;
+    rt->rtm_dst_len=24;
+    rt->rtm_table=table;
+    rt->rtm_protocol=RTPROT_BOOT;
+    rt->rtm_type=RTN_UNICAST;
+    add_attr(nh, RTA_TABLE, table);
+    add_attr(nh, RTA_DST, htonl(0x01000000 + (i << 8)));
+    add_attr(nh, RTA_PRIORITY, 20);
+    add_attr(nh, RTA_GATEWAY, htonl(gw));
+    add_attr(nh, RTA_OIF, 2);
+
+    return NLMSG_ALIGN(nh->nlmsg_len);
+}
+
+static int build_dump(struct nl_standin *nl, dump_set_e set, uint32_t routes)
+{
+    // space taken by one route message
+    size_t route_space=NLMSG_SPACE(sizeof(struct rtmsg)) + 5 * RTA_SPACE(4);
+    struct nlmsghdr *nh;
+    uint32_t i;
+
+    memset(nl, 0, sizeof(*nl));
+    nl->buf=(char *)malloc((size_t)routes * route_space + NLMSG_SPACE(4));
+    if (!nl->buf) {
+        return -1;
+    }
+
+    for (i=0; i < routes; ++i) {
+        nl->len+=put_route(nl->buf + nl->len, set, i);
+    }
+    nh=(struct nlmsghdr *)(nl->buf + nl->len);
+    memset(nh, 0, NLMSG_SPACE(sizeof(int)));
+    nh->nlmsg_len=NLMSG_LENGTH(sizeof(int));
+    nh->nlmsg_type=NLMSG_DONE;
+    nh->nlmsg_flags=NLM_F_MULTI;
+    nh->nlmsg_seq=BENCH_SEQ;
+    nl->len+=NLMSG_ALIGN(nh->nlmsg_len);
+    return 0;
+}
+
+// hands out as many whole messages as fit into one kernel dump datagram
+static ssize_t standin_recv(void *arg, void *buf, size_t len)
+{
+    struct nl_standin *nl=(struct nl_standin *)arg;
+    size_t start=nl->pos, end=nl->pos;
+
+    if (len > NL_DUMP_BUFSIZE) {
+        len=NL_DUMP_BUFSIZE;
+    }
+    while (end < nl->len) {
+        struct nlmsghdr *nh=(struct nlmsghdr *)(nl->buf + end);
+
+        if (end - start + NLMSG_ALIGN(nh->nlmsg_len) > len) {
+            break;
+        }
+        end+=NLMSG_ALIGN(nh->nlmsg_len);
+    }
+    if (end == start) {
+        return -1;
+    }
+    memcpy(buf, nl->buf + start, end - start);
+    nl->pos=end;
+    nl->datagrams++;
+    return (ssize_t)(end - start);
+}
+
+// parsing loop of getgateways before streaming parser: attributes of each
+// route are parsed and result grows by realloc per gateway route
+static double legacy_parse_ms(struct nl_standin *nl, size_t *entries)
+{
+    struct sockaddr_in6 *gws=NULL, *tmp;
+    struct nlmsghdr *nlMsg=(struct nlmsghdr *)nl->buf;
+    struct timeval start;
+    size_t cnt=0;
+    int len=(int)nl->len;
+
+    gettimeofday(&start, NULL);
+    for (; NLMSG_OK(nlMsg,(unsigned)len); nlMsg=NLMSG_NEXT(nlMsg,len)) {
+        struct rtmsg *rtMsg=(struct rtmsg *)NLMSG_DATA(nlMsg);
+        struct rtattr *rtAttr;
+        int rtLen;
+        unsigned int scope_id=0;
+        struct in6_addr addr;
+        int found=0;
+
+        if ((nlMsg->nlmsg_type != RTM_NEWROUTE)
+                || (rtMsg->rtm_table != RT_TABLE_MAIN)) {
+            continue;
+        }
+        rtAttr=(struct rtattr *)RTM_RTA(rtMsg);
+        rtLen=RTM_PAYLOAD(nlMsg);
+        for (; RTA_OK(rtAttr,rtLen); rtAttr=RTA_NEXT(rtAttr,rtLen)) {
+            if (rtAttr->rta_type == RTA_OIF) {
+                memcpy(&scope_id, RTA_DATA(rtAttr), sizeof(scope_id));
+            } else if (rtAttr->rta_type == RTA_GATEWAY) {
+                memset(&addr, 0, sizeof(addr));
+                memcpy(&addr, RTA_DATA(rtAttr), RTA_PAYLOAD(rtAttr));
+                found=1;
+            }
+        }
+        if (!found) {
+            continue;
+        }
+        tmp=(struct sockaddr_in6 *)realloc(gws, sizeof(*gws) * (cnt + 1));
+        if (!tmp) {
+            break;
+        }
+        gws=tmp;
+        memset(gws + cnt, 0, sizeof(*gws));
+        memcpy(&gws[cnt].sin6_addr, &addr, sizeof(addr));
+        gws[cnt].sin6_scope_id=scope_id;
+        cnt++;
+    }
+    free(gws);
+    *entries=cnt;
+    return elapsed_ms(&start);
+}
+
+static void bench_dump(dump_set_e set, uint32_t routes)
+{
+    struct nl_standin nl;
+    struct sockaddr_in6 *gws=NULL;
+    struct timeval start;
+    size_t legacy_entries;
+    double ms;
+    int cnt;
+
+    if (build_dump(&nl, set, routes)) {
+        printf("Not enough memory for %u routes\n", routes);
+        return;
+    }
+
+    printf("  %s\n", dump_set_names[set]);
+
+    gettimeofday(&start, NULL);
+    cnt=nl_read_gateways(standin_recv, &nl, BENCH_SEQ, &gws);
+    ms=elapsed_ms(&start);
+    printf("    streaming parser         : %.1f ms (%.0f ns/route), "
+            "%zu datagrams, %d gateways, result %zu B\n", ms, ms * 1e6 / routes,
+            nl.datagrams, cnt, cnt > 0 ? cnt * sizeof(*gws) : 0);
+    if (cnt > 0) {
+        free(gws);
+    }
+
+    // whole dump in one buffer - the former reader truncated it at 8 KiB
+    ms=legacy_parse_ms(&nl, &legacy_entries);
+    printf("    former parsing loop      : %.1f ms (%.0f ns/route), "
+            "%zu gateways, result %zu B\n", ms, ms * 1e6 / routes,
+            legacy_entries, legacy_entries * sizeof(*gws));
+
+    free(nl.buf);
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t routes=BENCH_DEFAULT_ROUTES;
+    dump_set_e set;
+
+    pcp_log_level=PCP_LOGLVL_NONE;
+    PD_SOCKET_STARTUP();
+
+    if (argc > 1) {
+        routes=(uint32_t)strtoul(argv[1], NULL, 10);
+        if (routes == 0) {
+            printf("Usage: %s [number of routes]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    printf("Routing table dump with %u routes\n", routes);
+    for (set=ds_bgp_nexthops; set < ds_count; ++set) {
+        bench_dump(set, routes);
+    }
+
+    PD_SOCKET_CLEANUP();
+    return 0;
+}
+
+#else //__linux__
+
+int main(void)
+{
+    printf("Netlink is not available on this platform.\n");
+    return 0;
+}
+
+#endif //__linux__
@@ -0,0 +1,289 @@
+/*
+ *------------------------------------------------------------------
+ * bench_pcp_flow.c
+ *
+ * Benchmark of flow DB memory footprint, key hash distribution and
+ * scheduling loop walk.
+ *
+ *------------------------------------------------------------------
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#else
+#include "default_config.h"
+#endif
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pcp_client_db.h"
+#include "pcp_utils.h"
+#include "pcp_socket.h"
+#include "unp.h"
+
+#define BENCH_DEFAULT_FLOWS 20000
+
+static double elapsed_ms(struct timeval *start)
+{
+    struct timeval now, diff;
+
+    gettimeofday(&now, NULL);
+    timeval_subtract(&diff, &now, start);
+    return diff.tv_sec * 1000.0 + diff.tv_usec / 1000.0;
+}
+
+// touches only what the scheduling loop does
+static int walk_iter(pcp_flow_t *f, void *data)
+{
+    unsigned long *sum=(unsigned long *)data;
+
+    *sum+=f->state + f->timeout.tv_sec + f->pcp_server_indx;
+    return 0;
+}
+
+// byte-wise hash used before pcp_db_flow_hash, folded to 5 bits
+static uint32_t legacy_flow_key(struct flow_key_data *kd)
+{
+    uint32_t h=0;
+    uint8_t *k=(uint8_t*)(kd + 1);
+
+    while ((void*)(k--) != (void*)kd) {
+        uint32_t ho=h & 0xff000000;
+        h=h << 8;
+        h=h ^ (ho >> 24);
+        h=h ^ *k;
+    }
+
+    return (h * 0x9E3779B9) >> (32 - 5);
+}
+
+#define BENCH_HASH_KEYS 4096
+
+typedef enum {
+    hs_host_ports,
+    hs_subnet_hosts,
+    hs_peer_dsts,
+    hs_count
+} hash_set_e;
+
+static const char *hash_set_names[hs_count]={
+    "one host, many ports",
+    "/16 hosts, one port",
+    "PEER to many dsts",
+};
+
+static void set_ip4(struct in6_addr *ip, uint32_t addr)
+{
+    memset(ip, 0, sizeof(*ip));
+    S6_ADDR32(ip)[2]=htonl(0xFFFF);
+    S6_ADDR32(ip)[3]=htonl(addr);
+}
+
+static void fill_key(struct flow_key_data *kd, hash_set_e set, uint32_t i)
+{
+    memset(kd, 0, sizeof(*kd));
+    set_ip4(&kd->pcp_server_ip, 0xC0A80101); //192.168.1.1
+    kd->nonce.n[0]=0x12345678;
+    switch (set) {
+        case hs_host_ports:
+            kd->operation=PCP_OPCODE_MAP;
+            set_ip4(&kd->src_ip, 0xC0A8010A);
+            kd->map_peer.protocol=(i & 1) ? IPPROTO_TCP : IPPROTO_UDP;
+            kd->map_peer.src_port=htons((uint16_t)(1024 + (i >> 1)));
+            break;
+        case hs_subnet_hosts:
+            kd->operation=PCP_OPCODE_MAP;
+            set_ip4(&kd->src_ip, 0x0A000000 + i); //10.0.0.0/16
+            kd->map_peer.protocol=IPPROTO_UDP;
+            kd->map_peer.src_port=htons(5000);
+            break;
+        default:
+            kd->operation=PCP_OPCODE_PEER;
+            set_ip4(&kd->src_ip, 0xC0A8010A);
+            kd->map_peer.protocol=IPPROTO_TCP;
+            kd->map_peer.src_port=htons((uint16_t)(40000 + (i & 1023)));
+            set_ip4(&kd->map_peer.dst_ip, 0xCB007100 + (i >> 10)); //203.0.113.x
+            kd->map_peer.dst_port=htons(443);
+            break;
+    }
+}
+
+static void print_distribution(const char *name, uint32_t *cnt,
+        uint32_t buckets, uint32_t keys)
+{
+    double expected=(double)keys / buckets;
+    double chi2=0;
+    uint32_t i, used=0, max=0;
+
+    for (i=0; i < buckets; ++i) {
+        used+=(cnt[i] > 0);
+        max=cnt[i] > max ? cnt[i] : max;
+        chi2+=(cnt[i] - expected) * (cnt[i] - expected) / expected;
+    }
+    // chi2/(buckets-1) close to 1.0 for uniform distribution
+    printf("    %-8s: used %2u/%u buckets, longest chain %4u (ideal %.0f), "
+            "chi2/df %.2f\n", name, used, buckets, max, expected,
+            chi2 / (buckets - 1));
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x=*(const uint64_t *)a, y=*(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static void bench_hash(void)
+{
+    static uint64_t hashes[BENCH_HASH_KEYS];
+    struct flow_key_data kd;
+    uint32_t legacy[FLOW_HASH_SIZE], current[FLOW_HASH_SIZE];
+    struct timeval start;
+    hash_set_e set;
+    uint64_t sum=0;
+    uint32_t i, collisions;
+    int round;
+    double ms;
+
+    printf("Flow key hash distribution (%d keys)\n", BENCH_HASH_KEYS);
+    for (set=hs_host_ports; set < hs_count; ++set) {
+        memset(legacy, 0, sizeof(legacy));
+        memset(current, 0, sizeof(current));
+        for (i=0; i < BENCH_HASH_KEYS; ++i) {
+            fill_key(&kd, set, i);
+            legacy[legacy_flow_key(&kd) % FLOW_HASH_SIZE]++;
+            hashes[i]=pcp_db_flow_hash(&kd);
+            current[hashes[i] >> (64 - FLOW_HASH_BITS)]++;
+        }
+        qsort(hashes, BENCH_HASH_KEYS, sizeof(hashes[0]), cmp_u64);
+        for (i=1, collisions=0; i < BENCH_HASH_KEYS; ++i) {
+            collisions+=(hashes[i] == hashes[i - 1]);
+        }
+        printf("  %s\n", hash_set_names[set]);
+        print_distribution("legacy", legacy, FLOW_HASH_SIZE, BENCH_HASH_KEYS);
+        print_distribution("current", current, FLOW_HASH_SIZE,
+                BENCH_HASH_KEYS);
+        printf("    64-bit hash collisions: %u\n", collisions);
+    }
+
+    fill_key(&kd, hs_peer_dsts, 1);
+    gettimeofday(&start, NULL);
+    for (round=0; round < 1000000; ++round) {
+        kd.map_peer.src_port=(uint16_t)round;
+        sum+=legacy_flow_key(&kd);
+    }
+    ms=elapsed_ms(&start);
+    printf("  legacy hash                : %.1f ns/key\n", ms * 1e6 / round);
+    gettimeofday(&start, NULL);
+    for (round=0; round < 1000000; ++round) {
+        kd.map_peer.src_port=(uint16_t)round;
+        sum+=pcp_db_flow_hash(&kd);
+    }
+    ms=elapsed_ms(&start);
+    printf("  current hash               : %.1f ns/key\n", ms * 1e6 / round);
+    if (sum == 1) {
+        printf("\n");
+    }
+}
+
+static void bench_footprint(void)
+{
+    size_t hot=sizeof(pcp_flow_t);
+    size_t cold=sizeof(struct pcp_flow_ext);
+
+    printf("Flow record\n");
+    printf("  pcp_flow_t                 : %zu B\n", hot);
+    printf("  scheduling loop part       : %zu B\n", offsetof(pcp_flow_t, kd));
+    printf("  option extension           : %zu B (allocated on first use)\n",
+            cold);
+    printf("  inline layout equivalent   : %zu B\n",
+            hot + cold - sizeof(struct pcp_flow_ext *));
+    printf("  saved per flow w/o options : %zu B (%.1f %%)\n",
+            cold - sizeof(struct pcp_flow_ext *),
+            100.0 * (cold - sizeof(struct pcp_flow_ext *))
+            / (hot + cold - sizeof(struct pcp_flow_ext *)));
+}
+
+static void bench_flows(size_t nflows)
+{
+    pcp_ctx_t *ctx;
+    pcp_flow_t **flows;
+    struct sockaddr_storage src, dst;
+    struct timeval start;
+    unsigned long sum=0;
+    double ms;
+    size_t i;
+    int rounds;
+
+    flows=(pcp_flow_t **)calloc(nflows, sizeof(*flows));
+    if (!flows) {
+        printf("Not enough memory for %zu flows\n", nflows);
+        return;
+    }
+
+    ctx=pcp_init(DISABLE_AUTODISCOVERY, NULL);
+    pcp_add_server(ctx, Sock_pton("127.0.0.1:5351"), 2);
+
+    gettimeofday(&start, NULL);
+    for (i=0; i < nflows; ++i) {
+        sock_pton("127.0.0.1", (struct sockaddr *)&src);
+        sock_pton("127.0.0.1", (struct sockaddr *)&dst);
+        ((struct sockaddr_in *)&src)->sin_port=htons((uint16_t)(i % 65535 + 1));
+        ((struct sockaddr_in *)&dst)->sin_port=htons((uint16_t)(i / 65535 + 1));
+        flows[i]=pcp_new_flow(ctx, (struct sockaddr *)&src,
+                (struct sockaddr *)&dst, NULL, IPPROTO_UDP, 100, NULL);
+    }
+    ms=elapsed_ms(&start);
+    printf("Flow DB with %zu flows\n", nflows);
+    printf("  create                     : %.1f ms (%.0f ns/flow)\n", ms,
+            ms * 1e6 / nflows);
+
+    rounds=10;
+    gettimeofday(&start, NULL);
+    for (i=0; i < (size_t)rounds; ++i) {
+        pcp_db_foreach_flow(ctx, walk_iter, &sum);
+    }
+    ms=elapsed_ms(&start) / rounds;
+    printf("  scheduling walk            : %.2f ms (%.1f ns/flow)\n", ms,
+            ms * 1e6 / nflows);
+
+    gettimeofday(&start, NULL);
+    for (i=0; i < nflows; ++i) {
+        pcp_delete_flow(flows[i]);
+    }
+    ms=elapsed_ms(&start);
+    printf("  delete                     : %.1f ms (%.0f ns/flow)\n", ms,
+            ms * 1e6 / nflows);
+
+    pcp_terminate(ctx, 0);
+    free(flows);
+    // keep the walk from being optimized out
+    if (sum == 1) {
+        printf("\n");
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    size_t nflows=BENCH_DEFAULT_FLOWS;
+
+    pcp_log_level=PCP_LOGLVL_NONE;
+    PD_SOCKET_STARTUP();
+
+    if (argc > 1) {
+        nflows=(size_t)strtoul(argv[1], NULL, 10);
+        if (nflows == 0) {
+            printf("Usage: %s [number of flows]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    bench_footprint();
+    bench_hash();
+    bench_flows(nflows);
+
+    PD_SOCKET_CLEANUP();
+    return 0;
+}
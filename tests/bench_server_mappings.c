@@ -0,0 +1,139 @@
+/*
+ *------------------------------------------------------------------
+ * bench_server_mappings.c
+ *
+ * Benchmark of mapping table of PCP server: creation, renewal and
+ * expiry of mappings and exhaustion of external ports.
+ *
+ *------------------------------------------------------------------
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#else
+#include "default_config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef WIN32
+#include <arpa/inet.h>
+#endif
+#include "pcp_utils.h"
+#include "pcp_socket.h"
+#include "pcp_msg_structs.h"
+#include "pcp_mapping_table.h"
+
+#define BENCH_DEFAULT_MAPPINGS 1000000
+// internal ports per internal address
+#define BENCH_HOST_PORTS 100
+
+static double elapsed_ms(struct timeval *start)
+{
+    struct timeval now, diff;
+
+    gettimeofday(&now, NULL);
+    timeval_subtract(&diff, &now, start);
+    return diff.tv_sec * 1000.0 + diff.tv_usec / 1000.0;
+}
+
+static void fill_request(pmt_request_t *req, uint32_t i, uint32_t lifetime)
+{
+    uint32_t host = htonl(0x0A000000 + i / BENCH_HOST_PORTS); //10.0.0.0/8
+
+    memset(req, 0, sizeof(*req));
+    req->int_ip.s6_addr[10] = 0xFF;
+    req->int_ip.s6_addr[11] = 0xFF;
+    memcpy(&req->int_ip.s6_addr[12], &host, sizeof(host));
+    req->nonce[0] = i;
+    req->int_port = (uint16_t)(10000 + i % BENCH_HOST_PORTS);
+    req->protocol = IPPROTO_UDP;
+    req->lifetime = lifetime;
+}
+
+// runs all requests, returns number of those with result code
+static uint32_t run(pcp_mapping_table_t *mt, const char *name, uint32_t first,
+        uint32_t cnt, uint32_t lifetime, uint32_t now, uint8_t result_code)
+{
+    struct timeval start;
+    pmt_request_t req;
+    pmt_result_t res;
+    uint32_t i, matched = 0;
+    double ms;
+
+    gettimeofday(&start, NULL);
+    for (i = 0; i < cnt; ++i) {
+        fill_request(&req, first + i, lifetime);
+        matched += (pmt_process(mt, &req, now, &res) == result_code);
+    }
+    ms = elapsed_ms(&start);
+    printf("  %-26s : %.1f ms (%.0f ns/request), %u of %u as expected\n",
+            name, ms, ms * 1e6 / cnt, matched, cnt);
+
+    return matched;
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t cnt = BENCH_DEFAULT_MAPPINGS, free_ports;
+    pcp_mapping_table_t *mt;
+    pmt_config_t cfg;
+    pmt_stats_t stats;
+    struct timeval start;
+    double ms;
+
+    PD_SOCKET_STARTUP();
+
+    if (argc > 1) {
+        cnt = (uint32_t)strtoul(argv[1], NULL, 10);
+        if (cnt == 0) {
+            printf("Usage: %s [number of mappings]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    memset(&cfg, 0, sizeof(cfg));
+    inet_pton(AF_INET6, "::ffff:203.0.113.1", &cfg.ext_ip);
+    cfg.port_min = 1024;
+    cfg.port_max = 65535;
+    // just enough external ports for all mappings
+    cfg.ext_ip_count = (cnt + 64511) / 64512;
+    mt = pmt_create(&cfg);
+    if (!mt) {
+        printf("Failed to create table for %u mappings\n", cnt);
+        return 1;
+    }
+
+    printf("Mapping table with %u mappings on %u external addresses\n", cnt,
+            cfg.ext_ip_count);
+    run(mt, "create", 0, cnt, 3600, 1, PCP_RES_SUCCESS);
+    run(mt, "renew", 0, cnt, 3600, 2, PCP_RES_SUCCESS);
+    free_ports = cfg.ext_ip_count * 64512 - cnt;
+    if (free_ports) {
+        run(mt, "take remaining ports", cnt, free_ports, 3600, 2,
+                PCP_RES_SUCCESS);
+    }
+    run(mt, "no free port", cnt + free_ports, 1000, 3600, 2,
+            PCP_RES_NO_RESOURCES);
+    pmt_get_stats(mt, &stats);
+    printf("  memory                     : %.1f MiB (%.0f B/mapping)\n",
+            stats.memory / 1048576.0, (double)stats.memory / stats.mappings);
+
+    gettimeofday(&start, NULL);
+    pmt_expire(mt, 3602);
+    ms = elapsed_ms(&start);
+    pmt_get_stats(mt, &stats);
+    printf("  expire all                 : %.1f ms (%.0f ns/mapping), "
+            "%u left\n", ms, ms * 1e6 / (cnt + free_ports), stats.mappings);
+
+    run(mt, "create after expiry", 0, cnt, 3600, 3603, PCP_RES_SUCCESS);
+    run(mt, "delete", 0, cnt, 0, 3604, PCP_RES_SUCCESS);
+    pmt_get_stats(mt, &stats);
+    printf("  left after delete          : %u mappings, %u addresses\n",
+            stats.mappings, stats.hosts);
+
+    pmt_destroy(mt);
+    PD_SOCKET_CLEANUP();
+    return 0;
+}
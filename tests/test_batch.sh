@@ -0,0 +1,68 @@
+#!/bin/bash
+
+function echo_exit {
+    echo $1
+    killall pcp-server &>/dev/null
+    rm -f $OUT $SPECS
+    exit 1
+}
+
+OUT=$(mktemp)
+SPECS=$(mktemp)
+
+killall pcp-server
+pcp-server --mappings &>/dev/null &
+sleep 1
+
+# options and JSON lines, command line options are defaults
+cat > $SPECS <<SPECS_END
+# mappings of one host
+-i 127.0.0.1:5000 -u
+--internal 127.0.0.1:5001 --lifetime 60
+
+{"internal": "127.0.0.1:5002", "protocol": 17, "prefer-failure": true}
+{"internal": "127.0.0.1:5003", "peer": "192.0.2.1:80"}
+SPECS_END
+pcp -d -s 127.0.0.1 -t -b $SPECS > $OUT 2>/dev/null \
+    || echo_exit "Failed batch file"
+[ $(grep -c " succ " $OUT) -eq 2 ] || echo_exit "Failed option lines"
+grep -q "^2  .* UDP .* 5000 .* succ " $OUT || echo_exit "Failed option line 2"
+grep -q "^3  .* TCP .* 5001 .* succ " $OUT || echo_exit "Failed option line 3"
+grep -q '^{"line":5,"state":"succ","result":0,.*"protocol":17,' $OUT \
+    || echo_exit "Failed JSON line 5"
+grep -q '^{"line":6,"state":"succ",.*"peer_port":80,' $OUT \
+    || echo_exit "Failed JSON line 6"
+
+# stdin
+printf -- '-i 127.0.0.1:6000\n-i 127.0.0.1:6001\n' \
+    | pcp -d -s 127.0.0.1 -u -b - > $OUT 2>/dev/null \
+    || echo_exit "Failed batch from stdin"
+[ $(grep -c " UDP .* succ " $OUT) -eq 2 ] || echo_exit "Failed stdin results"
+
+# invalid lines are reported, valid ones still run
+printf -- '-i 127.0.0.1:7000\n-x 1\n{"internal": \n--prefer-failure\n' \
+    | pcp -d -s 127.0.0.1 -b - > $OUT 2>&1
+[ $? -eq 1 ] || echo_exit "Failed exit code of invalid lines"
+grep -q ":2: Unknown option" $OUT || echo_exit "Failed unknown option"
+grep -q ":3: " $OUT || echo_exit "Failed invalid JSON"
+grep -q ":4: Missing internal address" $OUT \
+    || echo_exit "Failed missing internal address"
+grep -q "^1  .* succ " $OUT || echo_exit "Failed valid line of invalid file"
+
+# no server
+echo "-i 127.0.0.1:7001" | pcp -d -s 127.0.0.1:5359 -T 1 -b - > $OUT 2>&1
+[ $? -eq 2 ] || echo_exit "Failed timeout exit code"
+grep -q "^1  .* proc " $OUT || echo_exit "Failed timed out flow"
+
+# kept flows are renewed until terminated
+echo "-i 127.0.0.1:7002 -l 2" > $SPECS
+pcp -d -s 127.0.0.1 -k -b $SPECS > $OUT 2>/dev/null &
+PID=$!
+sleep 3
+kill $PID
+wait $PID || echo_exit "Failed exit code of kept flows"
+[ $(grep -c "^1  .* succ " $OUT) -ge 2 ] || echo_exit "Failed renewal"
+
+killall pcp-server
+rm -f $OUT $SPECS
+exit 0
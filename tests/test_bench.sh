@@ -0,0 +1,43 @@
+#!/bin/bash
+
+function echo_exit {
+    echo $1
+    killall pcp-server &>/dev/null
+    rm -f $OUT
+    exit 1
+}
+
+OUT=$(mktemp)
+
+killall pcp-server
+pcp-server --mappings &>/dev/null &
+pcp-server -p 5353 -r 8 &>/dev/null &
+sleep 1
+
+# MAP and PEER flows of both protocols
+pcp -d -s 127.0.0.1 -B 200 > $OUT 2>/dev/null || echo_exit "Failed benchmark"
+grep -q "^Mapped 200 flows (150 MAP, 50 PEER)" $OUT \
+    || echo_exit "Failed flow counts"
+grep -q "Succeeded:  *200$" $OUT || echo_exit "Failed results"
+grep -q "Time to mapping p50/p90/p99/max: " $OUT \
+    || echo_exit "Failed percentiles"
+grep -q "Requests sent:  *[0-9]* (0 retransmitted)" $OUT \
+    || echo_exit "Failed retransmission count"
+grep -q "Request rate: " $OUT || echo_exit "Failed request rate"
+
+# NO_RESOURCES results
+pcp -d -s 127.0.0.1:5353 -B 20 > $OUT 2>/dev/null
+[ $? -eq 3 ] || echo_exit "Failed exit code of error results"
+grep -q "Short lifetime error:  *20$" $OUT \
+    || echo_exit "Failed count of error results"
+
+# no server
+pcp -d -s 127.0.0.1:5359 -T 1 -B 10 > $OUT 2>/dev/null
+[ $? -ne 0 ] || echo_exit "Failed exit code of unanswered flows"
+grep -q "Succeeded:  *0$" $OUT || echo_exit "Failed unanswered flows"
+
+pcp -B 0 &>/dev/null && echo_exit "Failed invalid count"
+
+killall pcp-server
+rm -f $OUT
+exit 0
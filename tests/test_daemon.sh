@@ -0,0 +1,60 @@
+#!/bin/bash
+
+function echo_exit {
+    echo $1
+    kill $DAEMON $KEEP &>/dev/null
+    killall pcp-server &>/dev/null
+    rm -f $OUT $OUT2 $SRV_LOG $SOCK
+    exit 1
+}
+
+OUT=$(mktemp)
+OUT2=$(mktemp)
+SRV_LOG=$(mktemp)
+SOCK=$(mktemp -u)
+
+killall pcp-server
+stdbuf -oL pcp-server --mappings > $SRV_LOG 2>&1 &
+sleep 1
+
+pcp -d -s 127.0.0.1 -R $SOCK > /dev/null 2>&1 &
+DAEMON=$!
+sleep 1
+[ -S $SOCK ] || echo_exit "Failed daemon socket"
+
+# flow kept by one process is joined by another one, mapped only once
+echo "-i 127.0.0.1:5000 -l 60" > $OUT2
+PCP_DAEMON=$SOCK pcp -k -b $OUT2 > $OUT 2>/dev/null &
+KEEP=$!
+sleep 1
+grep -q "^1  .* succ " $OUT || echo_exit "Failed kept flow of client"
+# own servers of client are ignored
+PCP_DAEMON=$SOCK pcp -s 127.0.0.1:5359 -i 127.0.0.1:5000 -l 60 > $OUT2 \
+    2>/dev/null || echo_exit "Failed flow of second client"
+EXT=$(grep -o "203.0.113.1 *[0-9]*" $OUT | head -1)
+[ -n "$EXT" ] || echo_exit "Failed external address of kept flow"
+grep -q "$EXT" $OUT2 || echo_exit "Failed shared mapping"
+[ $(grep -c "MAP int port:.* 5000$" $SRV_LOG) -eq 1 ] \
+    || echo_exit "Failed deduplication of flows"
+
+kill $KEEP
+wait $KEEP || echo_exit "Failed exit code of kept flows"
+
+# flows of processes are mapped independently of each other
+PCP_DAEMON=$SOCK pcp -i 127.0.0.1:6000 -u > $OUT 2>/dev/null \
+    || echo_exit "Failed UDP flow"
+PCP_DAEMON=$SOCK pcp -i 127.0.0.1:6001 -p 192.0.2.1:80 > $OUT 2>/dev/null \
+    || echo_exit "Failed PEER flow"
+
+# daemon closes flows of its clients on exit
+kill $DAEMON
+wait $DAEMON || echo_exit "Failed exit code of daemon"
+[ -e $SOCK ] && echo_exit "Failed removal of daemon socket"
+
+# without daemon process maps flows itself
+PCP_DAEMON=$SOCK pcp -d -s 127.0.0.1 -i 127.0.0.1:7000 > $OUT 2>/dev/null \
+    || echo_exit "Failed fallback without daemon"
+
+killall pcp-server
+rm -f $OUT $OUT2 $SRV_LOG $SOCK
+exit 0
@@ -30,6 +30,8 @@
 #endif
 #include "pcp_socket.h"
 #include "test_macro.h"
+#include "pcp_utils.h"
+#include "findsaddr.h"
 
 static void test_getgateways(void)
 {
@@ -49,6 +51,90 @@ static void test_getgateways(void)
     TEST(getgateways(NULL)<0)
 }
 
+#ifdef __linux__
+static void count_route_change(void *arg, struct sockaddr_in6 *gw UNUSED,
+        int added UNUSED)
+{
+    ++*(int *)arg;
+}
+
+static void test_route_monitor(void)
+{
+    pcp_ctx_t *ctx;
+    int sock, cnt=0;
+
+    sock=route_monitor_open();
+    TEST(sock>=0);
+    TEST(route_monitor_read(sock, count_route_change, &cnt)==cnt);
+    route_monitor_close(sock);
+
+    ctx=pcp_init(DISABLE_AUTODISCOVERY, NULL);
+    TEST(pcp_get_route_socket(ctx)<0);
+    TEST(pcp_track_gateways(ctx, 1)==PCP_ERR_SUCCESS);
+    TEST(pcp_get_route_socket(ctx)>=0);
+    pcp_pulse(ctx, NULL);
+    TEST(pcp_track_gateways(ctx, 0)==PCP_ERR_SUCCESS);
+    TEST(pcp_get_route_socket(ctx)<0);
+    TEST(pcp_track_gateways(NULL, 1)==PCP_ERR_BAD_ARGS);
+    pcp_terminate(ctx, 0);
+}
+#endif
+
+static void test_saddr_cache(void)
+{
+    struct saddr_cache *c=saddr_cache_create();
+    struct sockaddr_in6 *gws=NULL;
+    struct sockaddr_storage dst[3];
+    struct in6_addr src, expected;
+    int i, gw_cnt;
+
+    TEST(c!=NULL);
+
+    // loopback, gateway (source of other interface) and loopback again,
+    // so the probe socket has to select source address anew
+    memset(dst, 0, sizeof(dst));
+    for (i=0; i<3; ++i) {
+        ((struct sockaddr_in *)&dst[i])->sin_family=AF_INET;
+        ((struct sockaddr_in *)&dst[i])->sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+    }
+    gw_cnt=getgateways(&gws);
+    for (i=0; i<gw_cnt; ++i) {
+        if (IN6_IS_ADDR_V4MAPPED(&gws[i].sin6_addr)) {
+            ((struct sockaddr_in *)&dst[1])->sin_addr.s_addr=
+                    S6_ADDR32(&gws[i].sin6_addr)[3];
+            break;
+        }
+    }
+    free(gws);
+
+    for (i=0; i<3; ++i) {
+        TEST(findsaddr((struct sockaddr_in *)&dst[i], &expected)==NULL);
+        TEST(saddr_cache_find(c, (struct sockaddr *)&dst[i], &src)==NULL);
+        TEST(IN6_ARE_ADDR_EQUAL(&src, &expected));
+        // answered from cache
+        memset(&src, 0, sizeof(src));
+        TEST(saddr_cache_find(c, (struct sockaddr *)&dst[i], &src)==NULL);
+        TEST(IN6_ARE_ADDR_EQUAL(&src, &expected));
+        saddr_cache_flush(c);
+    }
+
+    TEST(saddr_cache_find(NULL, (struct sockaddr *)&dst[0], &src)==NULL);
+    TEST(IN6_IS_ADDR_V4MAPPED(&src));
+    TEST(S6_ADDR32(&src)[3]==htonl(INADDR_LOOPBACK));
+
+    memset(&dst[0], 0, sizeof(dst[0]));
+    ((struct sockaddr_in6 *)&dst[0])->sin6_family=AF_INET6;
+    ((struct sockaddr_in6 *)&dst[0])->sin6_addr=in6addr_loopback;
+    TEST(saddr_cache_find(c, (struct sockaddr *)&dst[0], &src)==NULL);
+    TEST(IN6_IS_ADDR_LOOPBACK(&src));
+
+    dst[0].ss_family=AF_UNSPEC;
+    TEST(saddr_cache_find(c, (struct sockaddr *)&dst[0], &src)!=NULL);
+
+    saddr_cache_destroy(c);
+    saddr_cache_destroy(NULL);
+}
+
 static void test_sa_len(void)
 {
     struct sockaddr sa;
@@ -76,6 +162,14 @@ int main(void)
     printf("Testing get gateways:\n");
     test_getgateways();
 
+#ifdef __linux__
+    printf("Testing route monitor:\n");
+    test_route_monitor();
+#endif
+
+    printf("Testing source address cache:\n");
+    test_saddr_cache();
+
     printf("Testing SA_LEN  \n");
     test_sa_len();
 
@@ -0,0 +1,154 @@
+/*
+ *------------------------------------------------------------------
+ * test_gateway_racing.c
+ *
+ * Racing of gateways: flows are handled by the first responding one.
+ * Expects PCP server on 127.0.0.1:5351 and nothing on port 5352.
+ *
+ *------------------------------------------------------------------
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#else
+#include "default_config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#ifdef WIN32
+#include <winsock2.h>
+#include <windows.h>
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <unistd.h>
+#endif
+
+#include "pcp.h"
+#include "pcp_socket.h"
+#include "pcp_client_db.h"
+#include "pcp_utils.h"
+#include "unp.h"
+#include "test_macro.h"
+
+static long elapsed_ms(struct timeval *start)
+{
+    struct timeval now, diff;
+
+    gettimeofday(&now, NULL);
+    timeval_subtract(&diff, &now, start);
+    return diff.tv_sec * 1000 + diff.tv_usec / 1000;
+}
+
+// pcp_wait returns also when copy of flow on reserve gateway fails
+static pcp_fstate_e wait_result(pcp_flow_t *flow, int timeout)
+{
+    struct timeval start;
+    pcp_fstate_e fstate;
+    long ms;
+
+    gettimeofday(&start, NULL);
+    do {
+        fstate = pcp_wait(flow, timeout, 0);
+        ms = elapsed_ms(&start);
+    } while ((fstate == pcp_state_processing) && (ms < timeout));
+
+    return fstate;
+}
+
+// two gateways; the one on unused port never responds
+static pcp_ctx_t *init_gateways(int dead_first, pcp_server_t **dead,
+        pcp_server_t **live)
+{
+    pcp_ctx_t *ctx = pcp_init(0, NULL);
+    const char *addr[2] = {"127.0.0.1:5352", "127.0.0.1:5351"};
+    pcp_server_t *s[2];
+    int i;
+
+    for (i = 0; i < 2; ++i) {
+        s[i] = get_pcp_server(ctx, pcp_add_server(ctx,
+                Sock_pton(addr[dead_first ? i : 1 - i]), 2));
+        TEST(s[i] != NULL);
+        s[i]->gateway = 1;
+    }
+    pcp_set_gateway_racing(ctx, 1);
+    TEST((s[0]->racing) && (s[1]->racing));
+    // second gateway starts later
+    TEST(timeval_comp(&s[1]->race_start, &s[0]->race_start) > 0);
+
+    *dead = s[dead_first ? 0 : 1];
+    *live = s[dead_first ? 1 : 0];
+    return ctx;
+}
+
+int main(void)
+{
+    struct sockaddr_storage source_ip4;
+    pcp_flow_info_t info[2];
+    pcp_server_t *dead, *live;
+    pcp_flow_t *flow;
+    pcp_fstate_e fstate;
+    pcp_ctx_t *ctx;
+    struct timeval start;
+    size_t cnt;
+    long ms;
+
+    PD_SOCKET_STARTUP();
+    pcp_log_level = PCP_LOGLVL_INFO;
+    sock_pton(":1111", (struct sockaddr*) &source_ip4);
+
+    //TEST dead gateway doesn't delay flows
+    ctx = init_gateways(1, &dead, &live);
+    flow = pcp_new_flow(ctx, (struct sockaddr*)&source_ip4, NULL, NULL,
+            IPPROTO_TCP, 100, NULL);
+    gettimeofday(&start, NULL);
+    TEST(wait_result(flow, 5000) == pcp_state_succeeded);
+    ms = elapsed_ms(&start);
+    printf("Flow succeeded in %ld ms\n", ms);
+    TEST(ms < 2000);
+    TEST(live->server_state == pss_wait_io);
+    TEST((dead->server_state == pss_race_lost) && (!dead->racing));
+    cnt = pcp_flow_get_info_buf(flow, info, 2);
+    TEST(cnt == 2);
+    TEST(((info[0].result == pcp_state_succeeded)
+            && (info[1].result == pcp_state_failed))
+            || ((info[1].result == pcp_state_succeeded)
+            && (info[0].result == pcp_state_failed)));
+
+    // flows created later don't go to gateway kept in reserve
+    flow = pcp_new_flow(ctx, (struct sockaddr*)&source_ip4, NULL, NULL,
+            IPPROTO_UDP, 100, NULL);
+    TEST(wait_result(flow, 5000) == pcp_state_succeeded);
+
+    //TEST chosen gateway stops working - race is run again
+    live->server_state = pss_set_not_working;
+    gettimeofday(&live->next_timeout, NULL);
+    pcp_pulse(ctx, NULL);
+    TEST(live->server_state == pss_not_working);
+    TEST((dead->racing) && (dead->server_state != pss_race_lost));
+    // flow of reserve gateway is not failed any more
+    TEST(pcp_eval_flow_state(flow, &fstate) == 0);
+    TEST(fstate == pcp_state_processing);
+    pcp_terminate(ctx, 0);
+
+    //TEST late gateway is cancelled before it is pinged
+    ctx = init_gateways(0, &dead, &live);
+    flow = pcp_new_flow(ctx, (struct sockaddr*)&source_ip4, NULL, NULL,
+            IPPROTO_TCP, 100, NULL);
+    TEST(wait_result(flow, 5000) == pcp_state_succeeded);
+    TEST(dead->server_state == pss_race_lost);
+    TEST(dead->ping_flow_msg == NULL);
+
+    //TEST disabled racing returns reserve gateways to service
+    pcp_set_gateway_racing(ctx, 0);
+    TEST((dead->server_state == pss_ping) && (!dead->racing));
+    TEST(pcp_eval_flow_state(flow, &fstate) == 1);
+    TEST(fstate == pcp_state_partial_result);
+    pcp_terminate(ctx, 0);
+
+    PD_SOCKET_CLEANUP();
+    return 0;
+}
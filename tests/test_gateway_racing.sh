@@ -0,0 +1,6 @@
+#!/bin/bash
+
+killall pcp-server
+pcp-server &>/dev/null &
+sleep 1
+test_gateway_racing
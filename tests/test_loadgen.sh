@@ -0,0 +1,57 @@
+#!/bin/bash
+
+function echo_exit {
+    echo $1
+    killall pcp-server &>/dev/null
+    rm -f $OUT
+    exit 1
+}
+
+OUT=$(mktemp)
+
+killall pcp-server
+pcp-server --mappings &>/dev/null &
+pcp-server -p 5352 -v 1 &>/dev/null &
+pcp-server -p 5353 -r 8 &>/dev/null &
+sleep 1
+
+# every opcode of version 2, mappings of each run on their own ports
+PORT=10000
+for OPCODE in map peer announce sadscp; do
+    pcp-loadgen --requests 2000 --window 16 --opcode $OPCODE \
+        --port-base $PORT > $OUT || echo_exit "Failed $OPCODE load"
+    grep -q "SUCCESS  *2000$" $OUT || echo_exit "Failed $OPCODE results"
+    PORT=$((PORT + 1000))
+done
+
+# version 1 server
+for OPCODE in map peer announce; do
+    pcp-loadgen --server 127.0.0.1:5352 --version 1 --requests 2000 \
+        --opcode $OPCODE > $OUT || echo_exit "Failed version 1 $OPCODE load"
+    grep -q "SUCCESS  *2000$" $OUT \
+        || echo_exit "Failed version 1 $OPCODE results"
+done
+pcp-loadgen --server 127.0.0.1:5352 --requests 2000 > $OUT \
+    || echo_exit "Failed version 2 load of version 1 server"
+grep -q "UNSUPP_VERSION  *2000$" $OUT \
+    || echo_exit "Failed version 2 results of version 1 server"
+
+# options, error results, batches from several sockets
+pcp-loadgen --server 127.0.0.1:5353 --requests 2000 --batch 64 --sockets 4 \
+    --prefer-failure --third-party 10.0.0.1 --filter 192.0.2.0:80/24 > $OUT \
+    || echo_exit "Failed load with options"
+grep -q "NO_RESOURCES  *2000$" $OUT || echo_exit "Failed error results"
+
+# paced requests
+pcp-loadgen --server 127.0.0.1:5353 --rate 1000 --duration 1 > $OUT \
+    || echo_exit "Failed paced load"
+grep -q "^Sent 100[01] " $OUT || echo_exit "Failed request rate"
+
+# no server
+pcp-loadgen --server 127.0.0.1:5359 --requests 10 --timeout 200 > $OUT \
+    && echo_exit "Failed to detect unanswered requests"
+grep -q "Not answered:  *10$" $OUT || echo_exit "Failed unanswered count"
+
+killall pcp-server
+rm -f $OUT
+exit 0
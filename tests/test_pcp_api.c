@@ -21,6 +21,8 @@
 #include <string.h>
 #include <time.h>
 #include "pcp_client_db.h"
+#include "pcp_event_handler.h"
+#include "pcp_server_cache.h"
 #include "test_macro.h"
 #include "unp.h"
 #include "pcp_socket.h"
@@ -94,6 +96,442 @@ int main(void)
     pcp_flow_set_prefer_failure_opt(f2);
     pcp_flow_set_prefer_failure_opt(f2);
 
+    //TEST rarely used options are allocated on first use
+    TEST(f2->ext==NULL);
+#ifdef PCP_FLOW_PRIORITY
+    pcp_flow_set_flowp(f2, 0, 0);
+    TEST(f2->ext==NULL);
+#endif
+    pcp_flow_set_3rd_party_opt(f2, Sock_pton("127.0.0.2"));
+    TEST((f2->ext!=NULL)&&(f2->ext->third_party_option_present));
+    TEST(f1->ext==NULL);
+
+    //TEST flow info to caller's buffer and flow enumeration
+    {
+        pcp_flow_info_t info[4];
+        pcp_flow_t *flows[4];
+        pcp_flow_cursor_t cursor=PCP_FLOW_CURSOR_INIT;
+        size_t cnt=0, n;
+        int found_f1=0, found_f2=0;
+
+        TEST(pcp_flow_get_info_buf(NULL, info, 4)==0);
+        TEST(pcp_flow_get_info_buf(f1, NULL, 0)==1);
+        TEST(pcp_flow_get_info_buf(f1, info, 4)==1);
+        TEST(info[0].protocol==IPPROTO_TCP);
+        TEST(info[0].int_port==htons(1234));
+        TEST(info[0].result==pcp_state_processing);
+
+        TEST(pcp_flow_enum(NULL, &cursor, flows, info, 4)==0);
+        TEST(pcp_flow_enum(ctx, NULL, flows, info, 4)==0);
+        // enumerate in slices of one flow
+        while ((n=pcp_flow_enum(ctx, &cursor, flows, info, 1))>0) {
+            TEST(n==1);
+            found_f1|=(flows[0]==f1);
+            found_f2|=(flows[0]==f2);
+            cnt+=n;
+        }
+        TEST(cnt==ctx->pcp_db.flow_cnt);
+        TEST(found_f1 && found_f2);
+        TEST(pcp_flow_enum(ctx, &cursor, flows, info, 4)==0);
+    }
+
+    //TEST batch flow creation
+    {
+        pcp_flow_req_t reqs[3];
+        pcp_flow_t *out[3];
+        struct sockaddr_storage addrs[3];
+        size_t flow_cnt=ctx->pcp_db.flow_cnt;
+
+        memset(reqs, 0, sizeof(reqs));
+        TEST(sock_pton("127.0.0.1:2000", (struct sockaddr*)&addrs[0])==0);
+        TEST(sock_pton("127.0.0.1:2001", (struct sockaddr*)&addrs[1])==0);
+        TEST(sock_pton("127.0.0.1:3000", (struct sockaddr*)&addrs[2])==0);
+        reqs[0].src_addr=(struct sockaddr*)&addrs[0];
+        reqs[0].protocol=IPPROTO_UDP;
+        reqs[0].lifetime=100;
+        reqs[0].userdata=&reqs[0];
+        reqs[1].src_addr=NULL;
+        reqs[2].src_addr=(struct sockaddr*)&addrs[1];
+        reqs[2].dst_addr=(struct sockaddr*)&addrs[2];
+        reqs[2].protocol=IPPROTO_TCP;
+        reqs[2].lifetime=100;
+
+        TEST(pcp_new_flows(NULL, reqs, 3, out)==0);
+        TEST(pcp_new_flows(ctx, reqs, 3, out)==2);
+        TEST(out[1]==NULL);
+        TEST((out[0]!=NULL)&&(out[0]->kd.operation==PCP_OPCODE_MAP));
+        TEST(out[0]->kd.map_peer.src_port==htons(2000));
+        TEST(pcp_flow_get_user_data(out[0])==&reqs[0]);
+        TEST((out[2]!=NULL)&&(out[2]->kd.operation==PCP_OPCODE_PEER));
+        TEST(out[2]->kd.map_peer.dst_port==htons(3000));
+        TEST(ctx->pcp_db.flow_cnt==flow_cnt+2);
+        TEST(pcp_get_flow(&out[0]->kd, get_pcp_server(ctx, 0))==out[0]);
+        TEST(pcp_get_flow(&out[2]->kd, get_pcp_server(ctx, 0))==out[2]);
+
+        pcp_delete_flow(out[0]);
+        pcp_delete_flow(out[2]);
+        TEST(ctx->pcp_db.flow_cnt==flow_cnt);
+    }
+
+    //TEST desired state reconciliation
+    {
+        pcp_flow_req_t want[3];
+        struct sockaddr_storage addrs[2];
+        size_t flow_cnt=ctx->pcp_db.flow_cnt;
+
+        memset(want, 0, sizeof(want));
+        TEST(sock_pton("127.0.0.1:3000", (struct sockaddr*)&addrs[0])==0);
+        TEST(sock_pton("127.0.0.1:3001", (struct sockaddr*)&addrs[1])==0);
+        want[0].src_addr=(struct sockaddr*)&addrs[0];
+        want[0].protocol=IPPROTO_UDP;
+        want[0].lifetime=100;
+        want[1].src_addr=(struct sockaddr*)&addrs[1];
+        want[1].protocol=IPPROTO_UDP;
+        want[1].lifetime=100;
+        want[2]=want[0];
+
+        TEST(pcp_reconcile(NULL, want, 3)==PCP_ERR_BAD_ARGS);
+        TEST(pcp_reconcile(ctx, NULL, 3)==PCP_ERR_BAD_ARGS);
+        TEST(pcp_reconcile(ctx, want, 3)==2);
+        TEST(ctx->pcp_db.flow_cnt==flow_cnt+2);
+        TEST(pcp_reconcile(ctx, want, 2)==0);
+        want[1].lifetime=200;
+        TEST(pcp_reconcile(ctx, want, 2)==1);
+        //close flow of want[1]
+        TEST(pcp_reconcile(ctx, want, 1)==1);
+        TEST(ctx->pcp_db.flow_cnt==flow_cnt+2);
+        //request closed flow again
+        TEST(pcp_reconcile(ctx, want, 2)==1);
+        TEST(ctx->pcp_db.flow_cnt==flow_cnt+2);
+        TEST(pcp_reconcile(ctx, want, 1)==1);
+        //finished closed flow is deleted
+        TEST(pcp_reconcile(ctx, want, 1)==0);
+        TEST(ctx->pcp_db.flow_cnt==flow_cnt+1);
+        TEST(pcp_reconcile(ctx, NULL, 0)==1);
+        TEST(pcp_reconcile(ctx, NULL, 0)==0);
+        TEST(ctx->pcp_db.flow_cnt==flow_cnt);
+        TEST(ctx->reconciled_cnt==0);
+    }
+
+    //TEST sharing of identical flows
+    {
+        pcp_flow_t *fa, *fb, *fc;
+        struct sockaddr_storage src;
+        size_t flow_cnt=ctx->pcp_db.flow_cnt;
+
+        TEST(sock_pton("127.0.0.1:4000", (struct sockaddr*)&src)==0);
+        pcp_set_flow_sharing(ctx, 1);
+        TEST((fa=pcp_new_flow(ctx, (struct sockaddr*)&src, NULL, NULL,
+                IPPROTO_UDP, 100, &fa))!=NULL);
+        TEST((fb=pcp_new_flow(ctx, (struct sockaddr*)&src, NULL, NULL,
+                IPPROTO_UDP, 200, &fb))!=NULL);
+        TEST((fc=pcp_new_flow(ctx, (struct sockaddr*)&src, NULL, NULL,
+                IPPROTO_UDP, 50, &fc))!=NULL);
+        TEST(ctx->pcp_db.flow_cnt==flow_cnt+1);
+        TEST((fb->shared==fa)&&(fc->shared==fa)&&(fa->share_cnt==2));
+        TEST(fa->lifetime==200);
+        TEST(pcp_flow_get_user_data(fb)==&fb);
+        TEST(fb->state==fa->state);
+
+        //options are set on the shared flow
+        pcp_flow_set_lifetime(fc, 300);
+        TEST(fa->lifetime==300);
+
+        //closing follower leaves the longest lifetime of the others
+        pcp_close_flow(fc);
+        TEST((fc->shared==NULL)&&(fa->share_cnt==1));
+        TEST(fa->lifetime==200);
+        pcp_delete_flow(fc);
+
+        //closing on-wire flow passes it to the remaining one
+        pcp_close_flow(fa);
+        TEST((fb->shared==NULL)&&(fb->share_cnt==0));
+        TEST(fb->lifetime==200);
+        TEST(pcp_get_flow(&fb->kd, get_pcp_server(ctx, 0))==fb);
+        TEST(pcp_flow_get_user_data(fb)==&fb);
+        TEST(ctx->pcp_db.flow_cnt==flow_cnt+1);
+        pcp_delete_flow(fa);
+        TEST(ctx->pcp_db.flow_cnt==flow_cnt+1);
+
+        //closed flow is not shared
+        pcp_close_flow(fb);
+        TEST((fa=pcp_new_flow(ctx, (struct sockaddr*)&src, NULL, NULL,
+                IPPROTO_UDP, 100, NULL))!=NULL);
+        TEST(fa->shared==NULL);
+        pcp_delete_flow(fb);
+        pcp_delete_flow(fa);
+        TEST(ctx->pcp_db.flow_cnt==flow_cnt);
+
+        //shared mapping has the longest lifetime set on its flows
+        TEST((fa=pcp_new_flow(ctx, (struct sockaddr*)&src, NULL, NULL,
+                IPPROTO_UDP, 100, NULL))!=NULL);
+        TEST((fb=pcp_new_flow(ctx, (struct sockaddr*)&src, NULL, NULL,
+                IPPROTO_UDP, 100, NULL))!=NULL);
+        TEST(fb->shared==fa);
+        pcp_flow_set_lifetime(fb, 500);
+        pcp_flow_set_lifetime(fa, 50);
+        TEST(fa->lifetime==500);
+        pcp_flow_set_lifetime(fb, 70);
+        TEST(fa->lifetime==70);
+        pcp_flow_set_lifetime(fb, 500);
+        //lifetime 0 detaches only that flow
+        pcp_flow_set_lifetime(fb, 0);
+        TEST((fb->shared==NULL)&&(fb->lifetime==0)&&(fa->share_cnt==0));
+        TEST(fa->lifetime==50);
+        pcp_flow_set_lifetime(fb, 0);
+        TEST(fa->lifetime==50);
+        pcp_delete_flow(fb);
+        TEST((fb=pcp_new_flow(ctx, (struct sockaddr*)&src, NULL, NULL,
+                IPPROTO_UDP, 500, NULL))!=NULL);
+        TEST(fa->lifetime==500);
+        pcp_flow_set_lifetime(fa, 0);
+        TEST((fb->shared==NULL)&&(fa->shared==NULL)&&(fa->lifetime==0));
+        TEST(fb->lifetime==500);
+        TEST(pcp_get_flow(&fb->kd, get_pcp_server(ctx, 0))==fb);
+        pcp_delete_flow(fa);
+        pcp_delete_flow(fb);
+        TEST(ctx->pcp_db.flow_cnt==flow_cnt);
+
+        //identical requests of one batch share the mapping
+        {
+            pcp_flow_req_t reqs[2];
+            pcp_flow_t *out[2];
+
+            memset(reqs, 0, sizeof(reqs));
+            reqs[0].src_addr=(struct sockaddr*)&src;
+            reqs[0].protocol=IPPROTO_UDP;
+            reqs[0].lifetime=100;
+            reqs[1]=reqs[0];
+            reqs[1].lifetime=200;
+            TEST(pcp_new_flows(ctx, reqs, 2, out)==2);
+            TEST((out[1]->shared==out[0])&&(out[0]->share_cnt==1));
+            TEST(out[0]->lifetime==200);
+            TEST(ctx->pcp_db.flow_cnt==flow_cnt+1);
+            TEST(pcp_get_flow(&out[0]->kd, get_pcp_server(ctx, 0))==out[0]);
+            pcp_delete_flow(out[1]);
+            pcp_delete_flow(out[0]);
+            TEST(ctx->pcp_db.flow_cnt==flow_cnt);
+        }
+
+        //flows left shared are released on terminate
+        TEST((fa=pcp_new_flow(ctx, (struct sockaddr*)&src, NULL, NULL,
+                IPPROTO_UDP, 100, NULL))!=NULL);
+        TEST((fb=pcp_new_flow(ctx, (struct sockaddr*)&src, NULL, NULL,
+                IPPROTO_UDP, 100, NULL))!=NULL);
+        TEST(fb->shared==fa);
+        pcp_set_flow_sharing(ctx, 0);
+    }
+
+    //TEST optimistic start sends waiting requests along with the ping
+    {
+        pcp_ctx_t *octx;
+        pcp_server_t *s;
+        pcp_flow_t *fa, *fb;
+        int optimistic;
+
+        for (optimistic=0; optimistic<2; ++optimistic) {
+            octx=pcp_init(DISABLE_AUTODISCOVERY, NULL);
+            pcp_set_optimistic_start(octx, optimistic);
+            TEST(pcp_add_server(octx, Sock_pton("127.0.0.1:5399"), 2)==0);
+            TEST((fa=pcp_new_flow(octx, Sock_pton("127.0.0.1:4001"), NULL,
+                    NULL, IPPROTO_UDP, 100, NULL))!=NULL);
+            TEST((fb=pcp_new_flow(octx, Sock_pton("127.0.0.1:4002"), NULL,
+                    NULL, IPPROTO_UDP, 100, NULL))!=NULL);
+            pcp_pulse(octx, NULL);
+            s=get_pcp_server(octx, 0);
+            TEST(s->server_state==pss_wait_ping_resp);
+            TEST((fa->state==pfs_wait_resp)+(fb->state==pfs_wait_resp)
+                    ==1+optimistic);
+
+            //UNSUPP_VERSION returns requests to wait for negotiation
+            s->next_version=1;
+            s->server_state=pss_version_negotiation;
+            run_server_state_machine(s, pcpe_io_event);
+            TEST(s->server_state==pss_wait_ping_resp);
+            TEST(s->pcp_version==1);
+            TEST(s->optimistic==0);
+            TEST((fa->state==pfs_wait_resp)+(fb->state==pfs_wait_resp)==1);
+            TEST((fa->state==pfs_wait_for_server_init)
+                    +(fb->state==pfs_wait_for_server_init)==1);
+            pcp_terminate(octx, 0);
+        }
+    }
+
+#ifndef WIN32
+    //TEST servers confirmed in previous run start from server cache
+    {
+        const char *path="test_pcp_api.cache";
+        pcp_ctx_t *cctx;
+        pcp_server_t *s;
+        int i;
+
+        remove(path);
+        for (i=0; i<4; ++i) {
+            cctx=pcp_init(DISABLE_AUTODISCOVERY, NULL);
+            TEST(pcp_set_server_cache(cctx, path, 0)==PCP_ERR_SUCCESS);
+            TEST(pcp_add_server(cctx, Sock_pton("127.0.0.1:5399"), 2)==0);
+            s=get_pcp_server(cctx, 0);
+            switch (i) {
+                case 0:
+                    //unknown server is pinged, record written on response
+                    TEST(s->server_state==pss_ping);
+                    s->pcp_version=1;
+                    s->epoch=1234;
+                    s->rtt_us=500;
+                    psc_store(s);
+                    break;
+                case 1:
+                    TEST(s->server_state==pss_send_all_msgs);
+                    TEST((s->pcp_version==1)&&(s->version_known));
+                    TEST((s->epoch==1234)&&(s->rtt_us==500)&&(s->warm));
+                    //server stopped responding
+                    psc_forget(s);
+                    TEST(s->warm==0);
+                    break;
+                case 2:
+                    TEST(s->server_state==pss_ping);
+                    psc_store(s);
+                    //cache set after the server was added
+                    pcp_terminate(cctx, 0);
+                    cctx=pcp_init(DISABLE_AUTODISCOVERY, NULL);
+                    TEST(pcp_add_server(cctx, Sock_pton("127.0.0.1:5399"), 2)==0);
+                    s=get_pcp_server(cctx, 0);
+                    TEST(s->server_state==pss_ping);
+                    TEST(pcp_set_server_cache(cctx, path, 0)==PCP_ERR_SUCCESS);
+                    TEST(s->server_state==pss_send_all_msgs);
+                    TEST(pcp_set_server_cache(cctx, NULL, 0)==PCP_ERR_SUCCESS);
+                    //file of other format is reset
+                    {
+                        FILE *fp=fopen(path, "r+b");
+                        TEST(fp!=NULL);
+                        fputc(0, fp);
+                        fclose(fp);
+                    }
+                    break;
+                default:
+                    TEST(s->server_state==pss_ping);
+                    break;
+            }
+            pcp_terminate(cctx, 0);
+        }
+        TEST(pcp_set_server_cache(NULL, path, 0)==PCP_ERR_BAD_ARGS);
+        remove(path);
+    }
+#endif
+
+    //TEST flows restored from snapshot wait for renewal of their mappings
+    {
+        const char *path="test_pcp_api.snapshot";
+        pcp_flow_req_t req;
+        pcp_flow_cursor_t cur=PCP_FLOW_CURSOR_INIT;
+        pcp_flow_cursor_t scur=PCP_FLOW_CURSOR_INIT;
+        pcp_flow_t *fl[4], *fr;
+        pcp_flow_info_t info[4];
+        pcp_ctx_t *sctx;
+        pcp_server_t *s;
+        struct pcp_nonce nonce;
+        time_t lifetime_end=time(NULL)+100;
+        size_t cnt;
+        FILE *fp;
+
+        remove(path);
+        sctx=pcp_init(DISABLE_AUTODISCOVERY, NULL);
+        TEST(pcp_add_server(sctx, Sock_pton("127.0.0.1:5399"), 2)==0);
+        s=get_pcp_server(sctx, 0);
+        s->server_state=pss_wait_io;
+        s->epoch=77;
+        nonce=s->nonce;
+
+        // granted mapping
+        fl[0]=pcp_new_flow(sctx, Sock_pton("127.0.0.1:1234"), NULL, NULL,
+                IPPROTO_TCP, 100, NULL);
+        TEST(fl[0]!=NULL);
+        fl[0]->state=pfs_wait_for_lifetime_renew;
+        pcp_flow_account_state(fl[0]);
+        fl[0]->recv_lifetime=lifetime_end;
+        fl[0]->timeout.tv_sec=lifetime_end-50;
+        fl[0]->map_peer.ext_port=htons(4321);
+        // request without response yet
+        fl[1]=pcp_new_flow(sctx, Sock_pton("127.0.0.1:1235"), NULL, NULL,
+                IPPROTO_UDP, 100, NULL);
+        pcp_flow_set_prefer_failure_opt(fl[1]);
+        // closed flow is not saved
+        fl[2]=pcp_new_flow(sctx, Sock_pton("127.0.0.1:1236"), NULL, NULL,
+                IPPROTO_UDP, 100, NULL);
+        fl[2]->state=pfs_wait_for_lifetime_renew;
+        pcp_close_flow(fl[2]);
+        // flow managed by pcp_reconcile
+        memset(&req, 0, sizeof(req));
+        req.src_addr=Sock_pton("127.0.0.1:1237");
+        req.protocol=IPPROTO_TCP;
+        req.lifetime=200;
+        TEST(pcp_reconcile(sctx, &req, 1)==1);
+
+        TEST(pcp_ctx_save(NULL, path)==PCP_ERR_BAD_ARGS);
+        TEST(pcp_ctx_save(sctx, path)==PCP_ERR_SUCCESS);
+        pcp_terminate(sctx, 0);
+
+        sctx=pcp_init(DISABLE_AUTODISCOVERY, NULL);
+        TEST(pcp_ctx_restore(sctx, "test_pcp_api.missing")==PCP_ERR_NOT_FOUND);
+        TEST(pcp_ctx_restore(sctx, path)==3);
+        s=get_pcp_server(sctx, 0);
+        TEST((s!=NULL) && (s->server_state==pss_send_all_msgs));
+        TEST((s->epoch==77) && (!memcmp(&s->nonce, &nonce, sizeof(nonce))));
+        cnt=pcp_flow_enum(sctx, &cur, fl, info, 4);
+        TEST(cnt==3);
+        for (fr=NULL; cnt>0; --cnt) {
+            TEST(!memcmp(&fl[cnt-1]->kd.nonce, &nonce, sizeof(nonce)));
+            if (fl[cnt-1]->kd.map_peer.src_port==htons(1234)) {
+                fr=fl[cnt-1];
+                TEST(info[cnt-1].ext_port==htons(4321));
+            } else if (fl[cnt-1]->kd.map_peer.src_port==htons(1235)) {
+                TEST(fl[cnt-1]->state==pfs_wait_for_server_init);
+                TEST(fl[cnt-1]->pfailure_option_present);
+            } else {
+                TEST(fl[cnt-1]->kd.map_peer.src_port==htons(1237));
+                TEST(fl[cnt-1]->lifetime==200);
+            }
+        }
+        TEST((fr!=NULL) && (fr->state==pfs_wait_for_lifetime_renew));
+        TEST((fr->recv_lifetime==lifetime_end)
+                && (fr->timeout.tv_sec==lifetime_end-50));
+        // same desired flows - nothing to do
+        TEST(pcp_reconcile(sctx, &req, 1)==0);
+        // server with flows keeps its own nonce
+        TEST(pcp_ctx_restore(sctx, path)==0);
+        pcp_terminate(sctx, 0);
+
+        // shared mapping keeps lifetime requested by each flow
+        sctx=pcp_init(DISABLE_AUTODISCOVERY, NULL);
+        TEST(pcp_add_server(sctx, Sock_pton("127.0.0.1:5399"), 2)==0);
+        pcp_set_flow_sharing(sctx, 1);
+        fl[0]=pcp_new_flow(sctx, Sock_pton("127.0.0.1:1238"), NULL, NULL,
+                IPPROTO_UDP, 100, NULL);
+        fl[1]=pcp_new_flow(sctx, Sock_pton("127.0.0.1:1238"), NULL, NULL,
+                IPPROTO_UDP, 300, NULL);
+        TEST((fl[1]->shared==fl[0])&&(fl[0]->lifetime==300));
+        TEST(pcp_ctx_save(sctx, path)==PCP_ERR_SUCCESS);
+        pcp_terminate(sctx, 0);
+        sctx=pcp_init(DISABLE_AUTODISCOVERY, NULL);
+        TEST(pcp_ctx_restore(sctx, path)==2);
+        // flows sharing the mapping are not in DB
+        TEST(pcp_flow_enum(sctx, &scur, &fr, NULL, 1)==1);
+        TEST((fr->share_cnt==1)&&(fr->lifetime==300));
+        pcp_flow_set_lifetime(fr->next_follower, 0);
+        TEST(fr->lifetime==100);
+        pcp_terminate(sctx, 0);
+
+        // snapshot of other format
+        fp=fopen(path, "r+b");
+        TEST(fp!=NULL);
+        fputc(0, fp);
+        fclose(fp);
+        sctx=pcp_init(DISABLE_AUTODISCOVERY, NULL);
+        TEST(pcp_ctx_restore(sctx, path)==PCP_ERR_UNSUP_VERSION);
+        pcp_terminate(sctx, 0);
+        remove(path);
+    }
+
     pcp_flow_set_lifetime(f1, 1000);
     TEST((f1->lifetime)>=99);
     TEST((f1->timeout.tv_sec>0)||(f1->timeout.tv_usec>0));
@@ -104,6 +542,9 @@ int main(void)
     TEST(f1->lifetime==0);
     TEST((f1->timeout.tv_sec>0)||(f1->timeout.tv_usec>0));
 
+    pcp_terminate(ctx, 1);
+    TEST(ctx->pcp_db.flow_cnt==0);
+
     printf("Tests succeeded.\n\n");
 
     PD_SOCKET_CLEANUP();
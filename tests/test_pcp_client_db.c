@@ -21,6 +21,7 @@
 #include <string.h>
 #include "pcp_client_db.h"
 #include "test_macro.h"
+#include "unp.h"
 #include "pcp_utils.h"
 #include "pcp_socket.h"
 
@@ -84,14 +85,64 @@ static void test_pcp_server_functions(pcp_ctx_t *ctx)
     TEST(pcp_new_server(ctx, &ip6, PCP_SERVER_PORT, 0) == 5);
     TEST(pcp_new_server(ctx, &ip6, PCP_SERVER_PORT, 0) == 6);
 
-    sret=get_pcp_server_by_ip(ctx, &ip6);
+    sret=get_pcp_server_by_addr(ctx, &ip6, PCP_SERVER_PORT, 0);
     TEST(sret!=NULL);
     TEST(si2==(int)sret->index);
 #endif
-    sret=get_pcp_server_by_ip(ctx, &ip4);
+    sret=get_pcp_server_by_addr(ctx, &ip4, PCP_SERVER_PORT, 0);
     TEST(sret!=NULL);
     TEST(si1==(int)sret->index);
 
+    //port is a part of the key, scope_id only for link-local addresses
+    TEST(get_pcp_server_by_addr(ctx, &ip4, PCP_SERVER_PORT+1, 0)==NULL);
+    TEST(get_pcp_server_by_addr(ctx, &ip4, PCP_SERVER_PORT, 3)
+            ==get_pcp_server(ctx, si1));
+    {
+        struct in6_addr ll;
+        int sl1, sl2;
+
+        memset(&ll, 0, sizeof(ll));
+        S6_ADDR32(&ll)[0] = htonl(0xfe800000);
+        S6_ADDR32(&ll)[3] = htonl(1);
+        sl1=pcp_new_server(ctx, &ll, PCP_SERVER_PORT, 1);
+        sl2=pcp_new_server(ctx, &ll, PCP_SERVER_PORT, 2);
+        TEST((sl1>=0)&&(sl2>=0));
+        TEST(get_pcp_server_by_addr(ctx, &ll, PCP_SERVER_PORT, 1)
+                ==get_pcp_server(ctx, sl1));
+        TEST(get_pcp_server_by_addr(ctx, &ll, PCP_SERVER_PORT, 2)
+                ==get_pcp_server(ctx, sl2));
+        TEST(get_pcp_server_by_addr(ctx, &ll, PCP_SERVER_PORT, 0)==NULL);
+
+        //removed server is not found and its slot is reused
+        pcp_db_rem_server(get_pcp_server(ctx, sl1));
+        TEST(get_pcp_server(ctx, sl1)==NULL);
+        TEST(get_pcp_server_by_addr(ctx, &ll, PCP_SERVER_PORT, 1)==NULL);
+        TEST(get_pcp_server_by_addr(ctx, &ll, PCP_SERVER_PORT, 2)
+                ==get_pcp_server(ctx, sl2));
+        TEST(pcp_new_server(ctx, &ll, PCP_SERVER_PORT, 1)==sl1);
+        TEST(get_pcp_server_by_addr(ctx, &ll, PCP_SERVER_PORT, 1)
+                ==get_pcp_server(ctx, sl1));
+    }
+
+    //index survives growth of the server array
+    {
+        struct in6_addr ipn=ip4;
+        int i, indx[64];
+
+        for (i=0; i<64; ++i) {
+            S6_ADDR32(&ipn)[3] = htonl(0x0a000000 + i);
+            indx[i]=pcp_new_server(ctx, &ipn, PCP_SERVER_PORT, 0);
+            TEST(indx[i]>=0);
+        }
+        for (i=0; i<64; ++i) {
+            S6_ADDR32(&ipn)[3] = htonl(0x0a000000 + i);
+            sret=get_pcp_server_by_addr(ctx, &ipn, PCP_SERVER_PORT, 0);
+            TEST((sret!=NULL)&&((int)sret->index==indx[i]));
+        }
+        TEST(get_pcp_server_by_addr(ctx, &ip4, PCP_SERVER_PORT, 0)
+                ==get_pcp_server(ctx, si1));
+    }
+
     pcp_db_free_pcp_servers(ctx);
 
     TEST(get_pcp_server(ctx, 1)==NULL);
@@ -210,6 +261,212 @@ static void test_pcp_flow_funcs(pcp_ctx_t *ctx)
     TEST(cnt==3);
 }
 
+static void test_pcp_flow_pool(pcp_ctx_t *ctx)
+{
+    pcp_flow_t *flows[3];
+    pcp_flow_t *f;
+    struct flow_key_data fkd;
+    size_t free_cnt;
+
+    memset(&fkd, 0, sizeof(fkd));
+    fkd.operation=1;
+
+    TEST(pcp_db_reserve_flows(ctx, 100)==PCP_ERR_SUCCESS);
+    TEST(ctx->pcp_db.free_flow_cnt>=100);
+    free_cnt=ctx->pcp_db.free_flow_cnt;
+
+    //deleted flow is returned to the pool
+    f=pcp_create_flow(get_pcp_server(ctx, 0), &fkd);
+    TEST(f!=NULL);
+    TEST(ctx->pcp_db.free_flow_cnt==free_cnt-1);
+    TEST(pcp_delete_flow_intern(f)==PCP_ERR_SUCCESS);
+    TEST(ctx->pcp_db.free_flow_cnt==free_cnt);
+    TEST(pcp_create_flow(get_pcp_server(ctx, 0), &fkd)==f);
+
+    //bulk insert of flows and their children
+    fkd.map_peer.src_port=1;
+    flows[0]=f;
+    flows[1]=NULL;
+    flows[2]=pcp_create_flow(get_pcp_server(ctx, 0), &fkd);
+    fkd.map_peer.src_port=2;
+    flows[2]->next_child=pcp_create_flow(get_pcp_server(ctx, 0), &fkd);
+    TEST(pcp_db_add_flows(NULL, flows, 3)!=PCP_ERR_SUCCESS);
+    TEST(pcp_db_add_flows(ctx, flows, 3)==PCP_ERR_SUCCESS);
+    TEST(ctx->pcp_db.flow_cnt==3);
+    TEST(pcp_get_flow(&fkd, get_pcp_server(ctx, 0))==flows[2]->next_child);
+    fkd.map_peer.src_port=1;
+    TEST(pcp_get_flow(&fkd, get_pcp_server(ctx, 0))==flows[2]);
+
+    while (pcp_db_foreach_flow(ctx, ret_func, &f)==PCP_ERR_SUCCESS) {
+        pcp_delete_flow_intern(f);
+    }
+    TEST(ctx->pcp_db.flow_cnt==0);
+
+    pcp_db_free_flow_pool(ctx);
+    TEST(ctx->pcp_db.free_flow_cnt==0);
+    TEST(ctx->pcp_db.free_flows==NULL);
+}
+
+//server is identified by address and port, port isn't overwritten
+static void test_pcp_add_server(void)
+{
+    pcp_ctx_t *ctx;
+    struct in6_addr ip;
+    int si1, si2;
+
+    ctx=pcp_init(DISABLE_AUTODISCOVERY, NULL);
+    TEST(ctx!=NULL);
+
+    si1=pcp_add_server(ctx, Sock_pton("127.0.0.1:5351"), 2);
+    TEST(si1>=0);
+    si2=pcp_add_server(ctx, Sock_pton("127.0.0.1:5555"), 2);
+    TEST((si2>=0)&&(si2!=si1));
+    TEST(pcp_add_server(ctx, Sock_pton("127.0.0.1:5351"), 1)==si1);
+    TEST(get_pcp_server(ctx, si1)->pcp_version==1);
+
+    memset(&ip, 0, sizeof(ip));
+    S6_ADDR32(&ip)[2]=htonl(0xffff);
+    S6_ADDR32(&ip)[3]=htonl(0x7f000001);
+    TEST(get_pcp_server_by_addr(ctx, &ip, htons(5351), 0)
+            ==get_pcp_server(ctx, si1));
+    TEST(get_pcp_server_by_addr(ctx, &ip, htons(5555), 0)
+            ==get_pcp_server(ctx, si2));
+    TEST(get_pcp_server(ctx, si1)->pcp_port==htons(5351));
+
+    pcp_terminate(ctx, 1);
+}
+
+static void test_pcp_flow_group(pcp_ctx_t *ctx)
+{
+    pcp_flow_t *f[3];
+    struct flow_key_data fkd;
+    pcp_fstate_e fstate;
+    int i;
+
+    memset(&fkd, 0, sizeof(fkd));
+    fkd.operation=1;
+
+    for (i=0; i<3; ++i) {
+        f[i]=pcp_create_flow(get_pcp_server(ctx, 0), &fkd);
+        TEST(f[i]!=NULL);
+        f[i]->state=pfs_send;
+    }
+    pcp_flow_account_state(f[0]);
+    for (i=1; i<3; ++i) {
+        f[i-1]->next_child=f[i];
+        pcp_flow_join_group(f[0], f[i]);
+        TEST(f[i]->group==f[0]);
+    }
+    TEST(f[0]->group_cnt[pfc_processing]==3);
+    TEST(pcp_eval_flow_state(f[0], &fstate)==0);
+    TEST(fstate==pcp_state_processing);
+
+    //any member's change is seen by the whole group
+    f[2]->state=pfs_wait_for_lifetime_renew;
+    pcp_flow_account_state(f[2]);
+    TEST(pcp_eval_flow_state(f[0], &fstate)==1);
+    TEST(fstate==pcp_state_partial_result);
+    TEST(pcp_eval_flow_state(f[1], &fstate)==1);
+    TEST(fstate==pcp_state_partial_result);
+
+    //state written directly is accounted on evaluation of that flow
+    f[1]->state=pfs_failed;
+    TEST(pcp_eval_flow_state(f[1], &fstate)==2);
+    f[0]->state=pfs_wait_after_short_life_error;
+    TEST(pcp_eval_flow_state(f[0], &fstate)==3);
+    TEST(fstate==pcp_state_succeeded);
+    TEST(f[0]->group_cnt[pfc_processing]==0);
+
+    f[2]->state=pfs_failed;
+    pcp_flow_account_state(f[2]);
+    TEST(pcp_eval_flow_state(f[2], &fstate)==3);
+    TEST(fstate==pcp_state_failed);
+
+    f[1]->state=pfs_wait_after_short_life_error;
+    f[2]->state=pfs_wait_after_short_life_error;
+    pcp_flow_account_state(f[1]);
+    pcp_flow_account_state(f[2]);
+    TEST(pcp_eval_flow_state(f[0], &fstate)==3);
+    TEST(fstate==pcp_state_short_lifetime_error);
+
+    TEST(pcp_eval_flow_state(NULL, &fstate)==0);
+
+    for (i=0; i<3; ++i) {
+        pcp_delete_flow_intern(f[i]);
+    }
+}
+
+static void test_pcp_server_retire(void)
+{
+    pcp_ctx_t *ctx;
+    pcp_server_t *s;
+    pcp_flow_t *f, *fc;
+    struct sockaddr_storage src, srv;
+    struct in6_addr ip;
+    pcp_fstate_e fstate;
+    int si1, si2, si3;
+
+    ctx=pcp_init(0, NULL);
+    TEST(ctx!=NULL);
+    sock_pton("127.0.0.1:1234", (struct sockaddr *)&src);
+
+    si1=pcp_add_server(ctx, Sock_pton("127.0.0.1:5351"), 2);
+    TEST(si1>=0);
+    f=pcp_new_flow(ctx, (struct sockaddr *)&src, NULL, NULL, IPPROTO_TCP,
+            100, NULL);
+    TEST(f!=NULL);
+    TEST(f->pcp_server_indx==(uint32_t)si1);
+
+    //no other server - flow waits on retired one
+    pcp_server_retire(get_pcp_server(ctx, si1));
+    s=get_pcp_server(ctx, si1);
+    TEST(s->server_state==pss_retired);
+    TEST(f->state==pfs_wait_for_server_init);
+    TEST(f->pcp_server_indx==(uint32_t)si1);
+    sock_pton("127.0.0.1:5351", (struct sockaddr *)&srv);
+    pcp_fill_in6_addr(&ip, NULL, (struct sockaddr *)&srv);
+    TEST(get_pcp_server_by_addr(ctx, &ip, ntohs(PCP_SERVER_PORT), 0)==NULL);
+    TEST(pcp_eval_flow_state(f, &fstate)==0);
+    TEST(fstate==pcp_state_processing);
+
+    //new server takes flow over and retired one is released
+    si2=pcp_add_server(ctx, Sock_pton("127.0.0.2:5351"), 2);
+    TEST(si2>=0);
+    TEST(si2!=si1);
+    s=get_pcp_server(ctx, si2);
+    TEST(f->pcp_server_indx==(uint32_t)si2);
+    TEST(IN6_ARE_ADDR_EQUAL(&f->kd.pcp_server_ip, (struct in6_addr *)s->pcp_ip));
+    TEST(memcmp(&f->kd.nonce, &s->nonce, sizeof(s->nonce))==0);
+    TEST(pcp_get_flow(&f->kd, s)==f);
+    TEST(ctx->pcp_db.flow_cnt==1);
+    TEST(get_pcp_server(ctx, si1)==NULL);
+
+    //flow is moved to working server right away
+    si3=pcp_add_server(ctx, Sock_pton("127.0.0.3:5351"), 2);
+    TEST(si3>=0);
+    pcp_server_retire(get_pcp_server(ctx, si2));
+    TEST(f->pcp_server_indx==(uint32_t)si3);
+    TEST(get_pcp_server(ctx, si2)==NULL);
+    pcp_delete_flow(f);
+
+    //request already sent through other server isn't duplicated
+    si1=pcp_add_server(ctx, Sock_pton("127.0.0.4:5351"), 2);
+    f=pcp_new_flow(ctx, (struct sockaddr *)&src, NULL, NULL, IPPROTO_UDP,
+            100, NULL);
+    TEST(f!=NULL);
+    TEST(f->next_child!=NULL);
+    fc=f->pcp_server_indx==(uint32_t)si3 ? f : f->next_child;
+    pcp_server_retire(get_pcp_server(ctx, si3));
+    TEST(fc->state==pfs_failed);
+    TEST(fc->pcp_server_indx==(uint32_t)si3);
+    TEST(get_pcp_server(ctx, si3)->server_state==pss_retired);
+    TEST(pcp_eval_flow_state(f, &fstate)==1);
+
+    pcp_delete_flow(f);
+    TEST(ctx->pcp_db.flow_cnt==0);
+    pcp_terminate(ctx, 0);
+}
+
 int main(void)
 {
     pcp_ctx_t *ctx;
@@ -219,6 +476,10 @@ int main(void)
     TEST(ctx!=NULL);
     test_pcp_server_functions(ctx);
     test_pcp_flow_funcs(ctx);
+    test_pcp_flow_group(ctx);
+    test_pcp_flow_pool(ctx);
+    test_pcp_add_server();
+    test_pcp_server_retire();
 
     PD_SOCKET_CLEANUP();
     printf("Tests succeeded.\n\n");
@@ -184,6 +184,17 @@ killall pcp-server &>/dev/null
 grep -q "Size of PCP packet is either smaller" /tmp/pcp_server_bad_packet.test || echo_exit "Malformed packet test failed #1"
 fi
 
+#Worker threads tests
+pcp-server --workers 0 | grep -q "Bad value for option --workers" || echo_exit "Failed starting server with workers #1"
+killall pcp-server &>/dev/null
+pcp-server --workers 2 --timeout 1500 >/tmp/pcp_server_workers.test &
+sleep 0.1
+pcp -s 127.0.0.1 -i :1234 &>/dev/null
+sleep 2
+grep -q "Workers: *2" /tmp/pcp_server_workers.test || echo_exit "Failed starting server with workers #2"
+grep -q "Responses sent: *[1-9]" /tmp/pcp_server_workers.test || echo_exit "Failed starting server with workers #3"
+grep -q "PCP protocol VERSION" /tmp/pcp_server_workers.test && echo_exit "Failed starting server with workers #4"
+
 #Well formed packet unsuported version
 #pcp-server --ear 1 >/tmp/pcp_server_bad_packet.test &
 #echo -ne "\x03\x01\x00\x00\x00\x00\x03\x85\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\xff\xff\x7f\x00\x00\x01\x5f\x61\x4e\x21\x04\x58\x7f\x87\x2d\xb0\x47\x38\x06\x00\x00\x00\x04\xd2\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00" | nc -w 1 -u 0.0.0.0 5351 > /dev/null &
@@ -0,0 +1,353 @@
+/*
+ *------------------------------------------------------------------
+ * test_replay.c
+ *
+ * Capture files: datagrams written by pcp_pcap_write and by context
+ * with pcp_set_capture are read back, captures of other links are
+ * imported. Expects PCP server with mappings on port 5351, started by
+ * test_replay.sh, which replays the capture afterwards.
+ *
+ *------------------------------------------------------------------
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#else
+#include "default_config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef WIN32
+#include <winsock2.h>
+#include <windows.h>
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/types.h>
+#endif
+
+#include "pcp.h"
+#include "pcp_utils.h"
+#include "pcp_socket.h"
+#include "pcp_pcap.h"
+#include "unp.h"
+#include "test_macro.h"
+
+static const uint8_t payload[4] = { 'P', 'C', 'P', '!' };
+
+static void put16(uint8_t *b, uint16_t v)
+{
+    b[0] = (uint8_t)(v >> 8);
+    b[1] = (uint8_t)v;
+}
+
+static void put32(uint8_t *b, uint32_t v, int big_endian)
+{
+    int i;
+
+    for (i = 0; i < 4; ++i) {
+        b[big_endian ? i : 3 - i] = (uint8_t)(v >> (24 - 8 * i));
+    }
+}
+
+static FILE *create_capture(const char *path, uint32_t magic,
+        uint32_t linktype, int big_endian)
+{
+    uint8_t hdr[24];
+    FILE *f = fopen(path, "wb");
+
+    TEST(f != NULL);
+    memset(hdr, 0, sizeof(hdr));
+    put32(hdr, magic, big_endian);
+    hdr[big_endian ? 5 : 4] = 2;
+    hdr[big_endian ? 7 : 6] = 4;
+    put32(hdr + 16, 65535, big_endian);
+    put32(hdr + 20, linktype, big_endian);
+    TEST(fwrite(hdr, sizeof(hdr), 1, f) == 1);
+    return f;
+}
+
+static void add_frame(FILE *f, uint32_t sec, uint32_t frac,
+        const uint8_t *frame, size_t len, int big_endian)
+{
+    uint8_t hdr[16];
+
+    put32(hdr, sec, big_endian);
+    put32(hdr + 4, frac, big_endian);
+    put32(hdr + 8, (uint32_t)len, big_endian);
+    put32(hdr + 12, (uint32_t)len, big_endian);
+    TEST(fwrite(hdr, sizeof(hdr), 1, f) == 1);
+    TEST(fwrite(frame, len, 1, f) == 1);
+}
+
+// IPv4 packet with UDP or other protocol from 192.0.2.1:5350 to
+// 192.0.2.2:5351
+static size_t ip4_packet(uint8_t *p, uint8_t proto, uint16_t frag)
+{
+    memset(p, 0, 28);
+    p[0] = 0x45;
+    put16(p + 2, 28 + sizeof(payload));
+    put16(p + 6, frag);
+    p[8] = 64;
+    p[9] = proto;
+    put32(p + 12, 0xc0000201, 1);
+    put32(p + 16, 0xc0000202, 1);
+    put16(p + 20, 5350);
+    put16(p + 22, 5351);
+    put16(p + 24, 8 + sizeof(payload));
+    memcpy(p + 28, payload, sizeof(payload));
+    return 28 + sizeof(payload);
+}
+
+// Ethernet frame, VLAN tagged if vlan
+static size_t eth_frame(uint8_t *f, uint16_t type, int vlan)
+{
+    size_t off = 12;
+
+    memset(f, 0xaa, 12);
+    if (vlan) {
+        put16(f + off, 0x8100);
+        put16(f + off + 2, 100);
+        off += 4;
+    }
+    put16(f + off, type);
+    return off + 2;
+}
+
+static void test_ethernet_import(const char *path)
+{
+    uint8_t frame[128];
+    size_t len;
+    pcp_pcap_rec_t *rec = (pcp_pcap_rec_t *)malloc(sizeof(*rec));
+    pcp_pcap_t *p;
+    FILE *f;
+
+    TEST(rec != NULL);
+    // big endian with nanosecond timestamps
+    f = create_capture(path, 0xa1b23c4d, 1, 1);
+    len = eth_frame(frame, 0x0806, 0);
+    memset(frame + len, 0, 28);
+    add_frame(f, 1, 0, frame, len + 28, 1); // ARP
+    len = eth_frame(frame, 0x0800, 0);
+    len += ip4_packet(frame + len, IPPROTO_TCP, 0);
+    add_frame(f, 2, 0, frame, len, 1);
+    len = eth_frame(frame, 0x0800, 0);
+    len += ip4_packet(frame + len, IPPROTO_UDP, 0x2000); // more fragments
+    add_frame(f, 3, 0, frame, len, 1);
+    len = eth_frame(frame, 0x0800, 1);
+    len += ip4_packet(frame + len, IPPROTO_UDP, 0x4000); // don't fragment
+    add_frame(f, 4, 5000, frame, len, 1);
+    fclose(f);
+
+    p = pcp_pcap_open(path);
+    TEST(p != NULL);
+    TEST(pcp_pcap_read(p, rec) == 1);
+    TEST(rec->ts.tv_sec == 4);
+    TEST(rec->ts.tv_usec == 5);
+    TEST(rec->src.ss_family == AF_INET);
+    TEST(((struct sockaddr_in *)&rec->src)->sin_addr.s_addr
+            == htonl(0xc0000201));
+    TEST(ntohs(((struct sockaddr_in *)&rec->src)->sin_port) == 5350);
+    TEST(((struct sockaddr_in *)&rec->dst)->sin_addr.s_addr
+            == htonl(0xc0000202));
+    TEST(ntohs(((struct sockaddr_in *)&rec->dst)->sin_port) == 5351);
+    TEST(rec->len == sizeof(payload));
+    TEST(memcmp(rec->data, payload, sizeof(payload)) == 0);
+    TEST(pcp_pcap_read(p, rec) == 0);
+    pcp_pcap_close(p);
+    free(rec);
+}
+
+static void test_linux_cooked_import(const char *path)
+{
+    uint8_t frame[128], *ip;
+    pcp_pcap_rec_t *rec = (pcp_pcap_rec_t *)malloc(sizeof(*rec));
+    pcp_pcap_t *p;
+    FILE *f;
+
+    TEST(rec != NULL);
+    // IPv6 with hop-by-hop options header, little endian
+    memset(frame, 0, sizeof(frame));
+    put16(frame + 14, 0x86dd);
+    ip = frame + 16;
+    ip[0] = 0x60;
+    put16(ip + 4, 8 + 8 + sizeof(payload));
+    ip[6] = 0;
+    ip[8] = 0x20;
+    ip[9] = 0x01;
+    ip[23] = 1;
+    ip[24] = 0x20;
+    ip[25] = 0x01;
+    ip[39] = 2;
+    ip[40] = IPPROTO_UDP;
+    put16(ip + 48, 5350);
+    put16(ip + 50, 5351);
+    put16(ip + 52, 8 + sizeof(payload));
+    memcpy(ip + 56, payload, sizeof(payload));
+
+    TEST(rec != NULL);
+    f = create_capture(path, 0xa1b2c3d4, 113, 0);
+    add_frame(f, 10, 20, frame, 16 + 56 + sizeof(payload), 0);
+    fclose(f);
+
+    p = pcp_pcap_open(path);
+    TEST(p != NULL);
+    TEST(pcp_pcap_read(p, rec) == 1);
+    TEST(rec->ts.tv_sec == 10);
+    TEST(rec->ts.tv_usec == 20);
+    TEST(rec->src.ss_family == AF_INET6);
+    TEST(((struct sockaddr_in6 *)&rec->src)->sin6_addr.s6_addr[15] == 1);
+    TEST(((struct sockaddr_in6 *)&rec->dst)->sin6_addr.s6_addr[15] == 2);
+    TEST(ntohs(((struct sockaddr_in6 *)&rec->dst)->sin6_port) == 5351);
+    TEST(rec->len == sizeof(payload));
+    TEST(pcp_pcap_read(p, rec) == 0);
+    pcp_pcap_close(p);
+    free(rec);
+
+    // not a classic pcap file
+    f = fopen(path, "wb");
+    TEST(f != NULL);
+    TEST(fwrite("\x0a\x0d\x0d\x0a\x1c\0\0\0\x4d\x3c\x2b\x1a", 12, 1, f) == 1);
+    fclose(f);
+    TEST(pcp_pcap_open(path) == NULL);
+}
+
+static void test_write_read(const char *path)
+{
+    struct sockaddr_storage a4, b4, b6;
+    struct timeval ts = { 1234, 567 };
+    pcp_pcap_rec_t *rec = (pcp_pcap_rec_t *)malloc(sizeof(*rec));
+    pcp_pcap_t *p;
+
+    TEST(rec != NULL);
+    TEST(sock_pton("192.0.2.1:5350", (struct sockaddr *)&a4) == 0);
+    TEST(sock_pton("192.0.2.2:5351", (struct sockaddr *)&b4) == 0);
+    TEST(sock_pton("[2001:db8::2]:5351", (struct sockaddr *)&b6) == 0);
+
+    p = pcp_pcap_create(path);
+    TEST(p != NULL);
+    TEST(pcp_pcap_write(p, &ts, (struct sockaddr *)&a4,
+            (struct sockaddr *)&b4, payload, sizeof(payload)) == 0);
+    TEST(pcp_pcap_write(p, &ts, (struct sockaddr *)&a4,
+            (struct sockaddr *)&b6, payload, sizeof(payload)) == 0);
+    TEST(pcp_pcap_write(p, NULL, (struct sockaddr *)&b4, NULL, payload,
+            sizeof(payload)) == 0);
+    pcp_pcap_close(p);
+
+    p = pcp_pcap_open(path);
+    TEST(p != NULL);
+    TEST(pcp_pcap_read(p, rec) == 1);
+    TEST((rec->ts.tv_sec == 1234) && (rec->ts.tv_usec == 567));
+    TEST(rec->src.ss_family == AF_INET);
+    TEST(memcmp(&((struct sockaddr_in *)&rec->dst)->sin_addr,
+            &((struct sockaddr_in *)&b4)->sin_addr, 4) == 0);
+    TEST(((struct sockaddr_in *)&rec->dst)->sin_port
+            == ((struct sockaddr_in *)&b4)->sin_port);
+    TEST(rec->len == sizeof(payload));
+    TEST(memcmp(rec->data, payload, sizeof(payload)) == 0);
+
+    // IPv4 source of IPv6 packet is IPv4 mapped
+    TEST(pcp_pcap_read(p, rec) == 1);
+    TEST(rec->src.ss_family == AF_INET6);
+    TEST(IN6_IS_ADDR_V4MAPPED(&((struct sockaddr_in6 *)&rec->src)->sin6_addr));
+    TEST(memcmp(&((struct sockaddr_in6 *)&rec->dst)->sin6_addr,
+            &((struct sockaddr_in6 *)&b6)->sin6_addr, 16) == 0);
+
+    // unknown address is unspecified
+    TEST(pcp_pcap_read(p, rec) == 1);
+    TEST(rec->ts.tv_sec > 1234);
+    TEST(rec->dst.ss_family == AF_INET);
+    TEST(((struct sockaddr_in *)&rec->dst)->sin_addr.s_addr == INADDR_ANY);
+    TEST(pcp_pcap_read(p, rec) == 0);
+    pcp_pcap_close(p);
+    free(rec);
+}
+
+// records MAP flows of a context, leaves the capture in path
+static void test_ctx_capture(const char *path)
+{
+    pcp_ctx_t *ctx;
+    pcp_flow_t *flows[4];
+    struct sockaddr_storage src;
+    pcp_pcap_rec_t *rec = (pcp_pcap_rec_t *)malloc(sizeof(*rec));
+    pcp_pcap_t *p;
+    size_t requests = 0, responses = 0;
+    long last = 0;
+    int i;
+
+    TEST(rec != NULL);
+    TEST(pcp_set_capture(NULL, path) == PCP_ERR_BAD_ARGS);
+
+    ctx = pcp_init(DISABLE_AUTODISCOVERY, NULL);
+    TEST(ctx != NULL);
+    TEST(pcp_set_capture(ctx, "/nonexistent/dir/capture.pcap")
+            == PCP_ERR_UNKNOWN);
+    TEST(pcp_set_capture(ctx, path) == PCP_ERR_SUCCESS);
+    TEST(pcp_add_server(ctx, Sock_pton("127.0.0.1:5351"), 2) >= 0);
+    for (i = 0; i < 4; ++i) {
+        sock_pton(":3300", (struct sockaddr *)&src);
+        ((struct sockaddr_in6 *)&src)->sin6_port = htons(3300 + i);
+        flows[i] = pcp_new_flow(ctx, (struct sockaddr *)&src, NULL, NULL,
+                i & 1 ? IPPROTO_UDP : IPPROTO_TCP, 600, NULL);
+        TEST(flows[i] != NULL);
+    }
+    for (i = 0; i < 4; ++i) {
+        TEST(pcp_wait(flows[i], 2000, 0) == pcp_state_succeeded);
+    }
+    // closes the capture
+    pcp_terminate(ctx, 0);
+
+    p = pcp_pcap_open(path);
+    TEST(p != NULL);
+    while (pcp_pcap_read(p, rec) == 1) {
+        const struct sockaddr_in *server;
+
+        TEST(rec->ts.tv_sec * 1000000L + rec->ts.tv_usec >= last);
+        last = rec->ts.tv_sec * 1000000L + rec->ts.tv_usec;
+        TEST(rec->len >= 24);
+        TEST((rec->data[1] & 0x7f) == 1);
+        if (rec->data[1] & 0x80) {
+            server = (const struct sockaddr_in *)&rec->src;
+            responses++;
+        } else {
+            server = (const struct sockaddr_in *)&rec->dst;
+            requests++;
+        }
+        TEST(server->sin_family == AF_INET);
+        TEST(server->sin_addr.s_addr == htonl(INADDR_LOOPBACK));
+        TEST(ntohs(server->sin_port) == 5351);
+    }
+    pcp_pcap_close(p);
+    printf("Context recorded %zu requests and %zu responses\n", requests,
+            responses);
+    TEST(requests >= 4);
+    TEST(responses == requests);
+    free(rec);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *path = argc > 1 ? argv[1] : "test_replay.pcap";
+
+    PD_SOCKET_STARTUP();
+    pcp_log_level = PCP_LOGLVL_WARN;
+
+    //TEST written datagrams are read back
+    test_write_read(path);
+
+    //TEST UDP datagrams are imported from Ethernet capture
+    test_ethernet_import(path);
+
+    //TEST IPv6 datagrams are imported from Linux cooked capture
+    test_linux_cooked_import(path);
+
+    //TEST datagrams of a context are recorded
+    test_ctx_capture(path);
+
+    printf("Capture tests passed\n");
+    PD_SOCKET_CLEANUP();
+    return 0;
+}
@@ -0,0 +1,43 @@
+#!/bin/bash
+
+function echo_exit {
+    echo $1
+    killall pcp-server pcp-replay &>/dev/null
+    rm -f $CAPTURE $CLIENT_CAPTURE $NEGOTIATION
+    exit 1
+}
+
+CAPTURE=$(mktemp)
+CLIENT_CAPTURE=$(mktemp)
+NEGOTIATION=$(mktemp)
+
+killall pcp-server pcp-replay
+pcp-server --mappings --capture $CAPTURE &>/dev/null &
+pcp-server -p 5352 --mappings &>/dev/null &
+pcp-server -p 5353 -v 1 &>/dev/null &
+sleep 1
+test_replay $CLIENT_CAPTURE || echo_exit "Failed to record client"
+
+# server and client side of the same exchange replayed to a fresh server
+pcp-replay --speed 0 --strict --verbose --server 127.0.0.1:5352 $CAPTURE \
+    || echo_exit "Failed to replay server capture"
+pcp-replay --speed 0 --strict --verbose --server 127.0.0.1:5352 \
+    $CLIENT_CAPTURE || echo_exit "Failed to replay client capture"
+pcp-replay --speed 0 --server 127.0.0.1:5353 $CAPTURE &>/dev/null \
+    && echo_exit "Failed to detect different results"
+
+# version negotiation replayed to the client by recorded responses
+pcp -d -s 127.0.0.1:5353 -i 127.0.0.1:1500 -f -c $NEGOTIATION &>/dev/null \
+    || echo_exit "Failed to record version negotiation"
+pcp-replay --list $NEGOTIATION | grep -q "v1 response" \
+    || echo_exit "Failed to list capture"
+pcp-replay --respond 127.0.0.1:5354 --timeout 5000 $NEGOTIATION &>/dev/null &
+sleep 1
+pcp -d -s 127.0.0.1:5354 -i 127.0.0.1:1500 -f &>/dev/null \
+    || echo_exit "Failed to replay responses to client"
+pcp -d -s 127.0.0.1:5354 -i 127.0.0.1:1501 -f -T 1 &>/dev/null \
+    && echo_exit "Failed to drop request without recorded response"
+
+killall pcp-server pcp-replay
+rm -f $CAPTURE $CLIENT_CAPTURE $NEGOTIATION
+exit 0
@@ -0,0 +1,134 @@
+/*
+ *------------------------------------------------------------------
+ * test_server_faults.c
+ *
+ * Fault injection of PCP server: delayed, duplicated and reordered
+ * replies, lost and broken replies and epoch resets. Expects servers
+ * started by test_server_faults.sh.
+ *
+ *------------------------------------------------------------------
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#else
+#include "default_config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef WIN32
+#include <winsock2.h>
+#include <windows.h>
+#include "pcp_gettimeofday.h"
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+
+#include "pcp.h"
+#include "pcp_utils.h"
+#include "pcp_socket.h"
+#include "unp.h"
+#include "test_macro.h"
+
+static pcp_ctx_t *server_ctx(const char *server)
+{
+    pcp_ctx_t *ctx = pcp_init(DISABLE_AUTODISCOVERY, NULL);
+
+    TEST(ctx != NULL);
+    TEST(pcp_add_server(ctx, Sock_pton(server), 2) >= 0);
+    return ctx;
+}
+
+static pcp_flow_t *map_port(pcp_ctx_t *ctx, const char *src)
+{
+    struct sockaddr_storage src_addr;
+    pcp_flow_t *flow;
+
+    sock_pton(src, (struct sockaddr*) &src_addr);
+    flow = pcp_new_flow(ctx, (struct sockaddr*) &src_addr, NULL, NULL,
+            IPPROTO_TCP, 100, NULL);
+    TEST(flow != NULL);
+    return flow;
+}
+
+static long elapsed_ms(struct timeval *start)
+{
+    struct timeval now, diff;
+
+    gettimeofday(&now, NULL);
+    timeval_subtract(&diff, &now, start);
+    return diff.tv_sec * 1000 + diff.tv_usec / 1000;
+}
+
+int main(void)
+{
+    pcp_ctx_t *ctx, *other_ctx;
+    pcp_flow_t *flow;
+    pcp_flow_info_t info;
+    pcp_stats_t stats;
+    struct timeval start;
+    long ms;
+
+    PD_SOCKET_STARTUP();
+    pcp_log_level = PCP_LOGLVL_WARN;
+
+    //TEST delayed, duplicated and reordered replies are accepted once
+    ctx = server_ctx("127.0.0.1:5351");
+    gettimeofday(&start, NULL);
+    flow = map_port(ctx, ":1111");
+    TEST(pcp_wait(flow, 3000, 0) == pcp_state_succeeded);
+    ms = elapsed_ms(&start);
+    printf("Delayed reply received after %ld ms\n", ms);
+    TEST(ms >= 300);
+    TEST(pcp_flow_get_info_buf(flow, &info, 1) == 1);
+    TEST(info.result == pcp_state_succeeded);
+    TEST(pcp_get_stats(ctx, &stats) == PCP_ERR_SUCCESS);
+    TEST(stats.sent >= 1);
+    TEST(stats.received >= 1);
+    TEST(stats.retransmitted == 0);
+    TEST(pcp_get_stats(ctx, NULL) == PCP_ERR_BAD_ARGS);
+    pcp_terminate(ctx, 0);
+
+    //TEST truncated and malformed replies are dropped by client
+    ctx = server_ctx("127.0.0.1:5352");
+    flow = map_port(ctx, ":1111");
+    TEST(pcp_wait(flow, 1000, 0) == pcp_state_processing);
+    pcp_terminate(ctx, 0);
+
+    //TEST lost replies set by rules file
+    ctx = server_ctx("127.0.0.1:5354");
+    flow = map_port(ctx, ":1111");
+    TEST(pcp_wait(flow, 1000, 0) == pcp_state_processing);
+    // request is retransmitted after 3 s
+    TEST(pcp_wait(flow, 3000, 0) == pcp_state_processing);
+    TEST(pcp_get_stats(ctx, &stats) == PCP_ERR_SUCCESS);
+    TEST(stats.retransmitted >= 1);
+    TEST(stats.sent > stats.retransmitted);
+    TEST(stats.received == 0);
+    pcp_terminate(ctx, 0);
+
+    //TEST mappings are lost when epoch is reset
+    ctx = server_ctx("127.0.0.1:5353");
+    flow = map_port(ctx, ":2222");
+    TEST(pcp_wait(flow, 3000, 0) == pcp_state_succeeded);
+    other_ctx = server_ctx("127.0.0.1:5353");
+    // without reset the mapping would belong to the first client
+    flow = map_port(other_ctx, ":2222");
+    TEST(pcp_wait(flow, 3000, 0) == pcp_state_succeeded);
+    TEST(pcp_flow_get_info_buf(flow, &info, 1) == 1);
+    TEST(info.pcp_result_code == PCP_RES_SUCCESS);
+    pcp_terminate(other_ctx, 0);
+    pcp_terminate(ctx, 0);
+
+    printf("Fault injection tests passed\n");
+    PD_SOCKET_CLEANUP();
+    return 0;
+}
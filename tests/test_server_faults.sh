@@ -0,0 +1,17 @@
+#!/bin/bash
+
+RULES=$(mktemp)
+printf "# every reply is lost\nloss 100\n" > $RULES
+
+killall pcp-server
+pcp-server --delay 300 --jitter 100 --duplicate 100 --reorder 50 --seed 7 &>/dev/null &
+pcp-server -p 5352 --truncate 100 --malform 100 &>/dev/null &
+pcp-server -p 5353 --mappings --epoch-reset 100 &>/dev/null &
+pcp-server -p 5354 --faults $RULES &>/dev/null &
+sleep 1
+test_server_faults
+
+EXIT_STATUS=$?
+killall pcp-server
+rm -f $RULES
+exit $EXIT_STATUS
@@ -0,0 +1,133 @@
+/*
+ *------------------------------------------------------------------
+ * test_server_identities.c
+ *
+ * PCP server with many identities: each address and port is a
+ * separate server with its own version, result code and mapping
+ * table. Expects server started by test_server_identities.sh.
+ *
+ *------------------------------------------------------------------
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#else
+#include "default_config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef WIN32
+#include <winsock2.h>
+#include <windows.h>
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+
+#include "pcp.h"
+#include "pcp_socket.h"
+#include "pcp_msg_structs.h"
+#include "unp.h"
+#include "test_macro.h"
+
+#define PREFIX_SIZE 16
+
+// sends MAP v2 request to server and returns the response
+static int map_request(const char *server, pcp_response_t *resp)
+{
+    char buf[PCP_MAX_LEN];
+    pcp_request_t *req = (pcp_request_t *)buf;
+    pcp_map_v2_t *map = (pcp_map_v2_t *)req->next_data;
+    size_t len = sizeof(*req) + sizeof(*map);
+    struct timeval tv = { 1, 0 };
+    PCP_SOCKET s;
+    int ret;
+
+    memset(buf, 0, sizeof(buf));
+    req->ver = 2;
+    req->r_opcode = PCP_OPCODE_MAP;
+    req->req_lifetime = htonl(100);
+    req->ip[2] = htonl(0xFFFF);
+    req->ip[3] = htonl(0x7F000001);
+    map->nonce.n[0] = 0x12345678;
+    map->protocol = IPPROTO_TCP;
+    map->int_port = htons(1234);
+
+    s = socket(AF_INET, SOCK_DGRAM, 0);
+    TEST(s != PCP_INVALID_SOCKET);
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (char *)&tv, sizeof(tv));
+    TEST(sendto(s, buf, len, 0, Sock_pton(server),
+            sizeof(struct sockaddr_in)) == (ssize_t)len);
+    ret = recv(s, (char *)resp, PCP_MAX_LEN, 0);
+    CLOSE(s);
+    return ret;
+}
+
+int main(void)
+{
+    char buf[PCP_MAX_LEN];
+    pcp_response_t *resp = (pcp_response_t *)buf;
+    pcp_ctx_t *ctx;
+    pcp_flow_t *flow;
+    pcp_flow_info_t *info;
+    struct sockaddr_storage src;
+    size_t cnt, i, first_port;
+    char server[32];
+
+    PD_SOCKET_STARTUP();
+    pcp_log_level = PCP_LOGLVL_WARN;
+
+    //TEST version of identity is set by v= option
+    TEST(map_request("127.0.2.1:5362", resp) > 0);
+    TEST(resp->result_code == PCP_RES_UNSUPP_VERSION);
+    TEST(resp->ver == 1);
+
+    //TEST result code of identity is set by r= option
+    TEST(map_request("127.0.3.1:5351", resp) > 0);
+    TEST(resp->result_code == PCP_RES_NOT_AUTHORIZED);
+
+    //TEST other identities use defaults
+    TEST(map_request("127.0.1.3:5351", resp) > 0);
+    TEST(resp->ver == 2);
+    TEST(resp->result_code == PCP_RES_SUCCESS);
+
+    //TEST identity on other port of the range
+    TEST(map_request("127.0.2.1:5360", resp) > 0);
+    TEST(resp->result_code == PCP_RES_UNSUPP_VERSION);
+
+    //TEST flow is mapped by each server of the prefix
+    ctx = pcp_init(DISABLE_AUTODISCOVERY, NULL);
+    for (i = 0; i < PREFIX_SIZE; ++i) {
+        snprintf(server, sizeof(server), "127.0.1.%u:5351", (unsigned)i);
+        TEST(pcp_add_server(ctx, Sock_pton(server), 2) >= 0);
+    }
+    sock_pton(":2222", (struct sockaddr *)&src);
+    flow = pcp_new_flow(ctx, (struct sockaddr *)&src, NULL, NULL,
+            IPPROTO_TCP, 100, NULL);
+    TEST(flow != NULL);
+    TEST(pcp_wait(flow, 3000, 0) == pcp_state_succeeded);
+    info = pcp_flow_get_info(flow, &cnt);
+    TEST(info != NULL);
+    TEST(cnt == PREFIX_SIZE);
+    // mapping tables are separate: all allocate the first port, except
+    // 127.0.1.3 which already has mapping from the request above
+    for (i = 0, first_port = 0; i < cnt; ++i) {
+        TEST(info[i].result == pcp_state_succeeded);
+        TEST((ntohs(info[i].ext_port) == 1024)
+                || (ntohs(info[i].ext_port) == 1025));
+        first_port += (ntohs(info[i].ext_port) == 1024);
+    }
+    TEST(first_port == PREFIX_SIZE - 1);
+    free(info);
+    pcp_terminate(ctx, 0);
+
+    printf("Identity tests passed\n");
+    PD_SOCKET_CLEANUP();
+    return 0;
+}
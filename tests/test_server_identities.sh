@@ -0,0 +1,10 @@
+#!/bin/bash
+
+killall pcp-server
+pcp-server --mappings --identity 127.0.1.0/28 --identity 127.0.2.1@5360-5363,v=1 --identity 127.0.3.1,r=2 &>/dev/null &
+sleep 1
+test_server_identities
+
+EXIT_STATUS=$?
+killall pcp-server
+exit $EXIT_STATUS
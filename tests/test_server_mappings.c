@@ -0,0 +1,126 @@
+/*
+ *------------------------------------------------------------------
+ * test_server_mappings.c
+ *
+ * Mapping table of PCP server: port allocation, conflicts, quota,
+ * lifetime and deletion. Expects servers started by
+ * test_server_mappings.sh.
+ *
+ *------------------------------------------------------------------
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#else
+#include "default_config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef WIN32
+#include <winsock2.h>
+#include <windows.h>
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <unistd.h>
+#endif
+
+#include "pcp.h"
+#include "pcp_socket.h"
+#include "pcp_msg_structs.h"
+#include "unp.h"
+#include "test_macro.h"
+
+static pcp_flow_t *map_port(pcp_ctx_t *ctx, const char *src, uint32_t lifetime,
+        pcp_fstate_e expected, pcp_flow_info_t *info)
+{
+    struct sockaddr_storage src_addr;
+    pcp_flow_t *flow;
+
+    sock_pton(src, (struct sockaddr*) &src_addr);
+    flow = pcp_new_flow(ctx, (struct sockaddr*) &src_addr, NULL, NULL,
+            IPPROTO_TCP, lifetime, NULL);
+    TEST(flow != NULL);
+    TEST(pcp_wait(flow, 3000, 0) == expected);
+    TEST(pcp_flow_get_info_buf(flow, info, 1) == 1);
+    printf("%s: result %d, external port %d\n", src, info->pcp_result_code,
+            ntohs(info->ext_port));
+
+    return flow;
+}
+
+int main(void)
+{
+    pcp_ctx_t *ctx, *other_ctx;
+    pcp_flow_t *f1;
+    pcp_flow_info_t info1, info2, info;
+    struct in6_addr ext_ip;
+    uint16_t port1, port2;
+    long lifetime;
+    int i;
+
+    PD_SOCKET_STARTUP();
+    pcp_log_level = PCP_LOGLVL_WARN;
+    inet_pton(AF_INET6, "::ffff:203.0.113.7", &ext_ip);
+
+    ctx = pcp_init(DISABLE_AUTODISCOVERY, NULL);
+    pcp_add_server(ctx, Sock_pton("127.0.0.1:5351"), 2);
+
+    //TEST external ports are allocated from configured range
+    f1 = map_port(ctx, ":1111", 100, pcp_state_succeeded, &info1);
+    map_port(ctx, ":2222", 100, pcp_state_succeeded, &info2);
+    port1 = ntohs(info1.ext_port);
+    port2 = ntohs(info2.ext_port);
+    TEST((port1 >= 40000) && (port1 <= 40001));
+    TEST((port2 >= 40000) && (port2 <= 40001));
+    TEST(port1 != port2);
+    TEST(!memcmp(&info1.ext_ip, &ext_ip, sizeof(ext_ip)));
+    TEST(!memcmp(&info2.ext_ip, &ext_ip, sizeof(ext_ip)));
+
+    //TEST lifetime is limited by server
+    lifetime = (long) (info1.recv_lifetime_end - time(NULL));
+    TEST((lifetime > 50) && (lifetime <= 60));
+
+    //TEST no free port left
+    map_port(ctx, ":3333", 100, pcp_state_short_lifetime_error, &info);
+    TEST(info.pcp_result_code == PCP_RES_NO_RESOURCES);
+
+    //TEST mapping of other client is not taken over
+    other_ctx = pcp_init(DISABLE_AUTODISCOVERY, NULL);
+    pcp_add_server(other_ctx, Sock_pton("127.0.0.1:5351"), 2);
+    map_port(other_ctx, ":2222", 100, pcp_state_failed, &info);
+    TEST(info.pcp_result_code == PCP_RES_NOT_AUTHORIZED);
+    pcp_terminate(other_ctx, 0);
+
+    //TEST port of deleted mapping is allocated again
+    pcp_close_flow(f1);
+    for (i = 0; i < 5; ++i) {
+        pcp_pulse(ctx, NULL);
+#ifdef WIN32
+        Sleep(20);
+#else
+        usleep(20000);
+#endif
+    }
+    pcp_delete_flow(f1);
+    map_port(ctx, ":4444", 100, pcp_state_succeeded, &info);
+    TEST(ntohs(info.ext_port) == port1);
+    pcp_terminate(ctx, 1);
+
+    //TEST quota of internal address
+    ctx = pcp_init(DISABLE_AUTODISCOVERY, NULL);
+    pcp_add_server(ctx, Sock_pton("127.0.0.1:5352"), 2);
+    map_port(ctx, ":5555", 100, pcp_state_succeeded, &info);
+    TEST(ntohs(info.ext_port) >= 1024);
+    map_port(ctx, ":6666", 100, pcp_state_short_lifetime_error, &info);
+    TEST(info.pcp_result_code == PCP_RES_USER_EX_QUOTA);
+    pcp_terminate(ctx, 1);
+
+    PD_SOCKET_CLEANUP();
+    return 0;
+}
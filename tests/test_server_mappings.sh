@@ -0,0 +1,11 @@
+#!/bin/bash
+
+killall pcp-server
+pcp-server --mappings --ext-ip ::ffff:203.0.113.7 --port-range 40000-40001 --max-lifetime 60 &>/dev/null &
+pcp-server -p 5352 --mappings --quota 1 &>/dev/null &
+sleep 1
+test_server_mappings
+
+EXIT_STATUS=$?
+killall pcp-server
+exit $EXIT_STATUS
@@ -0,0 +1,144 @@
+/*
+ *------------------------------------------------------------------
+ * test_transport.c
+ *
+ * Contexts sharing one UDP socket: responses are handed to the
+ * context which sent the request. Expects server started by
+ * test_transport.sh.
+ *
+ *------------------------------------------------------------------
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#else
+#include "default_config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef WIN32
+#include <winsock2.h>
+#include <windows.h>
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/select.h>
+#include <unistd.h>
+#endif
+
+#include "pcp.h"
+#include "pcp_socket.h"
+#include "unp.h"
+#include "test_macro.h"
+
+#define FLOW_CNT 10
+
+static pcp_flow_t *new_map(pcp_ctx_t *ctx, const char *int_addr)
+{
+    struct sockaddr_storage src;
+
+    sock_pton(int_addr, (struct sockaddr *)&src);
+    return pcp_new_flow(ctx, (struct sockaddr *)&src, NULL, NULL,
+            IPPROTO_TCP, 100, NULL);
+}
+
+static int done(pcp_flow_t **flows, size_t cnt)
+{
+    pcp_fstate_e state;
+    size_t i;
+
+    for (i = 0; i < cnt; ++i) {
+        if ((pcp_eval_flow_state(flows[i], &state) == 0)
+                || (state != pcp_state_succeeded)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// handles events of all contexts of t until flows succeed or 3 s pass
+static void run_transport(pcp_transport_t *t, pcp_flow_t **flows, size_t cnt)
+{
+    PCP_SOCKET fd = pcp_transport_get_socket(t);
+    int i;
+
+    for (i = 0; (i < 300) && (!done(flows, cnt)); ++i) {
+        struct timeval tv = { 0, 10000 };
+        fd_set rfds;
+
+        pcp_transport_pulse(t, &tv);
+        FD_ZERO(&rfds);
+        FD_SET(fd, &rfds);
+        tv.tv_sec = 0;
+        tv.tv_usec = 10000;
+        select(fd + 1, &rfds, NULL, NULL, &tv);
+    }
+}
+
+int main(void)
+{
+    pcp_transport_t *t;
+    pcp_ctx_t *ctx1, *ctx2;
+    pcp_flow_t *flows[FLOW_CNT + 1];
+    pcp_flow_t *flow;
+    pcp_stats_t stats1, stats2;
+    char addr[32];
+    size_t i;
+
+    PD_SOCKET_STARTUP();
+    pcp_log_level = PCP_LOGLVL_WARN;
+
+    //TEST contexts use socket of transport
+    t = pcp_transport_create(NULL);
+    TEST(t != NULL);
+    TEST(pcp_init_shared(NULL, DISABLE_AUTODISCOVERY) == NULL);
+    ctx1 = pcp_init_shared(t, DISABLE_AUTODISCOVERY);
+    ctx2 = pcp_init_shared(t, DISABLE_AUTODISCOVERY);
+    TEST((ctx1 != NULL) && (ctx2 != NULL));
+    TEST(pcp_get_socket(ctx1) == pcp_transport_get_socket(t));
+    TEST(pcp_get_socket(ctx2) == pcp_transport_get_socket(t));
+    TEST(pcp_add_server(ctx1, Sock_pton("127.0.0.1:5351"), 2) >= 0);
+    TEST(pcp_add_server(ctx2, Sock_pton("127.0.0.1:5351"), 2) >= 0);
+
+    //TEST flows of both contexts are mapped through one socket
+    for (i = 0; i < FLOW_CNT; ++i) {
+        snprintf(addr, sizeof(addr), "127.0.0.1:%u", 3000 + (unsigned)i);
+        flows[i] = new_map(ctx1, addr);
+        TEST(flows[i] != NULL);
+    }
+    flows[FLOW_CNT] = new_map(ctx2, "127.0.0.1:4000");
+    TEST(flows[FLOW_CNT] != NULL);
+    run_transport(t, flows, FLOW_CNT + 1);
+    TEST(done(flows, FLOW_CNT + 1));
+
+    //TEST responses carrying nonce reach only context which sent request
+    TEST(pcp_get_stats(ctx1, &stats1) == PCP_ERR_SUCCESS);
+    TEST(pcp_get_stats(ctx2, &stats2) == PCP_ERR_SUCCESS);
+    TEST(stats1.received >= FLOW_CNT);
+    TEST(stats2.received >= 1);
+    TEST(stats2.received < FLOW_CNT);
+
+    //TEST pcp_wait of one context, datagrams of other one stay queued
+    flow = new_map(ctx2, "127.0.0.1:4001");
+    flows[0] = new_map(ctx1, "127.0.0.1:4002");
+    TEST((flow != NULL) && (flows[0] != NULL));
+    TEST(pcp_wait(flow, 3000, 0) == pcp_state_succeeded);
+    run_transport(t, flows, 1);
+    TEST(done(flows, 1));
+
+    //TEST transport is closed after its last context
+    TEST(pcp_transport_destroy(t) == PCP_ERR_BAD_ARGS);
+    pcp_terminate(ctx1, 1);
+    TEST(pcp_transport_destroy(t) == PCP_ERR_BAD_ARGS);
+    pcp_terminate(ctx2, 1);
+    TEST(pcp_transport_destroy(t) == PCP_ERR_SUCCESS);
+
+    printf("Transport tests passed\n");
+    PD_SOCKET_CLEANUP();
+    return 0;
+}
@@ -0,0 +1,10 @@
+#!/bin/bash
+
+killall pcp-server
+pcp-server --mappings &>/dev/null &
+sleep 1
+test_transport
+
+EXIT_STATUS=$?
+killall pcp-server
+exit $EXIT_STATUS